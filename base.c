@@ -32,6 +32,31 @@
 #define              TIMER_LOCK_ON      1
 #define              FRAME_LOCK_ON      1
 #define              DISK_LOCK_ON       1
+#define              MSG_LOCK_ON        1
+
+//map a fault in an untouched, aligned run of HUGE_PAGE_PGS pages onto
+//contiguous frames with a single huge PTE, while there are free frames
+#define              HUGE_PAGES         0
+
+//tag for the write back of an evicted frame, which nobody waits on
+#define              WRITEBACK_TAG      -2
+
+//interlock word holding the number of queued events, kept with
+//Z502_ATOMIC so it can be read without the event lock
+#define              EVENT_COUNT_WORD   ( MEMORY_INTERLOCK_BASE + 0x80 )
+
+//have the hardware put timer and disk completions on a ring in our memory,
+//and interrupt once COMPLETION_THRESHOLD of them are waiting or the first
+//has waited COMPLETION_DELAY ticks (0 interrupts for every one)
+#define              COMPLETION_RING_ON     1
+#define              COMPLETION_THRESHOLD   1
+#define              COMPLETION_DELAY       0
+
+//wake sleepers from timer channel SLEEP_TIMER_CHANNEL ticking every SLEEP_TICK
+//ticks, instead of a one shot timer on channel 0 set for the earliest sleeper
+//(0); a sleeper then wakes on the first tick at or after its wake up time
+#define              SLEEP_TICK             0
+#define              SLEEP_TIMER_CHANNEL    1
 
 #define              SPART              22
 char                 GreatSuccess[] = "      Action Failed\0        Action Succeeded";
@@ -53,7 +78,7 @@ static INT32         DISK_DEBUG  =      0;
 static INT32         FAULT_DEBUG  =     0;
 
 
-extern char          MEMORY[];  
+extern char          *MEMORY;  
 //extern BOOL          POP_THE_STACK;
 extern UINT16        *Z502_PAGE_TBL_ADDR;
 extern INT16         Z502_PAGE_TBL_LENGTH;
@@ -77,17 +102,22 @@ char                 *call_names[] = { "mem_read ", "mem_write",
                             "get_pid  ", "create   ", "term_proc", 
                             "suspend  ", "resume   ", "ch_prior ", 
                             "send     ", "receive  ", "disk_read",
-                            "disk_wrt ", "def_sh_ar" };
+                            "disk_wrt ", "def_sh_ar", "atomic   ",
+                            "get_count", "get_acct " };
 /* global variables */
 static INT32        pid = 0;
 static INT32        pTotal = 0;
-static INT32        eTotal = 0;
-static INT32        current_id = 0;
+static INT32        cpu_count = 1;
+static COMPLETION_RING completion_ring;
+static INT32        current_id[MAX_NUMBER_OF_CPUS];
+static INT32        cpu_idle[MAX_NUMBER_OF_CPUS];
 static PCB          *pList = NULL;
 static PCB          *pQueue = NULL;
 static EVNT         *pEvent = NULL;
 static FTBL         *pFrame = NULL;
-static char         DISK_BIT_MAP[MAX_NUMBER_OF_DISKS][NUM_LOGICAL_SECTORS];
+static char         **DISK_BIT_MAP = NULL;
+static INT32        tlb_entries = 0;
+static INT32        sleep_timer_expires = -1;  //-1 when the sleep timer is stopped
 
 /************************************************************************
     INTERRUPT_HANDLER
@@ -97,8 +127,21 @@ static char         DISK_BIT_MAP[MAX_NUMBER_OF_DISKS][NUM_LOGICAL_SECTORS];
 void    interrupt_handler( void ) {
     INT32              device_id;
     INT32              status;
+    INT32              tag;
+    INT32              frame;
     INT32              Index = 0;
     
+    // Take everything on the completion ring; with one CPU nothing else
+    // interrupts us, unless the ring overflowed
+    #if COMPLETION_RING_ON == 1
+    CALL(os_completion_drain());
+    if(cpu_count <= 1 && completion_ring.overflowed == FALSE){
+        CALL(os_event_clear());
+        return;
+    }
+    completion_ring.overflowed = FALSE;
+    #endif
+
     // Get cause of interrupt
     ZCALL(MEM_READ(Z502InterruptDevice, &device_id )); 
 
@@ -112,9 +155,18 @@ void    interrupt_handler( void ) {
     
         // Now read the status of this device
         ZCALL(MEM_READ(Z502InterruptStatus, &status ));
+
+        // Disk requests are tagged with the id of the process that made them,
+        // and a DMA request reports the frame it filled or emptied
+        tag = -1;
+        frame = -1;
+        if(device_id >= DISK_INTERRUPT_DISK1 && device_id <= DISK_INTERRUPT_DISK12){
+            ZCALL(MEM_READ(Z502InterruptTag, &tag ));
+            ZCALL(MEM_READ(Z502InterruptFrame, &frame ));
+        }
         
         // Add this event to event queue
-        CALL(os_event_add(device_id,status));
+        CALL(os_event_add(device_id,status,tag,frame));
         
         // Clear out this device - we're done with it
         ZCALL(MEM_WRITE(Z502InterruptClear, &Index ));
@@ -126,6 +178,23 @@ void    interrupt_handler( void ) {
     return;
 }                                       /* End of interrupt_handler */
 
+/************************************************************************
+    OS_COMPLETION_DRAIN
+        Move every completion the hardware has put on the ring to the
+        event queue.  A record is copied and head moved on before the
+        event is added, since adding it may let another CPU in here
+************************************************************************/
+void    os_completion_drain( void ){
+    COMPLETION record;
+
+    while(completion_ring.head != completion_ring.tail){
+        record = completion_ring.record[completion_ring.head];
+        completion_ring.head = (completion_ring.head + 1) % COMPLETION_RING_SIZE;
+        if(EVENT_DEBUG) printf("Completion from device %d at time %d\n", record.device, record.time);
+        CALL(os_event_add(record.device, record.status, record.tag, record.frame));
+    }
+}
+
 /************************************************************************
     HANDLE_EVENTS
         Checks all events that have occured from interrupts
@@ -134,12 +203,14 @@ void    interrupt_handler( void ) {
 INT32   handle_events( INT32 *ret ){
     INT32              device_id;
     INT32              status;
+    INT32              tag;
+    INT32              frame;
     INT32              next = 0, events = 0;
     
     if(EVENT_DEBUG) CALL(os_event_print());
 
     //Get next event
-    CALL(next = os_event_get_next(&device_id, &status));
+    CALL(next = os_event_get_next(&device_id, &status, &tag, &frame));
     while(next == 0){
         if(EVENT_DEBUG) printf("Handling event from device: %d and status: %d\n", device_id, status);
         (*ret) = status;
@@ -148,6 +219,9 @@ INT32   handle_events( INT32 *ret ){
         //handle event according to which device it originated from
         switch(device_id){
             case TIMER_INTERRUPT:
+            case TIMER_INTERRUPT_CHANNEL1:
+            case TIMER_INTERRUPT_CHANNEL2:
+            case TIMER_INTERRUPT_CHANNEL3:
                 CALL(timer_interrupt());
                 break;
             case DISK_INTERRUPT_DISK1:
@@ -162,14 +236,14 @@ INT32   handle_events( INT32 *ret ){
             case DISK_INTERRUPT_DISK10:
             case DISK_INTERRUPT_DISK11:
             case DISK_INTERRUPT_DISK12:
-                CALL(disk_interrupt(device_id-4,status)); 
+                CALL(disk_interrupt(device_id-4,status,tag,frame)); 
                 break;
             default:
                 break;
         }
 
         //keep getting events until we run out of them
-        CALL(next = os_event_get_next(&device_id, &status));
+        CALL(next = os_event_get_next(&device_id, &status, &tag, &frame));
     }
 
     return events;
@@ -186,8 +260,14 @@ void timer_interrupt( void )
     //Read timer status
     ZCALL(MEM_READ( Z502ClockStatus, &curr_time ));
 
-    //Wake up processes
-    if(wakeup_timer(curr_time) <= 0){
+    //A one shot timer has stopped now it has gone off.  This needs no
+    //lock, since at worst it makes the next sleep_timer_set write again
+    #if SLEEP_TICK == 0
+    sleep_timer_expires = -1;
+    #endif
+
+    //Wake up processes; a tick often has nobody to wake
+    if(wakeup_timer(curr_time) <= 0 && SLEEP_TICK == 0){
        printf("Nothing needed to wake up yet, continuing...\n"); 
     }
     
@@ -199,18 +279,11 @@ void timer_interrupt( void )
     DISK_INTERRUPT
         Handles disk interrupt
 ************************************************************************/
-void disk_interrupt(INT32 disk, INT32 status)
+void disk_interrupt(INT32 disk, INT32 status, INT32 tag, INT32 frame)
 {
-    INT32 id;
-    INT32 error;    
-    INT32 shadow;
-    INT32 page;
-    INT32 sector;
-    INT32 addr;
-    INT16 call_type;
-    INT32 mem_write_action = 0;
-
-    call_type = (INT16)SYS_CALL_CALL_TYPE;
+    INT32 id, curr_id;
+    INT32 owner;
+    INT32 page = -1;
 
     if(DISK_DEBUG) printf("Handling disk event from disk %d with status %d\n", disk, status);
 
@@ -230,28 +303,30 @@ void disk_interrupt(INT32 disk, INT32 status)
             break;
     }   
 
-    //figure out which process was using this disk
-    CALL(id = os_pcb_list_get_id_by_disk_in_use(disk));
+    //nobody waits on the write back of an evicted frame
+    if(tag == WRITEBACK_TAG){
+        if(DISK_DEBUG) printf("Frame %d is written back to disk %d\n", frame, disk);
+        return;
+    }
+
+    //the tag tells us which process made the request, since a disk can
+    //now hold requests from several processes at once
+    if(tag >= 0){
+        id = tag;
+    }else{
+        CALL(id = os_pcb_list_get_id_by_disk_in_use(disk));
+    }
     if(DISK_DEBUG) printf("Process %d was waiting for disk %d, waking it up now!\n", id, disk);
 
-    //figure out which sector we were writing to
-    CALL(sector = os_pcb_list_get_sector_in_use_by_id( id ));
-    
-    if(DISK_DEBUG) printf("Process %d was r/w to sector %d!\n", id, sector);
-
-    //figure out if a virtual page was just read, we are putting a page in memory that we just read from disk
-    if(call_type == SYSNUM_MEM_READ){
-        if(DISK_DEBUG) printf("Checking shadow table for mem read\n");
-        CALL(shadow = os_pcb_list_get_shadow_table_page_by_sector(&page, disk, sector, id));
-        if(shadow != -1){
-            //Get page to write to
-            CALL(addr = os_frame_page_to_addr(page));
-            if(DISK_DEBUG) printf("shadow table shows disk %d sec %d was for page %d addr %d\n", disk, sector, page, addr);
-            //Trick fault handler to think we are doing a write
-            SYS_CALL_CALL_TYPE = SYSNUM_MEM_WRITE;
-            //We trick the fault handler so that we can call mem_write and it will find
-            //this data a frame and write the frame's old contents into disk automatically
-            mem_write_action = 1;
+    //a page read in by DMA is already in its frame, so it only has to be
+    //made valid - unless the frame was taken for another page meanwhile
+    if(frame >= 0 && status == ERR_SUCCESS){
+        CALL(page = os_frame_get_page(frame, &owner));
+        if(page >= 0 && owner == id){
+            if(DISK_DEBUG) printf("Frame %d now holds page %d of process %d\n", frame, page, id);
+            CALL(os_pcb_list_set_page_table_page(id, page, frame | PTBL_VALID_BIT));
+        }else{
+            page = -1;
         }
     }
 
@@ -265,9 +340,14 @@ void disk_interrupt(INT32 disk, INT32 status)
         return;
     }
 
-    if(mem_write_action == 1){
-        //Write back into phys memory
-        CALL(mem_write(addr, Z502_ARG2.PTR));
+    //finish the access that faulted, if it's the one still in the registers
+    CALL(curr_id = os_pcb_get_curr_proc_id());
+    if(page >= 0 && curr_id == id && SYS_CALL_CALL_TYPE == SYSNUM_MEM_READ){
+        CALL(mem_read(Z502_ARG1.VAL, Z502_ARG2.PTR));
+    }
+    if(page >= 0 && curr_id == id && SYS_CALL_CALL_TYPE == SYSNUM_ATOMIC){
+        CALL(Z502_ATOMIC(Z502_ARG1.VAL, Z502_ARG2.VAL, Z502_ARG3.VAL, Z502_ARG4.VAL,
+                         (INT32 *)Z502_ARG5.PTR, (INT32 *)Z502_ARG6.PTR));
     }
 
     return;
@@ -304,14 +384,44 @@ void switch_to_next_highest_priority( void ){
 void    idle(){
     INT32 events_total = 0, events_handled = 0;
     INT32 ret_status;
-    
+    INT32 id, me;
+    PCB *process;
+
+    //with more than one CPU, halt this one until there is work for it
+    //rather than spinning, so the other CPUs get the time
+    if(cpu_count > 1){
+        me = os_cpu_id();
+        while(1){
+            CALL(events_total = os_event_get_total());
+            if(events_total > 0){
+                CALL(handle_events(&ret_status));
+            }
+            CALL(id = os_pcb_list_get_high_prior_id());
+            CALL(process = os_pcb_list_get_by_id(id));
+            if(process != NULL){
+                CALL(switch_process(id, SWITCH_CONTEXT_SAVE_MODE));
+                return;
+            }
+            cpu_idle[me] = TRUE;
+            ZCALL(Z502_IDLE());
+        }
+    }
+
     //sit in a loop looking for events, switch to higher priority if we handle an event, if one exists
     while(events_handled == 0){
         CALL(events_total = os_event_get_total());
         if(events_total > 0){
             CALL(events_handled = handle_events(&ret_status));
             if(events_handled > 0){
-                CALL(switch_to_next_highest_priority());
+                //an event that readies nobody (a write-back finishing
+                //while we wait on a page-in) is no reason to return
+                CALL(id = os_pcb_list_get_high_prior_id());
+                CALL(process = os_pcb_list_get_by_id(id));
+                if(process == NULL){
+                    events_handled = 0;
+                }else{
+                    CALL(switch_to_next_highest_priority());
+                }
             }
         }
     }
@@ -319,6 +429,75 @@ void    idle(){
     return;
 }
 
+/************************************************************************
+    OS_CPU_ID
+        Returns the number of the CPU we are running on
+************************************************************************/
+INT32   os_cpu_id( void ){
+    INT32 cpu = 0;
+
+    if(cpu_count > 1){
+        MEM_READ(Z502ProcessorID, &cpu);
+    }
+    return cpu;
+}
+
+/************************************************************************
+    OS_CPU_KICK
+        A process that belongs to the CPU passed in just became ready.
+        Interrupt an idle CPU so it comes and takes it, or failing that
+        the CPU it belongs to
+************************************************************************/
+void    os_cpu_kick( INT32 cpu ){
+    INT32 me, target, i;
+
+    if(cpu_count <= 1){
+        return;
+    }
+    me = os_cpu_id();
+    target = cpu;
+    if(target == me || cpu_idle[target] == FALSE){
+        for(i = 0; i < cpu_count; i++){
+            if(i != me && cpu_idle[i] == TRUE){
+                target = i;
+                break;
+            }
+        }
+    }
+    if(target != me){
+        //only one wake up per idle CPU, it looks for more work itself
+        cpu_idle[target] = FALSE;
+        ZCALL(MEM_WRITE(Z502ProcessorInterrupt, &target));
+    }
+}
+
+/************************************************************************
+    OS_CPU_RESCHEDULE
+        With more than one CPU, another CPU can suspend or terminate the
+        process this CPU is running.  Find something else to run before
+        going back to it
+************************************************************************/
+void    os_cpu_reschedule( void ){
+    INT32 curr_id, id, mode;
+    PCB *process;
+
+    CALL(curr_id = os_pcb_get_curr_proc_id());
+    CALL(process = os_pcb_list_get_by_id(curr_id));
+    if(process != NULL && process->state == RUNNING_STATE){
+        return;
+    }
+
+    //a terminated process has no use for its context any more
+    mode = (process == NULL) ? SWITCH_CONTEXT_KILL_MODE : SWITCH_CONTEXT_SAVE_MODE;
+    CALL(id = os_pcb_list_get_high_prior_id());
+    CALL(process = os_pcb_list_get_by_id(id));
+    if(process == NULL){
+        CALL(idle());
+    }else{
+        CALL(switch_process(id, mode));
+    }
+}
+
 /************************************************************************
     FAULT_HANDLER
         The beginning of the OS502.  Used to receive hardware faults.
@@ -374,21 +553,14 @@ void    fault_handler( void )
 void    page_fault_handler(INT32 page){
 
     INT16 call_type;
-    INT32 curr_id, id;
+    INT32 curr_id;
     INT32 status;
     INT32 frame;
     UINT16 page_entry = 0;
     INT32 error;
-    INT32 disk = 1;
-    INT32 seg = 0;
     INT32 read_disk;
     INT32 read_seg;
-    INT32 addr = 0;
-    INT32 old_page = 0;
-    INT32 disk_write_action = 0;
     INT32 disk_read_action = 0;
-    char buffer[PGSIZE];
-    memset(buffer,0,PGSIZE);
     
     if(FAULT_DEBUG) printf("IN PAGE FAULT HANDLER!!!\n");
 
@@ -406,61 +578,52 @@ void    page_fault_handler(INT32 page){
     
     switch(call_type){
         case SYSNUM_MEM_READ:
+        case SYSNUM_ATOMIC:
             
             //Does this virtual page exist on the disk?
             CALL(status = os_pcb_list_get_shadow_table_page(page, &read_disk, &read_seg, curr_id));
             if(status == 0){
                 if(FAULT_DEBUG) printf("shadow table shows page %d is stored at disk %d seg %d, reading now\n", page, read_disk, read_seg);
-                CALL(disk_read(read_disk, read_seg, Z502_ARG2.PTR));
+                //Give the page a frame now, the disk reads it straight in
+                CALL(frame = page_fault_take_frame());
+                if(frame == -1){
+                    return;
+                }
+                CALL(os_frame_set_page(frame, page, curr_id, NULL));
+                CALL(os_frame_touch_frame(frame, curr_id));
+                //Set disk read flag, need to do this last because process will suspend
+                disk_read_action = 1;
+            }else if(call_type == SYSNUM_ATOMIC){
+                //A new page; map it and let the hardware retry the atomic
+                CALL(frame = page_fault_take_frame());
+                if(frame == -1){
+                    return;
+                }
+                CALL(os_frame_set_page(frame, page, curr_id, NULL));
+                CALL(os_frame_touch_frame(frame, curr_id));
+                page_entry = frame;
+                page_entry |= PTBL_VALID_BIT;
+                CALL(os_pcb_list_set_page_table_page(curr_id, page, page_entry));
             }
-            //we will have to finish the mem read in the interrupt handler
-            //because we are about to do a disk read and suspend
+            //the page is made valid and the mem read finished in the
+            //interrupt handler, after the disk read
             break;
 
         case SYSNUM_MEM_WRITE:
 
-            //Get next emtpy frame
-            CALL(frame = os_frame_get_next_empty_frame());
-            if(frame == -1 ){
-                //Full frame table
-                if(FAULT_DEBUG) printf("Frame table is full!!\n");
-                //Get frame that has been touched last
-                CALL(frame = os_frame_get_last_touched_frame());
-                if(FAULT_DEBUG) printf("Last touched frame: %d\n", frame);
-                //Get page from last touched frame
-                CALL(old_page = os_frame_get_page(frame, &id));
-                if(FAULT_DEBUG) printf("Frame %d was being used by id %d and vpg %d\n", frame, id, old_page);
-                //Get the disk for this page
-                CALL(status = os_pcb_list_get_shadow_table_page(old_page, &disk, &seg, curr_id));
+            //Map the page's whole run in one go if we can
+            if(HUGE_PAGES){
+                CALL(status = os_frame_map_huge_page(page, curr_id));
                 if(status == 0){
-                    if(FAULT_DEBUG) printf("Page %d is already on disk at disk %d seg %d\n", old_page, disk, seg);
-                }else{
-                    //Doesnt have disk yet, get next available segment on disk
-                    for(disk = 1; disk <= MAX_NUMBER_OF_DISKS; disk++){
-                        CALL(seg = os_disk_get_next_free_sector(disk));
-                        if(seg != -1){
-                            break;
-                        }
-                    }
-                    if(seg == -1){
-                        printf("We are out of disk space!\n");
-                        CALL(terminate_process(-2,&error));
-                        return;
-                    }
-                    if(FAULT_DEBUG) printf("Next free hard drive is disk %d seg %d\n", disk, seg);
-                    //Set shadow table
-                    CALL(os_pcb_list_set_shadow_table_page(old_page, disk, seg, id));
-                    if(FAULT_DEBUG) printf("Setting shadow table of ID %d page %d to disk %d seg %d\n", id, old_page, disk, seg);
+                    if(FAULT_DEBUG) printf("Mapped page %d with a huge page\n", page);
+                    CALL(mem_write(Z502_ARG1.VAL, Z502_ARG2.PTR));
+                    break;
                 }
-                //Get page from phys memory
-                CALL(addr = os_frame_page_to_addr(old_page));
-                if(FAULT_DEBUG) printf("Reading out of phys mem addr %d to put in disk\n", addr);
-                //Read from memory
-                CALL(mem_read(addr,(UINT32 *)buffer));
-                //Set old page to invalid
-                CALL(os_pcb_list_set_page_table_page(id, old_page, 0));
-                //Set disk write flag, need to do this last because process will suspenc
-                disk_write_action = 1;
+            }
+
+            CALL(frame = page_fault_take_frame());
+            if(frame == -1){
+                return;
             }
 
             //Set frame table to page that faulted
@@ -489,15 +652,92 @@ void    page_fault_handler(INT32 page){
     CALL(os_dump_memory());
 
     //Do disk action
-    if(disk_write_action == 1){ 
-        //Copy to disk
-        if(FAULT_DEBUG) printf("Writing to disk %d seg %d\n", disk, seg);
-        CALL(disk_write(disk, seg, buffer));
+    if(disk_read_action == 1){ 
+        if(FAULT_DEBUG) printf("Reading disk %d seg %d into frame %d\n", read_disk, read_seg, frame);
+        CALL(status = disk_dma(read_disk, read_seg, frame, 0, curr_id));
+        if(status != ERR_SUCCESS){
+            return;
+        }
+        CALL(os_pcb_list_set_disk_in_use_by_id(curr_id, read_disk));
+        CALL(os_pcb_list_set_sector_in_use_by_id(curr_id, read_seg));
+        CALL(os_dump_stats2("DISKREAD", curr_id));
+        //Suspend and wait for the page
+        CALL(suspend_process(curr_id, &error));
     }
 
     return;
 }
 
+/************************************************************************
+    PAGE_FAULT_TAKE_FRAME
+        Find a frame for a faulting page.  If none is empty, take the
+        least recently touched one and write its page to disk straight
+        out of the frame.  The disk has the page as soon as it accepts
+        the request, so the frame can be reused without waiting
+************************************************************************/
+
+INT32   page_fault_take_frame( void ){
+
+    INT32 frame;
+    INT32 id;
+    INT32 status;
+    INT32 error;
+    INT32 disk = 1;
+    INT32 seg = 0;
+    INT32 old_page = 0;
+
+    //Get next emtpy frame
+    CALL(frame = os_frame_get_next_empty_frame());
+    if(frame != -1){
+        return frame;
+    }
+
+    //Full frame table
+    if(FAULT_DEBUG) printf("Frame table is full!!\n");
+    //Get frame that has been touched last
+    CALL(frame = os_frame_get_last_touched_frame());
+    if(FAULT_DEBUG) printf("Last touched frame: %d\n", frame);
+    //Get page from last touched frame
+    CALL(old_page = os_frame_get_page(frame, &id));
+    if(FAULT_DEBUG) printf("Frame %d was being used by id %d and vpg %d\n", frame, id, old_page);
+    //A huge page can't give up one of its frames, so break it
+    //back into ordinary pages first
+    if(HUGE_PAGES){
+        CALL(os_frame_split_huge_page(old_page, id));
+    }
+    //Get the disk for this page
+    CALL(status = os_pcb_list_get_shadow_table_page(old_page, &disk, &seg, id));
+    if(status == 0){
+        if(FAULT_DEBUG) printf("Page %d is already on disk at disk %d seg %d\n", old_page, disk, seg);
+    }else{
+        //Doesnt have disk yet, get next available segment on disk
+        for(disk = 1; disk <= MAX_NUMBER_OF_DISKS; disk++){
+            CALL(seg = os_disk_get_next_free_sector(disk));
+            if(seg != -1){
+                break;
+            }
+        }
+        if(seg == -1){
+            printf("We are out of disk space!\n");
+            CALL(terminate_process(-2,&error));
+            return -1;
+        }
+        if(FAULT_DEBUG) printf("Next free hard drive is disk %d seg %d\n", disk, seg);
+        //Set shadow table
+        CALL(os_pcb_list_set_shadow_table_page(old_page, disk, seg, id));
+        if(FAULT_DEBUG) printf("Setting shadow table of ID %d page %d to disk %d seg %d\n", id, old_page, disk, seg);
+    }
+    //Set old page to invalid before its frame goes anywhere
+    CALL(os_pcb_list_set_page_table_page(id, old_page, 0));
+    //Copy the frame to disk
+    if(FAULT_DEBUG) printf("Writing frame %d to disk %d seg %d\n", frame, disk, seg);
+    CALL(disk_dma(disk, seg, frame, 1, WRITEBACK_TAG));
+    CALL(os_disk_set_sector(disk, seg, 1));
+    CALL(os_dump_stats2("DISKWRIT", id));
+
+    return frame;
+}
+
 /************************************************************************
     SVC
         The beginning of the OS502.  Used to receive software interrupts.
@@ -511,8 +751,19 @@ void    svc( void ) {
     INT32               Time;
     INT32               events_handled, events_total;
     INT32               ret_status;
+    PCB                 *process;
     
     call_type = (INT16)SYS_CALL_CALL_TYPE;
+
+    //with more than one CPU, another CPU may have terminated this
+    //process while it was running here
+    if(cpu_count > 1){
+        CALL(process = os_pcb_list_get_by_id(os_pcb_get_curr_proc_id()));
+        if(process == NULL){
+            CALL(os_cpu_reschedule());
+            return;
+        }
+    }
     if ( do_print > 0 ) {
         if(SVC_DEBUG) printf( "SVC handler: %s %8ld %8ld %8ld %8ld %8ld %8ld\n",
                 call_names[call_type], Z502_ARG1.VAL, Z502_ARG2.VAL, 
@@ -549,12 +800,28 @@ void    svc( void ) {
             CALL(change_priority(Z502_ARG1.VAL, Z502_ARG2.VAL, Z502_ARG3.PTR));
             break;
         case SYSNUM_SEND_MESSAGE:
-            CALL(send_message(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.VAL,
+            //no CALL while the message lock is held: a popped stack
+            //would return past the give and leave it locked for good
+            if(cpu_count > 1){
+                msg_spinlock_get();
+                send_message(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.VAL,
+                                    Z502_ARG4.PTR);
+                msg_spinlock_give();
+            }else{
+                CALL(send_message(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.VAL,
                                     Z502_ARG4.PTR));
+            }
             break;
         case SYSNUM_RECEIVE_MESSAGE:
-            CALL(receive_message(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.VAL,
+            if(cpu_count > 1){
+                msg_spinlock_get();
+                receive_message(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.VAL,
+                                    Z502_ARG4.PTR, Z502_ARG5.PTR, Z502_ARG6.PTR);
+                msg_spinlock_give();
+            }else{
+                CALL(receive_message(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.VAL,
                                     Z502_ARG4.PTR, Z502_ARG5.PTR, Z502_ARG6.PTR)); 
+            }
             break;
         case SYSNUM_MEM_READ:
             //The sneaky z502 code skips SVC for mem operations
@@ -574,6 +841,13 @@ void    svc( void ) {
             CALL(define_shared_area(Z502_ARG1.VAL, Z502_ARG2.VAL, Z502_ARG3.PTR,
                                         Z502_ARG4.PTR, Z502_ARG5.PTR));
             break;
+        case SYSNUM_GET_PERFORMANCE_COUNT:
+            CALL(get_performance_count(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.PTR));
+            break;
+        case SYSNUM_GET_PROCESS_ACCOUNTING:
+            CALL(get_process_accounting(Z502_ARG1.VAL, Z502_ARG2.PTR, Z502_ARG3.PTR,
+                                        Z502_ARG4.PTR, Z502_ARG5.PTR, Z502_ARG6.PTR));
+            break;
         default:
             printf("ERROR! call_type is not recognized!\n");
             printf("call_type is - %i\n", call_type);
@@ -591,6 +865,11 @@ void    svc( void ) {
         }
     }    
 
+    //or suspended it
+    if(cpu_count > 1){
+        CALL(os_cpu_reschedule());
+    }
+
 }                                               // End of svc
  
 /************************************************************************
@@ -606,6 +885,7 @@ void    os_switch_context_complete( void )
     INT32               i;
     INT16               call_type;
     INT32*              temp;
+    INT32               curr_id;
     call_type = (INT16)SYS_CALL_CALL_TYPE;
 
     if ( do_print == TRUE )
@@ -616,12 +896,13 @@ void    os_switch_context_complete( void )
 
     //Point to page table
     Z502_PAGE_TBL_LENGTH = VIRTUAL_MEM_PGS;
-    CALL(Z502_PAGE_TBL_ADDR = os_pcb_list_get_page_table_by_id(current_id ));
+    curr_id = os_pcb_get_curr_proc_id();
+    CALL(Z502_PAGE_TBL_ADDR = os_pcb_list_get_page_table_by_id(curr_id ));
     
     switch(call_type){
         case SYSNUM_RECEIVE_MESSAGE:
             //If this is as receive message, manually populate return variables
-            CALL(os_pcb_list_get_last_msg_from_inbox(current_id, Z502_ARG5.PTR, Z502_ARG2.PTR, Z502_ARG4.PTR));
+            CALL(os_pcb_list_get_last_msg_from_inbox(curr_id, Z502_ARG5.PTR, Z502_ARG2.PTR, Z502_ARG4.PTR));
             break;
         case SYSNUM_DISK_READ:
             //this is purely for debug purposes, prints what we just read from disk
@@ -672,6 +953,34 @@ void    os_init( void )
 
     /* Setup disk bit map */
     CALL(os_disk_init_map());
+
+    /* See if the hardware has a TLB we need to keep up to date */
+    ZCALL(MEM_READ(Z502TLBEntries, &tlb_entries));
+
+    /* The sleep timer's channel ticks every SLEEP_TICK once started */
+    #if SLEEP_TICK > 0
+    i = SLEEP_TICK;
+    ZCALL(MEM_WRITE(Z502TimerChannelPeriod(SLEEP_TIMER_CHANNEL), &i));
+    #endif
+
+    /* Give the hardware our completion ring */
+    #if COMPLETION_RING_ON == 1
+    i = COMPLETION_THRESHOLD;
+    ZCALL(MEM_WRITE(Z502CompletionThreshold, &i));
+    i = COMPLETION_DELAY;
+    ZCALL(MEM_WRITE(Z502CompletionDelay, &i));
+    ZCALL(MEM_WRITE(Z502CompletionRing, (INT32 *)&completion_ring));
+    #endif
+
+    /* Start any other CPUs.  Each one idles until it is interrupted
+       because there is a process ready for it */
+    ZCALL(MEM_READ(Z502ProcessorCount, &cpu_count));
+    for(i = 1; i < cpu_count; i++){
+        cpu_idle[i] = TRUE;
+        ZCALL(Z502_MAKE_CONTEXT(&next_context, (void *)idle, KERNEL_MODE));
+        ZCALL(MEM_WRITE(Z502ProcessorSelect, &i));
+        ZCALL(MEM_WRITE(Z502ProcessorStart, (INT32 *)next_context));
+    }
     
     /*  Determine if the switch was set, and if so go to demo routine.  */
 
@@ -744,6 +1053,8 @@ void    *os_get_func_ptr(const char* name)
         return (void*)test1l;
     }else if(strcmp("test1m",name) == 0){
         return (void*)test1m;
+    }else if(strcmp("test1n",name) == 0){
+        return (void*)test1n;
     }else if(strcmp("test2a",name) == 0){
         //MEM_DEBUG  = 1;
         return (void*)test2a;
@@ -765,11 +1076,67 @@ void    *os_get_func_ptr(const char* name)
     }else if(strcmp("test2g",name) == 0){
         //DISK_DEBUG  = 1;
         return (void*)test2g;
+    }else if(strcmp("test2h",name) == 0){
+        return (void*)test2h;
+    }else if(strcmp("test2i",name) == 0){
+        return (void*)test2i;
     }else{
         return NULL;
     }
 }
 
+/************************************************************************
+    OS_GET_ENTRY_POINT / OS_GET_ENTRY_NAME
+        The routines a process may run on, by name.  A snapshot names
+        the routine each context runs, since its address may differ in
+        the run that restores it.
+************************************************************************/
+static struct {
+    char    *name;
+    void    *func;
+} entry_points[] = {
+    { "os_init",     (void*)os_init     }, { "sample",      (void*)sample_code },
+    { "idle",        (void*)idle        }, { "test0",       (void*)test0       },
+    { "test1a",      (void*)test1a      }, { "test1b",      (void*)test1b      },
+    { "test1c",      (void*)test1c      }, { "test1d",      (void*)test1d      },
+    { "test1e",      (void*)test1e      }, { "test1f",      (void*)test1f      },
+    { "test1g",      (void*)test1g      }, { "test1h",      (void*)test1h      },
+    { "test1i",      (void*)test1i      }, { "test1j",      (void*)test1j      },
+    { "test1k",      (void*)test1k      }, { "test1l",      (void*)test1l      },
+    { "test1m",      (void*)test1m      }, { "test1n",      (void*)test1n      },
+    { "test1x",      (void*)test1x      }, { "test1j_echo", (void*)test1j_echo },
+    { "test2a",      (void*)test2a      }, { "test2b",      (void*)test2b      },
+    { "test2c",      (void*)test2c      }, { "test2d",      (void*)test2d      },
+    { "test2e",      (void*)test2e      }, { "test2f",      (void*)test2f      },
+    { "test2g",      (void*)test2g      }, { "test2gx",     (void*)test2gx     },
+    { "test2h",      (void*)test2h      }, { "test2i",      (void*)test2i      },
+    { NULL,          NULL               }
+};
+
+void    *os_get_entry_point( const char* name )
+{
+    INT32 i;
+
+    for(i = 0; entry_points[i].name != NULL; i++){
+        if(strcmp(entry_points[i].name, name) == 0){
+            return entry_points[i].func;
+        }
+    }
+    return NULL;
+}
+
+char    *os_get_entry_name( void *func )
+{
+    INT32 i;
+
+    for(i = 0; entry_points[i].name != NULL; i++){
+        if(entry_points[i].func == func){
+            return entry_points[i].name;
+        }
+    }
+    return NULL;
+}
+
 /************************************************************************
     PROCESS_SLEEP
         This routine starts to the timer and puts PCB on waiting queue
@@ -849,10 +1216,8 @@ void    process_sleep( INT32 sleep_time ) {
 
     if(TIMER_DEBUG) CALL(os_dump_stats());
 
-    //Set timer
-    CALL(timer_spinlock_get());
-    ZCALL(MEM_WRITE( Z502TimerStart, &sleep_time ));
-    CALL(timer_spinlock_give());
+    //Set timer, if it isn't already set soon enough
+    CALL(sleep_timer_set(status, curr_time));
     
     //Switch to highest priority task or idle if none   
     CALL(id = os_pcb_list_get_high_prior_id());
@@ -921,6 +1286,15 @@ void    restart_timer( INT32 curr_time ){
     CALL(id = os_pcb_queue_get_high_prior_id());
     CALL(process = os_pcb_queue_get_by_id(id));
     if(process == NULL){
+        //nobody left to wake, so stop the tick
+        #if SLEEP_TICK > 0
+        CALL(timer_spinlock_get());
+        if(sleep_timer_expires >= 0){
+            ZCALL(MEM_WRITE(Z502TimerChannelCancel(SLEEP_TIMER_CHANNEL), &id));
+            sleep_timer_expires = -1;
+        }
+        CALL(timer_spinlock_give());
+        #endif
         return;
     }
     
@@ -930,13 +1304,37 @@ void    restart_timer( INT32 curr_time ){
     if(TIMER_DEBUG) printf("Restarting timer with time %d from proc %d\n", sleep_time, id);
 
     //Start timer
-    CALL(timer_spinlock_get());
-    ZCALL(MEM_WRITE( Z502TimerStart, &sleep_time ));
-    CALL(timer_spinlock_give());
+    CALL(sleep_timer_set(process->wake_up_time, curr_time));
 
     return;
 }
 
+/************************************************************************
+    SLEEP_TIMER_SET
+        Make sure the sleep timer goes off by wake_up_time.  The one shot
+        timer is only written when it isn't running or is set for later,
+        and the tick is only started when it isn't running, so a sleep
+        that isn't the earliest costs no timer MMIO at all
+************************************************************************/
+void    sleep_timer_set( INT32 wake_up_time, INT32 curr_time ){
+    INT32 sleep_time;
+
+    sleep_time = wake_up_time - curr_time;
+    CALL(timer_spinlock_get());
+    #if SLEEP_TICK > 0
+    if(sleep_timer_expires < 0){
+        ZCALL(MEM_WRITE(Z502TimerChannelStart(SLEEP_TIMER_CHANNEL), &sleep_time));
+        sleep_timer_expires = wake_up_time;
+    }
+    #else
+    if(sleep_timer_expires < 0 || wake_up_time < sleep_timer_expires){
+        ZCALL(MEM_WRITE(Z502TimerStart, &sleep_time));
+        sleep_timer_expires = wake_up_time;
+    }
+    #endif
+    CALL(timer_spinlock_give());
+}
+
 /************************************************************************
     OS_DUMP_STATS
         This is routine prints out debugging information
@@ -952,6 +1350,7 @@ void    os_dump_stats( void ){
     printf("Current running process id: %d\n", curr_id);
     
     CALL(os_pcb_print_all());
+    CALL(os_pcb_print_cpu_usage());
     printf("*************************************\n");
 
     return;
@@ -1123,6 +1522,7 @@ void     create_process( void *funcPtr, const char * name, INT32 priority,
     process->priority = priority;    
     CALL(curr_id = os_pcb_get_curr_proc_id());
     process->parent = curr_id;
+    process->cpu = os_cpu_id();
     process->wake_up_time = 0;
     process->num_msgs = 0;
     process->msg_state = MSG_READY_STATE;
@@ -1138,7 +1538,7 @@ void     create_process( void *funcPtr, const char * name, INT32 priority,
     shadow_table->page = 0;
     shadow_table->disk = -1;
     shadow_table->sector = -1;
-    for(i = 1; i < VIRTUAL_MEM_PGS-1; i++){
+    for(i = 1; i < VIRTUAL_MEM_PGS; i++){
         tmp = malloc(sizeof(STBL));
         tmp->page = i;
         tmp->disk = -1;
@@ -1146,6 +1546,7 @@ void     create_process( void *funcPtr, const char * name, INT32 priority,
         shadow_table->next = tmp;
         shadow_table = tmp;
     }
+    shadow_table->next = NULL;
     
     //make context
     ZCALL( Z502_MAKE_CONTEXT( &process->context, (void *)funcPtr, mode ));
@@ -1157,6 +1558,11 @@ void     create_process( void *funcPtr, const char * name, INT32 priority,
     (*error) = ERR_SUCCESS;
     
     CALL(os_dump_stats2("CREATE", pid));
+
+    //an idle CPU can take this process, or the one it displaces
+    if(cpu_count > 1){
+        CALL(os_cpu_kick(process->cpu));
+    }
    
     //switch to this process if none are running
     CALL(p_curr = os_pcb_list_get_by_id(curr_id));
@@ -1210,8 +1616,10 @@ void    switch_process( INT32 id, INT32 mode ){
         return;
     }
 
-    //set current process to new process
+    //set current process to new process, it now belongs to this CPU
     CALL(os_pcb_set_curr_proc_id(id));
+    process->cpu = os_cpu_id();
+    cpu_idle[process->cpu] = FALSE;
             
     if(PROC_DEBUG) printf("Just set running ID to: %d!\n", process->id);
     //CALL(os_dump_stats());
@@ -1345,6 +1753,57 @@ void     get_process_id(const char *name, INT32 *id, INT32 *error){
     }
 }
 
+/************************************************************************
+    GET_PERFORMANCE_COUNT
+        This routine reads one of the hardware's performance counters.
+        Or'ing PMU_CONTEXT into the event gives the count for the
+        calling process alone.  Only the low word of the count is
+        returned.
+
+************************************************************************/
+
+void     get_performance_count(INT32 event, INT32 *count, INT32 *error){
+    if((event & ~PMU_CONTEXT) < 0 || (event & ~PMU_CONTEXT) >= PMU_NUMBER_OF_EVENTS){
+        (*count) = 0;
+        (*error) = ERR_BAD_PARAM;
+        return;
+    }
+
+    ZCALL(MEM_WRITE(Z502PMUSelect, &event));
+    ZCALL(MEM_READ(Z502PMUCountLow, count));
+    (*error) = ERR_SUCCESS;
+}
+
+/************************************************************************
+    GET_PROCESS_ACCOUNTING
+        This routine reads the user and kernel time, faults and traps
+        the hardware has charged to a process; -1 means the caller.
+
+************************************************************************/
+
+void     get_process_accounting(INT32 id, INT32 *user, INT32 *kernel,
+                                INT32 *faults, INT32 *traps, INT32 *error){
+    PCB *process;
+
+    if(id == -1){
+        CALL(id = os_pcb_get_curr_proc_id());
+    }
+
+    CALL(process = os_pcb_list_get_by_id(id));
+    if(process == NULL){
+        (*error) = ERR_BAD_PARAM;
+        return;
+    }
+
+    ZCALL(MEM_WRITE( Z502AccountingContext, process->context ));
+    ZCALL(MEM_READ( Z502AccountingUserTicks, user ));
+    ZCALL(MEM_READ( Z502AccountingKernelTicks, kernel ));
+    ZCALL(MEM_READ( Z502AccountingFaults, faults ));
+    ZCALL(MEM_READ( Z502AccountingTraps, traps ));
+    ZCALL(MEM_WRITE( Z502AccountingContext, NULL ));
+    (*error) = ERR_SUCCESS;
+}
+
 /************************************************************************
     SUSPEND_PROCESS
         This routine suspends the process of the id passed to it
@@ -1686,7 +2145,11 @@ void   receive_message(INT32 source_id, char* message, INT32 rec_length,
             if(RECV_DEBUG) printf("Receive Message: no one broadcasting to us, suspending self!\n");
             //if(RECV_DEBUG) CALL(os_dump_stats());
             if(RECV_DEBUG) CALL(os_pcb_list_msgs_print());
-            CALL(suspend_process(curr_id, error));
+            if(cpu_count > 1){
+                CALL(receive_message_wait(curr_id));
+            }else{
+                CALL(suspend_process(curr_id, error));
+            }
             CALL(status = os_pcb_list_get_last_msg_from_inbox(curr_id, sender_id, message, send_length));
             if(status < 0){
                 (*error) = ERR_BAD_PARAM;
@@ -1722,7 +2185,11 @@ void   receive_message(INT32 source_id, char* message, INT32 rec_length,
             if(RECV_DEBUG) printf("Receive Message: no one sending to us, suspending self!\n");
             //if(RECV_DEBUG) CALL(os_dump_stats());
             if(RECV_DEBUG) CALL(os_pcb_list_msgs_print());
-            CALL(suspend_process(curr_id, error));
+            if(cpu_count > 1){
+                CALL(receive_message_wait(curr_id));
+            }else{
+                CALL(suspend_process(curr_id, error));
+            }
             CALL(status = os_pcb_list_get_last_msg_from_inbox(curr_id, sender_id, message, send_length));
             if(status < 0){
                 (*error) = ERR_BAD_PARAM;
@@ -1743,7 +2210,11 @@ void   receive_message(INT32 source_id, char* message, INT32 rec_length,
         if(RECV_DEBUG) printf("Receive Message: suspending ID: %d!\n", curr_id);
         //if(RECV_DEBUG) CALL(os_dump_stats());
         if(RECV_DEBUG) CALL(os_pcb_list_msgs_print());
-        CALL(suspend_process(curr_id, error));
+        if(cpu_count > 1){
+            CALL(receive_message_wait(curr_id));
+        }else{
+            CALL(suspend_process(curr_id, error));
+        }
         CALL(status = os_pcb_list_get_last_msg_from_inbox(curr_id, sender_id, message, send_length));
         if(status < 0){
             (*error) = ERR_BAD_PARAM;
@@ -1768,10 +2239,30 @@ void   receive_message(INT32 source_id, char* message, INT32 rec_length,
     return; 
 }
 
+/************************************************************************
+    RECEIVE MESSAGE WAIT
+        Wait in receive_message for a sender, with more than one CPU.
+        We hold the message lock, which a sender needs too.  Show
+        ourselves as waiting before letting it go, so a sender that gets
+        in before we switch away wakes us rather than finding us still
+        running.  The lock is taken back whether or not we switched
+        away, and svc gives it up once the stack is back there
+************************************************************************/
+
+void   receive_message_wait(INT32 curr_id){
+
+    CALL(os_pcb_list_set_state_by_id(curr_id, HALTED_STATE));
+    CALL(os_dump_stats2("SUSPEND", curr_id));
+    msg_spinlock_give();
+    os_cpu_reschedule();
+    msg_spinlock_get();
+}
+
 void   message_transfer(INT32 sender_id, INT32 rec_id, INT32 rec_length, INT32 *send_length, INT32 *error){
 
     PCB *process;
     INT32 status;
+    INT32 sender_msgs, other_id, other_length, other_error;
     char *buffer;
     
     if(RECV_DEBUG) printf("Transfer Message: id %d is receiving message from id: %d\n", rec_id, sender_id);
@@ -1830,6 +2321,7 @@ void   message_transfer(INT32 sender_id, INT32 rec_id, INT32 rec_length, INT32 *
     }
     //set state of sender back to ready if it has no messages in outbox
     CALL(status = os_pcb_list_get_msg_num_by_id(sender_id));
+    sender_msgs = status;
     if(status < 0){
         (*error) = ERR_BAD_PARAM;
         if(RECV_DEBUG) printf("Transfer Message: cant get number of messages in outbox of receiver\n");
@@ -1875,6 +2367,19 @@ void   message_transfer(INT32 sender_id, INT32 rec_id, INT32 rec_length, INT32 *
     }
 
     (*error) = ERR_SUCCESS;
+
+    //a sender whose outbox was full wasn't given any broadcasts; if it
+    //is waiting on one, now that it has room it can take one
+    if(cpu_count > 1 && sender_msgs == MSG_OUTBOX_MAX - 1 && sender_id != rec_id){
+        CALL(status = os_pcb_list_get_msg_state_by_id(sender_id));
+        if(status == MSG_REC_ALL_STATE){
+            CALL(other_id = os_pcb_list_get_send_broadcast_id(sender_id));
+            if(other_id >= 0 && other_id != sender_id){
+                CALL(other_length = os_pcb_list_get_msg_rec_len_by_id(sender_id));
+                CALL(message_transfer(other_id, sender_id, other_length, &other_length, &other_error));
+            }
+        }
+    }
     return;
 }
 
@@ -1943,10 +2448,8 @@ void mem_write(INT32 addr, INT32 *data){
         Read from disk with specified ID and sector
 
 ************************************************************************/
-void disk_read(INT16 disk_id, INT16 sector, char data[PGSIZE]){
+void disk_read(INT16 disk_id, INT16 sector, char data[]){
 
-    INT32 read = 0;
-    INT32 start = 0;
     INT32 status = 0;
     INT32 error = 0;
     INT32 curr_id = 0;
@@ -1962,29 +2465,12 @@ void disk_read(INT16 disk_id, INT16 sector, char data[PGSIZE]){
 
     if(DISK_DEBUG) printf("disk_read: reading from disk %d sector %d!\n", disk_id, sector);
 
-    //Set disk ID
-    ZCALL(MEM_WRITE(Z502DiskSetID, (INT32 *)&disk_id));
-    
-    //Read status
-    ZCALL(MEM_READ( Z502DiskStatus, &status));
-    if ( status != DEVICE_FREE ){
-        if(DISK_DEBUG) printf( "This disk is busy! Waiting for it to be free\n" );
-        while(status != DEVICE_FREE){
-            ZCALL(MEM_READ( Z502DiskStatus, &status));
-        }
+    //Start the read, tagged so its interrupt can be matched back to us;
+    //a read the disk refused never interrupts, so don't wait for it
+    CALL(status = disk_submit(disk_id, sector, data, -1, 0, curr_id));
+    if(status != ERR_SUCCESS){
+        return;
     }
-
-    //Set disk ID
-    ZCALL(MEM_WRITE(Z502DiskSetSector, (INT32 *)&sector));
-
-    //Set buffer to put information read
-    ZCALL(MEM_WRITE(Z502DiskSetBuffer, (INT32 *)data));
-
-    //Set action
-    ZCALL(MEM_WRITE(Z502DiskSetAction, &read));
-    
-    //Start Disk
-    ZCALL(MEM_WRITE(Z502DiskStart, &start));
     
     //set disk use flag in pcb
     CALL(status = os_pcb_list_set_disk_in_use_by_id(curr_id, disk_id));
@@ -2013,10 +2499,8 @@ void disk_read(INT16 disk_id, INT16 sector, char data[PGSIZE]){
         Read from disk with specified ID and sector
 
 ************************************************************************/
-void disk_write(INT16 disk_id, INT16 sector, char data[PGSIZE]){
+void disk_write(INT16 disk_id, INT16 sector, char data[]){
 
-    INT32 write = 1;
-    INT32 start = 0;
     INT32 status = 0;
     INT32 error = 0;
     INT32 curr_id = 0;
@@ -2043,27 +2527,13 @@ void disk_write(INT16 disk_id, INT16 sector, char data[PGSIZE]){
     
     if(DISK_DEBUG) printf(" to disk %d sector %d!\n", disk_id, sector);
 
-    //Set disk ID
-    ZCALL(MEM_WRITE(Z502DiskSetID, (INT32 *)&disk_id));
-    
-    //Read status
-    ZCALL(MEM_READ( Z502DiskStatus, &status));
-    if ( status != DEVICE_FREE ){
-        if(DISK_DEBUG) printf( "This disk is busy!\n" );
+    //Start the write, tagged so its interrupt can be matched back to us;
+    //a write the disk refused never interrupts, so don't wait for it
+    CALL(status = disk_submit(disk_id, sector, data, -1, 1, curr_id));
+    if(status != ERR_SUCCESS){
+        return;
     }
 
-    //Set disk ID
-    ZCALL(MEM_WRITE(Z502DiskSetSector, (INT32 *)&sector));
-
-    //Set buffer to put information read
-    ZCALL(MEM_WRITE(Z502DiskSetBuffer, (INT32 *)data));
-
-    //Set action
-    ZCALL(MEM_WRITE(Z502DiskSetAction, &write));
-    
-    //Start Disk
-    ZCALL(MEM_WRITE(Z502DiskStart, &start));
-
     //Set disk bit map to occupied
     CALL(os_disk_set_sector(disk_id, sector, 1));
     
@@ -2089,6 +2559,61 @@ void disk_write(INT16 disk_id, INT16 sector, char data[PGSIZE]){
     return;
 }
 
+/************************************************************************
+    DISK DMA
+        Move a page between a disk sector and a physical frame.  The disk
+        copies it itself, with no buffer in between, and its interrupt
+        reports the frame.  Doesn't wait for the disk to finish; returns
+        the status the disk gave the request
+
+************************************************************************/
+INT32 disk_dma(INT32 disk_id, INT32 sector, INT32 frame, INT32 action, INT32 tag){
+
+    INT32 status;
+
+    if(DISK_DEBUG) printf("disk_dma: %s frame %d, disk %d sector %d!\n",
+                          action == 0 ? "reading into" : "writing out", frame, disk_id, sector);
+
+    //The disk moves the page to or from the frame itself
+    CALL(status = disk_submit(disk_id, sector, NULL, frame, action, tag));
+
+    return status;
+}
+
+/************************************************************************
+    DISK SUBMIT
+        Start a one sector request with a single command block, giving
+        it again for as long as the disk says its queue is full.
+        Returns the status the disk gave the request
+
+************************************************************************/
+INT32 disk_submit(INT32 disk_id, INT32 sector, char *buffer, INT32 frame, INT32 action, INT32 tag){
+
+    DISK_COMMAND command;
+
+    command.disk = disk_id;
+    command.sector = sector;
+    command.count = 1;
+    command.action = action;
+    command.buffer = buffer;
+    command.sg_list = NULL;
+    command.frame = frame;
+    command.tag = tag;
+
+    ZCALL(MEM_WRITE(Z502DiskCommand, (INT32 *)&command));
+    if(command.status == ERR_DISK_IN_USE){
+        if(DISK_DEBUG) printf( "This disk is busy! Waiting for it to be free\n" );
+        while(command.status == ERR_DISK_IN_USE){
+            ZCALL(MEM_WRITE(Z502DiskCommand, (INT32 *)&command));
+        }
+    }
+    if(command.status != ERR_SUCCESS){
+        if(DISK_DEBUG) printf("disk_submit: the disk refused the request, error %d\n", command.status);
+    }
+
+    return command.status;
+}
+
 /************************************************************************
     DEFINE SHARED AREA
         This function defines a shared area of memory that 
@@ -2201,6 +2726,20 @@ void    DoUnlock( INT32 offset )
     //DestroyThread( 0 );
 }
 
+/************************************************************************
+    OS_ATOMIC_ADD
+        Add value to an interlock word in one step and return what it
+        held before.  Nothing is locked, so nobody waits
+************************************************************************/
+INT32   os_atomic_add( INT32 word, INT32 value )
+{
+    INT32     old_value;
+    INT32     result;
+    Z502_ATOMIC( word, ATOMIC_FETCH_AND_ADD, value, 0, &old_value, &result );
+    if(LOCK_DEBUG) printf( "      Atomic add:  %s\n", &(GreatSuccess[ SPART * result ]) );
+    return old_value;
+}
+
 void   list_spinlock_get(void){
     INT32 LockResult;
     #if LIST_LOCK_ON == 1
@@ -2301,6 +2840,20 @@ void    disk_spinlock_give(void){
     #endif
 }
 
+//sending and receiving is a run of steps on both PCBs, so with more
+//than one CPU the whole of SEND_MESSAGE or RECEIVE_MESSAGE holds this
+void   msg_spinlock_get(void){
+    #if MSG_LOCK_ON == 1
+    DoLock(7);
+    #endif
+}
+
+void    msg_spinlock_give(void){
+    #if MSG_LOCK_ON == 1
+    DoUnlock(7);
+    #endif
+}
+
 
 /************************************************************************
     OS List Operations
@@ -2514,6 +3067,11 @@ INT32    os_pcb_list_set_state_by_id( INT32 id, INT32 state ){
  
         //Give lock
         CALL(list_spinlock_give());
+
+        //let a CPU know there is a process for it to run
+        if(state == READY_STATE && cpu_count > 1){
+            CALL(os_cpu_kick(process->cpu));
+        }
         return 0;
     }
 
@@ -2701,7 +3259,8 @@ INT32  os_pcb_list_get_msg_from_outbox(INT32 rec_id, INT32 outbox_id, char *msg,
         prev = NULL;
         while(tmp != NULL){
             if( (tmp->dest_id == rec_id) ||
-                (tmp->dest_id == -1) ) {
+                (tmp->dest_id == -1 &&
+                 os_pcb_list_broadcast_ok(rec_id, outbox_id)) ) {
                 if(tmp->length <= len){
                     process->num_msgs--;
                     if(prev == NULL){
@@ -3158,7 +3717,7 @@ INT32    os_pcb_list_set_shadow_table_page(INT32 page, INT32 disk, INT32 sector,
         ret = -1;
     }else{
         tmp = process->shadow_table;
-        while(tmp->next != NULL){
+        while(tmp != NULL){
             if(tmp->page == page){
                 tmp->disk = disk;
                 tmp->sector = sector;
@@ -3192,7 +3751,7 @@ INT32    os_pcb_list_get_shadow_table_page(INT32 page, INT32 *disk, INT32 *secto
         ret = -1;
     }else{
         tmp = process->shadow_table;
-        while(tmp->next != NULL){
+        while(tmp != NULL){
             if( (tmp->page == page) &&
                 (tmp->disk != -1) &&
                 (tmp->sector != -1) ){
@@ -3228,7 +3787,7 @@ INT32    os_pcb_list_get_shadow_table_page_by_sector(INT32 *page, INT32 disk, IN
         ret = -1;
     }else{
         tmp = process->shadow_table;
-        while(tmp->next != NULL){
+        while(tmp != NULL){
             if( (tmp->disk == disk) &&
                 (tmp->sector == sector) ){
                 (*page) = tmp->page;
@@ -3266,6 +3825,13 @@ INT32    os_pcb_list_set_page_table_page(INT32 id, INT32 page, INT32 val){
     //Give lock
     CALL(list_spinlock_give());
 
+    //Drop any translation the TLB or the translation cache is still
+    //holding for this page
+    if(process != NULL){
+        ZCALL(MEM_WRITE(Z502TLBSetContext, (INT32 *)process->context));
+        ZCALL(MEM_WRITE(Z502TLBInvalidatePage, &page));
+    }
+
     return ret;
 }
 
@@ -3432,7 +3998,8 @@ INT32 os_pcb_list_get_send_broadcast_id( INT32 curr_id ){
             messages = list->outbox;
             while(messages != NULL){
                 //This is a broadcast message!
-                if( (messages->dest_id == -1) ||
+                if( (messages->dest_id == -1 &&
+                     os_pcb_list_broadcast_ok(curr_id, list->id)) ||
                     (messages->dest_id == curr_id) ){
                     id = list->id;
                     found = 1;
@@ -3472,8 +4039,9 @@ INT32 os_pcb_list_get_rec_broadcast_id( INT32 curr_id ){
         if( (list->state == READY_STATE) ||
             (list->state == RUNNING_STATE) ||
             (list->state == HALTED_STATE) ){
-            if( (list->msg_rec_id == curr_id) ||
-                (list->msg_rec_id == -1) ){
+            if( ( (list->msg_rec_id == curr_id) ||
+                  (list->msg_rec_id == -1) ) &&
+                os_pcb_list_broadcast_ok(list->id, curr_id) ){
                     id = list->id;
                     break;
             }
@@ -3555,16 +4123,19 @@ void    os_pcb_list_to_queue_copy( INT32 id, INT32 wake_up_time ){
 //get current running process id
 INT32   os_pcb_get_curr_proc_id( void ){
     
-    return current_id;
+    return current_id[os_cpu_id()];
 }
 
 //set current running process id
 void    os_pcb_set_curr_proc_id( INT32 id ){
+    INT32 me;
+
+    me = os_cpu_id();
     
     //Get lock
     CALL(list_spinlock_get());
 
-    current_id = id;    
+    current_id[me] = id;    
 
     //Give lock
     CALL(list_spinlock_give());
@@ -3575,8 +4146,10 @@ void    os_pcb_set_curr_proc_id( INT32 id ){
 //get high priority id on PCB list
 INT32   os_pcb_list_get_high_prior_id( void ){
     
-    INT32 id = -1;
+    INT32 id = -1, me;
     PCB *list = pList;
+
+    me = os_cpu_id();
     
     //Get lock
     CALL(list_spinlock_get());
@@ -3588,13 +4161,18 @@ INT32   os_pcb_list_get_high_prior_id( void ){
     }else{
         //Give lock
         while(list != NULL){
-            if( (list->state == READY_STATE) ||
-                (list->state == RUNNING_STATE) ){
+            if( (list->cpu == me) &&
+                ( (list->state == READY_STATE) ||
+                  (list->state == RUNNING_STATE) ) ){
                 id = list->id;
                 break;
             }
             list = list->next;
         }
+        //nothing for this CPU, so take work from another one
+        if(id == -1 && cpu_count > 1){
+            CALL(id = os_pcb_list_steal(me));
+        }
         //Give lock
         CALL(list_spinlock_give());
         return id;
@@ -3606,6 +4184,73 @@ INT32   os_pcb_list_get_high_prior_id( void ){
     return -1;
 }
 
+//take the highest priority ready process from the CPU with the most
+//of them, leaving alone any process a CPU is still running on.
+//Call with the list lock held
+INT32   os_pcb_list_steal( INT32 me ){
+
+    INT32 ready[MAX_NUMBER_OF_CPUS];
+    INT32 i, victim = -1;
+    PCB *list;
+
+    for(i = 0; i < cpu_count; i++){
+        ready[i] = 0;
+    }
+    for(list = pList; list != NULL; list = list->next){
+        if(list->state == READY_STATE && !os_cpu_running(list->id)){
+            ready[list->cpu]++;
+        }
+    }
+    for(i = 0; i < cpu_count; i++){
+        if(ready[i] > 0 && (victim < 0 || ready[i] > ready[victim])){
+            victim = i;
+        }
+    }
+    if(victim < 0){
+        return -1;
+    }
+    for(list = pList; list != NULL; list = list->next){
+        if(list->state == READY_STATE && list->cpu == victim &&
+           !os_cpu_running(list->id)){
+            if(PROC_DEBUG) printf("CPU %d took process %d from CPU %d\n", me, list->id, victim);
+            list->cpu = me;
+            return list->id;
+        }
+    }
+    return -1;
+}
+
+//is some CPU still running this process - its registers aren't saved yet
+INT32   os_cpu_running( INT32 id ){
+
+    INT32 i;
+
+    for(i = 0; i < cpu_count; i++){
+        if(current_id[i] == id){
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//with more than one CPU, a process only takes another's broadcast
+//if it has room in its outbox to answer it.  Call with the list
+//lock held
+INT32   os_pcb_list_broadcast_ok( INT32 rec_id, INT32 sender_id ){
+
+    PCB *list;
+
+    if(cpu_count == 1 || rec_id == sender_id){
+        return TRUE;
+    }
+    for(list = pList; list != NULL; list = list->next){
+        if(list->id == rec_id){
+            return list->num_msgs < MSG_OUTBOX_MAX;
+        }
+    }
+    return FALSE;
+}
+
 //sort list
 void    os_pcb_list_sort( void ){
 
@@ -4089,6 +4734,41 @@ void  os_pcb_print_all( void ){
     os_pcb_queue_print();
 }
 
+/************************************************************************
+    OS_PCB_PRINT_CPU_USAGE
+        Prints the time the hardware has charged to each process,
+        read from the accounting registers for its context
+************************************************************************/
+void  os_pcb_print_cpu_usage( void ){
+    PCB *list = pList;
+    INT32 curr_time, user, kernel, faults, traps;
+    void *current = NULL;
+
+    ZCALL(MEM_READ( Z502ClockStatus, &curr_time ));
+
+    //Get lock
+    CALL(list_spinlock_get());
+
+    printf("CPU Usage:\n");
+    printf("Name             ID  User     Kernel   Share  Faults Traps\n");
+    while(list != NULL){
+        ZCALL(MEM_WRITE( Z502AccountingContext, list->context ));
+        ZCALL(MEM_READ( Z502AccountingUserTicks, &user ));
+        ZCALL(MEM_READ( Z502AccountingKernelTicks, &kernel ));
+        ZCALL(MEM_READ( Z502AccountingFaults, &faults ));
+        ZCALL(MEM_READ( Z502AccountingTraps, &traps ));
+        printf("%-16s %-3d %-8d %-8d %5.1f%% %-6d %-5d\n",
+               list->name, list->id, user, kernel,
+               curr_time > 0 ? 100.0 * ( user + kernel ) / curr_time : 0.0,
+               faults, traps);
+        list = list->next;
+    }
+    ZCALL(MEM_WRITE( Z502AccountingContext, current ));
+
+    //Give lock
+    CALL(list_spinlock_give());
+}
+
 INT32   os_pcb_queue_get_high_prior_id( void ){
     
     //Get lock
@@ -4190,10 +4870,12 @@ void    os_pcb_queue_swap(PCB* one, PCB* two){
 
 ************************************************************************/
 
-void    os_event_add( INT32 device_id, INT32 status ){
+void    os_event_add( INT32 device_id, INT32 status, INT32 tag, INT32 frame ){
 
-    EVNT *list = pEvent;
+    EVNT *list;
     EVNT *event;
+    PCB *process;
+    INT32 me;
 
     event = malloc(sizeof(EVNT));
     if(event == NULL){
@@ -4201,10 +4883,28 @@ void    os_event_add( INT32 device_id, INT32 status ){
     }
     event->device_id = device_id;
     event->status = status;
+    event->tag = tag;
+    event->frame = frame;
+
+    //a disk interrupt is handled on the CPU of the process that asked
+    //for the disk, since it may be idling there in that process
+    me = os_cpu_id();
+    event->cpu = me;
+    if(cpu_count > 1 && tag > 0){
+        CALL(process = os_pcb_list_get_by_id(tag));
+        if(process != NULL && process->cpu != me){
+            event->cpu = process->cpu;
+            ZCALL(MEM_WRITE(Z502ProcessorInterrupt, &event->cpu));
+        }
+    }
 
     //Get lock
     CALL(event_spinlock_get());
-    eTotal++;
+    CALL(os_atomic_add(EVENT_COUNT_WORD, 1));
+
+    //the interrupt thread adds while the base thread takes, so only
+    //look at the list once we hold the lock
+    list = pEvent;
 
     //Check if list has been initiatilzed
     if(list == NULL){
@@ -4229,28 +4929,36 @@ void    os_event_add( INT32 device_id, INT32 status ){
     return;
 }
 
-INT32  os_event_get_next( INT32 *device_id, INT32 *status ){
+INT32  os_event_get_next( INT32 *device_id, INT32 *status, INT32 *tag, INT32 *frame ){
 
-    EVNT *tmp;
-    INT32 ret;
+    EVNT *tmp, *prev = NULL;
+    INT32 ret, me;
+
+    me = os_cpu_id();
     
     //Get lock
     CALL(event_spinlock_get());
+
+    //find the first event for this CPU
+    tmp = pEvent;
+    while(tmp != NULL && tmp->cpu != me){
+        prev = tmp;
+        tmp = tmp->next;
+    }
    
-    if(pEvent == NULL){
+    if(tmp == NULL){
         ret = -1;
     }else{
-        tmp = pEvent;
-        if(tmp->next == NULL){
-            pEvent = NULL;
-        }else{
+        if(prev == NULL){
             pEvent = tmp->next;
+        }else{
+            prev->next = tmp->next;
         }
-        eTotal--;
+        CALL(os_atomic_add(EVENT_COUNT_WORD, -1));
         ret = 0;
     }
 
-    if(eTotal == 0){
+    if(os_atomic_add(EVENT_COUNT_WORD, 0) == 0){
         pEvent = NULL;
     }
  
@@ -4260,10 +4968,14 @@ INT32  os_event_get_next( INT32 *device_id, INT32 *status ){
     if(ret == 0){
         (*device_id) = tmp->device_id;
         (*status) = tmp->status;
+        (*tag) = tmp->tag;
+        (*frame) = tmp->frame;
         free(tmp);
     }else{
         (*device_id) = -1;
         (*status) = -1;
+        (*tag) = -1;
+        (*frame) = -1;
     }
 
     return ret;
@@ -4276,7 +4988,7 @@ void os_event_print( void ){
     //Get lock
     CALL(event_spinlock_get());
     
-    printf("Events: %d\n", eTotal);
+    printf("Events: %d\n", os_atomic_add(EVENT_COUNT_WORD, 0));
     printf("DeviceID Status\n");
     //Check if list has been initiatilzed
     if(list == NULL){
@@ -4302,7 +5014,7 @@ void os_event_clear( void ){
     //Get lock
     CALL(event_spinlock_get());
     
-    if(eTotal == 0){
+    if(os_atomic_add(EVENT_COUNT_WORD, 0) == 0){
         pEvent = NULL;
     }
 
@@ -4313,12 +5025,28 @@ void os_event_clear( void ){
 }
 
 INT32 os_event_get_total( void ){
-    INT32 ret;   
+    INT32 ret, me;   
+    EVNT *list;
+
+    //with one CPU every event is ours, and the count is read
+    //atomically without the event lock
+    if(cpu_count <= 1){
+        CALL(ret = os_atomic_add(EVENT_COUNT_WORD, 0));
+        return ret;
+    }
+
+    me = os_cpu_id();
  
     //Get lock
     CALL(event_spinlock_get());
-    
-    ret = eTotal;
+
+    //only count the events for this CPU
+    ret = 0;
+    for(list = pEvent; list != NULL; list = list->next){
+        if(list->cpu == me){
+            ret++;
+        }
+    }
 
     //Give lock
     CALL(event_spinlock_give());
@@ -4663,6 +5391,105 @@ INT32   os_frame_get_next_empty_frame( void ){
     return ret;
 }
 
+//return the first frame of an aligned run of count empty frames, if
+//there is one
+INT32   os_frame_get_empty_run( INT32 count ){
+    FTBL *frame_tbl = pFrame;
+    INT32 ret = -1;
+    INT32 start = -1;
+    
+    //Get lock
+    CALL(frame_spinlock_get());
+
+    //the list is in frame order; start is the frame the current run of
+    //empty frames began at
+    while(frame_tbl != NULL){
+        if(frame_tbl->frames != NULL){
+            start = -1;
+        }else if(start == -1){
+            if(frame_tbl->frame % count == 0){
+                start = frame_tbl->frame;
+            }
+        }
+        if(start != -1 && frame_tbl->frame - start == count - 1){
+            ret = start;
+            break;
+        }
+        frame_tbl = frame_tbl->next;
+    }
+    
+    //Give lock
+    CALL(frame_spinlock_give());
+
+    return ret;
+}
+
+//map the aligned run of HUGE_PAGE_PGS pages holding page onto free
+//contiguous frames with one huge PTE.  The run has to be untouched: no
+//page of it valid or out on disk.  Returns -1 if it can't be done.
+INT32   os_frame_map_huge_page( INT32 page, INT32 pid ){
+    INT32 head;
+    INT32 frame;
+    INT32 entry;
+    INT32 disk, sector;
+    INT32 i;
+
+    head = page & ~(HUGE_PAGE_PGS - 1);
+    if(head + HUGE_PAGE_PGS > VIRTUAL_MEM_PGS){
+        return -1;
+    }
+    //once memory has filled up there won't be a free run, so check that
+    //before walking the page and shadow tables
+    CALL(frame = os_frame_get_empty_run(HUGE_PAGE_PGS));
+    if(frame == -1){
+        return -1;
+    }
+    for(i = 0; i < HUGE_PAGE_PGS; i++){
+        CALL(entry = os_pcb_list_get_page_table_page(pid, head + i));
+        if(entry < 0 || (entry & PTBL_VALID_BIT)){
+            return -1;
+        }
+        CALL(entry = os_pcb_list_get_shadow_table_page(head + i, &disk, &sector, pid));
+        if(entry == 0){
+            return -1;
+        }
+    }
+
+    for(i = 0; i < HUGE_PAGE_PGS; i++){
+        CALL(os_frame_set_page(frame + i, head + i, pid, NULL));
+        CALL(os_frame_touch_frame(frame + i, pid));
+    }
+    CALL(os_pcb_list_set_page_table_page(pid, head, frame | PTBL_HUGE_BIT | PTBL_VALID_BIT));
+
+    return 0;
+}
+
+//if page is part of a huge page, replace the huge PTE with one ordinary
+//PTE per page, mapping each to the same frame as before
+void    os_frame_split_huge_page( INT32 page, INT32 pid ){
+    INT32 head;
+    INT32 entry;
+    INT32 frame;
+    INT32 bits;
+    INT32 i;
+
+    head = page & ~(HUGE_PAGE_PGS - 1);
+    CALL(entry = os_pcb_list_get_page_table_page(pid, head));
+    if(entry < 0 || (entry & (PTBL_VALID_BIT | PTBL_HUGE_BIT)) != (PTBL_VALID_BIT | PTBL_HUGE_BIT)){
+        return;
+    }
+    if(FAULT_DEBUG) printf("Splitting huge page at page %d of id %d\n", head, pid);
+
+    frame = entry & PTBL_PHYS_PG_NO & ~(HUGE_PAGE_PGS - 1);
+    bits = entry & (PTBL_VALID_BIT | PTBL_MODIFIED_BIT | PTBL_REFERENCED_BIT);
+    //the head goes last, since until then it still maps the whole run
+    for(i = HUGE_PAGE_PGS - 1; i >= 0; i--){
+        CALL(os_pcb_list_set_page_table_page(pid, head + i, bits | (frame + i)));
+    }
+
+    return;
+}
+
 //get the frame with the oldest timestamp
 INT32   os_frame_get_last_touched_frame( void ){
     FTBL *frame_tbl = pFrame;
@@ -4750,12 +5577,19 @@ INT32 os_frame_page_to_addr( INT32 page){
 
 ************************************************************************/
 
-//init disk bit map to zero
+//init disk bit map to zero, sized for the disks the hardware has
 void  os_disk_init_map( void ){
     
     INT32 i;
     INT32 j; 
 
+    if(DISK_BIT_MAP == NULL){
+        DISK_BIT_MAP = malloc(sizeof(char *) * MAX_NUMBER_OF_DISKS);
+        for(i = 0; i < MAX_NUMBER_OF_DISKS; i++){
+            DISK_BIT_MAP[i] = malloc(NUM_LOGICAL_SECTORS);
+        }
+    }
+
     CALL(disk_spinlock_get());
 
     for(i = 0; i < MAX_NUMBER_OF_DISKS; i++){
@@ -4801,3 +5635,351 @@ INT32 os_disk_get_next_free_sector(INT32 disk){
 
     return ret;
 }
+
+/************************************************************************
+    OS_STATS_SAMPLE
+        Count what the hardware's --stats-file reports for the OS.  The
+        hardware calls this part way through a context switch, as it
+        does os_snapshot_save, so it can't CALL, charges no time and
+        takes no locks; the interrupt handler only touches the event
+        queue, so the lists here hold still while they are counted
+************************************************************************/
+void    os_stats_sample( OS_STATS *stats ){
+    PCB *process;
+    FTBL *frame_tbl;
+    INT32 i, j;
+
+    memset(stats, 0, sizeof(OS_STATS));
+    for(process = pList; process != NULL; process = process->next){
+        switch(process->state){
+            case RUNNING_STATE:
+                stats->running++;
+                break;
+            case READY_STATE:
+                stats->ready++;
+                break;
+            case WAITING_STATE:
+                stats->waiting++;
+                break;
+            case HALTED_STATE:
+                stats->suspended++;
+                break;
+            default:
+                break;
+        }
+    }
+    for(frame_tbl = pFrame; frame_tbl != NULL; frame_tbl = frame_tbl->next){
+        if(frame_tbl->frames == NULL){
+            stats->free_frames++;
+        }
+    }
+    for(i = 0; DISK_BIT_MAP != NULL && i < MAX_NUMBER_OF_DISKS; i++){
+        for(j = 0; j < NUM_LOGICAL_SECTORS; j++){
+            if(DISK_BIT_MAP[i][j] != 0){
+                stats->used_sectors++;
+            }
+        }
+    }
+}
+
+/************************************************************************
+    OS Snapshot Operations
+        The hardware calls os_snapshot_save() when it writes a snapshot,
+        and os_snapshot_restore() in place of os_init when it starts a
+        run from one.  Everything goes through Z502_SNAPSHOT_WRITE and
+        Z502_SNAPSHOT_READ in the same order.  The hardware is part way
+        through a context switch, so these can't CALL or ZCALL, and
+        they charge no time.
+
+************************************************************************/
+
+//create_process builds a shadow table with an entry for every page
+#define SHADOW_TABLE_LENGTH     VIRTUAL_MEM_PGS
+
+//a PCB copied to the timer queue shares its page table, shadow table
+//and messages with the original, so each is written once and then
+//referred to by number
+static void         **snapshot_refs = NULL;
+static INT32        snapshot_ref_count = 0;
+
+static INT32        *debug_flags[] = { &TIMER_DEBUG, &PROC_DEBUG,
+                            &ERROR_DEBUG, &SVC_DEBUG, &EVENT_DEBUG,
+                            &LOCK_DEBUG, &SUSP_DEBUG, &RESU_DEBUG,
+                            &PRIO_DEBUG, &SEND_DEBUG, &RECV_DEBUG,
+                            &MEM_DEBUG, &DISK_DEBUG, &FAULT_DEBUG };
+
+void    os_snapshot_save( void ){
+
+    EVNT *event;
+    FTBL *frame_tbl;
+    FRAME *frame;
+    INT32 i, count;
+
+    snapshot_ref_count = 0;
+
+    Z502_SNAPSHOT_WRITE(&pid, sizeof(pid));
+    Z502_SNAPSHOT_WRITE(&pTotal, sizeof(pTotal));
+    Z502_SNAPSHOT_WRITE(&cpu_count, sizeof(cpu_count));
+    Z502_SNAPSHOT_WRITE(current_id, sizeof(current_id));
+    Z502_SNAPSHOT_WRITE(cpu_idle, sizeof(cpu_idle));
+    Z502_SNAPSHOT_WRITE(&tlb_entries, sizeof(tlb_entries));
+    Z502_SNAPSHOT_WRITE(&sleep_timer_expires, sizeof(sleep_timer_expires));
+    for(i = 0; i < sizeof(debug_flags) / sizeof(debug_flags[0]); i++){
+        Z502_SNAPSHOT_WRITE(debug_flags[i], sizeof(INT32));
+    }
+
+    //processes, ready and waiting
+    os_snapshot_save_pcbs(pList);
+    os_snapshot_save_pcbs(pQueue);
+
+    //events
+    count = 0;
+    for(event = pEvent; event != NULL; event = event->next){
+        count++;
+    }
+    Z502_SNAPSHOT_WRITE(&count, sizeof(count));
+    for(event = pEvent; event != NULL; event = event->next){
+        Z502_SNAPSHOT_WRITE(event, sizeof(EVNT));
+    }
+
+    //frame table, each frame followed by the pages in it
+    count = 0;
+    for(frame_tbl = pFrame; frame_tbl != NULL; frame_tbl = frame_tbl->next){
+        count++;
+    }
+    Z502_SNAPSHOT_WRITE(&count, sizeof(count));
+    for(frame_tbl = pFrame; frame_tbl != NULL; frame_tbl = frame_tbl->next){
+        Z502_SNAPSHOT_WRITE(frame_tbl, sizeof(FTBL));
+        count = 0;
+        for(frame = frame_tbl->frames; frame != NULL; frame = frame->next){
+            count++;
+        }
+        Z502_SNAPSHOT_WRITE(&count, sizeof(count));
+        for(frame = frame_tbl->frames; frame != NULL; frame = frame->next){
+            Z502_SNAPSHOT_WRITE(frame, sizeof(FRAME));
+        }
+    }
+
+    //disk bit map
+    for(i = 0; i < MAX_NUMBER_OF_DISKS; i++){
+        Z502_SNAPSHOT_WRITE(DISK_BIT_MAP[i], NUM_LOGICAL_SECTORS);
+    }
+
+    //completion ring; the hardware keeps where it is
+    Z502_SNAPSHOT_WRITE(&completion_ring, sizeof(completion_ring));
+
+    return;
+}
+
+void    os_snapshot_restore( void ){
+
+    EVNT *event, **event_link;
+    FTBL *frame_tbl, **frame_tbl_link;
+    FRAME *frame, **frame_link;
+    INT32 i, j, count, frames;
+
+    TO_VECTOR[TO_VECTOR_INT_HANDLER_ADDR]   = (void *)interrupt_handler;
+    TO_VECTOR[TO_VECTOR_FAULT_HANDLER_ADDR] = (void *)fault_handler;
+    TO_VECTOR[TO_VECTOR_TRAP_HANDLER_ADDR]  = (void *)svc;
+
+    snapshot_ref_count = 0;
+
+    Z502_SNAPSHOT_READ(&pid, sizeof(pid));
+    Z502_SNAPSHOT_READ(&pTotal, sizeof(pTotal));
+    Z502_SNAPSHOT_READ(&cpu_count, sizeof(cpu_count));
+    Z502_SNAPSHOT_READ(current_id, sizeof(current_id));
+    Z502_SNAPSHOT_READ(cpu_idle, sizeof(cpu_idle));
+    Z502_SNAPSHOT_READ(&tlb_entries, sizeof(tlb_entries));
+    Z502_SNAPSHOT_READ(&sleep_timer_expires, sizeof(sleep_timer_expires));
+    for(i = 0; i < sizeof(debug_flags) / sizeof(debug_flags[0]); i++){
+        Z502_SNAPSHOT_READ(debug_flags[i], sizeof(INT32));
+    }
+
+    os_snapshot_restore_pcbs(&pList);
+    os_snapshot_restore_pcbs(&pQueue);
+
+    Z502_SNAPSHOT_READ(&count, sizeof(count));
+    event_link = &pEvent;
+    for(i = 0; i < count; i++){
+        event = malloc(sizeof(EVNT));
+        Z502_SNAPSHOT_READ(event, sizeof(EVNT));
+        (*event_link) = event;
+        event_link = (EVNT **)&event->next;
+    }
+    (*event_link) = NULL;
+
+    Z502_SNAPSHOT_READ(&count, sizeof(count));
+    frame_tbl_link = &pFrame;
+    for(i = 0; i < count; i++){
+        frame_tbl = malloc(sizeof(FTBL));
+        Z502_SNAPSHOT_READ(frame_tbl, sizeof(FTBL));
+        (*frame_tbl_link) = frame_tbl;
+        frame_tbl_link = (FTBL **)&frame_tbl->next;
+        Z502_SNAPSHOT_READ(&frames, sizeof(frames));
+        frame_link = (FRAME **)&frame_tbl->frames;
+        for(j = 0; j < frames; j++){
+            frame = malloc(sizeof(FRAME));
+            Z502_SNAPSHOT_READ(frame, sizeof(FRAME));
+            (*frame_link) = frame;
+            frame_link = (FRAME **)&frame->next;
+        }
+        (*frame_link) = NULL;
+    }
+    (*frame_tbl_link) = NULL;
+
+    DISK_BIT_MAP = malloc(sizeof(char *) * MAX_NUMBER_OF_DISKS);
+    for(i = 0; i < MAX_NUMBER_OF_DISKS; i++){
+        DISK_BIT_MAP[i] = malloc(NUM_LOGICAL_SECTORS);
+        Z502_SNAPSHOT_READ(DISK_BIT_MAP[i], NUM_LOGICAL_SECTORS);
+    }
+
+    Z502_SNAPSHOT_READ(&completion_ring, sizeof(completion_ring));
+
+    return;
+}
+
+//write a reference to ptr; TRUE the first time, when the caller must
+//write what it points at
+BOOL    os_snapshot_save_ref( void *ptr ){
+
+    INT32 i;
+
+    for(i = 0; i < snapshot_ref_count; i++){
+        if(snapshot_refs[i] == ptr){
+            break;
+        }
+    }
+    if(ptr == NULL){
+        i = -1;
+    }
+    Z502_SNAPSHOT_WRITE(&i, sizeof(i));
+    if(i != snapshot_ref_count){
+        return FALSE;
+    }
+    snapshot_refs = realloc(snapshot_refs, sizeof(void *) * (snapshot_ref_count + 1));
+    snapshot_refs[snapshot_ref_count++] = ptr;
+    return TRUE;
+}
+
+//read a reference back; the first time, size bytes are allocated for it
+//and the caller must read in what it points at
+void    *os_snapshot_restore_ref( INT32 size, BOOL *is_new ){
+
+    INT32 i;
+
+    (*is_new) = FALSE;
+    Z502_SNAPSHOT_READ(&i, sizeof(i));
+    if(i < 0){
+        return NULL;
+    }
+    if(i < snapshot_ref_count){
+        return snapshot_refs[i];
+    }
+    snapshot_refs = realloc(snapshot_refs, sizeof(void *) * (snapshot_ref_count + 1));
+    snapshot_refs[snapshot_ref_count++] = malloc(size);
+    (*is_new) = TRUE;
+    return snapshot_refs[i];
+}
+
+void    os_snapshot_save_pcbs( PCB *pcb ){
+
+    PCB *tmp;
+    STBL *shadow_table;
+    INT32 i, count = 0;
+
+    for(tmp = pcb; tmp != NULL; tmp = tmp->next){
+        count++;
+    }
+    Z502_SNAPSHOT_WRITE(&count, sizeof(count));
+
+    for(; pcb != NULL; pcb = pcb->next){
+        Z502_SNAPSHOT_WRITE(pcb, sizeof(PCB));
+        if(os_snapshot_save_ref(pcb->page_table)){
+            Z502_SNAPSHOT_WRITE(pcb->page_table, sizeof(UINT16) * VIRTUAL_MEM_PGS);
+        }
+        if(os_snapshot_save_ref(pcb->shadow_table)){
+            shadow_table = pcb->shadow_table;
+            for(i = 0; i < SHADOW_TABLE_LENGTH; i++){
+                Z502_SNAPSHOT_WRITE(shadow_table, sizeof(STBL));
+                shadow_table = shadow_table->next;
+            }
+        }
+        os_snapshot_save_msgs(pcb->outbox);
+        os_snapshot_save_msgs(pcb->inbox);
+        Z502_SNAPSHOT_WRITE_CONTEXT(pcb->context, pcb->page_table);
+    }
+
+    return;
+}
+
+void    os_snapshot_restore_pcbs( PCB **list ){
+
+    PCB *pcb, *prev = NULL;
+    STBL *shadow_table;
+    INT32 i, count;
+    BOOL is_new;
+
+    (*list) = NULL;
+    Z502_SNAPSHOT_READ(&count, sizeof(count));
+
+    while(count-- > 0){
+        pcb = malloc(sizeof(PCB));
+        Z502_SNAPSHOT_READ(pcb, sizeof(PCB));
+        pcb->page_table = os_snapshot_restore_ref(sizeof(UINT16) * VIRTUAL_MEM_PGS, &is_new);
+        if(is_new){
+            Z502_SNAPSHOT_READ(pcb->page_table, sizeof(UINT16) * VIRTUAL_MEM_PGS);
+        }
+        pcb->shadow_table = os_snapshot_restore_ref(sizeof(STBL), &is_new);
+        if(is_new){
+            shadow_table = pcb->shadow_table;
+            for(i = 0; i < SHADOW_TABLE_LENGTH; i++){
+                Z502_SNAPSHOT_READ(shadow_table, sizeof(STBL));
+                shadow_table->next = NULL;
+                if(i < SHADOW_TABLE_LENGTH - 1){
+                    shadow_table->next = malloc(sizeof(STBL));
+                }
+                shadow_table = shadow_table->next;
+            }
+        }
+        os_snapshot_restore_msgs(&pcb->outbox);
+        os_snapshot_restore_msgs(&pcb->inbox);
+        Z502_SNAPSHOT_READ_CONTEXT(&pcb->context, pcb->page_table);
+
+        pcb->prev = prev;
+        pcb->next = NULL;
+        if(prev == NULL){
+            (*list) = pcb;
+        }else{
+            prev->next = pcb;
+        }
+        prev = pcb;
+    }
+
+    return;
+}
+
+void    os_snapshot_save_msgs( MSG *msg ){
+
+    while(os_snapshot_save_ref(msg)){
+        Z502_SNAPSHOT_WRITE(msg, sizeof(MSG));
+        msg = msg->next;
+    }
+
+    return;
+}
+
+void    os_snapshot_restore_msgs( void **link ){
+
+    MSG *msg;
+    BOOL is_new;
+
+    while(TRUE){
+        msg = os_snapshot_restore_ref(sizeof(MSG), &is_new);
+        (*link) = msg;
+        if(!is_new){
+            return;
+        }
+        Z502_SNAPSHOT_READ(msg, sizeof(MSG));
+        link = &msg->next;
+    }
+}
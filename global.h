@@ -37,6 +37,11 @@ typedef         unsigned int                   UINT32;
 typedef         short                           INT16;
 typedef         unsigned short                  UINT16;
 typedef         int                             BOOL;
+#ifdef  NT
+typedef         unsigned __int64                UINT64;
+#else
+typedef         unsigned long long              UINT64;
+#endif
 
 #ifdef  NT
 #define THREAD_PRIORITY_LOW           THREAD_PRIORITY_BELOW_NORMAL
@@ -56,12 +61,60 @@ typedef         int                             BOOL;
 #define         FALSE                           (BOOL)0
 #define         TRUE                            (BOOL)1
 
-#define         PHYS_MEM_PGS                    (short)64
-#define         PGSIZE                          (short)16
-#define         PGBITS                          (short)4
-#define         VIRTUAL_MEM_PGS                 1024
-#define         VMEMPGBITS                      10
+        /*  The machine's geometry is settled when the hardware
+            starts, from --phys-mem-pages and the like or from a
+            --config file (see readme.txt).  These read what it chose.
+            Each has a _LIMIT, which also sizes anything that must be
+            fixed when the program is compiled.                 */
+
+typedef struct
+    {
+    INT32       phys_mem_pgs;
+    INT32       pgsize;
+    INT32       pgbits;
+    INT32       virtual_mem_pgs;
+    INT32       vmempgbits;
+    INT32       num_logical_sectors;
+    INT32       number_of_disks;
+} Z502_GEOMETRY;
+
+extern  Z502_GEOMETRY                   Z502Geometry;
+
+        /*  What each operation costs in simulated time.  The
+            defaults can be changed with --cost=NAME=N, so a --config
+            file can hold a whole cost profile.  The names are in
+            cost_names in z502.c.                               */
+
+typedef struct
+    {
+    INT32       memory_access;
+    INT32       atomic;
+    INT32       memory_mapped_io;
+    INT32       disk_access;
+    INT32       delay;
+    INT32       clock;
+    INT32       timer;
+    INT32       make_context;
+    INT32       destroy_context;
+    INT32       switch_context;
+    INT32       software_trap;
+    INT32       cpu_instruction;
+    INT32       call;
+    INT32       tlb_miss;
+} Z502_COSTS;
+
+extern  Z502_COSTS                      Z502Costs;
+
+#define         PHYS_MEM_PGS                    (short)Z502Geometry.phys_mem_pgs
+#define         PGSIZE                          (short)Z502Geometry.pgsize
+#define         PGBITS                          (short)Z502Geometry.pgbits
+#define         VIRTUAL_MEM_PGS                 Z502Geometry.virtual_mem_pgs
+#define         VMEMPGBITS                      Z502Geometry.vmempgbits
 #define         MEMSIZE                         PHYS_MEM_PGS * PGSIZE
+
+#define         PHYS_MEM_PGS_LIMIT              4096    /* PTBL_PHYS_PG_NO */
+#define         PGSIZE_LIMIT                    1024
+#define         VIRTUAL_MEM_PGS_LIMIT           16384
 
 /***************************************************************** 
         The next two variables have special meaning.  They allow the
@@ -80,15 +133,74 @@ typedef         int                             BOOL;
 #define         PTBL_VALID_BIT                  0x8000
 #define         PTBL_MODIFIED_BIT               0x4000
 #define         PTBL_REFERENCED_BIT             0x2000
+#define         PTBL_HUGE_BIT                   0x1000
 #define         PTBL_PHYS_PG_NO                 0x0FFF
 
-        /*  The maximum number of disks we will support:        */
+        /*  A valid PTE with PTBL_HUGE_BIT set, in the first slot of an
+            aligned run of HUGE_PAGE_PGS pages, maps the whole run onto
+            as many contiguous frames, starting at its frame (which
+            must be aligned the same way).  The hardware ignores the
+            other slots of the run while it's set, and keeps the run's
+            referenced and modified bits in the first one.           */
+
+#define         HUGE_PAGE_BITS                  3
+#define         HUGE_PAGE_PGS                   ( 1 << HUGE_PAGE_BITS )
+
+        /*  The number of disks; there's an interrupt for each of
+            up to MAX_NUMBER_OF_DISKS_LIMIT:                    */
+
+#define         MAX_NUMBER_OF_DISKS             (short)Z502Geometry.number_of_disks
+#define         MAX_NUMBER_OF_DISKS_LIMIT       12
 
-#define         MAX_NUMBER_OF_DISKS             (short)12
+        /*  The most sectors a single disk request may move:     */
+
+#define         MAX_SECTORS_PER_TRANSFER        (short)16
+
+        /*  The most processors the hardware can be started with: */
+
+#define         MAX_NUMBER_OF_CPUS              8
+
+        /*  The timer channels, and the registers each one has: */
+
+#define         NUMBER_OF_TIMER_CHANNELS        4
+#define         TIMER_CHANNEL_REGISTERS         4
 
 
 /*      These are the memory mapped IO addresses                */
 
+#define      Z502TimerChannelPeriod(c) ( Z502TimerChannelStart(c)+3 )
+#define      Z502TimerChannelCancel(c) ( Z502TimerChannelStart(c)+2 )
+#define      Z502TimerChannelStatus(c) ( Z502TimerChannelStart(c)+1 )
+#define      Z502TimerChannelStart(c)  ( Z502TimerChannels+(c)*TIMER_CHANNEL_REGISTERS )
+#define      Z502TimerChannels         Z502CompletionDelay+1
+#define      Z502CompletionDelay       Z502CompletionThreshold+1
+#define      Z502CompletionThreshold   Z502CompletionRing+1
+#define      Z502CompletionRing        Z502InterruptFrame+1
+#define      Z502InterruptFrame        Z502DiskSetFrame+1
+#define      Z502DiskSetFrame          Z502ProcessorInterrupt+1
+#define      Z502ProcessorInterrupt    Z502ProcessorStart+1
+#define      Z502ProcessorStart        Z502ProcessorSelect+1
+#define      Z502ProcessorSelect       Z502ProcessorCount+1
+#define      Z502ProcessorCount        Z502ProcessorID+1
+#define      Z502ProcessorID           Z502AccountingTraps+1
+#define      Z502AccountingTraps       Z502AccountingFaults+1
+#define      Z502AccountingFaults      Z502AccountingKernelTicks+1
+#define      Z502AccountingKernelTicks Z502AccountingUserTicks+1
+#define      Z502AccountingUserTicks   Z502AccountingContext+1
+#define      Z502AccountingContext     Z502PMUReset+1
+#define      Z502PMUReset              Z502PMUCountHigh+1
+#define      Z502PMUCountHigh          Z502PMUCountLow+1
+#define      Z502PMUCountLow           Z502PMUSelect+1
+#define      Z502PMUSelect             Z502TLBInvalidateAll+1
+#define      Z502TLBInvalidateAll      Z502TLBInvalidateASID+1
+#define      Z502TLBInvalidateASID     Z502TLBInvalidatePage+1
+#define      Z502TLBInvalidatePage     Z502TLBSetContext+1
+#define      Z502TLBSetContext         Z502TLBEntries+1
+#define      Z502TLBEntries            Z502DiskSetSGList+1
+#define      Z502DiskSetSGList         Z502DiskSetCount+1
+#define      Z502DiskSetCount          Z502InterruptTag+1
+#define      Z502InterruptTag          Z502DiskSetTag+1
+#define      Z502DiskSetTag            Z502InterruptDevice+1
 #define      Z502InterruptDevice       Z502InterruptStatus+1
 #define      Z502InterruptStatus       Z502InterruptClear+1
 #define      Z502InterruptClear        Z502ClockStatus+1
@@ -99,12 +211,81 @@ typedef         int                             BOOL;
 #define      Z502DiskSetID             Z502DiskSetSector+1
 #define      Z502DiskSetSector         Z502DiskSetBuffer+1
 #define      Z502DiskSetBuffer         Z502DiskSetAction+1
-#define      Z502DiskSetAction         Z502DiskSetup4+1
-#define      Z502DiskSetup4            Z502DiskStart+1
+#define      Z502DiskSetAction         Z502DiskCommand+1
+#define      Z502DiskCommand           Z502DiskStart+1
 #define      Z502DiskStart             Z502DiskStatus+1
 #define      Z502DiskStatus            Z502MEM_MAPPED_MIN+1
 #define      Z502MEM_MAPPED_MIN        0x7FF00000
 
+/*  These are the events the performance counters (PMU) count.  Write
+    one to Z502PMUSelect - or'd with PMU_CONTEXT to see only the count
+    for the current context - then read Z502PMUCountLow followed by
+    Z502PMUCountHigh.  Reading the low word latches both halves.
+    PMU_DISK_READS and PMU_DISK_WRITES count all disks; add a disk_id
+    to either one to count just that disk.                      */
+
+#define         PMU_MEMORY_ACCESSES             0
+#define         PMU_PAGE_FAULTS                 1
+#define         PMU_CONTEXT_SWITCHES            2
+#define         PMU_MMIO_OPERATIONS             3
+#define         PMU_TIMER_INTERRUPTS            4
+#define         PMU_IDLE_TICKS                  5
+#define         PMU_DISK_READS                  6
+#define         PMU_DISK_WRITES                 ( PMU_DISK_READS + MAX_NUMBER_OF_DISKS_LIMIT + 1 )
+#define         PMU_NUMBER_OF_EVENTS            ( PMU_DISK_WRITES + MAX_NUMBER_OF_DISKS_LIMIT + 1 )
+#define         PMU_CONTEXT                     0x100
+
+/*  With --cpus=N the machine has N processors that share memory,
+    disks and the timer.  Z502ProcessorID reads the number of the
+    processor doing the read and Z502ProcessorCount reads N.  To start
+    another processor, write its number to Z502ProcessorSelect and
+    then write a context to Z502ProcessorStart.  Writing a processor
+    number to Z502ProcessorInterrupt raises INTER_PROCESSOR_INTERRUPT
+    on that processor; the interrupt status is the sender's number.  */
+
+/*  A disk request given a frame in Z502DiskSetFrame, instead of a
+    buffer, moves its sectors straight between the disk and physical
+    memory starting at that frame - one frame per sector.  When it
+    completes, Z502InterruptFrame reads the frame back; it reads -1
+    for any other interrupt.                                        */
+
+/*  Write the address of a COMPLETION_RING to Z502CompletionRing and
+    the hardware puts each timer and disk completion on the ring,
+    rather than in the interrupt registers, so the interrupt handler
+    can take them all without any MMIO.  It interrupts once
+    Z502CompletionThreshold completions are waiting, or once the first
+    of them has waited Z502CompletionDelay ticks, with
+    COMPLETION_INTERRUPT as the device.  Write both before the ring.
+    With a delay of 0 (the default) every completion interrupts.  A
+    completion that finds the ring full goes to the interrupt
+    registers as before, and the hardware sets the ring's overflowed. */
+
+#define         COMPLETION_RING_SIZE                    64
+
+/*  There are NUMBER_OF_TIMER_CHANNELS timers, each with its own
+    registers and its own interrupt.  Channel 0 is the original timer:
+    Z502TimerStart and Z502TimerStatus are its Z502TimerChannelStart(0)
+    and Z502TimerChannelStatus(0), and it interrupts as TIMER_INTERRUPT.
+    Starting a channel replaces whatever it was timing.  Writing to
+    Z502TimerChannelCancel stops a channel without an interrupt.  A
+    channel whose Z502TimerChannelPeriod is written non-zero before it
+    is started is periodic: after the first interrupt it interrupts
+    every period ticks until it's cancelled or the period is written
+    back to 0.  Z502TimerChannelStatus reads DEVICE_IN_USE while the
+    channel is running.                                             */
+
+#define         TIMER_CHANNEL_INTERRUPT( c )    ( (c) == 0 ? TIMER_INTERRUPT \
+                                                : (short)( TIMER_INTERRUPT_CHANNEL1 + (c) - 1 ) )
+
+/*  Write the address of a DISK_COMMAND to Z502DiskCommand to start a
+    whole disk request at once, instead of setting it up a register
+    at a time.  The hardware checks it there and then and writes the
+    result to its status: ERR_SUCCESS if the disk took it, and
+    ERR_DISK_IN_USE if the disk's queue is full, so it may be given
+    again.  A request that's refused causes no interrupt.  Give a
+    buffer, a scatter-gather list or a frame (with the others NULL,
+    NULL and -1).                                               */
+
 /*  These are the allowable locations for hardware synchronization support */
 
 #define      MEMORY_INTERLOCK_BASE     0x7FE00000
@@ -138,10 +319,14 @@ typedef         int                             BOOL;
 #define         DISK_INTERRUPT_DISK10           (short)14
 #define         DISK_INTERRUPT_DISK11           (short)15
 #define         DISK_INTERRUPT_DISK12           (short)16
+#define         INTER_PROCESSOR_INTERRUPT       (short)17
+#define         COMPLETION_INTERRUPT            (short)18
+#define         TIMER_INTERRUPT_CHANNEL1        (short)19
+#define         TIMER_INTERRUPT_CHANNEL2        (short)20
+#define         TIMER_INTERRUPT_CHANNEL3        (short)21
 /*      ... we could define other explicit names here           */
 
-#define         LARGEST_STAT_VECTOR_INDEX       DISK_INTERRUPT + \
-                                                MAX_NUMBER_OF_DISKS - 1
+#define         LARGEST_STAT_VECTOR_INDEX       TIMER_INTERRUPT_CHANNEL3
 
 
 /*      Definition of the TO_VECTOR array.  The TO_VECTOR
@@ -169,7 +354,8 @@ typedef         int                             BOOL;
 
         /* Miscellaneous                                        */
 
-#define         NUM_LOGICAL_SECTORS                     (short)1600
+#define         NUM_LOGICAL_SECTORS                     (short)Z502Geometry.num_logical_sectors
+#define         NUM_LOGICAL_SECTORS_LIMIT               32767
 #define         SECTOR_EMPTY                            (short)0
 #define         SECTOR_FULL                             (short)1
         
@@ -201,6 +387,16 @@ typedef         int                             BOOL;
 #define         SUSPEND_UNTIL_LOCKED                    TRUE
 #define         DO_NOT_SUSPEND                          FALSE
 
+/*  Operations for Z502_ATOMIC.  The word is either an interlock word,
+    MEMORY_INTERLOCK_BASE up to MEMORY_INTERLOCK_BASE +
+    MEMORY_INTERLOCK_SIZE, or an aligned word of virtual memory - a
+    shared area, say.  An interlock word is used either with
+    Z502_READ_MODIFY as a lock or with Z502_ATOMIC, not both.     */
+
+#define         ATOMIC_COMPARE_AND_SWAP                 0
+#define         ATOMIC_FETCH_AND_ADD                    1
+#define         ATOMIC_EXCHANGE                         2
+
 #define         MAX_TAG_LENGTH                          20
 
 /*  This structure is used so that the hardware registers can be
@@ -214,6 +410,54 @@ typedef         union
     long        VAL;
 } Z502_ARG;
 
+/*  A completion ring.  The hardware fills record[tail] and moves tail
+    on; the OS takes record[head] and moves head on.  Both wrap at
+    COMPLETION_RING_SIZE, and the ring is full when tail is one
+    behind head.                                                */
+
+typedef         struct
+    {
+    INT32       device;
+    INT32       status;
+    INT32       tag;
+    INT32       frame;
+    INT32       time;
+} COMPLETION;
+
+typedef         struct
+    {
+    INT32       head;
+    INT32       tail;
+    INT32       overflowed;
+    COMPLETION  record[COMPLETION_RING_SIZE];
+} COMPLETION_RING;
+
+typedef         struct
+    {
+    INT32       disk;
+    INT32       sector;
+    INT32       count;
+    INT32       action;             /* 0 = read, 1 = write          */
+    char        *buffer;
+    char        **sg_list;
+    INT32       frame;
+    INT32       tag;
+    INT32       status;             /* Written by the hardware      */
+} DISK_COMMAND;
+
+/*  What the OS counts for each line of a --stats-file.  The hardware
+    asks for it with os_stats_sample() at a context switch.         */
+
+typedef         struct
+    {
+    INT32       running;
+    INT32       ready;
+    INT32       waiting;            /* Asleep on the timer          */
+    INT32       suspended;
+    INT32       free_frames;
+    INT32       used_sectors;       /* Marked in use on any disk    */
+} OS_STATS;
+
 typedef         struct
     {
     void        *context;
@@ -233,6 +477,7 @@ typedef         struct
     void        *shadow_table;
     UINT16      disk_in_use;
     UINT16      sector_in_use;
+    int         cpu;
     void        *next;
     void        *prev;
 } PCB;
@@ -249,6 +494,9 @@ typedef         struct
     {
     int         device_id;
     int         status;
+    int         tag;
+    int         frame;
+    int         cpu;
     void        *next;
 } EVNT;
 
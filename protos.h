@@ -21,29 +21,42 @@
 void   interrupt_handler( void );
 void   fault_handler( void );
 void   page_fault_handler( INT32 );
+INT32  page_fault_take_frame( void );
 void   svc( void );
 void   os_init( void );
 void   *os_get_func_ptr( const char* );
+void   *os_get_entry_point( const char * );
+char   *os_get_entry_name( void * );
+void   os_snapshot_save( void );
+void   os_stats_sample( OS_STATS * );
+void   os_snapshot_restore( void );
 void   os_switch_context_complete( void );
 void   process_sleep( INT32 );
 void   restart_timer( INT32 );
+void   sleep_timer_set( INT32, INT32 );
 INT32  wakeup_timer( INT32 );
 INT32  handle_events( INT32 * );
 void   switch_to_next_highest_priority( void );
 void   idle( void );
-void   disk_interrupt( INT32, INT32 );
+INT32  os_cpu_id( void );
+void   os_cpu_kick( INT32 );
+void   os_cpu_reschedule( void );
+void   disk_interrupt( INT32, INT32, INT32, INT32 );
 void   timer_interrupt( void );
 void   create_process( void *, const char *, INT32, INT32 *, INT32 *, INT32 );
 void   switch_process( INT32, INT32 );
 void   terminate_process( INT32, INT32 *);
 void   terminate_children( INT32, INT32 *);
 void   get_process_id( const char *, INT32 *, INT32 * );
+void   get_performance_count( INT32, INT32 *, INT32 * );
+void   get_process_accounting( INT32, INT32 *, INT32 *, INT32 *, INT32 *, INT32 * );
 void   suspend_process( INT32, INT32 * );
 void   resume_process( INT32, INT32 * );
 void   change_priority( INT32, INT32, INT32 * );
 void   send_message( INT32, char*, INT32, INT32 * );
 void   receive_message( INT32, char*, INT32, INT32 *, INT32 *, INT32 * );
 void   message_transfer( INT32, INT32, INT32, INT32 *, INT32 * );
+void   receive_message_wait( INT32 );
 void   list_spinlock_get( void );
 void   list_spinlock_give( void );
 void   queue_spinlock_get( void );
@@ -54,14 +67,20 @@ void   event_spinlock_get( void );
 void   event_spinlock_give( void );
 void   timer_spinlock_get( void );
 void   timer_spinlock_give( void );
+void   msg_spinlock_get( void );
+void   msg_spinlock_give( void );
+INT32  os_atomic_add( INT32, INT32 );
+void   os_completion_drain( void );
 void   os_dump_stats( void );
 void   os_dump_stats2( char*, INT32 );
 void   os_dump_memory( void );
 void   mem_read( INT32, INT32 * );
 void   mem_write( INT32, INT32 * );
 void   read_modify( INT32, INT32 );
-void   disk_read(INT16, INT16, char data[PGSIZE]);
-void   disk_write(INT16, INT16, char data[PGSIZE]);
+void   disk_read(INT16, INT16, char data[]);
+void   disk_write(INT16, INT16, char data[]);
+INT32  disk_dma(INT32, INT32, INT32, INT32, INT32);
+INT32  disk_submit(INT32, INT32, char *, INT32, INT32, INT32);
 void   define_shared_area( INT32, INT32, char area_tag[MAX_TAG_LENGTH], INT32 *, INT32 * );
 
 
@@ -109,6 +128,9 @@ void   os_pcb_list_to_queue_copy( INT32, INT32 );
 INT32  os_pcb_get_curr_proc_id( void );
 void   os_pcb_set_curr_proc_id( INT32 );
 INT32  os_pcb_list_get_high_prior_id( void );
+INT32  os_pcb_list_steal( INT32 );
+INT32  os_cpu_running( INT32 );
+INT32  os_pcb_list_broadcast_ok( INT32, INT32 );
 void   os_pcb_list_sort( void );
 void   os_pcb_list_swap( PCB *, PCB * );
 
@@ -128,12 +150,13 @@ void   os_pcb_queue_print();
 void   os_pcb_queue_to_list( INT32 );
 INT32  os_pcb_queue_get_high_prior_id( void );
 void   os_pcb_print_all();
+void   os_pcb_print_cpu_usage( void );
 void   os_pcb_queue_sort( void );
 void   os_pcb_queue_swap( PCB *, PCB * );
 
 /*                      Event Operations in base.c                */
-void   os_event_add( INT32, INT32 );
-INT32  os_event_get_next( INT32 *, INT32 * );
+void   os_event_add( INT32, INT32, INT32, INT32 );
+INT32  os_event_get_next( INT32 *, INT32 *, INT32 *, INT32 * );
 void   os_event_print( void );
 void   os_event_clear( void );
 INT32  os_event_get_total( void );
@@ -149,6 +172,9 @@ INT32  os_frame_set_tag( INT32, char* );
 INT32  os_frame_get_next_tagged_frame( INT32, char * );
 INT32  os_frame_touch_frame( INT32, INT32 );
 INT32  os_frame_get_next_empty_frame( void );
+INT32  os_frame_get_empty_run( INT32 );
+INT32  os_frame_map_huge_page( INT32, INT32 );
+void   os_frame_split_huge_page( INT32, INT32 );
 INT32  os_frame_get_last_touched_frame( void );
 void   os_frame_print( void );
 void   os_frame_addr_to_page( INT32, INT32 *, INT32 *);
@@ -158,6 +184,13 @@ INT32  os_frame_page_to_addr( INT32 );
 void   os_disk_init_map( void );
 void   os_disk_set_sector( INT32, INT32, INT32 );
 INT32  os_disk_get_next_free_sector( INT32 );
+/*                      Snapshot Operations in base.c             */
+BOOL   os_snapshot_save_ref( void * );
+void   *os_snapshot_restore_ref( INT32, BOOL * );
+void   os_snapshot_save_pcbs( PCB * );
+void   os_snapshot_restore_pcbs( PCB ** );
+void   os_snapshot_save_msgs( MSG * );
+void   os_snapshot_restore_msgs( void ** );
 
 /*                      ENTRIES in sample.c                       */
 
@@ -190,6 +223,7 @@ void   test1j( void );
 void   test1k( void );
 void   test1l( void );
 void   test1m( void );
+void   test1n( void );
 void   test2a( void );
 void   test2b( void );
 void   test2c( void );
@@ -197,6 +231,11 @@ void   test2d( void );
 void   test2e( void );
 void   test2f( void );
 void   test2g( void );
+void   test2h( void );
+void   test2i( void );
+void   test1x( void );
+void   test1j_echo( void );
+void   test2gx( void );
 void   get_skewed_random_number( long *, long );
 
 
@@ -207,11 +246,17 @@ void   Z502_HALT( void );
 void   Z502_MEM_READ(INT32, INT32 * );
 void   Z502_MEM_WRITE(INT32, INT32 * );
 void   Z502_READ_MODIFY( INT32, INT32, INT32, INT32 * );
+void   Z502_ATOMIC( INT32, INT32, INT32, INT32, INT32 *, INT32 * );
 void   Z502_HALT( void );
 void   Z502_IDLE( void );
 void   Z502_DESTROY_CONTEXT( void ** );
 void   Z502_MAKE_CONTEXT( void **, void *, BOOL );
 void   Z502_SWITCH_CONTEXT( BOOL, void ** );
+void   Z502_SNAPSHOT_WRITE( void *, INT32 );
+void   Z502_SNAPSHOT_READ( void *, INT32 );
+void   Z502_SNAPSHOT_WRITE_CONTEXT( void *, UINT16 * );
+void   Z502_SNAPSHOT_READ_CONTEXT( void **, UINT16 * );
+void   *Z502_ALLOCATE_USER_DATA( INT32 );
 
 int    CreateAThread( void *, INT32 * );
 void   DestroyThread( INT32   );
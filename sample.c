@@ -60,8 +60,8 @@ void    sample_code( void )
     long            Value;
 
     INT32           disk_id, sector;                /* Used for disk requests */
-    char            disk_buffer_write[ PGSIZE ];
-    char            disk_buffer_read[ PGSIZE ];
+    char            disk_buffer_write[ PGSIZE_LIMIT ];
+    char            disk_buffer_read[ PGSIZE_LIMIT ];
 
     void            *context_pointer;            /* Used for context commands*/
     void            *starting_address;
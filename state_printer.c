@@ -25,6 +25,7 @@
 #include                 "protos.h"
 #include                 "stdio.h"
 #include                 "string.h"
+#include                 "stdlib.h"
 #if defined LINUX || defined MAC
 #include                 <unistd.h>
 #endif
@@ -330,12 +331,18 @@ typedef struct
 
 typedef struct
 {
-    MP_FRAME_ENTRY  entry[PHYS_MEM_PGS];
+    MP_FRAME_ENTRY  *entry;             /* PHYS_MEM_PGS of them */
 }MP_FRAME_TABLE;
 
 MP_FRAME_TABLE  MP_ft;
 
+/*  Frames are printed MP_FRAMES_PER_LINE across; a bigger memory is
+    printed as several such tables, one below the other.             */
+
+#define         MP_FRAMES_PER_LINE      64
+
 void    MP_initialize( void );
+void    MP_fill_line( char *, INT32, INT32, INT32, INT32 );
 
 /****************************************************************************
 
@@ -396,50 +403,96 @@ void MP_setup( INT32 frame, INT32 pid, INT32 logical_page, INT32 state )
 void    MP_print_line( void )
 {
     INT32   index;
-    INT32   temp;
-    char    output_line3[PHYS_MEM_PGS+5];
-    char    output_line4[PHYS_MEM_PGS+5];
-    char    output_line5[PHYS_MEM_PGS+5];
-    char    output_line6[PHYS_MEM_PGS+5];
-    char    output_line7[PHYS_MEM_PGS+5];
-    char    output_line8[PHYS_MEM_PGS+5];
+    INT32   first, last;
+    INT32   row, power;
+    INT32   frame_digits, vpn_digits;
+    char    output_line[MP_FRAMES_PER_LINE+5];
+
+/*  Frame and virtual page numbers are written vertically, one row per
+    digit - at least 2 rows for a frame and 4 for a page, and more if
+    the machine is big enough to need them.                          */
+    for ( frame_digits = 2, power = 100; power <= PHYS_MEM_PGS - 1;
+          power *= 10 )
+        frame_digits++;
+    for ( vpn_digits = 4, power = 10000; power <= VIRTUAL_MEM_PGS - 1;
+          power *= 10 )
+        vpn_digits++;
 
 /*  Header Line */
     SP_do_output("\n                       PHYSICAL MEMORY STATE\n");
-/*      First Line      */
-    SP_do_output("Frame 0000000000111111111122222222223333333333444444444455555555556666\n");
-/*  Second Line */
-    SP_do_output("Frame 0123456789012345678901234567890123456789012345678901234567890123\n");
-/*  Third - Eighth Line  */
-    strcpy( output_line3, "                                                                 \n" );
-    strcpy( output_line4, "                                                                 \n" );
-    strcpy( output_line5, "                                                                 \n" );
-    strcpy( output_line6, "                                                                 \n" );
-    strcpy( output_line7, "                                                                 \n" );
-    strcpy( output_line8, "                                                                 \n" );
+    for ( first = 0; first < PHYS_MEM_PGS; first += MP_FRAMES_PER_LINE )
+    {
+        last = first + MP_FRAMES_PER_LINE;
+        if ( last > PHYS_MEM_PGS )
+            last = PHYS_MEM_PGS;
 
-    for ( index = 0; index < PHYS_MEM_PGS; index++ )
+/*  Frame number lines */
+        for ( row = frame_digits - 1; row >= 0; row-- )
+        {
+            for ( power = 1, index = 0; index < row; index++ )
+                power *= 10;
+            for ( index = first; index < last; index++ )
+                output_line[index - first] = (char)(( index / power ) % 10) +48;
+            strcpy( &output_line[last - first], "\n" );
+            SP_do_output( "Frame " );  SP_do_output( output_line );
+        }
+
+/*  PID line */
+        MP_fill_line( output_line, first, last, -1, 0 );
+        SP_do_output( "PID   " );  SP_do_output( output_line );
+
+/*  VPN lines */
+        for ( row = vpn_digits - 1; row >= 0; row-- )
+        {
+            for ( power = 1, index = 0; index < row; index++ )
+                power *= 10;
+            MP_fill_line( output_line, first, last, 0, power );
+            SP_do_output( "VPN   " );  SP_do_output( output_line );
+        }
+
+/*  State line */
+        MP_fill_line( output_line, first, last, 1, 0 );
+        SP_do_output( "VMR   " );  SP_do_output( output_line );
+    }
+    MP_initialize( );
+}
+
+/****************************************************************************
+
+        MP_fill_line
+
+        Fill in one line of the table for frames first up to last: the
+        PID (what < 0), one digit of the virtual page (what == 0, the
+        digit given by power) or the state (what > 0).  Frames holding
+        nothing are left blank.
+
+****************************************************************************/
+
+void    MP_fill_line( char *output_line, INT32 first, INT32 last,
+                      INT32 what, INT32 power )
+{
+    INT32   index;
+    INT32   column;
+
+    for ( column = 0; column <= last - first; column++ )
+        output_line[column] = ' ';
+    strcpy( &output_line[column], "\n" );
+    for ( index = first; index < last; index++ )
     {
         if ( MP_ft.entry[index].contains_data == TRUE )
         {
-            output_line3[index] = (char)(MP_ft.entry[index].pid + 48);
-            temp                = MP_ft.entry[index].logical_page;
-            output_line4[index] = (char)(temp / 1000 ) +48;
-            output_line5[index] = (char)((temp / 100 ) % 10) +48;
-            output_line6[index] = (char)((temp / 10  ) % 10) +48;
-            output_line7[index] = (char)((temp       ) % 10) +48;
-            output_line8[index] = (char)MP_ft.entry[index].state +48;
+            column = index - first;
+            if ( what < 0 )
+                output_line[column] = (char)(MP_ft.entry[index].pid + 48);
+            else if ( what == 0 )
+                output_line[column] = (char)
+                    ((MP_ft.entry[index].logical_page / power ) % 10) +48;
+            else
+                output_line[column] = (char)MP_ft.entry[index].state +48;
         }
     }
-    SP_do_output( "PID   " );  SP_do_output( output_line3 );
-    SP_do_output( "VPN   " );  SP_do_output( output_line4 );
-    SP_do_output( "VPN   " );  SP_do_output( output_line5 );
-    SP_do_output( "VPN   " );  SP_do_output( output_line6 );
-    SP_do_output( "VPN   " );  SP_do_output( output_line7 );
-    SP_do_output( "VMR   " );  SP_do_output( output_line8 );
-    MP_initialize( );
 }
-
+
 /****************************************************************************
 
         MP_initialize
@@ -450,7 +503,11 @@ void    MP_print_line( void )
 
 void    MP_initialize( void )
 {
-    short   index;
+    INT32   index;
+
+    if ( MP_ft.entry == NULL )
+        MP_ft.entry = (MP_FRAME_ENTRY *)calloc( PHYS_MEM_PGS,
+                                                sizeof( MP_FRAME_ENTRY ) );
     for ( index = 0; index < PHYS_MEM_PGS; index++ )
         MP_ft.entry[index].contains_data = FALSE;
 }
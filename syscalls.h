@@ -23,6 +23,14 @@
         3.1 Aug 2004:           hardware interrupt runs on separate thread
         3.11 Aug 2004:          Support for OS level locking
 	3.30 July 2006:         Modify POP_THE_STACK to apply to base only
+        3.60 August 2012:       ATOMIC - compare and swap, fetch and
+                                add, exchange.  The costs of CALL and
+                                STEP are set when the hardware starts.
+                                GET_PERFORMANCE_COUNT reads the
+                                hardware's performance counters.
+                                GET_PROCESS_ACCOUNTING reads the
+                                time, faults and traps charged to
+                                a process.
 *********************************************************************/
 
 #include        "stdio.h"
@@ -45,13 +53,16 @@
 #define         SYSNUM_DISK_READ                       13
 #define         SYSNUM_DISK_WRITE                      14
 #define         SYSNUM_DEFINE_SHARED_AREA              15
+#define         SYSNUM_ATOMIC                          16
+#define         SYSNUM_GET_PERFORMANCE_COUNT           17
+#define         SYSNUM_GET_PROCESS_ACCOUNTING          18
 
 
 extern void     charge_time_and_check_events( INT32 );
 extern int      BaseThread();
 
 #ifndef COST_OF_CALL
-#define         COST_OF_CALL                            2L
+#define         COST_OF_CALL                            (long)Z502Costs.call
 #endif
 
 
@@ -80,7 +91,7 @@ extern int      BaseThread();
 /*      Macros used to make the test programs more readable     */
 
 #ifndef         COST_OF_CPU_INSTRUCTION
-#define         COST_OF_CPU_INSTRUCTION                 1L
+#define         COST_OF_CPU_INSTRUCTION                 (long)Z502Costs.cpu_instruction
 #endif
 
                                 /* Some compilers require a short
@@ -142,6 +153,24 @@ extern int      BaseThread();
 #define         READ_MODIFY( arg1, arg2 )   Z502_READ_MODIFY( arg1, arg2 ); 
 #endif
 
+#ifdef  USER
+#define         ATOMIC( arg1, arg2, arg3, arg4, arg5, arg6 )    \
+                {                                               \
+                    SYS_CALL_CALL_TYPE = SYSNUM_ATOMIC;         \
+                    Z502_ARG1.VAL       = arg1;             \
+                    Z502_ARG2.VAL       = arg2;             \
+                    Z502_ARG3.VAL       = arg3;             \
+                    Z502_ARG4.VAL       = arg4;             \
+                    Z502_ARG5.PTR       = (void *)arg5;     \
+                    Z502_ARG6.PTR       = (void *)arg6;     \
+                    return;                                     \
+                }
+#endif
+#ifndef  USER
+#define         ATOMIC( arg1, arg2, arg3, arg4, arg5, arg6 )    \
+                Z502_ATOMIC( arg1, arg2, arg3, arg4, arg5, arg6 );
+#endif
+
 #define         GET_TIME_OF_DAY( arg1 )                         \
                 {                                               \
                 SYS_CALL_CALL_TYPE = SYSNUM_GET_TIME_OF_DAY;    \
@@ -262,6 +291,27 @@ extern int      BaseThread();
                 return;                                         \
                 }                                               \
 
+#define         GET_PERFORMANCE_COUNT( arg1, arg2, arg3 )       \
+                {                                               \
+                SYS_CALL_CALL_TYPE = SYSNUM_GET_PERFORMANCE_COUNT; \
+                Z502_ARG1.VAL       = arg1;                 \
+                Z502_ARG2.PTR       = (void *)arg2;         \
+                Z502_ARG3.PTR       = (void *)arg3;         \
+                return;                                         \
+                }                                               \
+
+#define         GET_PROCESS_ACCOUNTING( arg1, arg2, arg3, arg4, arg5, arg6 ) \
+                {                                               \
+                SYS_CALL_CALL_TYPE = SYSNUM_GET_PROCESS_ACCOUNTING; \
+                Z502_ARG1.VAL       = arg1;                 \
+                Z502_ARG2.PTR       = (void *)arg2;         \
+                Z502_ARG3.PTR       = (void *)arg3;         \
+                Z502_ARG4.PTR       = (void *)arg4;         \
+                Z502_ARG5.PTR       = (void *)arg5;         \
+                Z502_ARG6.PTR       = (void *)arg6;         \
+                return;                                         \
+                }                                               \
+
 
 /*      This section includes items needed in the scheduler printer.
         It's also useful for those routines that want to communicate
@@ -794,7 +794,7 @@ void    test1i( void)
 
     if ( Z502_REG_1 == 0 )
         {
-        Z502_REG_1 = (long)calloc( 1, sizeof ( TEST1I_DATA ));
+        Z502_REG_1 = (long)Z502_ALLOCATE_USER_DATA( sizeof( TEST1I_DATA ) );
         if ( Z502_REG_1 == 0 )
             {
             printf( "Something screwed up allocating space in test1i\n" );
@@ -976,7 +976,7 @@ void    test1j( void)
 
     if ( Z502_REG_1 == 0 )
         {
-        Z502_REG_1 = (long)calloc( 1, sizeof ( TEST1J_DATA ));
+        Z502_REG_1 = (long)Z502_ALLOCATE_USER_DATA( sizeof( TEST1J_DATA ) );
         if ( Z502_REG_1 == 0 )
             {
             printf( "Something screwed up allocating space in test1j\n" );
@@ -1241,7 +1241,7 @@ void    test1l( void)
 
     if ( Z502_REG_1 == 0 )
         {
-        Z502_REG_1 = (long)calloc( 1, sizeof ( TEST1L_DATA ));
+        Z502_REG_1 = (long)Z502_ALLOCATE_USER_DATA( sizeof( TEST1L_DATA ) );
         if ( Z502_REG_1 == 0 )
             {
             printf( "Something screwed up allocating space in test1j\n" );
@@ -1519,6 +1519,131 @@ void    test1m( void)
     }                                           // End while   
 }                                               // End test1m
 
+/**************************************************************************
+
+        Test 1n
+
+        Reads the time, faults and traps the hardware charges to a
+        process with GET_PROCESS_ACCOUNTING.  Between two readings of
+        its own, this process runs some user steps, sleeps and makes
+        the second call - so its user and kernel time must both grow,
+        it must have taken exactly two traps and no faults.  It then
+        reads a child's accounting, and asks for a process that
+        doesn't exist.
+
+        Z502_REG_1              Loop counter
+        Z502_REG_2              OUR process ID
+        Z502_REG_3              Child's process ID
+        Z502_REG_6              Pointer to the readings
+        Z502_REG_9              Error returned
+
+**************************************************************************/
+
+#define         TEST1N_USER_STEPS               20
+
+typedef struct
+    {
+    INT32    user;
+    INT32    kernel;
+    INT32    faults;
+    INT32    traps;
+} TEST1N_ACCOUNTING;
+
+typedef struct
+    {
+    TEST1N_ACCOUNTING   before;
+    TEST1N_ACCOUNTING   after;
+} TEST1N_DATA;
+
+void    test1n( void)
+    {
+    TEST1N_DATA *td;
+
+    if ( Z502_REG_6 == 0 )
+        {
+        Z502_REG_6 = (long)Z502_ALLOCATE_USER_DATA( sizeof( TEST1N_DATA ) );
+        if ( Z502_REG_6 == 0 )
+            {
+            printf( "Something screwed up allocating space in test1n\n" );
+        }
+    }
+    td = ( TEST1N_DATA *)Z502_REG_6;
+
+    while( 1 )
+        {
+        SELECT_STEP
+            {
+           STEP( 0 )
+                GET_PROCESS_ID( "", &Z502_REG_2, &Z502_REG_9 );
+
+           STEP( 1 )
+                printf( "Release %s:Test 1n: Pid %ld\n", CURRENT_REL, Z502_REG_2 );
+                GET_PROCESS_ACCOUNTING( -1, &(td->before.user),
+                        &(td->before.kernel), &(td->before.faults),
+                        &(td->before.traps), &Z502_REG_9 );
+
+           STEP( 2 )
+                success_expected( Z502_REG_9, "GET_PROCESS_ACCOUNTING" );
+                Z502_REG_1 = 0;
+                break;
+
+           STEP( 3 )
+                Z502_REG_1++;
+                if ( Z502_REG_1 < TEST1N_USER_STEPS )
+                    GO_NEXT_TO( 3 )
+                break;
+
+           STEP( 4 )
+                SLEEP( 100 );
+
+           STEP( 5 )
+                GET_PROCESS_ACCOUNTING( -1, &(td->after.user),
+                        &(td->after.kernel), &(td->after.faults),
+                        &(td->after.traps), &Z502_REG_9 );
+
+           STEP( 6 )
+                printf( "Before: user = %d  kernel = %d  faults = %d  traps = %d\n",
+                        td->before.user, td->before.kernel,
+                        td->before.faults, td->before.traps );
+                printf( "After:  user = %d  kernel = %d  faults = %d  traps = %d\n",
+                        td->after.user, td->after.kernel,
+                        td->after.faults, td->after.traps );
+                if (   td->after.user   <= td->before.user
+                    || td->after.kernel <= td->before.kernel
+                    || td->after.faults != td->before.faults
+                    || td->after.traps  != td->before.traps + 2 )
+                    printf( "AN ERROR HAS OCCURRED.\n" );
+                CREATE_PROCESS( "test1n_1", test1x, NORMAL_PRIORITY,
+                                &Z502_REG_3, &Z502_REG_9 );
+
+           STEP( 7 )
+                success_expected( Z502_REG_9, "CREATE_PROCESS" );
+                SLEEP( 200 );
+
+           STEP( 8 )
+                GET_PROCESS_ACCOUNTING( Z502_REG_3, &(td->after.user),
+                        &(td->after.kernel), &(td->after.faults),
+                        &(td->after.traps), &Z502_REG_9 );
+
+           STEP( 9 )
+                success_expected( Z502_REG_9, "GET_PROCESS_ACCOUNTING" );
+                printf( "Child:  user = %d  kernel = %d  faults = %d  traps = %d\n",
+                        td->after.user, td->after.kernel,
+                        td->after.faults, td->after.traps );
+                if ( td->after.user <= 0 || td->after.traps <= 0 )
+                    printf( "AN ERROR HAS OCCURRED.\n" );
+                GET_PROCESS_ACCOUNTING( 9999, &(td->after.user),
+                        &(td->after.kernel), &(td->after.faults),
+                        &(td->after.traps), &Z502_REG_9 );
+
+           STEP( 10 )
+                error_expected( Z502_REG_9, "GET_PROCESS_ACCOUNTING" );
+                TERMINATE_PROCESS( -2, &Z502_REG_9 );
+
+        }                                       // End switch
+    }                                           // End while
+}                                               // End test1n
+
 /**************************************************************************
 
       Test1x 
@@ -1620,7 +1745,7 @@ void    test1j_echo( void)
 
     if ( Z502_REG_1 == 0 )
         {
-        Z502_REG_1 = (long)calloc( 1, sizeof ( TEST1J_ECHO_DATA ));
+        Z502_REG_1 = (long)Z502_ALLOCATE_USER_DATA( sizeof( TEST1J_ECHO_DATA ) );
         if ( Z502_REG_1 == 0 )
             {
             printf( "Something screwed up allocating space in test1j_echo\n" );
@@ -1778,10 +1903,18 @@ void    test2a( void )
 
 void    test2b( void )
     {
-    static INT32        test_data[TEST_DATA_SIZE] = {
-                        0, 4, PGSIZE - 2, PGSIZE, 3 * PGSIZE - 2,
-                        (VIRTUAL_MEM_PGS - 1) * PGSIZE,
-                        VIRTUAL_MEM_PGS * PGSIZE - 2};
+    static INT32        test_data[TEST_DATA_SIZE];
+
+    /*  These depend on the machine's geometry, which is only known
+        once the hardware has started.                              */
+
+    test_data[0] = 0;
+    test_data[1] = 4;
+    test_data[2] = PGSIZE - 2;
+    test_data[3] = PGSIZE;
+    test_data[4] = 3 * PGSIZE - 2;
+    test_data[5] = (VIRTUAL_MEM_PGS - 1) * PGSIZE;
+    test_data[6] = VIRTUAL_MEM_PGS * PGSIZE - 2;
 
     while(1)
         {
@@ -1852,8 +1985,8 @@ void    test2b( void )
 
 typedef         union
     {
-    char        char_data[ PGSIZE ];
-    UINT32      int_data[ PGSIZE/ sizeof(int) ];
+    char        char_data[ PGSIZE_LIMIT ];
+    UINT32      int_data[ PGSIZE_LIMIT/ sizeof(int) ];
 } DISK_DATA;
 
 void    test2c( void )
@@ -1866,8 +1999,8 @@ void    test2c( void )
 
     if ( Z502_REG_1 == 0 )
         {
-        Z502_REG_1 = ( long )calloc( 1, sizeof( DISK_DATA ) );
-        Z502_REG_2 = ( long )calloc( 1, sizeof( DISK_DATA ) );
+        Z502_REG_1 = (long)Z502_ALLOCATE_USER_DATA( sizeof( DISK_DATA ) );
+        Z502_REG_2 = (long)Z502_ALLOCATE_USER_DATA( sizeof( DISK_DATA ) );
         if ( Z502_REG_2 == 0 )
             printf( "Something screwed up allocating space in test2c\n");
     }
@@ -2053,8 +2186,9 @@ void    test2d( void )
 
 **************************************************************************/
 
-#define         STEP_SIZE               VIRTUAL_MEM_PGS/(2 * PHYS_MEM_PGS )
-#define         DISPLAY_GRANULARITY2e     16 * STEP_SIZE
+#define         STEP_SIZE               ( VIRTUAL_MEM_PGS >= 2 * PHYS_MEM_PGS ? \
+                                          VIRTUAL_MEM_PGS/(2 * PHYS_MEM_PGS ) : 1 )
+#define         DISPLAY_GRANULARITY2e     ( 16 * STEP_SIZE )
 void    test2e( void )
     {
 
@@ -2139,7 +2273,7 @@ void    test2e( void )
 
 typedef struct
     {
-    INT16       page_touched[LOGICAL_PAGES_TO_TOUCH];
+    INT16       page_touched[2 * PHYS_MEM_PGS_LIMIT];
 } MEMORY_TOUCHED_RECORD;
 
 void    test2f( void )
@@ -2149,7 +2283,7 @@ void    test2f( void )
 
     if ( Z502_REG_5 == 0 )
         {
-        Z502_REG_5 = ( long )calloc( 1, sizeof(MEMORY_TOUCHED_RECORD) );
+        Z502_REG_5 = (long)Z502_ALLOCATE_USER_DATA( sizeof( MEMORY_TOUCHED_RECORD ) );
         if ( Z502_REG_5 == 0 )
             {
             printf("Something screwed up allocating space in test2f\n");
@@ -2443,7 +2577,7 @@ void    test2gx( void )
 
     if ( Z502_REG_1 == 0 )
         {
-        Z502_REG_1 = (long)calloc( 1, sizeof(LOCAL_DATA) );
+        Z502_REG_1 = (long)Z502_ALLOCATE_USER_DATA( sizeof( LOCAL_DATA ) );
         if ( Z502_REG_1 == 0 )
             {
             printf( "Unable to allocate memory in test2gx\n" );
@@ -2717,6 +2851,277 @@ void    test2gx( void )
     }                                           /* End of while     */
 }                                               /* End of test2gx   */
 
+/**************************************************************************
+
+      Test2h exercises ATOMIC - compare and swap, fetch and add and
+      exchange - on a word of memory and on an interlock word, checking
+      the old value and success flag each operation returns.
+
+        Use:  Z502_REG_1                data written
+              Z502_REG_2                data read
+              Z502_REG_3                memory address
+              Z502_REG_4                process_id
+              Z502_REG_5                interlock word address
+              Z502_REG_6                pointer to the old value and flag
+              Z502_REG_9                error
+**************************************************************************/
+
+#define         TEST2H_MEMORY_ADDRESS           ( 5 * PGSIZE )
+#define         TEST2H_INTERLOCK_ADDRESS        ( MEMORY_INTERLOCK_BASE + 0xC0 )
+
+typedef struct
+    {
+    INT32    old_value;
+    INT32    success;
+} TEST2H_DATA;
+
+void    test2h_check( TEST2H_DATA *td, char operation[],
+                      INT32 expected_old_value, INT32 expected_success )
+    {
+    printf( "%s: old value = %d  success = %d\n",
+            operation, td->old_value, td->success );
+    if (   td->old_value != expected_old_value
+        || td->success   != expected_success )
+        printf( "AN ERROR HAS OCCURRED.  Expected old value = %d  success = %d\n",
+                expected_old_value, expected_success );
+}                                               /* End of test2h_check */
+
+void    test2h( void )
+    {
+    TEST2H_DATA *td;
+
+    if ( Z502_REG_6 == 0 )
+        {
+        Z502_REG_6 = (long)Z502_ALLOCATE_USER_DATA( sizeof( TEST2H_DATA ) );
+        if ( Z502_REG_6 == 0 )
+            {
+            printf( "Something screwed up allocating space in test2h\n" );
+        }
+    }
+    td = ( TEST2H_DATA *)Z502_REG_6;
+
+    SELECT_STEP
+        {
+       STEP( 0 )
+            GET_PROCESS_ID( "", &Z502_REG_4, &Z502_REG_9 );
+
+       STEP( 1 )
+            printf( "Release %s:Test 2h: Pid %ld\n", CURRENT_REL, Z502_REG_4 );
+            Z502_REG_3 = TEST2H_MEMORY_ADDRESS;
+            Z502_REG_5 = TEST2H_INTERLOCK_ADDRESS;
+            Z502_REG_1 = 100;
+            MEM_WRITE( Z502_REG_3, &Z502_REG_1 );
+
+       STEP( 2 )
+            ATOMIC( Z502_REG_3, ATOMIC_COMPARE_AND_SWAP, 200, 100,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 3 )
+            test2h_check( td, "compare and swap", 100, TRUE );
+            ATOMIC( Z502_REG_3, ATOMIC_COMPARE_AND_SWAP, 300, 100,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 4 )
+            test2h_check( td, "failed compare and swap", 200, FALSE );
+            ATOMIC( Z502_REG_3, ATOMIC_FETCH_AND_ADD, 5, 0,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 5 )
+            test2h_check( td, "fetch and add", 200, TRUE );
+            ATOMIC( Z502_REG_3, ATOMIC_EXCHANGE, 7, 0,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 6 )
+            test2h_check( td, "exchange", 205, TRUE );
+            MEM_READ( Z502_REG_3, &Z502_REG_2 );
+
+       STEP( 7 )
+            printf( "Memory word now holds %ld\n", Z502_REG_2 );
+            if ( Z502_REG_2 != 7 )
+                printf( "AN ERROR HAS OCCURRED.\n" );
+
+            /*  The same again on an interlock word.  Exchange sets it
+                first, since nothing else has.                          */
+
+            ATOMIC( Z502_REG_5, ATOMIC_EXCHANGE, 10, 0,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 8 )
+            if ( td->success != TRUE )
+                printf( "AN ERROR HAS OCCURRED.\n" );
+            ATOMIC( Z502_REG_5, ATOMIC_FETCH_AND_ADD, 3, 0,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 9 )
+            test2h_check( td, "interlock fetch and add", 10, TRUE );
+            ATOMIC( Z502_REG_5, ATOMIC_COMPARE_AND_SWAP, 20, 13,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 10 )
+            test2h_check( td, "interlock compare and swap", 13, TRUE );
+            ATOMIC( Z502_REG_5, ATOMIC_COMPARE_AND_SWAP, 30, 13,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 11 )
+            test2h_check( td, "failed interlock compare and swap", 20, FALSE );
+            ATOMIC( Z502_REG_5, ATOMIC_EXCHANGE, 0, 0,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 12 )
+            test2h_check( td, "interlock exchange", 20, TRUE );
+
+            /*  A word that isn't aligned is refused.                   */
+
+            td->old_value = -1;
+            ATOMIC( Z502_REG_3 + 1, ATOMIC_EXCHANGE, 0, 0,
+                    &(td->old_value), &(td->success) );
+
+       STEP( 13 )
+            test2h_check( td, "unaligned exchange", -1, FALSE );
+            TERMINATE_PROCESS( -1, &Z502_REG_9 );
+
+    }                                           /* End of SELECT    */
+}                                               /* End of test2h    */
+
+/**************************************************************************
+
+      Test2i reads the hardware's performance counters with
+      GET_PERFORMANCE_COUNT before and after some known work - a
+      write and a read to each of a few new pages, then one disk write
+      and one disk read - and checks that each count moved by exactly
+      that much.  Memory accesses and page faults are counted for this
+      process alone; the disk counts are for the whole machine.
+
+        Use:  Z502_REG_2                data read
+              Z502_REG_3                address
+              Z502_REG_4                process_id
+              Z502_REG_6                pointer to the counts
+              Z502_REG_7                page number
+              Z502_REG_9                error
+**************************************************************************/
+
+#define         TEST2I_PAGES                    4
+#define         TEST2I_DISK                     1
+#define         TEST2I_SECTOR                   0x33
+
+typedef struct
+    {
+    INT32    memory_accesses;
+    INT32    page_faults;
+    INT32    disk_writes;
+    INT32    disk_reads;
+    INT32    count;
+    char     disk_buffer[PGSIZE_LIMIT];
+} TEST2I_DATA;
+
+void    test2i_check( char event[], INT32 before, INT32 after,
+                      INT32 expected )
+    {
+    printf( "%s: before = %d  after = %d\n", event, before, after );
+    if ( after - before != expected )
+        printf( "AN ERROR HAS OCCURRED.  Expected it to go up by %d\n",
+                expected );
+}                                               /* End of test2i_check */
+
+void    test2i( void )
+    {
+    TEST2I_DATA *td;
+
+    if ( Z502_REG_6 == 0 )
+        {
+        Z502_REG_6 = (long)Z502_ALLOCATE_USER_DATA( sizeof( TEST2I_DATA ) );
+        if ( Z502_REG_6 == 0 )
+            {
+            printf( "Something screwed up allocating space in test2i\n" );
+        }
+    }
+    td = ( TEST2I_DATA *)Z502_REG_6;
+
+    while( 1 )
+        {
+        SELECT_STEP
+            {
+           STEP( 0 )
+                GET_PROCESS_ID( "", &Z502_REG_4, &Z502_REG_9 );
+
+           STEP( 1 )
+                printf( "Release %s:Test 2i: Pid %ld\n", CURRENT_REL, Z502_REG_4 );
+                GET_PERFORMANCE_COUNT( PMU_CONTEXT | PMU_MEMORY_ACCESSES,
+                                       &(td->memory_accesses), &Z502_REG_9 );
+
+           STEP( 2 )
+                success_expected( Z502_REG_9, "GET_PERFORMANCE_COUNT" );
+                GET_PERFORMANCE_COUNT( PMU_CONTEXT | PMU_PAGE_FAULTS,
+                                       &(td->page_faults), &Z502_REG_9 );
+
+           STEP( 3 )
+                GET_PERFORMANCE_COUNT( PMU_DISK_WRITES + TEST2I_DISK,
+                                       &(td->disk_writes), &Z502_REG_9 );
+
+           STEP( 4 )
+                GET_PERFORMANCE_COUNT( PMU_DISK_READS + TEST2I_DISK,
+                                       &(td->disk_reads), &Z502_REG_9 );
+
+           STEP( 5 )
+                Z502_REG_3 = PGSIZE * ( Z502_REG_7 + 1 );
+                MEM_WRITE( Z502_REG_3, &Z502_REG_7 );
+
+           STEP( 6 )
+                MEM_READ( Z502_REG_3, &Z502_REG_2 );
+
+           STEP( 7 )
+                if ( Z502_REG_2 != Z502_REG_7 )
+                    printf( "AN ERROR HAS OCCURRED.\n" );
+                Z502_REG_7++;
+                if ( Z502_REG_7 < TEST2I_PAGES )
+                    GO_NEXT_TO( 5 )
+                break;
+
+           STEP( 8 )
+                strcpy( td->disk_buffer, "test2i" );
+                DISK_WRITE( TEST2I_DISK, TEST2I_SECTOR, td->disk_buffer );
+
+           STEP( 9 )
+                DISK_READ( TEST2I_DISK, TEST2I_SECTOR, td->disk_buffer );
+
+           STEP( 10 )
+                GET_PERFORMANCE_COUNT( PMU_CONTEXT | PMU_MEMORY_ACCESSES,
+                                       &(td->count), &Z502_REG_9 );
+
+           /*  Each page's write faults.  The fault handler does the
+               write itself, then the hardware retries it, so every
+               page costs three accesses.                               */
+
+           STEP( 11 )
+                test2i_check( "Memory accesses", td->memory_accesses,
+                              td->count, 3 * TEST2I_PAGES );
+                GET_PERFORMANCE_COUNT( PMU_CONTEXT | PMU_PAGE_FAULTS,
+                                       &(td->count), &Z502_REG_9 );
+
+           STEP( 12 )
+                test2i_check( "Page faults", td->page_faults,
+                              td->count, TEST2I_PAGES );
+                GET_PERFORMANCE_COUNT( PMU_DISK_WRITES + TEST2I_DISK,
+                                       &(td->count), &Z502_REG_9 );
+
+           STEP( 13 )
+                test2i_check( "Disk writes", td->disk_writes, td->count, 1 );
+                GET_PERFORMANCE_COUNT( PMU_DISK_READS + TEST2I_DISK,
+                                       &(td->count), &Z502_REG_9 );
+
+           STEP( 14 )
+                test2i_check( "Disk reads", td->disk_reads, td->count, 1 );
+                GET_PERFORMANCE_COUNT( PMU_NUMBER_OF_EVENTS,
+                                       &(td->count), &Z502_REG_9 );
+
+           STEP( 15 )
+                error_expected( Z502_REG_9, "GET_PERFORMANCE_COUNT" );
+                TERMINATE_PROCESS( -1, &Z502_REG_9 );
+
+        }                                       /* End of SELECT    */
+    }                                           /* End of while     */
+}                                               /* End of test2i    */
+
 /**************************************************************************
 
       get_skewed_random_number   Is a homegrown deterministic random
@@ -37,13 +37,45 @@
                               Release the lock when leaving mem_common
         3.60  August    2012: Used student supplied code to add support
                               for Mac machines
+                              --cpus=N gives the machine N processors
+                              Memory and disk geometry set at startup
+                              Huge pages in the page table
+                              Record and replay interrupt delivery
+                              Machine snapshots and warm restore
+                              DMA disk transfers to and from frames
+                              Atomic compare and swap, fetch and add
+                              and exchange
+                              Completion ring with coalesced interrupts
+                              Disk command blocks
+                              Costs and disk models set at startup
+                              Timer channels with periodic mode
+                              Statistics exported while running
 **********************************************************************
 
         mem_common();                   INTERNAL: a routine used by both
                                         MEM_READ & MEM_WRITE.
+        mem_fast_path();                INTERNAL: aligned accesses to
+                                        valid pages, without the
+                                        HardwareLock.
+        page_table_lookup();            INTERNAL: the PTE mapping a page,
+                                        huge or not.
+        memory_benchmark();             INTERNAL: --membench timing loop.
+        tlb_lookup();                   INTERNAL: search the TLB.
+        tlb_fill();                     INTERNAL: load a TLB entry.
+        tlb_translate();                INTERNAL: page to frame via TLB.
+        tlb_invalidate();               INTERNAL: drop TLB entries.
+        translation_cache_invalidate(); INTERNAL: drop translation
+                                        cache entries.
+        asid_allocate();                INTERNAL: an ASID for a new
+                                        context.
+        asid_release();                 INTERNAL: give it back.
+        pmu_count();                    INTERNAL: bump a performance
+                                        counter.
         Z502_MEM_READ();                hardware memory read request.
         Z502_MEM_WRITE();               hardware memory write request.
         Z502_READ_MODIFY();             atomic test and set.
+        Z502_ATOMIC();                  atomic compare and swap, fetch
+                                        and add, exchange.
         Z502_HALT();                    halts the CPU.
         Z502_IDLE();                    machine halts until interrupt 
                                         occurs.
@@ -53,15 +85,59 @@
         Z502_SWITCH_CONTEXT();          run a new context.
         change_context();               INTERNAL:  changes process that
                                         is currently running.
+        disk_queue_request();           INTERNAL: accept a disk request.
+        disk_start_next_request();      INTERNAL: pick the next queued
+                                        request by shortest seek.
+        disk_transfer_address();        INTERNAL: where a sector of a
+                                        request is copied, DMA or not.
+        disk_request_error();           INTERNAL: check a disk request.
+        disk_service_time();            INTERNAL: how long a disk takes
+                                        over a request, by its model.
+        disk_command();                 INTERNAL: start a request from
+                                        a command block.
+        hardware_timer();               INTERNAL: start a timer channel.
+        hardware_timer_cancel();        INTERNAL: stop a timer channel.
         charge_time_and_check_events(); INTERNAL: increment the simulation
                                         clock and see if there is interrupt.
         hardware_interrupt();           INTERNAL: calls the user's
                                         interrupt handler.
+        hardware_take_event();          INTERNAL: take a due event and
+                                        set up the interrupt registers.
+        completion_post();              INTERNAL: put a completion on
+                                        the OS's completion ring.
+        single_thread_interrupt();      INTERNAL: --single-thread inline
+                                        interrupt delivery.
+        at_interrupt_level();           INTERNAL: is the interrupt
+                                        handler running.
+        cpu_save();                     INTERNAL: park a processor's
+                                        registers.
+        cpu_load();                     INTERNAL: make them live again.
+        cpu_pick();                     INTERNAL: which processor should
+                                        run next.
+        cpu_switch();                   INTERNAL: hand the machine to
+                                        another processor.
+        cpu_yield();                    INTERNAL: let a processor that
+                                        has fallen behind catch up.
+        cpu_halt();                     INTERNAL: Z502_IDLE with --cpus.
+        cpu_start();                    INTERNAL: Z502ProcessorStart.
+        cpu_interrupt();                INTERNAL: Z502ProcessorInterrupt.
+        cpu_thread();                   INTERNAL: host thread of each
+                                        added processor.
+        machine_time();                 INTERNAL: the latest clock of
+                                        any processor.
         hardware_fault();               INTERNAL: calls user
                                                   hardware fault handler.
         software_trap();                INTERNAL: calls user
                                                   software fault handler.
         z502_internal_panic();          INTERNAL: halt machine with a message.
+        slab_alloc();                   INTERNAL: take an object from a slab.
+        slab_free();                    INTERNAL: give it back.
+        print_slab_stats();             INTERNAL: slab occupancy.
+        alloc_event();                  INTERNAL: take an event from its slab.
+        free_event();                   INTERNAL: return an event to its slab.
+        event_heap_sift_up();           INTERNAL: event heap maintenance.
+        event_heap_sift_down();         INTERNAL: event heap maintenance.
+        event_heap_remove();            INTERNAL: take an event off the heap.
         add_event();                    INTERNAL: schedule event to
                                                   interrupt in the future.
         get_next_ordered_event();       INTERNAL: determine who has caused
@@ -69,11 +145,48 @@
         dequeue_item();                 INTERNAL: remove item from event queue.
         get_next_event_time();          INTERNAL: determine the time at
                                         which the next event will occur.
+        publish_next_event_time();      INTERNAL: update the lock free
+                                        copy of that time.
         get_sector_struct();            INTERNAL: get information about disk.
-        create_sector_struct();         INTERNAL: create a structure to
-                                        be used to hold disk info.
-        main();                         contains the simulation entry
-                                        and the base level loop.
+        create_sector_struct();         INTERNAL: mark a sector written,
+                                        allocating its chunk if needed.
+        open_disk_images();             INTERNAL: map disk image files.
+        close_disk_images();            INTERNAL: flush and unmap them.
+        open_interrupt_log();           INTERNAL: start --record or
+                                        load --replay.
+        log_interrupt();                INTERNAL: record a delivery.
+        replay_point_reached();         INTERNAL: may an interrupt be
+                                        delivered now under --replay.
+        replay_force_event();           INTERNAL: make the recorded
+                                        interrupt due at its point.
+        close_interrupt_log();          INTERNAL: finish the recording.
+        open_stats_export();            INTERNAL: start --stats-file.
+        export_stats();                 INTERNAL: append a line to it.
+        open_snapshot();                INTERNAL: check --snapshot and
+                                        --restore.
+        take_snapshot();                INTERNAL: write the machine out.
+        restore_snapshot();             INTERNAL: read it back in.
+        snapshot_write_value();         INTERNAL: write a register that
+                                        may hold a pointer.
+        snapshot_read_value();          INTERNAL: read one back.
+        Z502_SNAPSHOT_WRITE();          write OS state to the snapshot.
+        Z502_SNAPSHOT_READ();           read it back.
+        Z502_SNAPSHOT_WRITE_CONTEXT();  write a context to the snapshot.
+        Z502_SNAPSHOT_READ_CONTEXT();   read one back.
+        Z502_ALLOCATE_USER_DATA();      memory for a user program's own
+                                        data, carried by snapshots.
+        print_lock_stats();             INTERNAL: --lock-stats report.
+        parse_hardware_options();       INTERNAL: consume --options
+                                        from the command line.
+        set_hardware_option();          INTERNAL: apply one option.
+        read_hardware_config();         INTERNAL: apply the options
+                                        in a --config file.
+        set_hardware_cost();            INTERNAL: apply a --cost.
+        set_disk_model();               INTERNAL: apply a --disk-model.
+        set_machine_geometry();         INTERNAL: check the geometry
+                                        and size memory and disks.
+        base_level();                   INTERNAL: the base level loop.
+        main();                         contains the simulation entry.
 ************************************************************************/
 
 /************************************************************************
@@ -95,6 +208,10 @@
 #include                 <stdio.h>
 #include                 <stdlib.h>
 #include                 <memory.h>
+#include                 <string.h>
+#include                 <time.h>
+#include                 <ctype.h>
+#include                 <stddef.h>
 #ifdef NT
 #include                 <windows.h>
 #include                 <winbase.h>
@@ -107,6 +224,9 @@
 #include                 <asm/errno.h>
 #include                 <sys/time.h>
 #include                 <sys/resource.h>
+#include                 <sys/mman.h>
+#include                 <sys/stat.h>
+#include                 <fcntl.h>
 #endif
 
 #ifdef MAC
@@ -115,6 +235,9 @@
 #include                 <errno.h>
 #include                 <sys/time.h>
 #include                 <sys/resource.h>
+#include                 <sys/mman.h>
+#include                 <sys/stat.h>
+#include                 <fcntl.h>
 #endif
 
 
@@ -122,33 +245,109 @@
 //  Prototypes that allow the OS to get to this hardware are in protos.h
 
 void            mem_common( INT32, char *, BOOL );
+BOOL            mem_fast_path( INT32, char *, BOOL );
+UINT16          page_table_lookup( INT16, INT16 * );
+BOOL            tlb_lookup( INT16, INT16, UINT16 * );
+void            tlb_fill( INT16, INT16, UINT16 );
+INT32           tlb_translate( INT16 );
+void            tlb_invalidate( INT16, INT16 );
+void            translation_cache_invalidate( INT16 );
+INT16           asid_allocate( void );
+void            asid_release( Z502CONTEXT * );
+void            memory_benchmark( void );
 void            do_memory_debug( INT16, INT16 );
 void            memory_mapped_io( INT32, INT32 *, BOOL );
 void            change_context( void );
 void            charge_time_and_check_events( INT32 );
 void            hardware_clock( INT32 * );
-void            hardware_timer( INT32 );
-void            hardware_read_disk(  INT16, INT16, char * );
-void            hardware_write_disk( INT16, INT16, char * );
+void            hardware_timer( INT16, INT32 );
+void            hardware_timer_cancel( INT16 );
+void            hardware_read_disk(  INT16, INT16, INT16, char *, char **,
+                                     INT32, INT32 );
+void            hardware_write_disk( INT16, INT16, INT16, char *, char **,
+                                     INT32, INT32 );
+INT16           disk_requests_outstanding( INT16 );
+void            disk_queue_request( INT16, INT16, INT16, INT32, INT32 );
+void            disk_start_request( INT16, INT16, INT16, INT32, INT32 );
+void            disk_start_next_request( INT16 );
+void            atomic_operation( INT32 *, INT32, INT32, INT32, INT32 *,
+                                  INT32 * );
+char            *disk_transfer_address( char *, char **, INT32, INT16 );
+INT16           disk_request_error( INT16, INT16, INT16, INT32, BOOL );
+INT32           disk_service_time( INT16, INT16, INT16 );
+void            disk_command( DISK_COMMAND * );
 void            hardware_interrupt( void );
+BOOL            hardware_take_event( void );
+BOOL            completion_post( INT16, INT16, INT32, INT32 );
+void            single_thread_interrupt( void );
+BOOL            at_interrupt_level( void );
+void            cpu_save( INT32 );
+void            cpu_load( INT32 );
+INT32           cpu_pick( BOOL, INT32 * );
+void            cpu_switch( INT32 );
+void            cpu_yield( void );
+void            cpu_halt( void );
+void            cpu_start( INT32, Z502CONTEXT * );
+void            cpu_interrupt( INT32 );
+void            cpu_thread( INT32 * );
+UINT32          machine_time( void );
+void            base_level( void );
 void            hardware_fault( INT16, INT16 );
 void            software_trap( void );
 void            z502_internal_panic( INT32 );
 void            PrintEventQueue();
-void            add_event( INT32, INT16, INT16, EVENT ** ); 
-void            get_next_ordered_event( INT32 *, INT16 *, INT16 *, INT32 * ); 
+void            *slab_alloc( SLAB * );
+void            slab_free( SLAB *, void * );
+void            print_slab_stats( SLAB * );
+EVENT           *alloc_event( void );
+void            free_event( EVENT * );
+void            event_heap_sift_up( INT32 );
+void            event_heap_sift_down( INT32 );
+void            event_heap_remove( INT32 );
+void            add_event( INT32, INT16, INT16, INT32, EVENT ** ); 
+void            get_next_ordered_event( INT32 *, INT16 *, INT16 *, INT32 *,
+                                        INT32 * ); 
 void            dequeue_item( EVENT *, INT32 * );
 void            get_next_event_time( INT32 * );
+void            publish_next_event_time( void );
+void            pmu_count( INT32, INT32 );
 void            get_sector_struct( INT16, INT16, char **, INT32 * );
 void            create_sector_struct( INT16, INT16, char ** );
+void            open_disk_images( void );
+void            close_disk_images( void );
+void            open_interrupt_log( void );
+void            log_interrupt( INT16, INT16 );
+BOOL            replay_point_reached( void );
+void            replay_force_event( void );
+void            close_interrupt_log( void );
+void            open_stats_export( void );
+void            export_stats( void );
+void            open_snapshot( void );
+void            take_snapshot( void );
+void            restore_snapshot( void );
+void            snapshot_write_value( long );
+long            snapshot_read_value( void );
+void            parse_hardware_options( int *, char *[] );
+void            set_hardware_option( char *, char * );
+void            read_hardware_config( char * );
+void            set_hardware_cost( char *, char * );
+void            set_disk_model( char *, char * );
+void            set_machine_geometry( void );
 void            print_ring_buffer( void );
 void            print_hardware_stats( void );
 int             GetMyTid( );
 void            PrintLockDebug( char *Text, int Action, char *LockCaller, int Mutex, int Return );
+double          lock_stats_now( void );
+void            lock_stats_acquired( UINT32, double );
+void            lock_stats_released( UINT32 );
+void            print_lock_stats( void );
 
-/*      This is Physical Memory which is used in part 2 of the project. */
+/*      This is Physical Memory which is used in part 2 of the project.
+        It's MEMSIZE bytes, allocated once the geometry is known.       */
 
-char            MEMORY[ PHYS_MEM_PGS * PGSIZE ];  
+char            *MEMORY = NULL;
+Z502_GEOMETRY   Z502Geometry = { 64, 16, 4, 1024, 10, 1600, 12 };
+Z502_COSTS      Z502Costs    = { 1, 2, 1, 8, 2, 3, 2, 20, 10, 15, 5, 1, 2, 4 };
 
 BOOL            POP_THE_STACK;               /* Don't mess with this    */
 
@@ -195,12 +394,83 @@ void              *TO_VECTOR[TO_VECTOR_TYPES];
 UINT32          current_simulation_time  = 0;
 INT16           event_ring_buffer_index  = 0;
 
-EVENT           event_queue;
+EVENT           **event_heap      = NULL;   /* Pending events, a min-heap */
+INT32           event_heap_count  = 0;
+INT32           event_heap_size   = 0;
+SLAB            event_slab   = { "Events", sizeof( EVENT ), EVENTS_PER_SLAB };
+SLAB            sector_slab  = { "Sector Chunks", sizeof( SECTOR_CHUNK ),
+                                 SECTOR_CHUNKS_PER_SLAB };
+SLAB            context_slab = { "Contexts", sizeof( Z502CONTEXT ),
+                                 CONTEXTS_PER_SLAB };
+UINT32          event_sequence    = 0;
+volatile INT32  next_event_time   = -1;     /* Heap top, or -1 if empty  */
+UINT64          pmu_counts[PMU_NUMBER_OF_EVENTS];
+Z502CONTEXT     *AccountingContext = NULL;  /* Z502AccountingContext  */
 INT32           NumberOfInterruptsStarted = 0;
 INT32           NumberOfInterruptsCompleted = 0;
-SECTOR          sector_queue[MAX_NUMBER_OF_DISKS + 1];
-DISK_STATE      disk_state[MAX_NUMBER_OF_DISKS + 1];
-TIMER_STATE     timer_state;
+SECTOR_CHUNK    **sector_table[MAX_NUMBER_OF_DISKS_LIMIT + 1];
+DISK_STATE      *disk_state = NULL;          /* MAX_NUMBER_OF_DISKS + 1 */
+DISK_IMAGE      *disk_image = NULL;
+INT32           DiskQueueDepth = 1;          /* --disk-queue-depth=N  */
+DISK_MODEL      disk_models[MAX_NUMBER_OF_DISKS_LIMIT + 1] =
+                    { { DISK_MODEL_HDD, 100, 20, 10, 0, 0, 0 } };
+                                             /* [0] for every disk    */
+INT32           interrupt_tag[LARGEST_STAT_VECTOR_INDEX + 1];
+INT32           interrupt_frame[LARGEST_STAT_VECTOR_INDEX + 1];
+COMPLETION_RING *completion_ring = NULL;     /* Z502CompletionRing    */
+INT32           completion_threshold = 1;
+INT32           completion_delay = 0;
+INT32           completion_waiting = 0;      /* Posted, not interrupted */
+BOOL            completion_flush_pending = FALSE;
+TRANSLATION_CACHE_ENTRY translation_cache[TRANSLATION_CACHE_SIZE];
+BOOL            MemoryFastPath = TRUE;
+BOOL            LockedMemoryPath = FALSE;    /* --locked-memory       */
+BOOL            LockStatistics = FALSE;      /* --lock-stats          */
+BOOL            SingleThread = FALSE;        /* --single-thread       */
+BOOL            InlineInterrupt = FALSE;     /* Handler running inline */
+INT32           InterlocksHeld = 0;          /* READ_MODIFY locks held */
+INT32           InterlockOwner[MEMORY_INTERLOCK_SIZE + 20]; /* --cpus: CPU+1 */
+INT32           InterlockWord[MEMORY_INTERLOCK_SIZE];       /* Z502_ATOMIC    */
+INT32           NumberOfCpus = 1;            /* --cpus=N              */
+INT32           CurrentCpu = 0;              /* Whose registers are live */
+Z502_CPU        cpu_state[MAX_NUMBER_OF_CPUS];
+INT32           CpuLock = -1;
+LOCK_STATS      lock_stats[LOCK_STATS_SIZE];
+BOOL            MemoryBenchmark = FALSE;     /* --membench            */
+char            *TlbGeometry = NULL;         /* --tlb=SETSxWAYS       */
+INT32           TlbSets = 0;
+INT32           TlbWays = 0;
+TLB_ENTRY       *tlb = NULL;
+UINT32          tlb_clock = 0;
+INT16           next_asid = 1;
+INT16           asid_holders[TLB_MAX_ASID + 1];  /* Live contexts with each */
+char            *DiskImageDirectory = NULL;  /* --disk-image=DIR      */
+char            *RecordFile = NULL;          /* --record=FILE         */
+char            *ReplayFile = NULL;          /* --replay=FILE         */
+FILE            *record_file = NULL;
+INTERRUPT_LOG_ENTRY *replay_log = NULL;
+INT32           replay_length = 0;
+INT32           replay_next = 0;             /* Next entry to deliver */
+INT32           replay_off_point = 0;
+EVENT           *replay_event = NULL;        /* Forced to go next     */
+BOOL            replay_handler_pending = FALSE; /* Taken, not handled */
+UINT32          base_charges = 0;            /* Charges at base level */
+char            *StatsFile = NULL;           /* --stats-file=FILE     */
+INT32           StatsInterval = 1000;        /* --stats-interval=N    */
+FILE            *stats_file = NULL;
+BOOL            stats_csv = FALSE;           /* Else JSON Lines       */
+UINT32          stats_next_time = 0;         /* Next line due         */
+char            *SnapshotFile = NULL;        /* --snapshot=FILE       */
+INT32           SnapshotTime = 0;            /* --snapshot-at=TIME    */
+char            *RestoreFile = NULL;         /* --restore=FILE        */
+FILE            *snapshot_file = NULL;       /* While writing/reading */
+Z502CONTEXT     **snapshot_contexts = NULL;  /* Contexts in the file  */
+UINT16          **snapshot_page_tables = NULL;
+INT32           snapshot_context_count = 0;
+USER_DATA       *user_data = NULL;           /* Z502_ALLOCATE_USER_DATA */
+INT32           user_data_count = 0;
+char            random_state[SNAPSHOT_RANDOM_STATE];
+TIMER_STATE     timer_state[NUMBER_OF_TIMER_CHANNELS];
 HARDWARE_STATS  hardware_stats;
 BOOL            z502_machine_kill_or_save = SWITCH_CONTEXT_SAVE_MODE;
 Z502CONTEXT     *z502_machine_next_context_ptr;
@@ -209,6 +479,7 @@ INT32           InterlockRecord[MEMORY_INTERLOCK_SIZE];
 INT32           EventLock = -1;                          // Change from UINT32 - 08/2012
 INT32           InterruptLock = -1;
 INT32           HardwareLock = -1;
+INT32           MemoryLock = -1;
 UINT32          InterruptCondition = 0;
 int             NextConditionToAllocate = 0;
 int             BaseTid;
@@ -239,15 +510,25 @@ INT32           SYS_CALL_CALL_TYPE;
           o The page exists in physical memory, so get the physical address.  
             Be careful since it may wrap across frame boundaries.
           o Copy data to/from caller's location.
-          o Set referenced/modified bit in page table.
+          o Set referenced/modified bit in page table - in the head of
+            the run if the page is mapped by a huge page.
           o Advance time and see if an interrupt has occurred.
+
+      Aligned accesses to a valid page are handled by mem_fast_path()
+      instead, without taking the HardwareLock.  Everything else -
+      faults, accesses that cross onto the next page - comes through
+      the full set of checks here, under the HardwareLock.  The copy
+      and the page table bits at the end are also done under the
+      MemoryLock, so they can't interleave with a fast path access.
+      --locked-memory puts the fast path back under the HardwareLock.
     *****************************************************************/
 
 void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
     {
     INT16       virtual_page_number;
+    INT16       pte_index, next_pte_index;
     INT32       phys_pg;
-    INT16       physical_address[4];
+    INT32       physical_address[4];
     INT32       page_offset;
     INT16       index;
     INT32       ptbl_bits;
@@ -256,11 +537,38 @@ void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
     char        Debug_Text[32];
 
     strcpy( Debug_Text, "mem_common");
+    if (   virtual_address < Z502MEM_MAPPED_MIN && LockedMemoryPath == FALSE
+        && mem_fast_path( virtual_address, data_ptr, read_or_write ) == TRUE )
+        return;
+
+    /*  The processor registers are wired in and touch nothing shared,
+        so they're answered without the HardwareLock.  The OS reads
+        Z502ProcessorID in places - os_switch_context_complete() -
+        that change_context() calls with the lock already held.     */
+
+    if (   virtual_address == Z502ProcessorID
+        || virtual_address == Z502ProcessorCount )
+    {
+        memory_mapped_io( virtual_address, (INT32 *)data_ptr, read_or_write );
+        return;
+    }
     GetLock( HardwareLock, Debug_Text );
     if ( virtual_address >= Z502MEM_MAPPED_MIN )
     {
         memory_mapped_io( virtual_address, (INT32 *)data_ptr, read_or_write );
         ReleaseLock( HardwareLock, Debug_Text );
+        /*  A replayed interrupt held off while we had the lock is
+            taken now, where the interrupt thread would have taken it */
+        if ( replay_log != NULL )
+            single_thread_interrupt( );
+        return;
+    }
+    if (   LockedMemoryPath == TRUE
+        && mem_fast_path( virtual_address, data_ptr, read_or_write ) == TRUE )
+    {
+        ReleaseLock( HardwareLock, Debug_Text );
+        if ( replay_log != NULL )
+            single_thread_interrupt( );
         return;
     }
     virtual_page_number = (INT16)( ( virtual_address >= 0 ) ?
@@ -283,7 +591,7 @@ void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
         if ( virtual_page_number >= Z502_PAGE_TBL_LENGTH) 
            invalidity = 4;
         if ( (invalidity == 0 ) &&
-             ( Z502_PAGE_TBL_ADDR[(UINT16)virtual_page_number] 
+             ( page_table_lookup( virtual_page_number, &pte_index )
                                    & PTBL_VALID_BIT) == 0 )   
            invalidity = 5;
 
@@ -307,8 +615,11 @@ void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
             page_is_valid = TRUE;
     }                                           /* END of while         */
 
-    phys_pg = Z502_PAGE_TBL_ADDR[virtual_page_number] & PTBL_PHYS_PG_NO;
-    physical_address[0] = (INT16)(phys_pg * (INT32)PGSIZE + page_offset);
+    phys_pg = page_table_lookup( virtual_page_number, &pte_index )
+                                                        & PTBL_PHYS_PG_NO;
+    if ( TlbSets > 0 )
+        phys_pg = tlb_translate( virtual_page_number );
+    physical_address[0] = phys_pg * (INT32)PGSIZE + page_offset;
     physical_address[1] = physical_address[0] + 1; /* first guess */
     physical_address[2] = physical_address[0] + 2; /* first guess */
     physical_address[3] = physical_address[0] + 3; /* first guess */
@@ -322,7 +633,9 @@ void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
             if ( virtual_page_number + 1 >= VIRTUAL_MEM_PGS ) invalidity = 6;
             if ( virtual_page_number + 1 >= 
                                 Z502_PAGE_TBL_LENGTH )    invalidity = 7;
-            if ( ( Z502_PAGE_TBL_ADDR[(UINT16)virtual_page_number + 1] 
+            if ( invalidity == 0 &&
+                 ( page_table_lookup( (INT16)(virtual_page_number + 1),
+                                      &next_pte_index )
                                 & PTBL_VALID_BIT ) == 0 )     invalidity = 8;
             do_memory_debug( invalidity, (short)(virtual_page_number + 1) );
             if ( invalidity > 0 )
@@ -342,12 +655,14 @@ void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
                 page_is_valid = TRUE;
         }                                       /* End of while         */
 
-        phys_pg = Z502_PAGE_TBL_ADDR[virtual_page_number + 1] 
-                                                        & PTBL_PHYS_PG_NO;
+        phys_pg = page_table_lookup( (INT16)(virtual_page_number + 1),
+                                     &next_pte_index ) & PTBL_PHYS_PG_NO;
+        if ( TlbSets > 0 )
+            phys_pg = tlb_translate( (INT16)( virtual_page_number + 1 ) );
         for ( index = PGSIZE - (INT16)page_offset; index <= 3; index++ )
-            physical_address[index] = (INT16)(( phys_pg - 1 ) 
+            physical_address[index] = ( phys_pg - 1 ) 
                                     * (INT32)PGSIZE + page_offset 
-                                    + (INT32)index);
+                                    + (INT32)index;
     }                                           /* End of if page       */
 
     if ( phys_pg < 0  || phys_pg > PHYS_MEM_PGS - 1 )
@@ -366,6 +681,7 @@ void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
     Z502_CURRENT_CONTEXT->fault_in_progress = FALSE;
 
 
+    GetLock( MemoryLock, Debug_Text );
     if ( read_or_write == SYSNUM_MEM_READ )
         {
         data_ptr[0] = MEMORY[ physical_address[0] ];
@@ -384,15 +700,424 @@ void   mem_common( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
         ptbl_bits = PTBL_REFERENCED_BIT | PTBL_MODIFIED_BIT;
     }
 
-    Z502_PAGE_TBL_ADDR[ virtual_page_number ]         |= ptbl_bits;
+    Z502_PAGE_TBL_ADDR[ pte_index ]         |= ptbl_bits;
     if ( page_offset > PGSIZE - 4 )
-        Z502_PAGE_TBL_ADDR[ virtual_page_number + 1 ] |= ptbl_bits;
+        Z502_PAGE_TBL_ADDR[ next_pte_index ] |= ptbl_bits;
+    pmu_count( PMU_MEMORY_ACCESSES, 1 );
+    ReleaseLock( MemoryLock, Debug_Text );
   
     charge_time_and_check_events( COST_OF_MEMORY_ACCESS );
     if ( Z502_MODE != KERNEL_MODE )
         POP_THE_STACK = TRUE;
     ReleaseLock( HardwareLock, Debug_Text );
+    if ( replay_log != NULL )
+        single_thread_interrupt( );
 }                                       /* End of mem_common        */
+
+
+    /*****************************************************************
+    mem_fast_path
+
+      Nearly every access is an aligned 4 byte access to a page that
+      is already valid.  Such an access can't cross onto another page,
+      so it needs one translation and moves as a single word.
+
+      This runs without the HardwareLock, which is left to faults,
+      devices and context switches.  What it does touch - the TLB, the
+      translation cache, MEMORY and the referenced/modified bits - is
+      guarded by the MemoryLock.  change_context() loads the page
+      table registers under that lock too, so an access sees either
+      the old context or the new one, never half of each.  An access
+      being retried after a fault is left to mem_common, since
+      change_context() hands that retry the HardwareLock to release.
+
+      With a TLB, the translation comes from the TLB just as it would
+      on real hardware, and it's up to the OS to invalidate entries
+      when it changes a PTE.  Without one, it comes from the
+      translation cache, which the OS invalidates the same way -
+      through the Z502TLBInvalidate registers - and which is emptied
+      on every context switch.  So a hit is trusted as it stands;
+      the PTE is only read on a miss.  If the page is valid the entry
+      is refilled, and if not we leave the access to mem_common so
+      that it takes the fault.
+
+      Returns TRUE if the access was done here.  The referenced and
+      modified bits, the time charged, and the rest of the machine
+      state end up exactly as mem_common would leave them.
+    *****************************************************************/
+
+BOOL   mem_fast_path( INT32 virtual_address, char *data_ptr, BOOL read_or_write )
+    {
+    TRANSLATION_CACHE_ENTRY     *tce;
+    INT16                       vpn;
+    INT16                       pte_index;
+    UINT16                      pte;
+    char                        *physical;
+    INT32                       cost;
+
+    if (   MemoryFastPath == FALSE
+        || virtual_address < 0 || ( virtual_address & 3 ) != 0 )
+        return( FALSE );
+    vpn      = (INT16)( virtual_address / PGSIZE );
+    physical = NULL;
+    cost     = COST_OF_MEMORY_ACCESS;
+
+    GetLock( MemoryLock, "mem_fast_path" );
+    if (   vpn < VIRTUAL_MEM_PGS && Z502_PAGE_TBL_ADDR != NULL
+        && vpn < Z502_PAGE_TBL_LENGTH
+        && Z502_CURRENT_CONTEXT->structure_id == CONTEXT_STRUCTURE_ID
+        && Z502_CURRENT_CONTEXT->fault_in_progress == FALSE )
+        {
+        if ( TlbSets > 0 )
+            {
+            pte = page_table_lookup( vpn, &pte_index );
+            if ( tlb_lookup( Z502_CURRENT_CONTEXT->asid, vpn, &pte ) == TRUE )
+                physical = &MEMORY[ ( pte & PTBL_PHYS_PG_NO ) * PGSIZE ];
+            else if (   ( pte & PTBL_VALID_BIT ) != 0
+                     && ( pte & PTBL_PHYS_PG_NO ) <= PHYS_MEM_PGS - 1 )
+                {
+                tlb_fill( Z502_CURRENT_CONTEXT->asid, vpn, pte );
+                physical = &MEMORY[ ( pte & PTBL_PHYS_PG_NO ) * PGSIZE ];
+                cost    += COST_OF_TLB_MISS;
+            }
+        }
+        else
+            {
+            tce = &translation_cache[vpn % TRANSLATION_CACHE_SIZE];
+            if ( tce->page_table == Z502_PAGE_TBL_ADDR && tce->vpn == vpn )
+                {
+                physical  = tce->frame;
+                pte_index = tce->pte_index;
+                hardware_stats.translation_hits++;
+            }
+            else
+                {
+                pte = page_table_lookup( vpn, &pte_index );
+                if (   ( pte & PTBL_VALID_BIT ) != 0
+                    && ( pte & PTBL_PHYS_PG_NO ) <= PHYS_MEM_PGS - 1 )
+                    {
+                    tce->page_table = Z502_PAGE_TBL_ADDR;
+                    tce->vpn        = vpn;
+                    tce->pte_index  = pte_index;
+                    tce->frame      = &MEMORY[ ( pte & PTBL_PHYS_PG_NO ) * PGSIZE ];
+                    physical        = tce->frame;
+                    hardware_stats.translation_misses++;
+                }
+            }
+        }
+    }
+
+    if ( physical != NULL )
+        {
+        physical += virtual_address % PGSIZE;
+        if ( read_or_write == SYSNUM_MEM_READ )
+            {
+            memcpy( data_ptr, physical, sizeof( INT32 ) );
+            Z502_PAGE_TBL_ADDR[pte_index] |= PTBL_REFERENCED_BIT;
+        }
+        else
+            {
+            memcpy( physical, data_ptr, sizeof( INT32 ) );
+            Z502_PAGE_TBL_ADDR[pte_index] |= PTBL_REFERENCED_BIT | PTBL_MODIFIED_BIT;
+        }
+        pmu_count( PMU_MEMORY_ACCESSES, 1 );
+    }
+    ReleaseLock( MemoryLock, "mem_fast_path" );
+    if ( physical == NULL )
+        return( FALSE );
+
+    if ( DO_MEMORY_DEBUG )
+        do_memory_debug( 0, vpn );
+    charge_time_and_check_events( cost );
+    if ( Z502_MODE != KERNEL_MODE )
+        POP_THE_STACK = TRUE;
+    return( TRUE );
+}                                       /* End of mem_fast_path     */
+
+
+    /*****************************************************************
+    page_table_lookup
+
+      Find the PTE that maps a page of the current context.  Actions
+      include:
+          o Look at the first PTE of the aligned run of HUGE_PAGE_PGS
+            pages holding the page.  If it has both PTBL_VALID_BIT and
+            PTBL_HUGE_BIT set, the run is one huge page on contiguous
+            frames: the page's frame is the head's frame with the low
+            HUGE_PAGE_BITS replaced by the page's place in the run.
+            The other PTEs of the run are not looked at.
+          o Otherwise the page's own PTE maps it.
+
+      Returns the valid bit and frame, as if from an ordinary PTE, and
+      sets *pte_index to the entry whose referenced and modified bits
+      the access should set.  The caller has checked that the page is
+      inside the page table.
+    *****************************************************************/
+
+UINT16  page_table_lookup( INT16 vpn, INT16 *pte_index )
+    {
+    INT16       head;
+    UINT16      pte;
+
+    head = vpn & ~( HUGE_PAGE_PGS - 1 );
+    pte  = Z502_PAGE_TBL_ADDR[head];
+    if (   ( pte & ( PTBL_VALID_BIT | PTBL_HUGE_BIT ) )
+        == ( PTBL_VALID_BIT | PTBL_HUGE_BIT ) )
+        {
+        *pte_index = head;
+        return(   ( pte & ( PTBL_VALID_BIT | PTBL_PHYS_PG_NO )
+                        & ~( HUGE_PAGE_PGS - 1 ) )
+                | ( vpn & ( HUGE_PAGE_PGS - 1 ) ) );
+    }
+    *pte_index = vpn;
+    return( Z502_PAGE_TBL_ADDR[vpn] & ( PTBL_VALID_BIT | PTBL_PHYS_PG_NO ) );
+}                                       /* End of page_table_lookup */
+
+
+    /*****************************************************************
+
+        TLB
+
+            These routines model a set associative TLB sitting in
+            front of the page table.  It exists only when the simulator
+            is started with --tlb=SETSxWAYS; otherwise TlbSets is 0 and
+            none of this is used.
+
+            A hit hands back the translation the TLB holds, even if the
+            OS has since changed the PTE - the OS is expected to use
+            the Z502TLBInvalidate registers when it does that.  A miss
+            costs COST_OF_TLB_MISS while the hardware walks the page
+            table.  Only valid translations are ever loaded.
+
+            The TLB is guarded by the MemoryLock.  tlb_lookup() and
+            tlb_fill() expect the caller to hold it, and leave charging
+            for the miss to the caller; tlb_translate() and
+            tlb_invalidate() take the lock themselves.
+
+        tlb_lookup()     - search the set for (asid, vpn).
+        tlb_fill()       - load a translation after a miss.
+        tlb_translate()  - page to frame for the current context, for
+                           a page already known to be valid.
+        tlb_invalidate() - drop one page or every page, for one ASID
+                           or for all of them (-1 means all).
+        asid_allocate()  - the next ASID that no live context holds.
+        asid_release()   - a context is going; drop its entries and
+                           free its ASID.
+
+            Only an ASID nobody holds is handed out, so two live
+            contexts never share TLB entries.  If all TLB_MAX_ASID are
+            held, a new context gets ASID 0, which any number may hold;
+            its entries are dropped each time one of them is switched
+            in, so that none sees another's.
+    *****************************************************************/
+
+BOOL    tlb_lookup( INT16 asid, INT16 vpn, UINT16 *pte )
+    {
+    TLB_ENTRY   *set;
+    INT32       way;
+
+    set = &tlb[ ( vpn % TlbSets ) * TlbWays ];
+    for ( way = 0; way < TlbWays; way++ )
+        if ( set[way].valid && set[way].vpn == vpn && set[way].asid == asid )
+            {
+            set[way].last_used = ++tlb_clock;
+            *pte = set[way].pte;
+            hardware_stats.tlb_hits++;
+            return( TRUE );
+        }
+    return( FALSE );
+}                                       /* End of tlb_lookup        */
+
+void    tlb_fill( INT16 asid, INT16 vpn, UINT16 pte )
+    {
+    TLB_ENTRY   *set;
+    INT32       way, victim;
+
+    set    = &tlb[ ( vpn % TlbSets ) * TlbWays ];
+    victim = 0;
+    for ( way = 0; way < TlbWays; way++ )
+        {
+        if ( set[way].valid == FALSE )
+            {
+            victim = way;
+            break;
+        }
+        if ( set[way].last_used < set[victim].last_used )
+            victim = way;
+    }
+    set[victim].valid       = TRUE;
+    set[victim].asid        = asid;
+    set[victim].vpn         = vpn;
+    set[victim].pte         = pte;
+    set[victim].last_used   = ++tlb_clock;
+    hardware_stats.tlb_misses++;
+}                                       /* End of tlb_fill          */
+
+INT32   tlb_translate( INT16 vpn )
+    {
+    INT16       pte_index;
+    UINT16      pte;
+    BOOL        hit;
+
+    GetLock( MemoryLock, "tlb_translate" );
+    hit = tlb_lookup( Z502_CURRENT_CONTEXT->asid, vpn, &pte );
+    if ( hit == FALSE )
+        {
+        pte = page_table_lookup( vpn, &pte_index );
+        tlb_fill( Z502_CURRENT_CONTEXT->asid, vpn, pte );
+    }
+    ReleaseLock( MemoryLock, "tlb_translate" );
+    if ( hit == FALSE )
+        charge_time_and_check_events( COST_OF_TLB_MISS );
+    return( pte & PTBL_PHYS_PG_NO );
+}                                       /* End of tlb_translate     */
+
+void    tlb_invalidate( INT16 asid, INT16 vpn )
+    {
+    INT32       index, first, last;
+
+    if ( TlbSets == 0 )
+        return;
+    first = 0;
+    last  = TlbSets * TlbWays;
+    if ( vpn >= 0 )                     /* A page can only be in its set */
+        {
+        first = ( vpn % TlbSets ) * TlbWays;
+        last  = first + TlbWays;
+        hardware_stats.tlb_page_invalidations++;
+    }
+    else
+        hardware_stats.tlb_flushes++;
+    GetLock( MemoryLock, "tlb_invalidate" );
+    for ( index = first; index < last; index++ )
+        if (   ( asid < 0 || tlb[index].asid == asid )
+            && ( vpn  < 0 || tlb[index].vpn  == vpn ) )
+            tlb[index].valid = FALSE;
+    ReleaseLock( MemoryLock, "tlb_invalidate" );
+}                                       /* End of tlb_invalidate    */
+
+/*  Drop the translation cache's entry for a page, whatever page
+    table it came from, or every entry if vpn is -1.               */
+
+void    translation_cache_invalidate( INT16 vpn )
+    {
+    INT32       index;
+
+    GetLock( MemoryLock, "translation_cache_invalidate" );
+    for ( index = 0; index < TRANSLATION_CACHE_SIZE; index++ )
+        if ( vpn < 0 || translation_cache[index].vpn == vpn )
+            translation_cache[index].page_table = NULL;
+    ReleaseLock( MemoryLock, "translation_cache_invalidate" );
+}                               /* End of translation_cache_invalidate */
+
+INT16   asid_allocate( void )
+    {
+    INT16       asid, tries;
+
+    for ( tries = 0; tries < TLB_MAX_ASID; tries++ )
+        {
+        asid      = next_asid;
+        next_asid = next_asid % TLB_MAX_ASID + 1;
+        if ( asid_holders[asid] == 0 )
+            {
+            asid_holders[asid]++;
+            return( asid );
+        }
+    }
+    asid_holders[0]++;
+    return( 0 );
+}                                       /* End of asid_allocate     */
+
+void    asid_release( Z502CONTEXT *context )
+    {
+    asid_holders[context->asid]--;
+    if ( context->asid != 0 || asid_holders[0] == 0 )
+        tlb_invalidate( context->asid, -1 );
+}                                       /* End of asid_release      */
+
+
+    /*****************************************************************
+    pmu_count
+
+      Add to one of the performance counters the OS reads through the
+      Z502PMU registers.  Each event is counted globally and for the
+      context that's current, if there is one.  The counts are kept
+      here rather than in hardware_stats so the OS can reset them.
+    *****************************************************************/
+
+void    pmu_count( INT32 event, INT32 amount )
+    {
+    pmu_counts[event] += amount;
+    if (   Z502_CURRENT_CONTEXT != NULL
+        && Z502_CURRENT_CONTEXT->structure_id == CONTEXT_STRUCTURE_ID )
+        Z502_CURRENT_CONTEXT->pmu_counts[event] += amount;
+}                                       /* End of pmu_count         */
+
+
+    /*****************************************************************
+    memory_benchmark
+
+      Run with --membench, this times MEM_READ and MEM_WRITE against
+      a page table that maps every virtual page, with the fast path
+      and then with every access forced through the full checks, and
+      then exits.  The OS is never started.
+    *****************************************************************/
+
+void    memory_benchmark( void )
+    {
+    UINT16              *page_table;
+    static Z502CONTEXT  bench_context;
+    INT32               index, pass, address, data;
+    clock_t             start;
+    double              seconds;
+    char                *pattern;
+
+    page_table = (UINT16 *)calloc( VIRTUAL_MEM_PGS, sizeof( UINT16 ) );
+    for ( index = 0; index < VIRTUAL_MEM_PGS; index++ )
+        page_table[index] = PTBL_VALID_BIT | ( index % PHYS_MEM_PGS );
+    bench_context.structure_id  = CONTEXT_STRUCTURE_ID;
+    Z502_CURRENT_CONTEXT        = &bench_context;
+    Z502_PAGE_TBL_ADDR          = page_table;
+    Z502_PAGE_TBL_LENGTH        = VIRTUAL_MEM_PGS;
+    Z502_MODE                   = KERNEL_MODE;
+
+    printf( "Memory benchmark: %d accesses per test, %s\n", MEMBENCH_ACCESSES,
+            LockedMemoryPath ? "fast path under the HardwareLock"
+                             : "fast path without the HardwareLock" );
+    for ( pass = 0; pass < 4; pass++ )
+        {
+        MemoryFastPath  = ( pass % 2 == 0 );
+        pattern         = ( pass < 2 ) ? "sequential" : "strided   ";
+        hardware_stats.translation_hits   = 0;
+        hardware_stats.translation_misses = 0;
+        start = clock();
+        for ( index = 0; index < MEMBENCH_ACCESSES; index++ )
+            {
+            if ( pass < 2 )             /* Walk through one page after another */
+                address = ( index * 4 ) % ( VIRTUAL_MEM_PGS * PGSIZE );
+            else                        /* Hop between pages on every access   */
+                address = ( ( index * 7 ) % VIRTUAL_MEM_PGS ) * PGSIZE
+                        + ( index % ( PGSIZE / 4 ) ) * 4;
+            data = index;
+            if ( index % 2 == 0 )
+                mem_common( address, (char *)&data, (BOOL)SYSNUM_MEM_WRITE );
+            else
+                mem_common( address, (char *)&data, (BOOL)SYSNUM_MEM_READ );
+        }
+        seconds = (double)( clock() - start ) / CLOCKS_PER_SEC;
+        printf( "  %s %s: %8.3f sec  %12.0f accesses/sec",
+                pattern, MemoryFastPath ? "fast path " : "full check",
+                seconds, seconds > 0 ? MEMBENCH_ACCESSES / seconds : 0.0 );
+        if ( MemoryFastPath )
+            printf( "  (cache hits %d, misses %d)",
+                    hardware_stats.translation_hits,
+                    hardware_stats.translation_misses );
+        printf( "\n" );
+    }
+    if ( LockStatistics )
+        print_lock_stats( );
+    GoToExit( 0 );
+}                                       /* End of memory_benchmark  */
 
     /*****************************************************************
         do_memory_debug
@@ -507,6 +1232,7 @@ void    Z502_READ_MODIFY( INT32 VirtualAddress, INT32 NewLockValue,
                           INT32 Suspend, INT32 *SuccessfulAction )
 {
     int    WhichRecord;
+    INT32  next, next_time;
     // GetLock( HardwareLock, "Z502_READ_MODIFY" );   JB - 7/26/06
     if (   VirtualAddress < MEMORY_INTERLOCK_BASE
         || VirtualAddress >= MEMORY_INTERLOCK_BASE + MEMORY_INTERLOCK_SIZE + 10
@@ -517,6 +1243,47 @@ void    Z502_READ_MODIFY( INT32 VirtualAddress, INT32 NewLockValue,
         return;
     }
     WhichRecord = VirtualAddress - MEMORY_INTERLOCK_BASE + 10;
+
+    /*  With several processors only one host thread runs at a time,
+        so a host mutex held by a processor that isn't running would
+        stop the others for good.  Instead each lock records which
+        processor holds it, and a processor that must wait hands the
+        machine to another one until the lock is free.              */
+
+    if ( NumberOfCpus > 1 )
+    {
+        if ( NewLockValue == 1 )
+        {
+            while (   Suspend == TRUE && InterlockOwner[ WhichRecord ] != 0
+                   && InterlockOwner[ WhichRecord ] != CurrentCpu + 1 )
+            {
+                next = cpu_pick( TRUE, &next_time );
+                if ( next < 0 )
+                {
+                    printf( "PANIC in Z502_READ_MODIFY - the lock is held by a\n" );
+                    printf( "processor that will never run again.\n" );
+                    z502_internal_panic( ERR_OS502_GENERATED_BUG );
+                }
+                cpu_switch( next );
+            }
+            *SuccessfulAction = ( InterlockOwner[ WhichRecord ] == 0 );
+            if ( *SuccessfulAction == TRUE )
+            {
+                InterlockOwner[ WhichRecord ] = CurrentCpu + 1;
+                InterlocksHeld++;
+            }
+        }
+        else
+        {
+            *SuccessfulAction = ( InterlockOwner[ WhichRecord ] == CurrentCpu + 1 );
+            if ( *SuccessfulAction == TRUE )
+            {
+                InterlockOwner[ WhichRecord ] = 0;
+                InterlocksHeld--;
+            }
+        }
+        return;
+    }
     if ( InterlockRecord[ WhichRecord ] == -1 )
          CreateLock( &(InterlockRecord[ WhichRecord ]) );
     if ( NewLockValue == 1 && Suspend == FALSE )
@@ -527,14 +1294,171 @@ void    Z502_READ_MODIFY( INT32 VirtualAddress, INT32 NewLockValue,
         *SuccessfulAction
              = GetLock( InterlockRecord[ WhichRecord ], "Z502_READ_MODIFY");
     }
+    if ( NewLockValue == 1 && *SuccessfulAction == TRUE )
+        InterlocksHeld++;
     if ( NewLockValue == 0 )
     {
         *SuccessfulAction 
              = ReleaseLock( InterlockRecord[ WhichRecord ], "Z502_READ_MODIFY" );
+        if ( *SuccessfulAction == TRUE )
+            InterlocksHeld--;
+        /*  As in mem_common, a replayed interrupt held off by the
+            lock is taken as soon as it's released                  */
+        if ( replay_log != NULL && InterlocksHeld == 0 )
+            single_thread_interrupt( );
     }
     // ReleaseLock( HardwareLock, "Z502_READ_MODIFY" );   JB - 7/26/06
 
 }                                       /* End  Z502_READ_MODIFY  */
+
+
+/*************************************************************************
+    Z502_ATOMIC
+
+    Do an atomic operation on a word, returning what the word held
+    before in OldValue.  Operation is one of:
+        ATOMIC_COMPARE_AND_SWAP - if the word holds Compare, it's set to
+                                  Value.  Otherwise it's left alone and
+                                  SuccessfulAction = FALSE.
+        ATOMIC_FETCH_AND_ADD    - Value is added to the word.
+        ATOMIC_EXCHANGE         - the word is set to Value.
+    The word is an interlock word - MEMORY_INTERLOCK_BASE up to
+    MEMORY_INTERLOCK_SIZE more - or an aligned word of virtual memory,
+    such as one in a shared area.  A page that isn't valid faults just
+    as it would for MEM_READ.  Nothing is locked across the operation
+    and nobody waits, so it's usable from user mode as well as kernel
+    mode.  Every operation costs COST_OF_ATOMIC.  If the input
+    parameters are incorrect, SuccessfulAction = FALSE and OldValue
+    isn't touched.
+*************************************************************************/
+
+void    Z502_ATOMIC( INT32 VirtualAddress, INT32 Operation, INT32 Value,
+                     INT32 Compare, INT32 *OldValue, INT32 *SuccessfulAction )
+{
+    INT32       *word;
+    INT16       virtual_page_number;
+    INT16       pte_index;
+    INT32       phys_pg;
+    INT32       ptbl_bits;
+    BOOL        interlock;
+    char        Debug_Text[32];
+
+    strcpy( Debug_Text, "Z502_ATOMIC" );
+    *SuccessfulAction = FALSE;
+    interlock = (   VirtualAddress >= MEMORY_INTERLOCK_BASE
+                 && VirtualAddress <  MEMORY_INTERLOCK_BASE
+                                    + MEMORY_INTERLOCK_SIZE );
+    if (   Operation < ATOMIC_COMPARE_AND_SWAP
+        || Operation > ATOMIC_EXCHANGE
+        || (   interlock == FALSE
+            && (   VirtualAddress < 0
+                || VirtualAddress >= VIRTUAL_MEM_PGS * PGSIZE
+                || VirtualAddress % sizeof( INT32 ) != 0 ) ) )
+    {
+        charge_time_and_check_events( COST_OF_ATOMIC );
+        if ( Z502_MODE != KERNEL_MODE && at_interrupt_level( ) == FALSE )
+            POP_THE_STACK = TRUE;
+        return;
+    }
+
+    /*  An interlock word lives in the hardware, so there's nothing
+        to translate and only the MemoryLock is needed.  It costs
+        COST_OF_ATOMIC like any other, charged once the lock is
+        released, as memory_mapped_io does, since the interrupt
+        handler uses these words too.                               */
+
+    if ( interlock == TRUE )
+    {
+        word = &InterlockWord[ VirtualAddress - MEMORY_INTERLOCK_BASE ];
+        GetLock( MemoryLock, Debug_Text );
+        atomic_operation( word, Operation, Value, Compare,
+                          OldValue, SuccessfulAction );
+        ReleaseLock( MemoryLock, Debug_Text );
+        charge_time_and_check_events( COST_OF_ATOMIC );
+        if ( Z502_MODE != KERNEL_MODE && at_interrupt_level( ) == FALSE )
+            POP_THE_STACK = TRUE;
+        return;
+    }
+
+    /*  Memory is translated as in mem_common - faulting until the page
+        is valid - and the word is changed under the MemoryLock, so no
+        other access can come between the read and the write.       */
+
+    GetLock( HardwareLock, Debug_Text );
+    virtual_page_number = (INT16)( VirtualAddress / PGSIZE );
+    while (   Z502_PAGE_TBL_ADDR == NULL
+           || virtual_page_number >= Z502_PAGE_TBL_LENGTH
+           || ( page_table_lookup( virtual_page_number, &pte_index )
+                                                & PTBL_VALID_BIT ) == 0 )
+    {
+        if ( Z502_CURRENT_CONTEXT->structure_id != CONTEXT_STRUCTURE_ID )
+        {
+            printf( "Z502_CURRENT_CONTEXT is invalid in Z502_ATOMIC\n");
+            printf( "Something in the OS has destroyed this location.\n");
+            z502_internal_panic( ERR_OS502_GENERATED_BUG );
+        }
+        Z502_CURRENT_CONTEXT->fault_in_progress = TRUE;
+        ReleaseLock( HardwareLock, Debug_Text );
+        ZCALL( hardware_fault( INVALID_MEMORY, virtual_page_number ) );
+        GetLock( HardwareLock, Debug_Text );
+    }
+    Z502_CURRENT_CONTEXT->fault_in_progress = FALSE;
+
+    phys_pg = page_table_lookup( virtual_page_number, &pte_index )
+                                                    & PTBL_PHYS_PG_NO;
+    if ( TlbSets > 0 )
+        phys_pg = tlb_translate( virtual_page_number );
+    if ( phys_pg < 0 || phys_pg > PHYS_MEM_PGS - 1 )
+    {
+        printf( "The physical address is invalid in Z502_ATOMIC\n");
+        printf( "Physical page = %d, Virtual Page = %d\n",
+                        phys_pg, virtual_page_number );
+        z502_internal_panic( ERR_OS502_GENERATED_BUG );
+    }
+    word = (INT32 *)&MEMORY[ phys_pg * PGSIZE + VirtualAddress % PGSIZE ];
+
+    GetLock( MemoryLock, Debug_Text );
+    atomic_operation( word, Operation, Value, Compare,
+                      OldValue, SuccessfulAction );
+    ptbl_bits = PTBL_REFERENCED_BIT;
+    if ( *SuccessfulAction == TRUE )
+        ptbl_bits |= PTBL_MODIFIED_BIT;
+    Z502_PAGE_TBL_ADDR[ pte_index ] |= ptbl_bits;
+    pmu_count( PMU_MEMORY_ACCESSES, 1 );
+    ReleaseLock( MemoryLock, Debug_Text );
+
+    charge_time_and_check_events( COST_OF_ATOMIC );
+    if ( Z502_MODE != KERNEL_MODE )
+        POP_THE_STACK = TRUE;
+    ReleaseLock( HardwareLock, Debug_Text );
+    if ( replay_log != NULL )
+        single_thread_interrupt( );
+}                                       /* End  Z502_ATOMIC  */
+
+/*  The operation itself, on a word the caller has found and locked.  */
+
+void    atomic_operation( INT32 *word, INT32 Operation, INT32 Value,
+                          INT32 Compare, INT32 *OldValue,
+                          INT32 *SuccessfulAction )
+{
+    *OldValue           = *word;
+    *SuccessfulAction   = TRUE;
+    switch ( Operation )
+    {
+        case ATOMIC_COMPARE_AND_SWAP:
+            if ( *word == Compare )
+                *word = Value;
+            else
+                *SuccessfulAction = FALSE;
+            break;
+        case ATOMIC_FETCH_AND_ADD:
+            *word += Value;
+            break;
+        case ATOMIC_EXCHANGE:
+            *word = Value;
+            break;
+    }
+}                                       /* End  atomic_operation  */
 
 
 /*************************************************************************
@@ -552,15 +1476,42 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
     static INT32       MemoryMappedIODiskDevice      = -1;
     static MEMORY_MAPPED_DISK_STATE
                        MemoryMappedDiskState;
+    static Z502CONTEXT *MemoryMappedTLBContext       = NULL;
+    static INT32       MemoryMappedPMUEvent          = -1;
+    static UINT64      MemoryMappedPMULatch          = 0;
+    static INT32       MemoryMappedCpu               = -1;
+    UINT64             *counter;
+    Z502CONTEXT        *context;
+    INT16              asid;
     INT32              index;
 
     // GetLock ( HardwareLock, "memory_mapped_io" );
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )  {
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )  {
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
     }
-        charge_time_and_check_events( COST_OF_MEMORY_MAPPED_IO );
+
+    /*  A processor's number and the number of processors are wired
+        in, so reading them takes no time.  An OS that asks on every
+        call then runs with one processor exactly as it always has. */
+
+    if ( address == Z502ProcessorID || address == Z502ProcessorCount )
+    {
+        if ( read_or_write == SYSNUM_MEM_READ )
+            *data = ( address == Z502ProcessorID ) ? CurrentCpu : NumberOfCpus;
+        return;
+    }
+
+    /*  Z502TimerStart and Z502TimerStatus are channel 0's registers
+        at their old addresses.                                     */
+
+    if ( address == Z502TimerStart )
+        address = Z502TimerChannelStart( 0 );
+    if ( address == Z502TimerStatus )
+        address = Z502TimerChannelStatus( 0 );
+    charge_time_and_check_events( COST_OF_MEMORY_MAPPED_IO );
+    pmu_count( PMU_MMIO_OPERATIONS, 1 );
     switch( address )
     {
         /*  Here we either get the device that's caused the interrupt, or
@@ -588,6 +1539,20 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
             break;
         }
 
+        case Z502InterruptTag: {
+            *data = -1;
+            if ( MemoryMappedIOInterruptDevice != -1 )
+                *data = interrupt_tag[MemoryMappedIOInterruptDevice];
+            break;
+        }
+
+        case Z502InterruptFrame: {
+            *data = -1;
+            if ( MemoryMappedIOInterruptDevice != -1 )
+                *data = interrupt_frame[MemoryMappedIOInterruptDevice];
+            break;
+        }
+
         case Z502InterruptClear: {
             if ( MemoryMappedIOInterruptDevice != -1 && *data == 0 )
             {
@@ -597,19 +1562,31 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
             }
             break;
         }
-        case Z502ClockStatus: {
-             hardware_clock( data );
+
+        /*  The completion ring lives in the OS's memory; the address
+            is passed just as Z502DiskSetBuffer's is.                 */
+
+        case Z502CompletionRing: {
+            if ( read_or_write == SYSNUM_MEM_WRITE )
+                completion_ring = (COMPLETION_RING *)data;
             break;
         }
-        case Z502TimerStart: {
-            hardware_timer( *data );
+        case Z502CompletionThreshold: {
+            if ( read_or_write == SYSNUM_MEM_READ )
+                *data = completion_threshold;
+            else if ( *data >= 1 && *data < COMPLETION_RING_SIZE )
+                completion_threshold = *data;
             break;
         }
-        case Z502TimerStatus: {
-            if ( timer_state.timer_in_use > 0 )
-                *data = DEVICE_IN_USE;
-            else
-                *data = DEVICE_FREE;
+        case Z502CompletionDelay: {
+            if ( read_or_write == SYSNUM_MEM_READ )
+                *data = completion_delay;
+            else if ( *data >= 0 )
+                completion_delay = *data;
+            break;
+        }
+        case Z502ClockStatus: {
+             hardware_clock( data );
             break;
         }
         /*  When we get the disk ID, set up the structure that we will
@@ -622,6 +1599,10 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
                 MemoryMappedDiskState.sector               = -1;
                 MemoryMappedDiskState.action               = -1;
                 MemoryMappedDiskState.buffer               = (char *)-1;
+                MemoryMappedDiskState.sg_list              = NULL;
+                MemoryMappedDiskState.frame                = -1;
+                MemoryMappedDiskState.count                = 1;
+                MemoryMappedDiskState.tag                  = -1;
             }
             else
             {
@@ -651,7 +1632,72 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
 
             break;
         }
-        case Z502DiskSetup4: {
+        /*  A whole request in one go - see disk_command().  */
+        case Z502DiskCommand: {
+            if ( read_or_write == SYSNUM_MEM_WRITE )
+                disk_command( (DISK_COMMAND *)data );
+            break;
+        }
+        /*  A request may move several consecutive sectors.  Their data
+         *  is either one contiguous buffer given to Z502DiskSetBuffer,
+         *  or a scatter-gather list - an array of count buffer addresses,
+         *  one for each sector.  */
+        case Z502DiskSetCount: {
+            if ( MemoryMappedIODiskDevice != -1 )
+                MemoryMappedDiskState.count = (INT16)*data;
+            else
+            {
+                if ( DO_DEVICE_DEBUG )
+                {
+                    printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502DiskSetCount ------------- \n");
+                    printf( "ERROR:  You must define the Device ID before setting the count\n");
+                    printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+                }
+            }
+            break;
+        }
+        case Z502DiskSetSGList: {
+            if ( MemoryMappedIODiskDevice != -1 )
+                MemoryMappedDiskState.sg_list = (char **)data;
+            else
+            {
+                if ( DO_DEVICE_DEBUG )
+                {
+                    printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502DiskSetSGList ------------ \n");
+                    printf( "ERROR:  You must define the Device ID before setting the SG list\n");
+                    printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+                }
+            }
+            break;
+        }
+        /*  DMA - the request's sectors move straight to or from
+         *  physical memory, starting at this frame.  */
+        case Z502DiskSetFrame: {
+            if ( MemoryMappedIODiskDevice != -1 )
+                MemoryMappedDiskState.frame = *data;
+            else
+            {
+                if ( DO_DEVICE_DEBUG )
+                {
+                    printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502DiskSetFrame ------------ \n");
+                    printf( "ERROR:  You must define the Device ID before setting the frame\n");
+                    printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+                }
+            }
+            break;
+        }
+        case Z502DiskSetTag: {
+            if ( MemoryMappedIODiskDevice != -1 )
+                MemoryMappedDiskState.tag = *data;
+            else
+            {
+                if ( DO_DEVICE_DEBUG )
+                {
+                    printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502DiskSetTag --------------- \n");
+                    printf( "ERROR:  You must define the Device ID before setting the tag\n");
+                    printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+                }
+            }
             break;
         }
         case Z502DiskSetAction: {
@@ -688,17 +1734,27 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
             if ( *data == 0 
                  && MemoryMappedIODiskDevice != -1 
                  && MemoryMappedDiskState.action != -1 
-                 && MemoryMappedDiskState.buffer != (char *)-1 
+                 && (   MemoryMappedDiskState.buffer != (char *)-1
+                     || MemoryMappedDiskState.sg_list != NULL
+                     || MemoryMappedDiskState.frame != -1 )
                  && MemoryMappedDiskState.sector != -1 )
             {
                 if ( MemoryMappedDiskState.action == 0 )
                     hardware_read_disk( (INT16)MemoryMappedIODiskDevice, 
                                   MemoryMappedDiskState.sector, 
-                                  MemoryMappedDiskState.buffer );
+                                  MemoryMappedDiskState.count,
+                                  MemoryMappedDiskState.buffer,
+                                  MemoryMappedDiskState.sg_list,
+                                  MemoryMappedDiskState.frame,
+                                  MemoryMappedDiskState.tag );
                 if ( MemoryMappedDiskState.action == 1 )
                     hardware_write_disk((INT16)MemoryMappedIODiskDevice, 
                                   MemoryMappedDiskState.sector, 
-                                  MemoryMappedDiskState.buffer );
+                                  MemoryMappedDiskState.count,
+                                  MemoryMappedDiskState.buffer,
+                                  MemoryMappedDiskState.sg_list,
+                                  MemoryMappedDiskState.frame,
+                                  MemoryMappedDiskState.tag );
             }
             else
             {
@@ -715,6 +1771,10 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
             MemoryMappedDiskState.action = -1;
             MemoryMappedDiskState.buffer = (char *)-1;
             MemoryMappedDiskState.sector = -1;
+            MemoryMappedDiskState.sg_list = NULL;
+            MemoryMappedDiskState.frame  = -1;
+            MemoryMappedDiskState.count  = 1;
+            MemoryMappedDiskState.tag    = -1;
             break;
         }
         case Z502DiskStatus: {
@@ -722,75 +1782,225 @@ void    memory_mapped_io( INT32 address, INT32 *data, BOOL read_or_write )
                 *data = ERR_BAD_DEVICE_ID;
             else
             {
-                if ( disk_state[MemoryMappedIODiskDevice].disk_in_use == TRUE )
+                if ( disk_requests_outstanding( (INT16)MemoryMappedIODiskDevice )
+                                                    >= DiskQueueDepth )
                     *data = DEVICE_IN_USE;
                 else
                     *data = DEVICE_FREE;
             }
             break;
         }
-        default: 
+        /*  The TLB invalidations apply to the context named with
+         *  Z502TLBSetContext, or to the current context if none was
+         *  named.  Either way the choice lasts for one invalidation. */
+        case Z502TLBEntries: {
+            *data = TlbSets * TlbWays;
             break;
-    }                                    /* End of switch */
-    // ReleaseLock ( HardwareLock, "memory_mapped_io" );
-
-}                                       /* End  memory_mapped_io  */
-
-/*************************************************************************
-
-        hardware_read_disk
-
-            This code simulates a disk read.  Actions include:
+        }
+        case Z502TLBSetContext: {
+            MemoryMappedTLBContext = (Z502CONTEXT *)data;
+            if (   MemoryMappedTLBContext != NULL
+                && MemoryMappedTLBContext->structure_id != CONTEXT_STRUCTURE_ID )
+            {
+                if ( DO_DEVICE_DEBUG )
+                {
+                    printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502TLBSetContext ------------ \n");
+                    printf( "ERROR:  The address given is not a context\n");
+                    printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+                }
+                MemoryMappedTLBContext = NULL;
+            }
+            break;
+        }
+        case Z502TLBInvalidatePage:
+        case Z502TLBInvalidateASID: {
+            asid = ( MemoryMappedTLBContext != NULL )
+                        ? MemoryMappedTLBContext->asid
+                        : Z502_CURRENT_CONTEXT->asid;
+            tlb_invalidate( asid, (INT16)( address == Z502TLBInvalidatePage
+                                           ? *data : -1 ) );
+            translation_cache_invalidate( (INT16)( address == Z502TLBInvalidatePage
+                                                   ? *data : -1 ) );
+            MemoryMappedTLBContext = NULL;
+            break;
+        }
+        case Z502TLBInvalidateAll: {
+            tlb_invalidate( -1, -1 );
+            translation_cache_invalidate( -1 );
+            MemoryMappedTLBContext = NULL;
+            break;
+        }
+
+        /*  The PMU.  The selected event keeps PMU_CONTEXT if it was
+         *  given, and the count then comes from whichever context is
+         *  current when the counter is read or reset.  */
+
+        /*  CPU accounting.  Reads are for the context last written to
+         *  Z502AccountingContext, or the current context if that was
+         *  NULL.  The choice stays until the next write, or until that
+         *  context is destroyed.  */
+
+        case Z502AccountingContext: {
+            AccountingContext = (Z502CONTEXT *)data;
+            if (   AccountingContext != NULL
+                && AccountingContext->structure_id != CONTEXT_STRUCTURE_ID )
+            {
+                if ( DO_DEVICE_DEBUG )
+                {
+                    printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502AccountingContext -------- \n");
+                    printf( "ERROR:  The address given is not a context\n");
+                    printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+                }
+                AccountingContext = NULL;
+            }
+            break;
+        }
+        case Z502AccountingUserTicks:
+        case Z502AccountingKernelTicks:
+        case Z502AccountingFaults:
+        case Z502AccountingTraps: {
+            context = ( AccountingContext != NULL ) ? AccountingContext
+                                                    : Z502_CURRENT_CONTEXT;
+            if ( address == Z502AccountingUserTicks )
+                *data = context->user_ticks;
+            if ( address == Z502AccountingKernelTicks )
+                *data = context->kernel_ticks;
+            if ( address == Z502AccountingFaults )
+                *data = context->faults;
+            if ( address == Z502AccountingTraps )
+                *data = context->traps;
+            break;
+        }
+
+        case Z502PMUSelect: {
+            MemoryMappedPMUEvent = -1;
+            if (   ( *data & ~PMU_CONTEXT ) >= 0
+                && ( *data & ~PMU_CONTEXT ) < PMU_NUMBER_OF_EVENTS )
+                MemoryMappedPMUEvent = *data;
+            break;
+        }
+        case Z502PMUCountLow:
+        case Z502PMUCountHigh:
+        case Z502PMUReset: {
+            counter = NULL;
+            if ( MemoryMappedPMUEvent >= 0 )
+                counter = ( MemoryMappedPMUEvent & PMU_CONTEXT )
+                    ? &Z502_CURRENT_CONTEXT->pmu_counts[MemoryMappedPMUEvent & ~PMU_CONTEXT]
+                    : &pmu_counts[MemoryMappedPMUEvent];
+            if ( address == Z502PMUReset )
+                {
+                if ( counter != NULL )
+                    *counter = 0;
+                break;
+            }
+            if ( address == Z502PMUCountLow )
+                MemoryMappedPMULatch = ( counter != NULL ) ? *counter : (UINT64)-1;
+            if ( address == Z502PMUCountLow )
+                *data = (INT32)( MemoryMappedPMULatch & 0xFFFFFFFF );
+            else
+                *data = (INT32)( MemoryMappedPMULatch >> 32 );
+            break;
+        }
+
+        /*  Other processors.  Select one, then start it on a context
+         *  or interrupt it.  */
+
+        case Z502ProcessorSelect: {
+            if ( read_or_write == SYSNUM_MEM_READ )
+                *data = MemoryMappedCpu;
+            else
+                if ( *data >= 0 && *data < NumberOfCpus )
+                    MemoryMappedCpu = *data;
+                else
+                    MemoryMappedCpu = -1;
+            break;
+        }
+        case Z502ProcessorStart: {
+            cpu_start( MemoryMappedCpu, (Z502CONTEXT *)data );
+            MemoryMappedCpu = -1;
+            break;
+        }
+        case Z502ProcessorInterrupt: {
+            if ( read_or_write == SYSNUM_MEM_WRITE )
+                cpu_interrupt( *data );
+            break;
+        }
+
+        /*  Anything else is one of the timer channels' registers,
+            or nothing at all.                                      */
+
+        default:
+            if (   address <  Z502TimerChannelStart( 0 )
+                || address >= Z502TimerChannelStart( NUMBER_OF_TIMER_CHANNELS ) )
+                break;
+            index = ( address - Z502TimerChannelStart( 0 ) )
+                                        / TIMER_CHANNEL_REGISTERS;
+            if ( address == Z502TimerChannelStart( index ) )
+                hardware_timer( (INT16)index, *data );
+            if ( address == Z502TimerChannelStatus( index ) )
+                *data = ( timer_state[index].timer_in_use > 0 )
+                                ? DEVICE_IN_USE : DEVICE_FREE;
+            if (   address == Z502TimerChannelCancel( index )
+                && read_or_write == SYSNUM_MEM_WRITE )
+                hardware_timer_cancel( (INT16)index );
+            if ( address == Z502TimerChannelPeriod( index ) )
+                {
+                if ( read_or_write == SYSNUM_MEM_READ )
+                    *data = timer_state[index].period;
+                else if ( *data >= 0 )
+                    timer_state[index].period = *data;
+            }
+            break;
+    }                                    /* End of switch */
+    // ReleaseLock ( HardwareLock, "memory_mapped_io" );
+
+}                                       /* End  memory_mapped_io  */
+
+/*************************************************************************
+
+        hardware_read_disk
+
+            This code simulates a disk read.  Actions include:
                 o If not in KERNEL_MODE, then cause priv inst trap.
-                o Do range check on disk_id, sector; give
+                o Do range check on disk_id, sector and count; give
                   interrupt error = ERR_BAD_PARAM if illegal.
-                o If an event for this disk already exists ( the disk
-                  is already busy ), then give interrupt error                   
+                o If the disk already holds as many requests as its
+                  queue depth allows, then give interrupt error
                   ERR_DISK_IN_USE.
-                o Search for sector structure off of hashed value.
+                o Find each sector in the disk's chunk table.
                 o If search fails give interrupt error = 
                   ERR_NO_PREVIOUS_WRITE
-                o Copy data from sector to buffer.
-                o From disk_state information, determine how long
-                  this request will take.
-                o Request a future interrupt for this event.
+                o Copy data from each sector to its buffer - the
+                  next piece of a contiguous buffer, the next
+                  entry of the scatter-gather list, or the next
+                  frame of physical memory.
+                o Hand the request to the disk queue, which decides
+                  when it will complete.
                 o Advance time and see if an interrupt has occurred.
 
 **************************************************************************/
 
-void    hardware_read_disk( INT16 disk_id, INT16 sector, char *buffer_ptr )
+void    hardware_read_disk( INT16 disk_id, INT16 sector, INT16 count,
+                            char *buffer_ptr, char **sg_list, INT32 frame,
+                            INT32 tag )
     {
     INT32       local_error;
     char        *sector_ptr;
-    INT32       access_time;
     INT16       error_found;
+    INT16       index;
+    EVENT       *error_event;
 
     error_found = 0;
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )  {
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )  {
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
     }
 
+    error_found = disk_request_error( disk_id, sector, count, frame, TRUE );
     if (   disk_id  < 1  || disk_id  >  MAX_NUMBER_OF_DISKS )
-        {
         disk_id = 1;                    /* To aim at legal vector  */
-        error_found = ERR_BAD_PARAM;
-    }
-    if ( sector   < 0  || sector   >= NUM_LOGICAL_SECTORS )
-        error_found = ERR_BAD_PARAM;
 
-
-    if ( error_found == 0 )
-        {
-        get_sector_struct( disk_id, sector, &sector_ptr, &local_error );
-        if ( local_error != 0 )
-            error_found = ERR_NO_PREVIOUS_WRITE;
-
-        if ( disk_state[disk_id].disk_in_use  == TRUE )
-            error_found = ERR_DISK_IN_USE;
-    }
-
     /* If we found an error, add an event that will cause an immediate
        hardware interrupt.                                              */
 
@@ -807,30 +2017,26 @@ void    hardware_read_disk( INT16 disk_id, INT16 sector, char *buffer_ptr )
         }
         add_event( current_simulation_time, 
                    (INT16)(DISK_INTERRUPT + disk_id - 1),
-                   error_found, &disk_state[disk_id].event_ptr );
+                   error_found, tag, &error_event );
     }
     else
         {
-        memcpy( buffer_ptr, sector_ptr, PGSIZE );
-
-        access_time = current_simulation_time + 100
-                  + abs( disk_state[disk_id].last_sector - sector )/20;
-        hardware_stats.disk_reads[disk_id]++;
-        hardware_stats.time_disk_busy[disk_id] 
-                        += access_time - current_simulation_time;
-        if ( DO_DEVICE_DEBUG )
-        {
-            printf( "------ BEGIN DO_DEVICE DEBUG - IN read_disk ------------- \n");
-            printf( "Time now = %d:  Disk read will cause interrupt at time = %d\n",
-                            current_simulation_time, access_time );
-            printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+        if ( frame != -1 )
+            GetLock( MemoryLock, "hardware_read_disk" );
+        for ( index = 0; index < count; index++ )
+            {
+            get_sector_struct( disk_id, (INT16)( sector + index ),
+                               &sector_ptr, &local_error );
+            memcpy( disk_transfer_address( buffer_ptr, sg_list, frame, index ),
+                    sector_ptr, PGSIZE );
         }
-        add_event( access_time, (INT16)(DISK_INTERRUPT + disk_id - 1),
-                        (INT16)ERR_SUCCESS, &disk_state[disk_id].event_ptr );
-        disk_state[disk_id].last_sector         = sector;
+        if ( frame != -1 )
+            ReleaseLock( MemoryLock, "hardware_read_disk" );
+        hardware_stats.disk_reads[disk_id]++;
+        pmu_count( PMU_DISK_READS, 1 );
+        pmu_count( PMU_DISK_READS + disk_id, 1 );
+        disk_queue_request( disk_id, sector, count, frame, tag );
     }
-    disk_state[disk_id].disk_in_use = TRUE;
-    // printf("1. Setting %d TRUE\n", disk_id );
     charge_time_and_check_events( COST_OF_DISK_ACCESS );
 
 }                                       /* End of hardware_read_disk    */
@@ -843,48 +2049,45 @@ void    hardware_read_disk( INT16 disk_id, INT16 sector, char *buffer_ptr )
 
             This code simulates a disk write.  Actions include:
                 o If not in KERNEL_MODE, then cause priv inst trap.
-                o Do range check on disk_id, sector; give
+                o Do range check on disk_id, sector and count; give
                   interrupt error = ERR_BAD_PARAM if illegal.
-                o If an event for this disk already exists ( the disk
-                  is already busy ), then give interrupt error 
+                o If the disk already holds as many requests as its
+                  queue depth allows, then give interrupt error
                   ERR_DISK_IN_USE.
-                o Search for sector structure off of hashed value.
+                o Find each sector in the disk's chunk table.
                 o If search fails give create a sector on the
                   simulated disk.
-                o Copy data from buffer to sector.
-                o From disk_state information, determine how long
-                  this request will take.
-                o Request a future interrupt for this event.
+                o Copy data to each sector from its buffer - the
+                  next piece of a contiguous buffer, the next
+                  entry of the scatter-gather list, or the next
+                  frame of physical memory.
+                o Hand the request to the disk queue, which decides
+                  when it will complete.
                 o Advance time and see if an interrupt has occurred.
 
     *****************************************************************/
 
-void    hardware_write_disk( INT16 disk_id,INT16 sector, char *buffer_ptr )
+void    hardware_write_disk( INT16 disk_id,INT16 sector, INT16 count,
+                             char *buffer_ptr, char **sg_list, INT32 frame,
+                             INT32 tag )
 {
     INT32       local_error;
     char        *sector_ptr;
-    INT32       access_time;
     INT16       error_found;
+    INT16       index;
+    EVENT       *error_event;
 
     error_found = 0;
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )   {
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )   {
         ZCALL( hardware_fault(PRIVILEGED_INSTRUCTION, 0));
         return;
     }
 
+    error_found = disk_request_error( disk_id, sector, count, frame, FALSE );
     if (   disk_id  < 1  || disk_id  >  MAX_NUMBER_OF_DISKS )
-        {
         disk_id = 1;                    /* To aim at legal vector  */
-        error_found = ERR_BAD_PARAM;
-    }
-    if ( sector < 0  || sector >= NUM_LOGICAL_SECTORS )
-        error_found = ERR_BAD_PARAM;
-
-    if ( disk_state[disk_id].disk_in_use == TRUE )
-        error_found = ERR_DISK_IN_USE;
 
-
     if ( error_found != 0 )
     {
         if ( DO_DEVICE_DEBUG )
@@ -898,75 +2101,353 @@ void    hardware_write_disk( INT16 disk_id,INT16 sector, char *buffer_ptr )
         }
         add_event( current_simulation_time, 
                    (INT16)(DISK_INTERRUPT + disk_id - 1),
-                   error_found, &disk_state[disk_id].event_ptr );
+                   error_found, tag, &error_event );
     }
     else
         {
-        get_sector_struct( disk_id, sector, &sector_ptr, &local_error );
-        if ( local_error != 0 )   /* No structure for this sector exists */
-            create_sector_struct( disk_id, sector, &sector_ptr );
+        if ( frame != -1 )
+            GetLock( MemoryLock, "hardware_write_disk" );
+        for ( index = 0; index < count; index++ )
+            {
+            get_sector_struct( disk_id, (INT16)( sector + index ),
+                               &sector_ptr, &local_error );
+            if ( local_error != 0 )   /* No structure for this sector exists */
+                create_sector_struct( disk_id, (INT16)( sector + index ),
+                                      &sector_ptr );
+
+            memcpy( sector_ptr,
+                    disk_transfer_address( buffer_ptr, sg_list, frame, index ),
+                    PGSIZE );
+        }
+        if ( frame != -1 )
+            ReleaseLock( MemoryLock, "hardware_write_disk" );
+        hardware_stats.disk_writes[disk_id]++;
+        pmu_count( PMU_DISK_WRITES, 1 );
+        pmu_count( PMU_DISK_WRITES + disk_id, 1 );
+        disk_queue_request( disk_id, sector, count, frame, tag );
+    }
+    charge_time_and_check_events( COST_OF_DISK_ACCESS );
 
-        memcpy( sector_ptr, buffer_ptr, PGSIZE );
+}                                       /* End of hardware_write_disk   */
 
-        access_time = (INT32)current_simulation_time + 100
-                    + abs( disk_state[disk_id].last_sector - sector )/20;
-        hardware_stats.disk_writes[disk_id]++;
-        hardware_stats.time_disk_busy[disk_id] 
-                        += access_time - current_simulation_time;
+    /*****************************************************************
+
+        disk_transfer_address()
+
+            Where the index'th sector of a request comes from or goes
+            to: the next frame of physical memory for DMA, the next
+            entry of the scatter-gather list, or the next piece of a
+            contiguous buffer.
+
+    *****************************************************************/
+
+char    *disk_transfer_address( char *buffer_ptr, char **sg_list,
+                                INT32 frame, INT16 index )
+    {
+    if ( frame != -1 )
+        return( (char *)&MEMORY[( frame + index ) * PGSIZE] );
+    if ( sg_list != NULL )
+        return( sg_list[index] );
+    return( buffer_ptr + index * PGSIZE );
+}                               /* End of disk_transfer_address     */
+
+    /*****************************************************************
+
+        disk_request_error()
+
+            Check a disk request before it's started; used both for
+            one set up through the registers and for a command block.
+            Returns ERR_SUCCESS, ERR_BAD_PARAM for a disk, sector,
+            count or frame out of range, ERR_DISK_IN_USE if the disk's
+            queue is full, or, for a read, ERR_NO_PREVIOUS_WRITE if a
+            sector has never been written.
+    *****************************************************************/
+
+INT16   disk_request_error( INT16 disk_id, INT16 sector, INT16 count,
+                            INT32 frame, BOOL is_read )
+    {
+    INT32       local_error;
+    char        *sector_ptr;
+    INT16       index;
+
+    if (   disk_id  < 1  || disk_id  >  MAX_NUMBER_OF_DISKS
+        || count    < 1  || count    >  MAX_SECTORS_PER_TRANSFER
+        || sector   < 0  || sector + count > NUM_LOGICAL_SECTORS )
+        return( ERR_BAD_PARAM );
+    if (   frame != -1
+        && ( frame  < 0  || frame  + count > PHYS_MEM_PGS ) )
+        return( ERR_BAD_PARAM );
+    if ( disk_requests_outstanding( disk_id ) >= DiskQueueDepth )
+        return( ERR_DISK_IN_USE );
+    if ( is_read == TRUE )
+        for ( index = 0; index < count; index++ )
+            {
+            get_sector_struct( disk_id, (INT16)( sector + index ),
+                               &sector_ptr, &local_error );
+            if ( local_error != 0 )
+                return( ERR_NO_PREVIOUS_WRITE );
+        }
+    return( ERR_SUCCESS );
+}                               /* End of disk_request_error        */
+
+    /*****************************************************************
+
+        disk_command()
+
+            Start the request in a DISK_COMMAND, written to
+            Z502DiskCommand.  It takes the one MMIO operation in place
+            of the six or more that set up the registers.  Actions
+            include:
+                o If not in KERNEL_MODE, then cause priv inst trap.
+                o Check the request - see disk_request_error().  If it
+                  can't be started, say why in its status and stop;
+                  there's no interrupt.
+                o Otherwise start it as Z502DiskStart would, and set
+                  its status to ERR_SUCCESS.
+    *****************************************************************/
+
+void    disk_command( DISK_COMMAND *command )
+    {
+    char        *buffer_ptr;
+    INT16       error_found;
+
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )  {
+        ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
+        return;
+    }
+    buffer_ptr = ( command->buffer != NULL ) ? command->buffer : (char *)-1;
+    if (   ( command->action != 0 && command->action != 1 )
+        || (   buffer_ptr == (char *)-1 && command->sg_list == NULL
+            && command->frame == -1 ) )
+        error_found = ERR_BAD_PARAM;
+    else
+        error_found = disk_request_error( (INT16)command->disk,
+                                          (INT16)command->sector,
+                                          (INT16)command->count,
+                                          command->frame,
+                                          (BOOL)( command->action == 0 ) );
+    command->status = error_found;
+    if ( error_found != ERR_SUCCESS )
+        {
         if ( DO_DEVICE_DEBUG )
         {
-            printf( "------ BEGIN DO_DEVICE DEBUG - IN write_disk ------------- \n");
-            printf( "Time now = %d:  Disk write will cause interrupt at time = %d\n",
-                            current_simulation_time, access_time );
+            printf( "------ BEGIN DO_DEVICE DEBUG - IN disk_command ------------- \n");
+            printf( "The disk refused the command with error %d, that you can\n",
+                            error_found );
+            printf( "look up in global.h.\n" );
             printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
         }
-        add_event( access_time, (INT16)(DISK_INTERRUPT + disk_id - 1),
-                        (INT16)ERR_SUCCESS, &disk_state[disk_id].event_ptr );
-        disk_state[disk_id].last_sector         = sector;
+        return;
     }
-    disk_state[disk_id].disk_in_use = TRUE;
-    // printf("2. Setting %d TRUE\n", disk_id );
-    charge_time_and_check_events( COST_OF_DISK_ACCESS );
+    if ( command->action == 0 )
+        hardware_read_disk( (INT16)command->disk, (INT16)command->sector,
+                            (INT16)command->count, buffer_ptr,
+                            command->sg_list, command->frame, command->tag );
+    else
+        hardware_write_disk( (INT16)command->disk, (INT16)command->sector,
+                             (INT16)command->count, buffer_ptr,
+                             command->sg_list, command->frame, command->tag );
+}                               /* End of disk_command              */
 
-}                                       /* End of hardware_write_disk   */
+
+    /*****************************************************************
+
+        Disk Request Queue
+
+            A disk can hold up to DiskQueueDepth requests at once
+            (set with --disk-queue-depth, 1 by default).  The data
+            moves when the request is accepted, so the order in which
+            the OS sees its reads and writes take effect is the order
+            it issued them.  What the queue decides is when each one
+            completes.  The head services one request at a time; when
+            it finishes, the waiting request with the shortest seek
+            from where the head now sits goes next.  Every request
+            completes with its own interrupt carrying the tag the OS
+            gave it in Z502DiskSetTag.
+
+            How long the head takes over a request is up to the
+            disk's model - see disk_service_time().
+
+        disk_requests_outstanding()  - requests held by the disk.
+        disk_queue_request()         - accept a request.
+        disk_start_request()         - put the head in motion.
+        disk_start_next_request()    - pick the next request when the
+                                       head comes free.
+    *****************************************************************/
+
+INT16   disk_requests_outstanding( INT16 disk_id )
+    {
+    return( (INT16)( disk_state[disk_id].requests_queued
+                   + ( disk_state[disk_id].disk_in_use == TRUE ? 1 : 0 ) ) );
+}                               /* End of disk_requests_outstanding */
+
+void    disk_queue_request( INT16 disk_id, INT16 sector, INT16 count,
+                            INT32 frame, INT32 tag )
+    {
+    DISK_STATE          *disk = &disk_state[disk_id];
+
+    if ( disk->disk_in_use == FALSE )
+        {
+        disk_start_request( disk_id, sector, count, frame, tag );
+        return;
+    }
+    disk->queue[disk->requests_queued].sector   = sector;
+    disk->queue[disk->requests_queued].count    = count;
+    disk->queue[disk->requests_queued].frame    = frame;
+    disk->queue[disk->requests_queued].tag      = tag;
+    disk->requests_queued++;
+    if ( DO_DEVICE_DEBUG )
+    {
+        printf( "------ BEGIN DO_DEVICE DEBUG - IN disk_queue_request ---- \n");
+        printf( "Disk %d is busy:  sector %d waits with %d other requests\n",
+                        disk_id, sector, disk->requests_queued - 1 );
+        printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+    }
+}                               /* End of disk_queue_request        */
+
+void    disk_start_request( INT16 disk_id, INT16 sector, INT16 count,
+                            INT32 frame, INT32 tag )
+    {
+    INT32       access_time;
+
+    access_time = (INT32)current_simulation_time
+                + disk_service_time( disk_id, sector, count );
+    hardware_stats.time_disk_busy[disk_id]
+                    += access_time - current_simulation_time;
+    if ( DO_DEVICE_DEBUG )
+    {
+        printf( "------ BEGIN DO_DEVICE DEBUG - IN disk_start_request ---- \n");
+        printf( "Time now = %d:  Disk %d will cause interrupt at time = %d\n",
+                        current_simulation_time, disk_id, access_time );
+        printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+    }
+    add_event( access_time, (INT16)(DISK_INTERRUPT + disk_id - 1),
+               (INT16)ERR_SUCCESS, tag, &disk_state[disk_id].event_ptr );
+    disk_state[disk_id].last_sector     = sector + count - 1;
+    disk_state[disk_id].frame           = frame;
+    disk_state[disk_id].disk_in_use     = TRUE;
+}                               /* End of disk_start_request        */
+
+    /*****************************************************************
+
+        disk_service_time()
+
+            How long the head of a disk takes over a request starting
+            now, from wherever the last one left it.  The disk uses its
+            own --disk-model if it was given one, and otherwise the one
+            given for every disk (an HDD by default).  See DISK_MODEL
+            in z502.h for what each model charges.
+    *****************************************************************/
+
+INT32   disk_service_time( INT16 disk_id, INT16 sector, INT16 count )
+    {
+    DISK_MODEL  *model = &disk_models[disk_id];
+    INT32       last_sector = disk_state[disk_id].last_sector;
+    INT32       time, per_sector, position, target;
+    INT32       track, last_track, end_track;
+
+    if ( model->kind == DISK_MODEL_DEFAULT )
+        model = &disk_models[0];
+    switch ( model->kind )
+        {
+        case DISK_MODEL_SSD:
+        case DISK_MODEL_RAM:
+            return( model->latency + ( count - 1 ) * model->transfer );
+
+        case DISK_MODEL_ROTATIONAL:
+            track       = sector / model->sectors_per_track;
+            last_track  = last_sector / model->sectors_per_track;
+            end_track   = ( sector + count - 1 ) / model->sectors_per_track;
+            per_sector  = model->rotation / model->sectors_per_track;
+            if ( per_sector < 1 )
+                per_sector = 1;
+            time = 0;
+            if ( track != last_track )
+                time = model->latency
+                     + abs( track - last_track ) * model->track_seek;
+
+            /*  Wait for the sector to come round, then read it and
+                the rest, stepping a track for each one we run off.  */
+
+            position    = ( (INT32)current_simulation_time + time )
+                                                    % model->rotation;
+            target      = ( sector % model->sectors_per_track ) * per_sector;
+            time       += ( target - position + model->rotation )
+                                                    % model->rotation;
+            time       += count * per_sector
+                        + ( end_track - track ) * model->track_seek;
+            return( time );
+
+        default:
+            return( model->latency
+                  + abs( last_sector - sector ) / model->seek_divisor
+                  + ( count - 1 ) * model->transfer );
+    }
+}                               /* End of disk_service_time         */
+
+void    disk_start_next_request( INT16 disk_id )
+    {
+    DISK_STATE          *disk = &disk_state[disk_id];
+    DISK_REQUEST        next;
+    INT16               index;
+    INT16               best;
+
+    if ( disk->requests_queued == 0 )
+        return;
+    best = 0;
+    for ( index = 1; index < disk->requests_queued; index++ )
+        if (   abs( disk->last_sector - disk->queue[index].sector )
+             < abs( disk->last_sector - disk->queue[best].sector ) )
+            best = index;
+
+    next = disk->queue[best];
+    disk->requests_queued--;
+    for ( index = best; index < disk->requests_queued; index++ )
+        disk->queue[index] = disk->queue[index + 1];
+    disk_start_request( disk_id, next.sector, next.count, next.frame,
+                        next.tag );
+}                               /* End of disk_start_next_request   */
 
 
     /*****************************************************************
 
         hardware_timer()
 
-            This is the routine that sets up a clock to interrupt
-            in the future.  Actions include:
+            This is the routine that sets up a timer channel to
+            interrupt in the future.  Actions include:
                 o If not in KERNEL_MODE, then cause priv inst trap.
                 o If time is illegal, generate an interrupt immediately.
-                o Purge any outstanding timer events.
-                o Request a future event.
+                o Purge any outstanding event on this channel.
+                o Request a future event.  A periodic channel asks
+                  for the next one as each is taken - see
+                  hardware_take_event().
                 o Advance time and see if an interrupt has occurred.
 
     *****************************************************************/
 
-void    hardware_timer( INT32 time_to_delay )
+void    hardware_timer( INT16 channel, INT32 time_to_delay )
 {
-    INT32         error;
+    TIMER_STATE   *timer = &timer_state[channel];
     UINT32         CurrentTimerExpirationTime = 9999999;
 
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )  {
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )  {
         ZCALL( hardware_fault(PRIVILEGED_INSTRUCTION, 0 ));
         return;
     }
     
     if ( DO_DEVICE_DEBUG )                // Print lots of info
     {
-        printf( "------ BEGIN DO_DEVICE DEBUG - START TIMER --------- \n");
-        if ( timer_state.timer_in_use > 0 )
+        printf( "------ BEGIN DO_DEVICE DEBUG - START TIMER %d ------- \n",
+                channel );
+        if ( timer->timer_in_use > 0 )
             printf( "The timer is already in use - you will destroy previous timer request\n");
         else
             printf( "The timer is not currently running\n");
         if ( time_to_delay < 0 )
             printf( "TROUBLE - you are asking to delay for a negative time!!\n");
-        if ( timer_state.timer_in_use > 0 )
-            CurrentTimerExpirationTime = timer_state.event_ptr->time_of_event;
+        if ( timer->timer_in_use > 0 )
+            CurrentTimerExpirationTime = timer->event_ptr->time_of_event;
         if ( CurrentTimerExpirationTime < current_simulation_time + time_to_delay )
         {
             printf( "TROUBLE - you are replacing the current timer value of %d with a time of %d\n",
@@ -976,33 +2457,57 @@ void    hardware_timer( INT32 time_to_delay )
         printf( "Time Now = %d, Delaying for time = %d,  Interrupt will occur at = %d\n",
                 current_simulation_time, time_to_delay,
                 current_simulation_time + time_to_delay );
+        if ( timer->period > 0 )
+            printf( "and then every %d\n", timer->period );
         printf( "-------- END DO_DEVICE DEBUG - ---------------------- \n");
     }
-    if ( timer_state.timer_in_use > 0 )
-        {
-        dequeue_item( timer_state.event_ptr, &error );
-        if ( error != 0 )
-            {
-            printf( "Internal error - we tried to retrieve a timer\n");
-            printf( "event, but failed in hardware_timer.\n");
-            z502_internal_panic ( ERR_Z502_INTERNAL_BUG );
-        }
-        timer_state.timer_in_use--;
-    }
+    hardware_timer_cancel( channel );
 
     if ( time_to_delay < 0 )                    /* Illegal time       */
         {
-        add_event( current_simulation_time, TIMER_INTERRUPT, 
-                   (INT16)ERR_BAD_PARAM, &timer_state.event_ptr );
+        add_event( current_simulation_time, TIMER_CHANNEL_INTERRUPT( channel ),
+                   (INT16)ERR_BAD_PARAM, -1, &timer->event_ptr );
         return;
     }
 
     add_event( current_simulation_time + time_to_delay,
-                   TIMER_INTERRUPT, (INT16)ERR_SUCCESS, &timer_state.event_ptr );
-    timer_state.timer_in_use++;
+                   TIMER_CHANNEL_INTERRUPT( channel ), (INT16)ERR_SUCCESS, -1,
+                   &timer->event_ptr );
+    timer->timer_in_use++;
     charge_time_and_check_events( COST_OF_TIMER );
 
 }                                       /* End of hardware_timer  */
+
+
+    /*****************************************************************
+
+        hardware_timer_cancel()
+
+            Take a channel's outstanding event, if it has one, off
+            the event queue so that it never interrupts.  Starting a
+            channel cancels it first, and so does a write to its
+            Z502TimerChannelCancel.  Its period is left as it is.
+
+    *****************************************************************/
+
+void    hardware_timer_cancel( INT16 channel )
+{
+    TIMER_STATE   *timer = &timer_state[channel];
+    INT32         error;
+
+    if ( timer->timer_in_use > 0 )
+        {
+        dequeue_item( timer->event_ptr, &error );
+        if ( error != 0 )
+            {
+            printf( "Internal error - we tried to retrieve a timer\n");
+            printf( "event, but failed in hardware_timer_cancel.\n");
+            z502_internal_panic ( ERR_Z502_INTERNAL_BUG );
+        }
+        timer->timer_in_use--;
+        timer->event_ptr = NULL;
+    }
+}                                       /* End of hardware_timer_cancel */
 
 
     /*****************************************************************
@@ -1021,7 +2526,7 @@ void    hardware_timer( INT32 time_to_delay )
 void    hardware_clock( INT32   *current_time_returned )
     {
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() ) {
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE ) {
         *current_time_returned = -1;    /* return bogus value      */
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
@@ -1040,20 +2545,33 @@ void    hardware_clock( INT32   *current_time_returned )
             This is the routine that ends the simulation.
             Actions include:
                 o If not in KERNEL_MODE, then cause priv inst trap.
+                o Write the last --stats-file line.
+                o Warn if --snapshot was never reached.
                 o Wrapup any outstanding work and terminate.
 
     *****************************************************************/
 
 void    Z502_HALT( void  )     {
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )  {
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )  {
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
     }
     print_hardware_stats( );
+    if ( SnapshotFile != NULL )
+        printf( "Warning: no snapshot was written to %s; the run ended at %d, before --snapshot-at=%d\n",
+                SnapshotFile, machine_time( ), SnapshotTime );
+    if ( stats_file != NULL )
+        {
+        export_stats( );
+        fclose( stats_file );
+        stats_file = NULL;
+    }
+    close_disk_images( );
+    close_interrupt_log( );
 
     printf( "The Z502 halts execution and Ends at Time %d\n",
-                  current_simulation_time );
+                  machine_time( ) );
     GoToExit(0);
 }                                       /* End of Z502_HALT        */
 
@@ -1066,8 +2584,12 @@ void    Z502_HALT( void  )     {
             This is the routine that idles the Z502 until the next
             interrupt.  Actions include:
                 o If not in KERNEL_MODE, then cause priv inst trap.
+                o With several processors, halt this one - see
+                  cpu_halt().
                 o If there's nothing to wait for, print a message 
                   and halt the machine.
+                o Advance the clock - and with --replay, the count of
+                  base level charges - to the next event.
                 o Get the next event and cause an interrupt.
 
     *****************************************************************/
@@ -1079,11 +2601,19 @@ void    Z502_IDLE( void )
 
     GetLock ( HardwareLock, "Z502_IDLE" );
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )  {
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )  {
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
     }
 
+    if ( NumberOfCpus > 1 )
+        {
+        ReleaseLock ( HardwareLock, "Z502_IDLE" );
+        cpu_halt( );
+        single_thread_interrupt( );
+        return;
+    }
+
     get_next_event_time( &time_of_next_event );
     if ( DO_DEVICE_DEBUG )
     {
@@ -1115,9 +2645,21 @@ void    Z502_IDLE( void )
     }
     if ( ( time_of_next_event > 0 )
       && ( current_simulation_time < (UINT32)time_of_next_event ) )
+        {
+        pmu_count( PMU_IDLE_TICKS,
+                   time_of_next_event - (INT32)current_simulation_time );
         current_simulation_time = time_of_next_event;
+    }
+    /*  Idling is waiting for the next interrupt, so a replay skips
+        ahead to where it was delivered, just as the clock does.   */
+    if (   replay_log != NULL && replay_next < replay_length
+        && base_charges < replay_log[replay_next].base_charges )
+        base_charges = replay_log[replay_next].base_charges;
     ReleaseLock ( HardwareLock, "Z502_IDLE" );
-    SignalCondition( InterruptCondition, "Z502_IDLE" );
+    if ( SingleThread )
+        single_thread_interrupt( );
+    else
+        SignalCondition( InterruptCondition, "Z502_IDLE" );
 }                                       /* End of Z502_IDLE         */
 
 
@@ -1129,9 +2671,8 @@ void    Z502_IDLE( void )
             This is the routine that sets up a new context.
             Actions include:
                 o If not in KERNEL_MODE, then cause priv inst trap.
-                o Allocate a structure for a context.  The "calloc"
-                  sets the contents of this memory to 0.
-                o Ensure that memory was actually obtained.
+                o Take a structure for a context from its slab.  The
+                  slab hands it over with the contents set to 0.
                 o Initialize the structure.
                 o Advance time and see if an interrupt has occurred.
                 o Return the structure pointer to the caller.
@@ -1146,18 +2687,13 @@ void    Z502_MAKE_CONTEXT( void       **ReturningContextPointer,
 
     GetLock ( HardwareLock, "Z502_MAKE_CONTEXT" );
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )
         {
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
     }
 
-    our_ptr      = (Z502CONTEXT *)calloc( 1, sizeof( Z502CONTEXT ) );
-    if ( our_ptr == NULL )
-        {
-        printf( "We didn't complete the calloc in MAKE_CONTEXT.\n" );
-        z502_internal_panic( ERR_OS502_GENERATED_BUG      );
-    }
+    our_ptr      = (Z502CONTEXT *)slab_alloc( &context_slab );
 
     our_ptr->structure_id       = CONTEXT_STRUCTURE_ID;
     our_ptr->entry              = (void *)starting_address;
@@ -1166,10 +2702,13 @@ void    Z502_MAKE_CONTEXT( void       **ReturningContextPointer,
     our_ptr->pc                 = 0;
     our_ptr->program_mode       = user_or_kernel;
     our_ptr->fault_in_progress  = FALSE;
+    our_ptr->asid               = asid_allocate( );
     *ReturningContextPointer    = (void *)our_ptr;
 
     charge_time_and_check_events( COST_OF_MAKE_CONTEXT );
     ReleaseLock ( HardwareLock, "Z502_MAKE_CONTEXT" );
+    if ( replay_log != NULL )
+        single_thread_interrupt( );
 
 }                                       /* End of Z502_MAKE_CONTEXT */
 
@@ -1192,10 +2731,11 @@ void    Z502_MAKE_CONTEXT( void       **ReturningContextPointer,
 void    Z502_DESTROY_CONTEXT( void **IncomingContextPointer )
 {
     Z502CONTEXT **context_ptr = (Z502CONTEXT **)IncomingContextPointer;
+    INT32       i;
 
     GetLock ( HardwareLock , "Z502_DESTROY_CONTEXT");
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )
         {
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
@@ -1207,12 +2747,21 @@ void    Z502_DESTROY_CONTEXT( void **IncomingContextPointer )
         printf( "running process.\n" );
         z502_internal_panic( ERR_OS502_GENERATED_BUG );
     }
+    for ( i = 0; i < NumberOfCpus; i++ )
+        if ( i != CurrentCpu && *context_ptr == cpu_state[i].current_context )
+            {
+            printf( "PANIC:  Attempt to destroy context of the process " );
+            printf( "running on processor %d.\n", i );
+            z502_internal_panic( ERR_OS502_GENERATED_BUG );
+        }
 
     if ( (*context_ptr)->structure_id != CONTEXT_STRUCTURE_ID )
         ZCALL( hardware_fault( CPU_ERROR, (INT16)ERR_ILLEGAL_ADDRESS ) );
 
-    (*context_ptr)->structure_id = 0;
-    free( *context_ptr );
+    asid_release( *context_ptr );
+    if ( AccountingContext == *context_ptr )
+        AccountingContext = NULL;
+    slab_free( &context_slab, *context_ptr );
     ReleaseLock ( HardwareLock, "Z502_DESTROY_CONTEXT" );
 
 }                               /* End of Z502_DESTROY_CONTEXT  */
@@ -1239,12 +2788,20 @@ void    Z502_DESTROY_CONTEXT( void **IncomingContextPointer )
 
         change_context()
 
+                o With --snapshot, once --snapshot-at is reached,
+                  write the machine out.  Nothing is on the stack
+                  here, so everything is in the registers and the
+                  hardware's and OS's structures.
+                o With --stats-file, once the next line is due,
+                  write it - see export_stats().
                 o Clear "POP_THE_STACK" disabling the "CALL" mechanism.
                 o Get current context from Z502_CURRENT_CONTEXT.
                 o Validate structure_id on context.  If bogus, panic.
                 o If this is the initial process, ignore KILL/SAVE.
                 o If KILL_SELF, then call DESTROY_CONTEXT.
                 o If SAVE_SELF, put the registers into the context.
+                o A context sharing ASID 0 starts with none of that
+                  ASID's TLB entries.
                 o Advance time and see if an interrupt has occurred.
                 o If "next_context_ptr" is null, run last process again.
                 o Move stuff from new context to registers.
@@ -1262,7 +2819,7 @@ void    Z502_SWITCH_CONTEXT( BOOL kill_or_save,
 
     GetLock ( HardwareLock, "Z502_SWITCH_CONTEXT" );
     // We need to be in kernel mode or be in interrupt handler
-    if ( Z502_MODE != KERNEL_MODE  && InterruptTid != GetMyTid() )
+    if ( Z502_MODE != KERNEL_MODE  && at_interrupt_level() == FALSE )
         {
         ZCALL( hardware_fault( PRIVILEGED_INSTRUCTION, 0 ) );
         return;
@@ -1289,10 +2846,16 @@ void    change_context( )
     Z502CONTEXT     *curr_ptr;
     void        (*routine)( void );
 
+    if (   SnapshotFile != NULL
+        && current_simulation_time >= (UINT32)SnapshotTime )
+        take_snapshot( );
+    if ( stats_file != NULL && machine_time( ) >= stats_next_time )
+        export_stats( );
     GetLock ( HardwareLock, "change_context" );
     POP_THE_STACK = FALSE;
     curr_ptr = Z502_CURRENT_CONTEXT;
     hardware_stats.context_switches++;
+    pmu_count( PMU_CONTEXT_SWITCHES, 1 );
 
     if ( Z502_CURRENT_CONTEXT != NULL )
         {
@@ -1303,8 +2866,10 @@ void    change_context( )
         }
         if ( z502_machine_kill_or_save == SWITCH_CONTEXT_KILL_MODE )
             {
-            curr_ptr->structure_id = 0;
-            free( curr_ptr );
+            if ( AccountingContext == curr_ptr )
+                AccountingContext = NULL;
+            asid_release( curr_ptr );
+            slab_free( &context_slab, curr_ptr );
         }
 
         if ( z502_machine_kill_or_save == SWITCH_CONTEXT_SAVE_MODE )
@@ -1328,6 +2893,7 @@ void    change_context( )
             curr_ptr->page_table_ptr    = Z502_PAGE_TBL_ADDR;
             curr_ptr->page_table_len    = Z502_PAGE_TBL_LENGTH;
             curr_ptr->pc                = Z502_PROGRAM_COUNTER;
+            curr_ptr->last_clock        = current_simulation_time;
         }
     }
 
@@ -1340,15 +2906,33 @@ void    change_context( )
         printf( "CURRENT_CONTEXT is invalid in change_context\n");
         z502_internal_panic( ERR_OS502_GENERATED_BUG  );
     }
-    if ( InterruptTid == GetMyTid() )   // Are we running on hardware thread
+    if ( at_interrupt_level() )         // Are we in the interrupt handler
         {
         printf( "Trying to switch context while at interrupt level > 0.\n");
         printf( "This is NOT advisable and will lead to strange results.\n");
     }
+
+    /*  With several processors a context may move to one whose clock
+        is behind the one it last ran on.  Its time mustn't run
+        backwards, so this processor idles until it catches up.     */
+
+    if ( NumberOfCpus > 1 && curr_ptr->last_clock > current_simulation_time )
+        {
+        pmu_count( PMU_IDLE_TICKS,
+                   (INT32)( curr_ptr->last_clock - current_simulation_time ) );
+        cpu_state[CurrentCpu].idle_ticks
+                  += curr_ptr->last_clock - current_simulation_time;
+        current_simulation_time = curr_ptr->last_clock;
+    }
 
+    GetLock ( MemoryLock, "change_context" );
     Z502_CURRENT_CONTEXT        = curr_ptr;
     Z502_PAGE_TBL_ADDR          = curr_ptr->page_table_ptr;
     Z502_PAGE_TBL_LENGTH        = curr_ptr->page_table_len;
+    ReleaseLock ( MemoryLock, "change_context" );
+    if ( curr_ptr->asid == 0 )          /* Shared - see asid_allocate() */
+        tlb_invalidate( 0, -1 );
+    translation_cache_invalidate( -1 );
     Z502_PROGRAM_COUNTER        = curr_ptr->pc;
     Z502_MODE                   = curr_ptr->program_mode;
     Z502_REG_1                  = curr_ptr->reg1;
@@ -1381,8 +2965,13 @@ void    change_context( )
     }
 
     /* We're now running the new context - return to the OS for any
-       work to be done before going to the user program.            */
+       work to be done before going to the user program.  With one
+       processor, the call type the OS sees is that of the context
+       which switched away; with several, that belongs to some other
+       processor, so the OS sees the call this context was in.      */
 
+    if ( NumberOfCpus > 1 )
+        SYS_CALL_CALL_TYPE  = curr_ptr->call_type;
     Z502_MODE               = KERNEL_MODE;
     os_switch_context_complete( );
     Z502_MODE               = curr_ptr->program_mode;
@@ -1390,6 +2979,8 @@ void    change_context( )
     SYS_CALL_CALL_TYPE = -1;            /* Invalidate it            */
     routine                    = (void (*)(void))curr_ptr->entry;
     ReleaseLock ( HardwareLock, "change_context" );
+    if ( replay_log != NULL )
+        single_thread_interrupt( );
 
     // Allow interrupts to occur since scheduling is done
     (*routine)();
@@ -1416,10 +3007,18 @@ void    change_context( )
     clock and then check that no event has occurred.
     Actions include:
         o Increment the clock.
+        o Charge the time to the current context, as user time
+          or kernel time.  Time spent in the interrupt handler
+          is kernel time.
+        o Count the charges made at base level, for --record and
+          --replay.  A replay interrupts once they reach the next
+          recorded point, due or not.
         o IF interrupts are masked, don't even think about 
           trying to do an interrupt.
         o If interrupts are NOT masked, determine if an interrupt
-          should occur.  If so, then signal the interrupt thread.
+          should occur.  If so, then signal the interrupt thread,
+          or with --single-thread, deliver it right here.
+        o With several processors, see if another one should run.
 
     ******************************************************************/
 
@@ -1429,14 +3028,32 @@ void    charge_time_and_check_events( INT32 time_to_charge )
 
     current_simulation_time += time_to_charge;
     hardware_stats.number_charge_times++;
+    if (   ( record_file != NULL || replay_log != NULL )
+        && at_interrupt_level() == FALSE )
+        base_charges++;
+    if ( Z502_CURRENT_CONTEXT != NULL )
+        {
+        if ( Z502_MODE == USER_MODE && at_interrupt_level() == FALSE )
+            Z502_CURRENT_CONTEXT->user_ticks   += time_to_charge;
+        else
+            Z502_CURRENT_CONTEXT->kernel_ticks += time_to_charge;
+    }
 
     //printf( "Charge_Time... -- current time = %ld\n", current_simulation_time );
-    get_next_event_time( &time_of_next_event );
-    if (  time_of_next_event > 0 && 
-          time_of_next_event <= (INT32)current_simulation_time )
+    time_of_next_event = ATOMIC_LOAD_INT32( &next_event_time );
+    if (  ( time_of_next_event > 0 && 
+            time_of_next_event <= (INT32)current_simulation_time )
+       || ( NumberOfCpus > 1 && cpu_state[CurrentCpu].ipi_pending == TRUE )
+       || (   replay_log != NULL && replay_next < replay_length
+           && base_charges >= replay_log[replay_next].base_charges ) )
     {
+        if ( SingleThread )
+            single_thread_interrupt( );
+        else
             SignalCondition( InterruptCondition, "Charge_Time" );
     }
+    if ( NumberOfCpus > 1 )
+        cpu_yield( );
 }                       /* End of charge_time_and_check_events      */
 
     /*****************************************************************
@@ -1449,9 +3066,9 @@ void    charge_time_and_check_events( INT32 time_to_charge )
             o Wait for a signal from base level.
             o Get the next event - we expect the time has expired, but if
               it hasn't do nothing.
-            o If it's a device, show that the device is no longer busy.
-            o Set up registers which user interrupt handler will see.
-            o Call the interrupt handler.
+            o Take the event - see hardware_take_event().
+            o Call the interrupt handler, unless the event went on the
+              completion ring to wait for others.
 
         Simply return if no event can be found.
     *****************************************************************/
@@ -1459,10 +3076,6 @@ void    charge_time_and_check_events( INT32 time_to_charge )
 void    hardware_interrupt( void  )
     {
     INT32       time_of_event;
-    INT32       index;
-    INT16       event_type;
-    INT16       event_error;
-    INT32       local_error;
     INT32       TimeToWaitForCondition = 30;     // Millisecs before Condition will go off
     void        (*interrupt_handler)( void );
 
@@ -1486,85 +3099,12 @@ void    hardware_interrupt( void  )
         // We got here because there IS an event that needs servicing.
 
         GetLock ( HardwareLock , "hardware_interrupt-2");
-        NumberOfInterruptsStarted++;
-        get_next_ordered_event(&time_of_event, &event_type, 
-                               &event_error, &local_error);
-        if ( local_error != 0 )
-        {
-            printf( "In hardware_interrupt we expected to find an event\n");
-            printf( "Something in the OS has destroyed this location.\n");
-            z502_internal_panic( ERR_OS502_GENERATED_BUG      );
-        }
-
-        if (   event_type >= DISK_INTERRUPT 
-            && event_type <= DISK_INTERRUPT + MAX_NUMBER_OF_DISKS - 1 )
-            {
-            /* Note - if we get a disk error, we simply enqueued an event
-               and incremented (hopefully momentarily) the disk_in_use value */
-            if( disk_state[event_type - DISK_INTERRUPT+1].disk_in_use == FALSE )
-                {
-                printf( "False interrupt - the Z502 got an interrupt from a\n");
-                printf( "DISK - but that disk wasn't in use.\n" );
-                z502_internal_panic( ERR_Z502_INTERNAL_BUG );
-            }
-
-            //  NOTE:  Here when we take a disk interrupt, we clear the busy of ALL
-            //  disks because we assume that the user will handle all of them with
-            //  the interrupt that's about to be done.
-            for ( index = DISK_INTERRUPT; index <= DISK_INTERRUPT + MAX_NUMBER_OF_DISKS - 1; index++ )
-            {
-                if ( STAT_VECTOR[SV_ACTIVE][ index ] != 0 )
-                {
-			// Bugfix 08/2012 - disk_state contains MAX_NUMBER_OF_DISKS elements
-			// We were spraying some unknown memory locations
-                    disk_state[index - DISK_INTERRUPT].disk_in_use = FALSE;
-                    // printf("3. Setting %d FALSE\n", index );
-                }
-            }
-            //  We MAYBE should be clearing all these as well - and not just the current one.
-
-            disk_state[event_type - DISK_INTERRUPT+1].disk_in_use   = FALSE;
-            // printf("3. Setting %d FALSE\n", event_type );
-            disk_state[event_type - DISK_INTERRUPT+1].event_ptr   = NULL;
-        }
-        if ( event_type == TIMER_INTERRUPT && event_error == ERR_SUCCESS )
-            {
-            if( timer_state.timer_in_use <= 0 )
-                {
-                printf( "False interrupt - the Z502 got an interrupt from a\n");
-                printf( "TIMER - but that timer wasn't in use.\n" );
-                z502_internal_panic( ERR_Z502_INTERNAL_BUG );
-            }
-            timer_state.timer_in_use--;
-            timer_state.event_ptr           = NULL;
-        }
-
-        /*  NOTE: The hardware clears these in main, but not after that     */
-        STAT_VECTOR[SV_ACTIVE][ event_type ] = 1;
-        STAT_VECTOR[SV_VALUE][ event_type ]  = event_error;
-
-        if ( DO_DEVICE_DEBUG )
-        {
-            printf( "------ BEGIN DO_DEVICE DEBUG - CALLING INTERRUPT HANDLER --------- \n");
-            printf( "The time is now = %d: Handling event that was scheduled to happen at = %d\n",
-                            current_simulation_time, time_of_event );
-            printf( "The hardware is now about to enter your interrupt_handler in base.c\n");
-            printf( "-------- END DO_DEVICE DEBUG - ---------------------- \n");
-        }
-
-        /*  If we've come here from Z502_IDLE, then the current time may be 
-            less than the event time. Then we must increase the 
-            current_simulation_time to match the time given by the event.  */
-/*
-        if ( ( INT32 )current_simulation_time < time_of_event )
-            current_simulation_time              = time_of_event;
-*/
-        if ( Z502_CURRENT_CONTEXT->structure_id != CONTEXT_STRUCTURE_ID )
+        if ( hardware_take_event( ) == FALSE )
         {
-            printf( "Z502_REG_CURRENT_CONTEXT is invalid in hard_interrupt\n");
-            printf( "Something in the OS has destroyed this location.\n");
-            z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+            ReleaseLock( HardwareLock, "hardware_interrupt-2" );
+            continue;
         }
+        NumberOfInterruptsStarted++;
         ReleaseLock( HardwareLock, "hardware_interrupt-2" );
 
         interrupt_handler = (void (*)(void))TO_VECTOR[TO_VECTOR_INT_HANDLER_ADDR];
@@ -1584,6 +3124,668 @@ void    hardware_interrupt( void  )
         NumberOfInterruptsCompleted++;
     }                            /* End of while TRUE           */
 }                               /* End of hardware_interrupt   */
+
+
+    /*****************************************************************
+
+        hardware_take_event()
+
+            Take the event that's due off the queue and make it
+            visible to the interrupt handler.  The caller holds the
+            HardwareLock.  Actions include:
+                o Get the next event.
+                o If it's a device, show that the device is no longer
+                  busy, and start any disk request that was waiting.
+                  A DMA request hands its frame to the interrupt.
+                  A periodic timer channel asks for its next tick,
+                  skipping any that have already gone by.
+                o Record or check the delivery - see log_interrupt().
+                o Put it on the completion ring if the OS gave us one;
+                  see completion_post().
+                o Otherwise set up registers which user interrupt
+                  handler will see.
+
+            Returns TRUE if the interrupt handler should be called.
+    *****************************************************************/
+
+BOOL    hardware_take_event( void )
+    {
+    INT32       time_of_event;
+    INT32       index;
+    INT16       event_type;
+    INT16       event_error;
+    INT32       event_tag;
+    INT32       event_frame = -1;
+    INT32       local_error;
+    EVENT       *event_ptr;
+
+    get_next_ordered_event(&time_of_event, &event_type, 
+                           &event_error, &event_tag, &local_error);
+    if ( local_error != 0 )
+    {
+        printf( "In hardware_take_event we expected to find an event\n");
+        printf( "Something in the OS has destroyed this location.\n");
+        z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+    }
+
+    /*  A disk error was reported without the request ever reaching
+        the disk, so only a successful completion frees the head.
+        Once it's free, start the next request waiting on it.       */
+
+    if (   event_type >= DISK_INTERRUPT 
+        && event_type <= DISK_INTERRUPT + MAX_NUMBER_OF_DISKS - 1 
+        && event_error == ERR_SUCCESS )
+        {
+        index = event_type - DISK_INTERRUPT + 1;
+        if( disk_state[index].disk_in_use == FALSE )
+            {
+            printf( "False interrupt - the Z502 got an interrupt from a\n");
+            printf( "DISK - but that disk wasn't in use.\n" );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+        event_frame                     = disk_state[index].frame;
+        disk_state[index].disk_in_use   = FALSE;
+        disk_state[index].event_ptr     = NULL;
+        disk_state[index].frame         = -1;
+        disk_start_next_request( (INT16)index );
+    }
+    for ( index = 0; index < NUMBER_OF_TIMER_CHANNELS; index++ )
+        if ( event_type == TIMER_CHANNEL_INTERRUPT( index ) )
+            break;
+    if ( index < NUMBER_OF_TIMER_CHANNELS && event_error == ERR_SUCCESS )
+        {
+        if( timer_state[index].timer_in_use <= 0 )
+            {
+            printf( "False interrupt - the Z502 got an interrupt from a\n");
+            printf( "TIMER - but that timer wasn't in use.\n" );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+        timer_state[index].timer_in_use--;
+        timer_state[index].event_ptr    = NULL;
+        if ( timer_state[index].period > 0 )
+            {
+            do
+                time_of_event += timer_state[index].period;
+            while ( time_of_event <= (INT32)current_simulation_time );
+            add_event( time_of_event, event_type, (INT16)ERR_SUCCESS, -1,
+                       &timer_state[index].event_ptr );
+            timer_state[index].timer_in_use++;
+        }
+        pmu_count( PMU_TIMER_INTERRUPTS, 1 );
+    }
+
+    log_interrupt( event_type, event_error );
+
+    if ( event_type == COMPLETION_INTERRUPT )
+        {
+        completion_flush_pending = FALSE;
+        if ( completion_waiting == 0 )
+            return( FALSE );
+        completion_waiting = 0;
+        return( TRUE );
+    }
+    if (   completion_ring != NULL
+        && completion_post( event_type, event_error,
+                            event_tag, event_frame ) == TRUE )
+        {
+        if ( completion_waiting < completion_threshold
+             && completion_delay > 0 )
+            {
+            if ( completion_flush_pending == FALSE )
+                {
+                add_event( current_simulation_time + completion_delay,
+                           COMPLETION_INTERRUPT, 0, -1, &event_ptr );
+                completion_flush_pending = TRUE;
+            }
+            return( FALSE );
+        }
+        completion_waiting = 0;
+        return( TRUE );
+    }
+
+    /*  NOTE: The hardware clears these in main, but not after that     */
+    STAT_VECTOR[SV_ACTIVE][ event_type ] = 1;
+    STAT_VECTOR[SV_VALUE][ event_type ]  = event_error;
+    interrupt_tag[ event_type ]          = event_tag;
+    interrupt_frame[ event_type ]        = event_frame;
+
+    if ( DO_DEVICE_DEBUG )
+    {
+        printf( "------ BEGIN DO_DEVICE DEBUG - CALLING INTERRUPT HANDLER --------- \n");
+        printf( "The time is now = %d: Handling event that was scheduled to happen at = %d\n",
+                        current_simulation_time, time_of_event );
+        printf( "The hardware is now about to enter your interrupt_handler in base.c\n");
+        printf( "-------- END DO_DEVICE DEBUG - ---------------------- \n");
+    }
+
+    /*  If we've come here from Z502_IDLE, then the current time may be 
+        less than the event time. Then we must increase the 
+        current_simulation_time to match the time given by the event.  */
+/*
+    if ( ( INT32 )current_simulation_time < time_of_event )
+        current_simulation_time              = time_of_event;
+*/
+    if ( Z502_CURRENT_CONTEXT->structure_id != CONTEXT_STRUCTURE_ID )
+    {
+        printf( "Z502_REG_CURRENT_CONTEXT is invalid in hard_interrupt\n");
+        printf( "Something in the OS has destroyed this location.\n");
+        z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+    }
+    return( TRUE );
+}                               /* End of hardware_take_event  */
+
+
+    /*****************************************************************
+
+        completion_post()
+
+            Put a completion on the OS's ring, stamped with the time.
+            The ring is in the OS's memory, but the OS only moves
+            head, and only from its interrupt handler, which never runs
+            alongside the hardware taking an event.  Returns FALSE if
+            the ring is full; the OS is told by overflowed, and the
+            completion goes to the interrupt registers instead.
+    *****************************************************************/
+
+BOOL    completion_post( INT16 device, INT16 status, INT32 tag, INT32 frame )
+    {
+    COMPLETION  *record;
+    INT32       next;
+
+    next = ( completion_ring->tail + 1 ) % COMPLETION_RING_SIZE;
+    if ( next == completion_ring->head )
+        {
+        completion_ring->overflowed = TRUE;
+        return( FALSE );
+    }
+    record          = &completion_ring->record[ completion_ring->tail ];
+    record->device  = device;
+    record->status  = status;
+    record->tag     = tag;
+    record->frame   = frame;
+    record->time    = (INT32)current_simulation_time;
+    completion_ring->tail = next;
+    completion_waiting++;
+    return( TRUE );
+}                               /* End of completion_post      */
+
+
+    /*****************************************************************
+
+        single_thread_interrupt()
+
+            With --single-thread there is no interrupt thread.  Instead
+            charge_time_and_check_events() and Z502_IDLE() call here
+            when an event is due, and the interrupt handler is run
+            right here on the base thread.  Actions include:
+                o Don't interrupt the interrupt handler.
+                o Don't interrupt code that holds the HardwareLock or
+                  one of the OS's READ_MODIFY locks - the handler would
+                  walk straight through them.  The event stays on the
+                  queue and is taken at a later check.  Under --replay
+                  a recorded event is still taken at its point, just
+                  as the interrupt thread took it and then waited in
+                  the handler for the lock; the handler is run once
+                  the OS lets go.
+                o While events are due, take one and call the handler
+                  (unless it went on the completion ring to wait).
+                  With --replay, an event that's due also waits for the
+                  point at which the recording delivered it, and at
+                  that point the recorded one goes whether it's due
+                  or not - see replay_force_event().
+                o With several processors, an inter-processor
+                  interrupt for this processor is taken the same way.
+
+            The handler may do CALLs of its own, so BaseThread()
+            answers FALSE until it returns, and whatever POP_THE_STACK
+            was when we were called is put back afterwards.
+    *****************************************************************/
+
+void    single_thread_interrupt( void )
+    {
+    INT32       time_of_event;
+    BOOL        pop_the_stack;
+    Z502_CPU    *cpu = &cpu_state[CurrentCpu];
+    void        (*interrupt_handler)( void );
+
+    if ( InlineInterrupt == TRUE )
+        return;
+    if (   InterlocksHeld > 0
+        && ( replay_log == NULL || replay_handler_pending == TRUE ) )
+        return;
+    if ( GetTryLock( HardwareLock ) == FALSE )
+        return;
+    if ( InterlocksHeld > 0 )
+        {
+        replay_force_event( );
+        if ( replay_event != NULL && hardware_take_event( ) == TRUE )
+            replay_handler_pending = TRUE;
+        ReleaseLock( HardwareLock, "single_thread_interrupt" );
+        return;
+    }
+    InlineInterrupt = TRUE;
+    pop_the_stack   = POP_THE_STACK;
+    replay_force_event( );
+    get_next_event_time( &time_of_event );
+    while (   ( time_of_event >= 0 && time_of_event <= (INT32)current_simulation_time
+                && replay_point_reached() )
+           || replay_event != NULL || replay_handler_pending == TRUE
+           || cpu->ipi_pending == TRUE )
+        {
+        if ( replay_handler_pending == TRUE )
+            replay_handler_pending = FALSE;
+        else if (   replay_event != NULL
+                 || (   time_of_event >= 0
+                     && time_of_event <= (INT32)current_simulation_time ) )
+            {
+            if ( hardware_take_event( ) == FALSE )
+                {
+                replay_force_event( );
+                get_next_event_time( &time_of_event );
+                continue;
+            }
+        }
+        else
+            {
+            cpu->ipi_pending = FALSE;
+            cpu->ipis++;
+            STAT_VECTOR[SV_ACTIVE][ INTER_PROCESSOR_INTERRUPT ] = 1;
+            STAT_VECTOR[SV_VALUE][ INTER_PROCESSOR_INTERRUPT ]  = (INT16)cpu->ipi_sender;
+            interrupt_tag[ INTER_PROCESSOR_INTERRUPT ]          = -1;
+            interrupt_frame[ INTER_PROCESSOR_INTERRUPT ]        = -1;
+        }
+        NumberOfInterruptsStarted++;
+        cpu->interrupted = TRUE;
+        ReleaseLock( HardwareLock, "single_thread_interrupt" );
+
+        interrupt_handler = (void (*)(void))TO_VECTOR[TO_VECTOR_INT_HANDLER_ADDR];
+        (*interrupt_handler)();
+
+        GetLock( HardwareLock, "single_thread_interrupt" );
+        if ( Z502_CURRENT_CONTEXT->structure_id != CONTEXT_STRUCTURE_ID )
+            {
+            printf( "Z502_REG_CURRENT_CONTEXT is invalid in single_thread_interrupt\n");
+            printf( "Something in the OS has destroyed this location.\n");
+            z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+        }
+        NumberOfInterruptsCompleted++;
+        replay_force_event( );
+        get_next_event_time( &time_of_event );
+    }
+    POP_THE_STACK   = pop_the_stack;
+    InlineInterrupt = FALSE;
+    ReleaseLock( HardwareLock, "single_thread_interrupt" );
+}                               /* End of single_thread_interrupt */
+
+
+    /*****************************************************************
+
+        at_interrupt_level()
+
+            TRUE while the OS's interrupt handler is running, either
+            on the interrupt thread or inline on the base thread.  The
+            handler may touch privileged hardware whatever mode the
+            interrupted code was in.
+    *****************************************************************/
+
+BOOL    at_interrupt_level( void )
+    {
+    if ( InlineInterrupt == TRUE || InterruptTid == GetMyTid() )
+        return( TRUE );
+    return( FALSE );
+}                               /* End of at_interrupt_level    */
+
+
+    /*****************************************************************
+
+        cpu_save()
+        cpu_load()
+
+            With --cpus=N, the processor that's running keeps its
+            registers and its clock in the usual globals.  These move
+            them in and out of its Z502_CPU when another processor
+            takes over.
+    *****************************************************************/
+
+void    cpu_save( INT32 which )
+    {
+    Z502_CPU    *cpu = &cpu_state[which];
+
+    cpu->clock              = current_simulation_time;
+    cpu->interlocks_held    = InterlocksHeld;
+    cpu->current_context    = Z502_CURRENT_CONTEXT;
+    cpu->page_tbl_addr      = Z502_PAGE_TBL_ADDR;
+    cpu->page_tbl_length    = Z502_PAGE_TBL_LENGTH;
+    cpu->program_counter    = Z502_PROGRAM_COUNTER;
+    cpu->mode               = Z502_MODE;
+    cpu->call_type          = SYS_CALL_CALL_TYPE;
+    cpu->arg1               = Z502_ARG1;
+    cpu->arg2               = Z502_ARG2;
+    cpu->arg3               = Z502_ARG3;
+    cpu->arg4               = Z502_ARG4;
+    cpu->arg5               = Z502_ARG5;
+    cpu->arg6               = Z502_ARG6;
+    cpu->reg1               = Z502_REG_1;
+    cpu->reg2               = Z502_REG_2;
+    cpu->reg3               = Z502_REG_3;
+    cpu->reg4               = Z502_REG_4;
+    cpu->reg5               = Z502_REG_5;
+    cpu->reg6               = Z502_REG_6;
+    cpu->reg7               = Z502_REG_7;
+    cpu->reg8               = Z502_REG_8;
+    cpu->reg9               = Z502_REG_9;
+    cpu->pop_the_stack      = POP_THE_STACK;
+    cpu->kill_or_save       = z502_machine_kill_or_save;
+    cpu->next_context_ptr   = z502_machine_next_context_ptr;
+}                               /* End of cpu_save              */
+
+void    cpu_load( INT32 which )
+    {
+    Z502_CPU    *cpu = &cpu_state[which];
+
+    current_simulation_time         = cpu->clock;
+    InterlocksHeld                  = cpu->interlocks_held;
+    Z502_CURRENT_CONTEXT            = cpu->current_context;
+    if ( Z502_CURRENT_CONTEXT != NULL && Z502_CURRENT_CONTEXT->asid == 0 )
+        tlb_invalidate( 0, -1 );
+    Z502_PAGE_TBL_ADDR              = cpu->page_tbl_addr;
+    Z502_PAGE_TBL_LENGTH            = cpu->page_tbl_length;
+    Z502_PROGRAM_COUNTER            = cpu->program_counter;
+    Z502_MODE                       = cpu->mode;
+    SYS_CALL_CALL_TYPE              = cpu->call_type;
+    Z502_ARG1                       = cpu->arg1;
+    Z502_ARG2                       = cpu->arg2;
+    Z502_ARG3                       = cpu->arg3;
+    Z502_ARG4                       = cpu->arg4;
+    Z502_ARG5                       = cpu->arg5;
+    Z502_ARG6                       = cpu->arg6;
+    Z502_REG_1                      = cpu->reg1;
+    Z502_REG_2                      = cpu->reg2;
+    Z502_REG_3                      = cpu->reg3;
+    Z502_REG_4                      = cpu->reg4;
+    Z502_REG_5                      = cpu->reg5;
+    Z502_REG_6                      = cpu->reg6;
+    Z502_REG_7                      = cpu->reg7;
+    Z502_REG_8                      = cpu->reg8;
+    Z502_REG_9                      = cpu->reg9;
+    POP_THE_STACK                   = cpu->pop_the_stack;
+    z502_machine_kill_or_save       = cpu->kill_or_save;
+    z502_machine_next_context_ptr   = cpu->next_context_ptr;
+}                               /* End of cpu_load              */
+
+
+    /*****************************************************************
+
+        cpu_pick()
+
+            Choose the processor that should run: the one whose clock
+            is furthest behind.  A halted processor counts from the
+            time it is due to wake; one waiting for an inter-processor
+            interrupt, or never started, can't be chosen.  Ties go to
+            the processor that's running, then round the others in
+            order.  Returns -1 if there's no one, and the chosen
+            processor's time in *time_returned.
+    *****************************************************************/
+
+INT32   cpu_pick( BOOL others_only, INT32 *time_returned )
+    {
+    INT32       i, which, time, best, best_time;
+    Z502_CPU    *cpu;
+
+    best      = -1;
+    best_time = 0;
+    for ( i = 0; i < NumberOfCpus; i++ )
+        {
+        which = ( CurrentCpu + i ) % NumberOfCpus;
+        cpu   = &cpu_state[which];
+        if ( which == CurrentCpu && others_only == TRUE )
+            continue;
+        if (   cpu->state == CPU_PARKED
+            || ( cpu->state == CPU_HALTED && cpu->wake_time < 0 ) )
+            continue;
+        time = ( which == CurrentCpu ) ? (INT32)current_simulation_time
+                                       : (INT32)cpu->clock;
+        if ( cpu->state == CPU_HALTED && cpu->wake_time > time )
+            time = cpu->wake_time;
+        if ( best < 0 || time < best_time )
+            {
+            best      = which;
+            best_time = time;
+        }
+    }
+    *time_returned = best_time;
+    return( best );
+}                               /* End of cpu_pick              */
+
+
+    /*****************************************************************
+
+        cpu_switch()
+
+            Hand the machine to another processor.  Actions include:
+                o Put this processor's registers away and make the
+                  other one's live.
+                o Wake the other processor's host thread, and wait
+                  until some processor hands the machine back to us.
+    *****************************************************************/
+
+void    cpu_switch( INT32 next )
+    {
+    INT32       me = CurrentCpu;
+
+    cpu_save( me );
+    cpu_load( next );
+    cpu_state[next].handoffs++;
+    GetLock( CpuLock, "cpu_switch" );
+    CurrentCpu = next;
+    SignalCondition( cpu_state[next].condition, "cpu_switch" );
+    while ( CurrentCpu != me )
+        WaitForCondition( cpu_state[me].condition, CpuLock, 0 );
+    ReleaseLock( CpuLock, "cpu_switch" );
+    BaseTid = GetMyTid();
+}                               /* End of cpu_switch            */
+
+
+    /*****************************************************************
+
+        cpu_yield()
+
+            Called between instructions.  If another processor has
+            fallen CPU_QUANTUM behind this one, let it catch up.  Only
+            user code is ever put aside like this - the OS keeps the
+            processor until it goes back to user code or idles - and
+            never while a lock is held.
+    *****************************************************************/
+
+void    cpu_yield( void )
+    {
+    INT32       next, next_time;
+
+    if (   Z502_MODE != USER_MODE || InlineInterrupt == TRUE
+        || InterlocksHeld > 0 )
+        return;
+    next = cpu_pick( FALSE, &next_time );
+    if (   next < 0 || next == CurrentCpu
+        || next_time + CPU_QUANTUM > (INT32)current_simulation_time )
+        return;
+    if ( GetTryLock( HardwareLock ) == FALSE )
+        return;
+    ReleaseLock( HardwareLock, "cpu_yield" );
+    cpu_switch( next );
+}                               /* End of cpu_yield             */
+
+
+    /*****************************************************************
+
+        cpu_halt()
+
+            Z502_IDLE with several processors.  Actions include:
+                o If an interrupt was taken since this processor last
+                  halted, return at once - the OS may have looked for
+                  work before the handler ran, and would never see
+                  what the handler left for it.
+                o If an interrupt is already due, return at once.
+                o Halt this processor until the next event, or with
+                  nothing on the event queue, until another processor
+                  interrupts it.
+                o Hand the machine to whichever processor is now
+                  furthest behind - perhaps this one, if the next
+                  event comes before any other processor's time.
+                o If every processor is halted with nothing to wake
+                  it, print a message and halt the machine.
+                o Once woken, move the clock up to the wake time.
+    *****************************************************************/
+
+void    cpu_halt( void )
+    {
+    Z502_CPU    *cpu = &cpu_state[CurrentCpu];
+    INT32       time_of_next_event;
+    INT32       next, next_time;
+
+    if ( cpu->interrupted == TRUE )
+        {
+        cpu->interrupted = FALSE;
+        return;
+    }
+    get_next_event_time( &time_of_next_event );
+    if (   cpu->ipi_pending == TRUE
+        || (   time_of_next_event >= 0
+            && time_of_next_event <= (INT32)current_simulation_time ) )
+        return;
+    cpu->state      = CPU_HALTED;
+    cpu->wake_time  = time_of_next_event;
+    next = cpu_pick( FALSE, &next_time );
+    if ( next < 0 )
+        {
+        printf( "ERROR in Z502_IDLE.  Every processor is idle and there\n" );
+        printf( "is no event that will cause an interrupt.\n" );
+        z502_internal_panic( ERR_OS502_GENERATED_BUG );
+    }
+    if ( next != CurrentCpu )
+        cpu_switch( next );
+    cpu->state      = CPU_RUNNING;
+    if ( cpu->wake_time > (INT32)current_simulation_time )
+        {
+        pmu_count( PMU_IDLE_TICKS,
+                   cpu->wake_time - (INT32)current_simulation_time );
+        cpu->idle_ticks += cpu->wake_time - (INT32)current_simulation_time;
+        current_simulation_time = cpu->wake_time;
+    }
+}                               /* End of cpu_halt              */
+
+
+    /*****************************************************************
+
+        cpu_start()
+
+            Start a processor that has never run on the context given.
+            It starts in kernel mode at the time of the processor that
+            started it, and its host thread picks up the context the
+            first time the machine is handed to it.
+    *****************************************************************/
+
+void    cpu_start( INT32 which, Z502CONTEXT *context )
+    {
+    Z502_CPU    *cpu;
+
+    if (   which < 0 || which >= NumberOfCpus
+        || cpu_state[which].state != CPU_PARKED
+        || context == NULL || context->structure_id != CONTEXT_STRUCTURE_ID )
+    {
+        if ( DO_DEVICE_DEBUG )
+        {
+            printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502ProcessorStart ----------- \n");
+            printf( "ERROR:  Select a processor that hasn't been started, and\n");
+            printf( "        give it a context to start on.\n");
+            printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+        }
+        return;
+    }
+    cpu = &cpu_state[which];
+    cpu->state              = CPU_RUNNING;
+    cpu->clock              = current_simulation_time;
+    cpu->start_time         = current_simulation_time;
+    cpu->mode               = KERNEL_MODE;
+    cpu->call_type          = -1;
+    cpu->current_context    = NULL;
+    cpu->next_context_ptr   = context;
+    cpu->kill_or_save       = SWITCH_CONTEXT_SAVE_MODE;
+    cpu->pop_the_stack      = TRUE;
+}                               /* End of cpu_start             */
+
+
+    /*****************************************************************
+
+        cpu_interrupt()
+
+            Raise INTER_PROCESSOR_INTERRUPT on a processor; the status
+            it sees is the number of the processor that sent it.  A
+            halted processor wakes at the sender's time.
+    *****************************************************************/
+
+void    cpu_interrupt( INT32 which )
+    {
+    Z502_CPU    *cpu;
+
+    if ( which < 0 || which >= NumberOfCpus )
+    {
+        if ( DO_DEVICE_DEBUG )
+        {
+            printf( "------ BEGIN DO_DEVICE DEBUG - IN Z502ProcessorInterrupt ------- \n");
+            printf( "ERROR:  There is no processor %d\n", which );
+            printf( "-------- END DO_DEVICE DEBUG - ----------------------------------\n");
+        }
+        return;
+    }
+    cpu = &cpu_state[which];
+    cpu->ipi_pending    = TRUE;
+    cpu->ipi_sender     = CurrentCpu;
+    if (   cpu->state == CPU_HALTED
+        && (   cpu->wake_time < 0
+            || cpu->wake_time > (INT32)current_simulation_time ) )
+        cpu->wake_time  = current_simulation_time;
+}                               /* End of cpu_interrupt         */
+
+
+    /*****************************************************************
+
+        cpu_thread()
+
+            The host thread of each processor after the first.  It
+            waits until the machine is first handed to it, and from
+            then on runs the base level loop like the first one does.
+    *****************************************************************/
+
+void    cpu_thread( INT32 *which )
+    {
+    GetLock( CpuLock, "cpu_thread" );
+    while ( CurrentCpu != *which )
+        WaitForCondition( cpu_state[*which].condition, CpuLock, 0 );
+    ReleaseLock( CpuLock, "cpu_thread" );
+    BaseTid = GetMyTid();
+    base_level( );
+}                               /* End of cpu_thread            */
+
+
+    /*****************************************************************
+
+        machine_time()
+
+            The time on the machine as a whole: the latest clock of
+            any processor that has been started.
+    *****************************************************************/
+
+UINT32  machine_time( void )
+    {
+    UINT32      time = current_simulation_time;
+    INT32       i;
+
+    for ( i = 0; i < NumberOfCpus; i++ )
+        if (   i != CurrentCpu && cpu_state[i].state != CPU_PARKED
+            && cpu_state[i].clock > time )
+            time = cpu_state[i].clock;
+    return( time );
+}                               /* End of machine_time          */
 
 
     /*****************************************************************
@@ -1608,6 +3810,9 @@ void    hardware_fault( INT16 fault_type, INT16 argument )
     STAT_VECTOR[SV_VALUE][ fault_type ]  = (INT16)argument;
     Z502_MODE = KERNEL_MODE;
     hardware_stats.number_faults++;
+    Z502_CURRENT_CONTEXT->faults++;
+    if ( fault_type == INVALID_MEMORY )
+        pmu_count( PMU_PAGE_FAULTS, 1 );
     fault_handler = 
               ( void (*)(void))TO_VECTOR[TO_VECTOR_FAULT_HANDLER_ADDR];
 
@@ -1646,6 +3851,7 @@ void    software_trap( void )
     // INT32       time_of_next_event;
 
     Z502_MODE = KERNEL_MODE;
+    Z502_CURRENT_CONTEXT->traps++;
     charge_time_and_check_events( COST_OF_SOFTWARE_TRAP );
     /*
     current_simulation_time += COST_OF_SOFTWARE_TRAP;
@@ -1693,51 +3899,224 @@ void    z502_internal_panic( INT32 panic_type )
 
     /*****************************************************************
 
-        add_event()
+        Slabs
 
-            This is the routine that will add an event to the queue.
-            Actions include:
-                o Do lots of sanity checks.
-                o Allocate a structure for the event.
-                o Fill in the structure.
-                o Enqueue it.
-            Store data in ring buffer for possible debugging.
+            slab_alloc()  - take an object, zeroed, from the slab's
+                            free list, adding a slab of objects
+                            first if the list is empty.
+            slab_free()   - poison the object's structure_id and put
+                            it back on the free list.
 
+            A slab is only ever touched under the lock that guards
+            the objects in it: EventLock for events, the HardwareLock
+            for sector chunks and contexts.
     *****************************************************************/
 
-void    add_event( INT32   time_of_event, 
-                   INT16   event_type, 
-                   INT16   event_error, 
-                   EVENT **returned_event_ptr ) 
+void    *slab_alloc( SLAB *slab )
     {
-    EVENT       *ep;
-    EVENT       *temp_ptr;
-    EVENT       *last_ptr;
-    INT16       erbi;        /* Short for event_ring_buffer_index    */
+    char        *block;
+    void        **free_list;
+    INT32       index;
 
-    if ( time_of_event < ( INT32 )current_simulation_time )     {
-        printf( "time_of_event < current_sim.._time in add_event\n" );
-        printf( "time_of_event = %d,  current_simulation_time = %d\n",
-                             time_of_event, current_simulation_time );
-        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
-    }
-    if (   event_type < 0 || event_type > LARGEST_STAT_VECTOR_INDEX )     {
-        printf( "Illegal event_type= %d  in add_event.\n", event_type );
-        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
-    }
-    ep = ( EVENT *)malloc ( sizeof( EVENT ) );
-    if ( ep == NULL )     {
-        printf( "We didn't complete the malloc in add_event.\n" );
-        z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+    if ( slab->free_count == 0 )
+        {
+        block     = (char *)calloc( slab->objects_per_slab, slab->object_size );
+        free_list = (void **)realloc( slab->free_list,
+                        ( slab->slabs + 1 ) * slab->objects_per_slab 
+                                                   * sizeof( void * ) );
+        if ( block == NULL || free_list == NULL )
+            {
+            printf( "We didn't complete the malloc of a slab of %s.\n",
+                    slab->name );
+            z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+        }
+        slab->free_list = free_list;
+        slab->slabs++;
+        for ( index = slab->objects_per_slab - 1; index >= 0; index-- )
+            slab->free_list[slab->free_count++] 
+                                    = block + index * slab->object_size;
     }
-    GetLock( EventLock, "add_event" );
+    block = (char *)slab->free_list[--slab->free_count];
+    memset( block, 0, slab->object_size );
+    slab->in_use++;
+    if ( slab->in_use > slab->high_water )
+        slab->high_water = slab->in_use;
+    return( block );
+}                                       /* End of slab_alloc        */
+
+void    slab_free( SLAB *slab, void *object )
+    {
+    *(unsigned char *)object = 0;       /* structure_id - make sure this 
+                                           isn't mistaken             */
+    slab->free_list[slab->free_count++] = object;
+    slab->in_use--;
+}                                       /* End of slab_free         */
+
+void    print_slab_stats( SLAB *slab )
+    {
+    if ( slab->slabs == 0 )
+        return;
+    printf( "%-13s: In Use = %5d:  High Water = %5d:  Slabs = %3d (%d bytes)\n",
+            slab->name, slab->in_use, slab->high_water, slab->slabs,
+            (INT32)( slab->slabs * slab->objects_per_slab * slab->object_size ) );
+}                                       /* End of print_slab_stats  */
+
+
+    /*****************************************************************
+
+        Event Heap
+
+            Pending events live in an indexed binary min-heap ordered
+            on time_of_event.  Events with the same time are ordered
+            by their sequence number, so they come out in the order
+            they were added - just as the old sorted list did.  Every
+            EVENT remembers its own slot in the heap, which lets
+            dequeue_item() remove it without a search.
+
+            EVENT structures come from event_slab and are recycled
+            rather than freed, so the interrupt path doesn't go
+            through malloc.  The heap itself grows in step.
+
+            All of these routines expect the caller to hold EventLock.
+
+    *****************************************************************/
+
+#define EVENT_PRECEDES( a, b )                                          \
+        ( (a)->time_of_event < (b)->time_of_event                       \
+          || ( (a)->time_of_event == (b)->time_of_event                 \
+               && (INT32)( (a)->sequence - (b)->sequence ) < 0 ) )
+
+EVENT   *alloc_event( void )
+    {
+    EVENT       **new_heap;
+
+    if ( event_heap_count == event_heap_size )
+        {
+        new_heap = (EVENT **)realloc( event_heap, 
+                     ( event_heap_size + EVENTS_PER_SLAB ) 
+                                                   * sizeof( EVENT * ) );
+        if ( new_heap == NULL )
+            {
+            printf( "We didn't complete the malloc in alloc_event.\n" );
+            z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+        }
+        event_heap       = new_heap;
+        event_heap_size += EVENTS_PER_SLAB;
+    }
+    return( (EVENT *)slab_alloc( &event_slab ) );
+}                                       /* End of alloc_event       */
+
+void    free_event( EVENT *ep )
+    {
+    ep->heap_index       = -1;
+    slab_free( &event_slab, ep );
+}                                       /* End of free_event        */
+
+void    event_heap_sift_up( INT32 index )
+    {
+    EVENT       *ep = event_heap[index];
+    INT32       parent;
+
+    while ( index > 0 )
+        {
+        parent = ( index - 1 ) / 2;
+        if ( ! EVENT_PRECEDES( ep, event_heap[parent] ) )
+            break;
+        event_heap[index]             = event_heap[parent];
+        event_heap[index]->heap_index = index;
+        index                         = parent;
+    }
+    event_heap[index] = ep;
+    ep->heap_index    = index;
+}                                       /* End of event_heap_sift_up   */
+
+void    event_heap_sift_down( INT32 index )
+    {
+    EVENT       *ep = event_heap[index];
+    INT32       child;
+
+    while ( ( child = 2 * index + 1 ) < event_heap_count )
+        {
+        if (   child + 1 < event_heap_count 
+            && EVENT_PRECEDES( event_heap[child + 1], event_heap[child] ) )
+            child++;
+        if ( ! EVENT_PRECEDES( event_heap[child], ep ) )
+            break;
+        event_heap[index]             = event_heap[child];
+        event_heap[index]->heap_index = index;
+        index                         = child;
+    }
+    event_heap[index] = ep;
+    ep->heap_index    = index;
+}                                       /* End of event_heap_sift_down */
+
+    /*  Take the event in slot "index" off the heap and fill the hole
+        with the last event, moving that one whichever way it needs.   */
+
+void    event_heap_remove( INT32 index )
+    {
+    EVENT       *ep = event_heap[index];
+
+    event_heap_count--;
+    if ( index != event_heap_count )
+        {
+        event_heap[index]             = event_heap[event_heap_count];
+        event_heap[index]->heap_index = index;
+        if ( index > 0 
+             && EVENT_PRECEDES( event_heap[index], 
+                                event_heap[( index - 1 ) / 2] ) )
+            event_heap_sift_up( index );
+        else
+            event_heap_sift_down( index );
+    }
+    event_heap[event_heap_count] = NULL;
+    ep->heap_index               = -1;
+}                                       /* End of event_heap_remove    */
+
+
+    /*****************************************************************
+
+        add_event()
+
+            This is the routine that will add an event to the queue.
+            Actions include:
+                o Do lots of sanity checks.
+                o Take a structure for the event from the pool.
+                o Fill in the structure.
+                o Put it on the event heap.
+            Store data in ring buffer for possible debugging.
+
+    *****************************************************************/
+
+void    add_event( INT32   time_of_event, 
+                   INT16   event_type, 
+                   INT16   event_error, 
+                   INT32   event_tag,
+                   EVENT **returned_event_ptr ) 
+    {
+    EVENT       *ep;
+    INT16       erbi;        /* Short for event_ring_buffer_index    */
+
+    if ( time_of_event < ( INT32 )current_simulation_time )     {
+        printf( "time_of_event < current_sim.._time in add_event\n" );
+        printf( "time_of_event = %d,  current_simulation_time = %d\n",
+                             time_of_event, current_simulation_time );
+        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+    }
+    if (   event_type < 0 || event_type > LARGEST_STAT_VECTOR_INDEX )     {
+        printf( "Illegal event_type= %d  in add_event.\n", event_type );
+        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+    }
+    GetLock( EventLock, "add_event" );
+    ep = alloc_event( );
 
-    ep->queue                = (INT32 *)NULL;
     ep->time_of_event        = time_of_event;
+    ep->sequence             = event_sequence++;
     ep->ring_buffer_location = event_ring_buffer_index;
     ep->structure_id         = EVENT_STRUCTURE_ID;
     ep->event_type           = event_type;
     ep->event_error          = event_error;
+    ep->event_tag            = event_tag;
     *returned_event_ptr      = ep; 
 
     
@@ -1749,30 +4128,17 @@ void    add_event( INT32   time_of_event,
     event_ring_buffer[erbi].event_error                 = event_error;
     event_ring_buffer_index  = (++erbi) % EVENT_RING_BUFFER_SIZE;
     
-    temp_ptr                = &event_queue;     /* The header queue  */
-    temp_ptr->time_of_event = -1;
-    last_ptr                = temp_ptr;
+    event_heap[event_heap_count] = ep;
+    event_heap_count++;
+    event_heap_sift_up( event_heap_count - 1 );
+    publish_next_event_time( );
 
-    while(1)
-        {
-        if ( temp_ptr->time_of_event > time_of_event ) /* we're past */
-            {
-            ep->queue           = last_ptr->queue;
-            last_ptr->queue     = (INT32 *)ep;
-            break;
-        }
-        if ( temp_ptr->queue == NULL )
-            {
-            temp_ptr->queue = (INT32 *)ep;
-            break;
-        }
-        last_ptr        = temp_ptr;
-        temp_ptr        = ( EVENT *)temp_ptr->queue;
-    }                                   /* End of while     */
     if ( ReleaseLock( EventLock, "add_event" ) == FALSE )
         printf( "Took error on ReleaseLock in add_event\n");
     // PrintEventQueue();
-    if ( (  time_of_event > 0 )
+    // With --single-thread the next charge_time_and_check_events
+    // delivers it, so there's nobody to wake.
+    if ( (  time_of_event > 0 ) && SingleThread == FALSE
        &&(  time_of_event <= (INT32)current_simulation_time ))
     {
         // Bugfix 09/2011 - There are situations where the hardware lock
@@ -1796,9 +4162,10 @@ void    add_event( INT32   time_of_event,
 
             This is the routine that will remove an event from
             the queue.  Actions include:
-                o Gets the next item from the event queue.
+                o Takes the earliest event off the event heap - or
+                  under --replay, the one replay_force_event() chose.
                 o Fills in the return arguments.
-                o Frees the structure.
+                o Returns the structure to the pool.
       We come here only when we KNOW time is past.  We take an error
       if there's nothing on the queue.
     *****************************************************************/
@@ -1806,6 +4173,7 @@ void    add_event( INT32   time_of_event,
 void    get_next_ordered_event( INT32   *time_of_event, 
                                 INT16   *event_type, 
                                 INT16   *event_error, 
+                                INT32   *event_tag,
                                 INT32   *local_error ) 
 
     {
@@ -1813,25 +4181,29 @@ void    get_next_ordered_event( INT32   *time_of_event,
     INT16       rbl;        /* Ring Buffer Location                */
 
     GetLock( EventLock, "get_next_ordered_ev" );
-    if (event_queue.queue == NULL )
+    if ( event_heap_count == 0 )
         {
         *local_error = ERR_Z502_INTERNAL_BUG;
         if ( ReleaseLock( EventLock, "get_next_ordered_ev" ) == FALSE )
             printf( "Took error on ReleaseLock in get_next_ordered_event\n");
         return;
     }
-    ep                  = (EVENT *)event_queue.queue;
-    event_queue.queue   = ep->queue;
-    ep->queue           = NULL;
-
+    ep                  = event_heap[0];
+    if ( replay_event != NULL )
+        ep              = replay_event;
+    replay_event        = NULL;
     if ( ep->structure_id != EVENT_STRUCTURE_ID )
         {
         printf( "Bad structure id read in get_next_ordered_event.\n" );
         z502_internal_panic( ERR_Z502_INTERNAL_BUG );
     }
+    event_heap_remove( ep->heap_index );
+    publish_next_event_time( );
+
     *time_of_event      = ep->time_of_event;
     *event_type         = ep->event_type;
     *event_error        = ep->event_error;
+    *event_tag          = ep->event_tag;
     *local_error        = ERR_SUCCESS;
     rbl                 = ep->ring_buffer_location;
 
@@ -1840,10 +4212,9 @@ void    get_next_ordered_event( INT32   *time_of_event,
 //        else
 //                printf( "XXX %d %d\n", current_simulation_time, *time_of_event );
 
+    free_event( ep );
     if ( ReleaseLock( EventLock, "get_next_ordered_ev" ) == FALSE )
         printf( "Took error on ReleaseLock in get_next_ordered_event\n");
-    ep->structure_id    = 0;            /* make sure this isn't mistaken */
-    free ( ep );
 
 }                       /* End of get_next_ordered_event            */
 
@@ -1851,20 +4222,18 @@ void    get_next_ordered_event( INT32   *time_of_event,
 
       PrintEventQueue()
 
-      Print out the times that are on the event Q.
+      Print out the times that are on the event Q.  These are shown
+      in heap order; the first one printed is always the earliest.
     *****************************************************************/
 
 void    PrintEventQueue( )
     {
-    EVENT       *ep;
+    INT32       index;
 
     GetLock( EventLock, "PrintEventQueue" );
     printf( "Event Queue: ");
-    ep                  = (EVENT *)event_queue.queue;
-    while (ep != NULL )  {
-        printf( "  %d", ep->time_of_event );
-        ep = (EVENT *)ep->queue;
-    }
+    for ( index = 0; index < event_heap_count; index++ )
+        printf( "  %d", event_heap[index]->time_of_event );
     printf( "  NULL\n");
     ReleaseLock( EventLock, "PrintEventQueue" );
     return;
@@ -1878,10 +4247,10 @@ void    PrintEventQueue( )
 
             Deque a specified item from the event queue.
             Actions include:
-                o Start at the head of the queue.
-                o Hunt along until we find a matching identifier.
-                o Dequeue it.
-                o Return the pointer to the structure to the caller.
+                o Use the heap slot recorded in the event to find it.
+                o Make sure the slot really holds this event.
+                o Take it off the heap.
+                o Return the structure to the pool.
 
             error not 0 means the event wasn't found;
     *****************************************************************/
@@ -1889,35 +4258,27 @@ void    PrintEventQueue( )
 void    dequeue_item( EVENT   *event_ptr, INT32  *error )
 
     {
-    EVENT               *last_ptr;
-    EVENT               *temp_ptr;
+    INT32               index;
 
     if ( event_ptr->structure_id != EVENT_STRUCTURE_ID )
         {
         printf( "Bad structure id read in dequeue_item.\n" );
         z502_internal_panic( ERR_Z502_INTERNAL_BUG );
     }
-
     GetLock( EventLock, "dequeue_item" );
     *error      = 0;
-    temp_ptr    = (EVENT *)event_queue.queue;
-    last_ptr    = &event_queue;
-    while (1)
+    index       = event_ptr->heap_index;
+    if (   index < 0 || index >= event_heap_count 
+        || event_heap[index] != event_ptr )
+        *error = 1;
+    else
         {
-        if ( temp_ptr == NULL )
-            {
-            *error = 1;
-            break;
-        }
-        if ( temp_ptr == event_ptr )
-            {
-            last_ptr->queue = temp_ptr->queue;
-            event_ptr->queue= (INT32 *)NULL;
-            break;
-        }
-        last_ptr = temp_ptr;
-        temp_ptr = (EVENT *)temp_ptr->queue;
-    }                                   /* End while                */ 
+        if ( event_ptr == replay_event )
+            replay_event = NULL;
+        event_heap_remove( index );
+        publish_next_event_time( );
+        free_event( event_ptr );
+    }
     if ( ReleaseLock( EventLock, "dequeue_item" ) == FALSE )
         printf( "Took error on ReleaseLock in dequeue_item\n");
 }                                       /* End   dequeue_item       */ 
@@ -1927,8 +4288,11 @@ void    dequeue_item( EVENT   *event_ptr, INT32  *error )
 
         get_next_event_time()
 
-            Look in the event queue.  Don't dequeue anything,
-            but just read the time of the first event.
+            Read the time of the first event in the event queue,
+            without dequeuing anything.  This is asked on every
+            charge_time_and_check_events(), so rather than take
+            EventLock to look at the heap, it reads next_event_time,
+            which the routines that change the heap keep up to date.
 
             return a -1 if there's nothing on the queue 
             - the caller must check for this.
@@ -1937,26 +4301,35 @@ void    dequeue_item( EVENT   *event_ptr, INT32  *error )
 void    get_next_event_time( INT32   *time_of_next_event )
 
     {
-    EVENT               *ep;
+    *time_of_next_event = ATOMIC_LOAD_INT32( &next_event_time );
+}                               /* End of get_next_event_time       */
+
+    /*****************************************************************
+
+        publish_next_event_time()
+
+            Called with EventLock held, whenever the top of the event
+            heap may have changed.
+    *****************************************************************/
+
+void    publish_next_event_time( void )
 
-    GetLock( EventLock, "get_next_event_time" );
-    *time_of_next_event = -1;
-    if ( event_queue.queue == NULL )
     {
-        if ( ReleaseLock(EventLock,"get_next_event_time") == FALSE )
-            printf( "Took error on ReleaseLock in get_next_event_time\n");
+    EVENT               *ep;
+
+    if ( event_heap_count == 0 )
+        {
+        ATOMIC_STORE_INT32( &next_event_time, -1 );
         return;
     }
-    ep = ( EVENT *)event_queue.queue;
+    ep = event_heap[0];
     if ( ep->structure_id != EVENT_STRUCTURE_ID )
         {
-        printf( "Bad structure id read in get_next_event_time.\n" );
+        printf( "Bad structure id read in publish_next_event_time.\n" );
         z502_internal_panic( ERR_Z502_INTERNAL_BUG );
     }
-    *time_of_next_event = ep->time_of_event;
-    if ( ReleaseLock(EventLock,"get_next_event_time") == FALSE )
-        printf( "Took error on ReleaseLock in get_next_event_time\n");
-}                               /* End of get_next_event_time       */
+    ATOMIC_STORE_INT32( &next_event_time, ep->time_of_event );
+}                               /* End of publish_next_event_time   */
 
     /*****************************************************************
 
@@ -1970,6 +4343,8 @@ void    get_next_event_time( INT32   *time_of_next_event )
 void    print_hardware_stats( void )
         {
         INT32   i, temp;
+        UINT32  end_time = machine_time( );
+        UINT32  clock;
         double  util;                                   /* This is in range 0 - 1       */
 
         printf( "Hardware Statistics during the Simulation\n");
@@ -1983,7 +4358,7 @@ void    print_hardware_stats( void )
                                 i, hardware_stats.disk_reads[i], 
                                 hardware_stats.disk_writes[i] );
                         util = (double)hardware_stats.time_disk_busy[i] / 
-                                        (double)current_simulation_time;
+                                        (double)end_time;
                         printf( "Disk Utilization = %6.3f\n", util );
                 }
         }
@@ -1993,8 +4368,160 @@ void    print_hardware_stats( void )
                 printf( "Context Switches = %5d:  ", hardware_stats.context_switches );
         printf( "CALLS = %5d:  ", hardware_stats.number_charge_times );
         printf( "Masks = %5d\n", hardware_stats.number_mask_set_seen );
+        for ( i = 0; i < NumberOfCpus && NumberOfCpus > 1; i++ )
+                {
+                if ( cpu_state[i].state == CPU_PARKED )
+                        continue;
+                clock = ( i == CurrentCpu ) ? current_simulation_time
+                                            : cpu_state[i].clock;
+                util  = (double)( clock - cpu_state[i].start_time
+                                  - cpu_state[i].idle_ticks ) / (double)end_time;
+                printf( "CPU %d: Utilization = %6.3f:  Idle = %8d:  IPIs = %5d:  Handoffs = %5d\n",
+                        i, util, cpu_state[i].idle_ticks, cpu_state[i].ipis,
+                        cpu_state[i].handoffs );
+        }
+        if ( hardware_stats.sector_chunks > 0 )
+                printf( "Disk Storage = %d bytes in %d sector chunks\n",
+                        hardware_stats.disk_storage_bytes,
+                        hardware_stats.sector_chunks );
+        if ( TlbSets > 0 )
+                printf( "TLB %dx%d: Hits = %d:  Misses = %d:  Page Invalidations = %d:  Flushes = %d\n",
+                        TlbSets, TlbWays, hardware_stats.tlb_hits,
+                        hardware_stats.tlb_misses,
+                        hardware_stats.tlb_page_invalidations,
+                        hardware_stats.tlb_flushes );
+        if ( DiskImageDirectory != NULL )
+                printf( "Disk Images mapped from %s\n", DiskImageDirectory );
+        if ( replay_log != NULL )
+                printf( "Replayed %d of %d interrupts from %s:  Off the recorded point = %d\n",
+                        replay_next, replay_length, ReplayFile,
+                        replay_off_point );
+        print_slab_stats( &event_slab );
+        print_slab_stats( &sector_slab );
+        print_slab_stats( &context_slab );
+        if ( LockStatistics )
+                print_lock_stats( );
 
 }                            /* End of print_hardware_stats          */
+
+
+    /*****************************************************************
+
+        Statistics export
+
+    With --stats-file=FILE the hardware appends a line to FILE at the
+    first context switch after every --stats-interval ticks, and one
+    more at halt, so a long run can be watched or plotted as it goes.
+    Each line is stamped with the time it was taken and holds the
+    running totals of hardware_stats and the performance counters,
+    each disk's reads, writes, busy time, utilization so far and
+    queue, the number of pending events, and what the OS reports
+    through os_stats_sample().  A FILE ending in .csv gets a header
+    line (if it's new) and then comma separated values; any other
+    gets a JSON object to a line.  The line is flushed as soon as it
+    is written.
+
+        open_stats_export()     - open --stats-file.
+        export_stats()          - write the line that's due.
+
+    *****************************************************************/
+
+void    open_stats_export( void )
+    {
+    size_t      length = strlen( StatsFile );
+    INT32       disk_id;
+
+    if ( StatsInterval < 1 )
+        {
+        printf( "The --stats-interval must be at least 1.\n" );
+        GoToExit( 1 );
+    }
+    stats_file = fopen( StatsFile, "a" );
+    if ( stats_file == NULL )
+        {
+        printf( "Unable to open the statistics file %s\n", StatsFile );
+        GoToExit( 1 );
+    }
+    stats_csv = ( length >= 4
+                  && strcmp( &StatsFile[length - 4], ".csv" ) == 0 );
+    if ( stats_csv == FALSE || ftell( stats_file ) > 0 )
+        return;
+    fprintf( stats_file, "time,context_switches,faults,calls,mmio,"
+             "timer_interrupts,idle_ticks,memory_accesses,events_queued,"
+             "running,ready,waiting,suspended,free_frames,used_sectors" );
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        fprintf( stats_file, ",disk%d_reads,disk%d_writes,disk%d_busy,"
+                 "disk%d_utilization,disk%d_queued", disk_id, disk_id,
+                 disk_id, disk_id, disk_id );
+    fprintf( stats_file, "\n" );
+}                       /* End of open_stats_export                 */
+
+void    export_stats( void )
+    {
+    OS_STATS    os_stats;
+    UINT32      now = machine_time( );
+    INT32       disk_id, queued;
+    double      util;
+
+    os_stats_sample( &os_stats );
+    if ( stats_csv )
+        fprintf( stats_file, "%u,%d,%d,%d,%llu,%llu,%llu,%llu,%d,"
+                 "%d,%d,%d,%d,%d,%d",
+                 now, hardware_stats.context_switches,
+                 hardware_stats.number_faults,
+                 hardware_stats.number_charge_times,
+                 (unsigned long long)pmu_counts[PMU_MMIO_OPERATIONS],
+                 (unsigned long long)pmu_counts[PMU_TIMER_INTERRUPTS],
+                 (unsigned long long)pmu_counts[PMU_IDLE_TICKS],
+                 (unsigned long long)pmu_counts[PMU_MEMORY_ACCESSES],
+                 event_heap_count, os_stats.running, os_stats.ready,
+                 os_stats.waiting, os_stats.suspended,
+                 os_stats.free_frames, os_stats.used_sectors );
+    else
+        fprintf( stats_file, "{\"time\":%u,\"context_switches\":%d,"
+                 "\"faults\":%d,\"calls\":%d,\"mmio\":%llu,"
+                 "\"timer_interrupts\":%llu,\"idle_ticks\":%llu,"
+                 "\"memory_accesses\":%llu,\"events_queued\":%d,"
+                 "\"os\":{\"running\":%d,\"ready\":%d,\"waiting\":%d,"
+                 "\"suspended\":%d,\"free_frames\":%d,"
+                 "\"used_sectors\":%d},\"disks\":[",
+                 now, hardware_stats.context_switches,
+                 hardware_stats.number_faults,
+                 hardware_stats.number_charge_times,
+                 (unsigned long long)pmu_counts[PMU_MMIO_OPERATIONS],
+                 (unsigned long long)pmu_counts[PMU_TIMER_INTERRUPTS],
+                 (unsigned long long)pmu_counts[PMU_IDLE_TICKS],
+                 (unsigned long long)pmu_counts[PMU_MEMORY_ACCESSES],
+                 event_heap_count, os_stats.running, os_stats.ready,
+                 os_stats.waiting, os_stats.suspended,
+                 os_stats.free_frames, os_stats.used_sectors );
+
+    /*  A disk's queue is the request it's serving and those waiting.  */
+
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        {
+        queued = disk_state[disk_id].requests_queued
+               + ( disk_state[disk_id].disk_in_use ? 1 : 0 );
+        util   = ( now > 0 ) ? (double)hardware_stats.time_disk_busy[disk_id]
+                                                        / (double)now
+                             : 0.0;
+        if ( stats_csv )
+            fprintf( stats_file, ",%d,%d,%d,%.3f,%d",
+                     hardware_stats.disk_reads[disk_id],
+                     hardware_stats.disk_writes[disk_id],
+                     hardware_stats.time_disk_busy[disk_id], util, queued );
+        else
+            fprintf( stats_file, "%s{\"disk\":%d,\"reads\":%d,"
+                     "\"writes\":%d,\"busy\":%d,\"utilization\":%.3f,"
+                     "\"queued\":%d}", ( disk_id > 1 ) ? "," : "", disk_id,
+                     hardware_stats.disk_reads[disk_id],
+                     hardware_stats.disk_writes[disk_id],
+                     hardware_stats.time_disk_busy[disk_id], util, queued );
+    }
+    fprintf( stats_file, stats_csv ? "\n" : "]}\n" );
+    fflush( stats_file );
+    stats_next_time = ( now / StatsInterval + 1 ) * StatsInterval;
+}                       /* End of export_stats                      */
     /*****************************************************************
 
         print_ring_buffer()
@@ -2051,92 +4578,1068 @@ void    print_ring_buffer( void )
 
         get_sector_struct()
 
-    Determine if the requested sector exists, and if so hand back the 
-    location in memory where we've stashed data for this sector.
+    Determine if the requested sector exists, and if so hand back the 
+    location in memory where we've stashed data for this sector.
+
+    Each disk has a table of sector chunks.  A chunk holds the data
+    for SECTORS_PER_CHUNK consecutive sectors along with a bit for
+    each one saying whether it has ever been written.  Chunks are
+    only allocated when something is first written into them.
+
+    If the disk is backed by an image file, the sector lives directly
+    in the mapping and the image header holds the written bits.
+
+    Actions include:
+        o Index the disk's chunk table with the sector number.
+        o Make sure the chunk exists and the sector has been written.
+        o Return the address of the sector data.
+
+    Error not 0 means the structure wasn't found.  This means that
+    noone has used this particular sector before and thus it hasn't
+    been written to.
+    *****************************************************************/
+
+void    get_sector_struct( INT16         disk_id, 
+                           INT16         sector, 
+                           char          **sector_ptr, 
+                           INT32         *error )
+    {
+    SECTOR_CHUNK        *chunk;
+    INT16               slot;
+
+    *error      = 1;
+    if ( disk_image[disk_id].header != NULL )
+        {
+        if ( ( disk_image[disk_id].written[sector / 8]
+                                & ( 1 << ( sector % 8 ) ) ) == 0 )
+            return;
+        *sector_ptr = disk_image[disk_id].sector_data + sector * PGSIZE;
+        *error      = 0;
+        return;
+    }
+
+    chunk       = sector_table[disk_id][sector / SECTORS_PER_CHUNK];
+    if ( chunk == NULL )
+        return;
+
+    if ( chunk->structure_id != SECTOR_STRUCTURE_ID )
+        {
+        printf( "Bad structure id read in get_sector_structure.\n" );
+        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+    }
+
+    slot        = sector % SECTORS_PER_CHUNK;
+    if ( ( chunk->written[slot / 8] & ( 1 << ( slot % 8 ) ) ) == 0 )
+        return;
+    *sector_ptr = chunk->sector_data + slot * PGSIZE;
+    *error      = 0;
+}                                       /* End get_sector_struct*/ 
+
+    /*****************************************************************
+
+        create_sector_struct()
+
+    This is the routine that will create a sector structure and add it 
+    to the list of valid sectors.
+
+    Actions include:
+                o For a disk with an image file, just mark the
+                  sector written in the image header.
+                o Allocate the chunk holding this sector if
+                  this is the first write anywhere in it.
+                o Mark the sector as written.
+                o Pass back the pointer to the sector data.
+
+    WARNING: NO CHECK is made to ensure a structure for this sector 
+    doesn't exist.  The assumption is that the caller has previously 
+    failed a call to get_sector_struct.
+    *****************************************************************/
+
+void    create_sector_struct( INT16   disk_id, 
+                              INT16   sector, 
+                              char    **returned_sector_ptr )
+    {
+    SECTOR_CHUNK        *chunk;
+    INT16               slot;
+
+    if ( disk_image[disk_id].header != NULL )
+        {
+        disk_image[disk_id].written[sector / 8]
+                                |= ( 1 << ( sector % 8 ) );
+        *returned_sector_ptr = disk_image[disk_id].sector_data
+                                + sector * PGSIZE;
+        return;
+    }
+
+    chunk = sector_table[disk_id][sector / SECTORS_PER_CHUNK];
+    if ( chunk == NULL )
+        {
+        chunk = ( SECTOR_CHUNK *)slab_alloc( &sector_slab );
+        chunk->structure_id  = SECTOR_STRUCTURE_ID;
+        chunk->disk_id       = disk_id;
+        chunk->first_sector  = sector - sector % SECTORS_PER_CHUNK;
+        chunk->sector_data   = (char *)( chunk + 1 );
+        sector_table[disk_id][sector / SECTORS_PER_CHUNK] = chunk;
+        hardware_stats.sector_chunks++;
+        hardware_stats.disk_storage_bytes += (INT32)sector_slab.object_size;
+    }
+
+    slot  = sector % SECTORS_PER_CHUNK;
+    chunk->written[slot / 8] |= ( 1 << ( slot % 8 ) );
+    chunk->sectors_written++;
+    *returned_sector_ptr = chunk->sector_data + slot * PGSIZE;
+
+}                       /* End of create_sector_struct              */
+
+
+    /*****************************************************************
+
+        open_disk_images()
+
+    When the simulator is started with --disk-image=DIR, each disk is
+    backed by the file DIR/diskNN.img rather than by sector chunks in
+    memory.  The file is mapped shared, so whatever the OS writes to
+    the disk is still there the next time the simulator runs, and a
+    previously prepared image is available without any copying.
+
+    Actions include:
+        o Open (creating if needed) the image for each disk.
+        o Size a new image and fill in its header.
+        o Check the header of an existing image against our geometry.
+        o Map the image and remember where the sector data begins.
+    *****************************************************************/
+
+void    open_disk_images( void )
+    {
+#if defined LINUX || defined MAC
+    char                file_name[256];
+    INT16               disk_id;
+    int                 fd;
+    struct stat         file_status;
+    size_t              length;
+    void                *map;
+    DISK_IMAGE_HEADER   *header;
+
+    length = DISK_IMAGE_DATA_OFFSET + (size_t)NUM_LOGICAL_SECTORS * PGSIZE;
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        {
+        snprintf( file_name, sizeof( file_name ), "%s/disk%02d.img",
+                  DiskImageDirectory, disk_id );
+        fd = open( file_name, O_RDWR | O_CREAT, 0644 );
+        if ( fd < 0 || fstat( fd, &file_status ) != 0 )
+            {
+            printf( "Unable to open the disk image %s\n", file_name );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+        if ( file_status.st_size == 0 && ftruncate( fd, length ) != 0 )
+            {
+            printf( "Unable to size the disk image %s\n", file_name );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+        if ( file_status.st_size != 0
+                        && (size_t)file_status.st_size != length )
+            {
+            printf( "The disk image %s is %ld bytes, but should be %ld.\n",
+                    file_name, (long)file_status.st_size, (long)length );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+        map = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        close( fd );
+        if ( map == MAP_FAILED )
+            {
+            printf( "Unable to map the disk image %s\n", file_name );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+
+        header = ( DISK_IMAGE_HEADER *)map;
+        if ( file_status.st_size == 0 )
+            {
+            strcpy( header->magic, DISK_IMAGE_MAGIC );
+            header->version             = DISK_IMAGE_VERSION;
+            header->disk_id             = disk_id;
+            header->number_of_sectors   = NUM_LOGICAL_SECTORS;
+            header->sector_size         = PGSIZE;
+        }
+        if (   strcmp( header->magic, DISK_IMAGE_MAGIC ) != 0
+            || header->version           != DISK_IMAGE_VERSION
+            || header->number_of_sectors != NUM_LOGICAL_SECTORS
+            || header->sector_size       != PGSIZE )
+            {
+            printf( "The disk image %s doesn't match this hardware.\n",
+                    file_name );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+        disk_image[disk_id].header      = header;
+        disk_image[disk_id].written     = (unsigned char *)( header + 1 );
+        disk_image[disk_id].sector_data = (char *)map + DISK_IMAGE_DATA_OFFSET;
+        disk_image[disk_id].length      = length;
+    }
+#else
+    printf( "Disk images are not supported on this platform - ignored.\n" );
+    DiskImageDirectory = NULL;
+#endif
+}                       /* End of open_disk_images                  */
+
+    /*****************************************************************
+
+        close_disk_images()
+
+    Called at halt.  Push everything written to the disk images out
+    to their files and release the mappings.
+    *****************************************************************/
+
+void    close_disk_images( void )
+    {
+#if defined LINUX || defined MAC
+    INT16               disk_id;
+
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        {
+        if ( disk_image[disk_id].header == NULL )
+            continue;
+        msync( disk_image[disk_id].header, disk_image[disk_id].length,
+               MS_SYNC );
+        munmap( disk_image[disk_id].header, disk_image[disk_id].length );
+        disk_image[disk_id].header      = NULL;
+        disk_image[disk_id].sector_data = NULL;
+    }
+#endif
+}                       /* End of close_disk_images                 */
+
+    /*****************************************************************
+
+        open_interrupt_log()
+
+    With the interrupt thread, when an interrupt is taken depends on
+    how the host schedules that thread against the base thread, so no
+    two runs are quite alike.  --record=FILE writes down the point at
+    which each interrupt was delivered, and --replay=FILE delivers
+    them at those same points.  A replay runs without the interrupt
+    thread, as with --single-thread, so replaying the same file
+    always gives the same run.
+
+    Actions include:
+        o Refuse --cpus, whose runs are already repeatable.
+        o For --record, create the file and write its header.
+        o For --replay, read the whole file in and check its header
+          against our geometry.
+    *****************************************************************/
+
+void    open_interrupt_log( void )
+    {
+    INTERRUPT_LOG_HEADER    header;
+    FILE                    *file;
+    long                    length;
+
+    if ( NumberOfCpus > 1 )
+        {
+        printf( "--record and --replay can't be used with --cpus; runs\n" );
+        printf( "with several processors are always repeatable.\n" );
+        GoToExit( 1 );
+    }
+    memset( &header, 0, sizeof( header ) );
+    strcpy( header.magic, INTERRUPT_LOG_MAGIC );
+    header.version          = INTERRUPT_LOG_VERSION;
+    header.pgsize           = PGSIZE;
+    header.phys_mem_pgs     = PHYS_MEM_PGS;
+    header.number_of_disks  = MAX_NUMBER_OF_DISKS;
+
+    if ( RecordFile != NULL )
+        {
+        record_file = fopen( RecordFile, "wb" );
+        if (   record_file == NULL
+            || fwrite( &header, sizeof( header ), 1, record_file ) != 1 )
+            {
+            printf( "Unable to create the interrupt recording %s\n",
+                    RecordFile );
+            GoToExit( 1 );
+        }
+    }
+    if ( ReplayFile == NULL )
+        return;
+
+    file = fopen( ReplayFile, "rb" );
+    if ( file == NULL )
+        {
+        printf( "Unable to open the interrupt recording %s\n", ReplayFile );
+        GoToExit( 1 );
+    }
+    fseek( file, 0L, SEEK_END );
+    length = ftell( file ) - (long)sizeof( header );
+    fseek( file, 0L, SEEK_SET );
+    if (   length < 0 || length % sizeof( INTERRUPT_LOG_ENTRY ) != 0
+        || fread( &header, sizeof( header ), 1, file ) != 1
+        || strcmp( header.magic, INTERRUPT_LOG_MAGIC ) != 0
+        || header.version != INTERRUPT_LOG_VERSION )
+        {
+        printf( "%s is not an interrupt recording.\n", ReplayFile );
+        GoToExit( 1 );
+    }
+    if (   header.pgsize != PGSIZE || header.phys_mem_pgs != PHYS_MEM_PGS
+        || header.number_of_disks != MAX_NUMBER_OF_DISKS )
+        {
+        printf( "The interrupt recording %s was made on a machine\n",
+                ReplayFile );
+        printf( "with a different geometry.\n" );
+        GoToExit( 1 );
+    }
+    replay_length = (INT32)( length / sizeof( INTERRUPT_LOG_ENTRY ) );
+    replay_log    = (INTERRUPT_LOG_ENTRY *)calloc( replay_length + 1,
+                                            sizeof( INTERRUPT_LOG_ENTRY ) );
+    if (   replay_log == NULL
+        || fread( replay_log, sizeof( INTERRUPT_LOG_ENTRY ),
+                  replay_length, file ) != (size_t)replay_length )
+        {
+        printf( "Unable to read the interrupt recording %s\n", ReplayFile );
+        GoToExit( 1 );
+    }
+    fclose( file );
+    SingleThread = TRUE;
+}                       /* End of open_interrupt_log                */
+
+    /*****************************************************************
+
+        log_interrupt()
+
+    Called as each interrupt is delivered.  With --record, append
+    where it happened.  With --replay, step past the entry it came
+    from, counting it if it wasn't delivered exactly as recorded - at
+    that point, from that device, with that status.  That only
+    happens when the OS or the options differ from the recording, or
+    where the hardware had to put an interrupt off (see
+    single_thread_interrupt()).
+    *****************************************************************/
+
+void    log_interrupt( INT16 device, INT16 status )
+    {
+    INTERRUPT_LOG_ENTRY     entry;
+
+    entry.time          = current_simulation_time;
+    entry.base_charges  = base_charges;
+    entry.device        = device;
+    entry.status        = status;
+    if ( record_file != NULL )
+        fwrite( &entry, sizeof( entry ), 1, record_file );
+    if ( replay_log != NULL && replay_next < replay_length )
+        {
+        if (   replay_log[replay_next].base_charges != entry.base_charges
+            || replay_log[replay_next].device       != entry.device
+            || replay_log[replay_next].status       != entry.status )
+            replay_off_point++;
+        replay_next++;
+    }
+}                       /* End of log_interrupt                     */
+
+    /*****************************************************************
+
+        replay_point_reached()
+
+    May an interrupt that's due be delivered now?  Always, unless
+    we're replaying and the base level hasn't yet reached the point
+    at which the recording delivered the next one.  Once the
+    recording runs out, interrupts are delivered as soon as they're
+    due, as with --single-thread.
+    *****************************************************************/
+
+BOOL    replay_point_reached( void )
+    {
+    if ( replay_log == NULL || replay_next >= replay_length )
+        return( TRUE );
+    return( base_charges >= replay_log[replay_next].base_charges );
+}                       /* End of replay_point_reached              */
+
+    /*****************************************************************
+
+        replay_force_event()
+
+    Holding an interrupt back until its point isn't enough: the
+    recording may have taken it there before it was due, or ahead of
+    one that was due first, because that's where the interrupt thread
+    happened to get in.  So once base level reaches the next recorded
+    point, find the event from that device with that status and have
+    it taken next, moving the clock up to the recorded time if we're
+    short of it.  If there's no such event the run has gone its own
+    way, and interrupts are simply delivered as they come due.  The
+    caller holds the HardwareLock.
+    *****************************************************************/
+
+void    replay_force_event( void )
+    {
+    INTERRUPT_LOG_ENTRY *entry;
+    EVENT               *ep;
+    INT32               index;
+
+    if (   replay_log == NULL || replay_next >= replay_length
+        || replay_event != NULL )
+        return;
+    entry = &replay_log[replay_next];
+    if ( base_charges < entry->base_charges )
+        return;
+    GetLock( EventLock, "replay_force_event" );
+    for ( index = 0; index < event_heap_count; index++ )
+        {
+        ep = event_heap[index];
+        if (   ep->event_type == entry->device
+            && ep->event_error == entry->status
+            && ( replay_event == NULL || EVENT_PRECEDES( ep, replay_event ) ) )
+            replay_event = ep;
+    }
+    ReleaseLock( EventLock, "replay_force_event" );
+    if ( replay_event != NULL && current_simulation_time < entry->time )
+        current_simulation_time = entry->time;
+}                       /* End of replay_force_event                */
+
+    /*****************************************************************
+
+        close_interrupt_log()
+
+    Called at halt to finish off the recording.
+    *****************************************************************/
+
+void    close_interrupt_log( void )
+    {
+    if ( record_file != NULL )
+        fclose( record_file );
+    record_file = NULL;
+}                       /* End of close_interrupt_log               */
+
+    /*****************************************************************
+
+        Snapshots
+
+    The long paging tests spend most of their run getting their pages
+    out to disk before they settle down.  --snapshot=FILE writes the
+    machine out at the first context switch at or after
+    --snapshot-at=TIME, and the run carries on; --restore=FILE starts
+    a run at that switch instead of at os_init.  Nothing is on the
+    host's stack at a switch - user code is re-entered through the
+    program counter in its context - so the machine is all in:
+        o MEMORY, the TLB, the event heap, the timer and the disks.
+        o The registers and the contexts.
+        o What the OS keeps.  The hardware calls os_snapshot_save(),
+          which writes it with Z502_SNAPSHOT_WRITE and
+          Z502_SNAPSHOT_WRITE_CONTEXT, and os_snapshot_restore(),
+          which reads it back.
+        o The user data from Z502_ALLOCATE_USER_DATA.
+        o The state of rand(), which the tests use to pick pages.
+    Statics in test.c aren't carried over.  Only the short tests
+    keep anything in them.
+
+        open_snapshot()         - check the options go together.
+        take_snapshot()         - write the machine to --snapshot.
+        restore_snapshot()      - read it back from --restore.
+        snapshot_write_value()  - write a register, which may point
+                                  into user data or our own image.
+        snapshot_read_value()   - and read it back.
+    *****************************************************************/
+
+#ifdef  LINUX
+extern char     __executable_start[], _end[];
+#define         IMAGE_START             ( (long)__executable_start )
+#define         IMAGE_END               ( (long)_end )
+#else
+#define         IMAGE_START             0L
+#define         IMAGE_END               0L
+#endif
+
+/*  Where on the heap an event is, or -1.  A device may still point at
+    an event that has been delivered, and whose slot has been reused. */
+
+#define         SNAPSHOT_EVENT_INDEX( ep )                              \
+        ( ( (ep) != NULL && (ep)->heap_index >= 0                       \
+            && (ep)->heap_index < event_heap_count                      \
+            && event_heap[(ep)->heap_index] == (ep) )                   \
+                                ? (ep)->heap_index : -1 )
+
+void    open_snapshot( void )
+    {
+    if (   NumberOfCpus > 1 || RecordFile != NULL || ReplayFile != NULL
+        || DiskImageDirectory != NULL )
+        {
+        printf( "--snapshot and --restore can't be used with --cpus,\n" );
+        printf( "--record, --replay or --disk-image.\n" );
+        GoToExit( 1 );
+    }
+    /*  An interrupt thread could be part way through the handler at
+        the switch, so a snapshot is taken, and run, without one.   */
+    SingleThread = TRUE;
+
+    /*  glibc's rand() draws on random()'s state.  Give it one that we
+        can write out - seeded with 1 it gives the same numbers as a
+        rand() that was never seeded.                               */
+#ifdef  LINUX
+    if ( RestoreFile == NULL )
+        initstate( 1, random_state, sizeof( random_state ) );
+#endif
+}                       /* End of open_snapshot                     */
+
+void    take_snapshot( void )
+    {
+    SNAPSHOT_HEADER     header;
+    DISK_STATE          disk;
+    char                *file_name = SnapshotFile;
+    char                *sector_ptr;
+    INT32               index, channel, local_error;
+    INT16               disk_id, sector;
+
+    SnapshotFile        = NULL;         /* Just the one             */
+    snapshot_file       = fopen( file_name, "wb" );
+    if ( snapshot_file == NULL )
+        {
+        printf( "Unable to create the snapshot %s\n", file_name );
+        GoToExit( 1 );
+    }
+    memset( &header, 0, sizeof( header ) );
+    strcpy( header.magic, SNAPSHOT_MAGIC );
+    header.version              = SNAPSHOT_VERSION;
+    header.pgsize               = PGSIZE;
+    header.phys_mem_pgs         = PHYS_MEM_PGS;
+    header.virtual_mem_pgs      = VIRTUAL_MEM_PGS;
+    header.num_logical_sectors  = NUM_LOGICAL_SECTORS;
+    header.number_of_disks      = MAX_NUMBER_OF_DISKS;
+    header.disk_queue_depth     = DiskQueueDepth;
+    header.tlb_sets             = TlbSets;
+    header.tlb_ways             = TlbWays;
+    header.image_length         = IMAGE_END - IMAGE_START;
+    header.os_init_offset       = (long)os_init - IMAGE_START;
+    header.time                 = current_simulation_time;
+    Z502_SNAPSHOT_WRITE( &header, sizeof( header ) );
+
+    /*  Memory, the TLB and the event heap - an event is written as
+        its place on the heap.                                      */
+
+    Z502_SNAPSHOT_WRITE( MEMORY, MEMSIZE );
+    if ( tlb != NULL )
+        Z502_SNAPSHOT_WRITE( tlb, TlbSets * TlbWays * sizeof( TLB_ENTRY ) );
+    Z502_SNAPSHOT_WRITE( &event_heap_count, sizeof( event_heap_count ) );
+    for ( index = 0; index < event_heap_count; index++ )
+        Z502_SNAPSHOT_WRITE( event_heap[index], sizeof( EVENT ) );
+    for ( channel = 0; channel < NUMBER_OF_TIMER_CHANNELS; channel++ )
+        {
+        Z502_SNAPSHOT_WRITE( &timer_state[channel].timer_in_use,
+                             sizeof( timer_state[channel].timer_in_use ) );
+        Z502_SNAPSHOT_WRITE( &timer_state[channel].period,
+                             sizeof( timer_state[channel].period ) );
+        index = SNAPSHOT_EVENT_INDEX( timer_state[channel].event_ptr );
+        Z502_SNAPSHOT_WRITE( &index, sizeof( index ) );
+    }
+
+    /*  The disks, then every sector that has been written, ending
+        each disk with -1.                                          */
+
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        {
+        disk            = disk_state[disk_id];
+        index           = SNAPSHOT_EVENT_INDEX( disk.event_ptr );
+        disk.event_ptr  = NULL;
+        Z502_SNAPSHOT_WRITE( &disk, sizeof( disk ) );
+        Z502_SNAPSHOT_WRITE( &index, sizeof( index ) );
+    }
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        {
+        for ( sector = 0; sector < NUM_LOGICAL_SECTORS; sector++ )
+            {
+            get_sector_struct( disk_id, sector, &sector_ptr, &local_error );
+            if ( local_error != 0 )
+                continue;
+            index = sector;
+            Z502_SNAPSHOT_WRITE( &index, sizeof( index ) );
+            Z502_SNAPSHOT_WRITE( sector_ptr, PGSIZE );
+        }
+        index = -1;
+        Z502_SNAPSHOT_WRITE( &index, sizeof( index ) );
+    }
+
+    /*  The clock, the counters and the interrupt and lock registers.
+        These go after the disks, whose restore counts the chunks it
+        allocates all over again.                                   */
+
+    Z502_SNAPSHOT_WRITE( &event_sequence, sizeof( event_sequence ) );
+    Z502_SNAPSHOT_WRITE( &next_asid, sizeof( next_asid ) );
+    Z502_SNAPSHOT_WRITE( asid_holders, sizeof( asid_holders ) );
+    Z502_SNAPSHOT_WRITE( &tlb_clock, sizeof( tlb_clock ) );
+    Z502_SNAPSHOT_WRITE( &hardware_stats, sizeof( hardware_stats ) );
+    Z502_SNAPSHOT_WRITE( pmu_counts, sizeof( pmu_counts ) );
+    Z502_SNAPSHOT_WRITE( &NumberOfInterruptsStarted, sizeof( INT32 ) );
+    Z502_SNAPSHOT_WRITE( &NumberOfInterruptsCompleted, sizeof( INT32 ) );
+    Z502_SNAPSHOT_WRITE( STAT_VECTOR, sizeof( STAT_VECTOR ) );
+    Z502_SNAPSHOT_WRITE( interrupt_tag, sizeof( interrupt_tag ) );
+    Z502_SNAPSHOT_WRITE( interrupt_frame, sizeof( interrupt_frame ) );
+    snapshot_write_value( (long)completion_ring );
+    Z502_SNAPSHOT_WRITE( &completion_threshold, sizeof( INT32 ) );
+    Z502_SNAPSHOT_WRITE( &completion_delay, sizeof( INT32 ) );
+    Z502_SNAPSHOT_WRITE( &completion_waiting, sizeof( INT32 ) );
+    Z502_SNAPSHOT_WRITE( &completion_flush_pending, sizeof( BOOL ) );
+    Z502_SNAPSHOT_WRITE( InterlockRecord, sizeof( InterlockRecord ) );
+    Z502_SNAPSHOT_WRITE( &InterlocksHeld, sizeof( InterlocksHeld ) );
+    Z502_SNAPSHOT_WRITE( InterlockWord, sizeof( InterlockWord ) );
+
+    /*  User data, then the OS with the contexts of its processes.  */
+
+    Z502_SNAPSHOT_WRITE( &user_data_count, sizeof( user_data_count ) );
+    for ( index = 0; index < user_data_count; index++ )
+        {
+        Z502_SNAPSHOT_WRITE( &user_data[index].length, sizeof( INT32 ) );
+        Z502_SNAPSHOT_WRITE( user_data[index].data, user_data[index].length );
+    }
+    snapshot_context_count = 0;
+    os_snapshot_save( );
+
+    /*  The registers.  The contexts they name are nearly always the
+        OS's; any others (the one os_init ran on, or one being killed)
+        are written here.  The page table is the one the OS gave with
+        a context, or NULL.                                         */
+
+    Z502_SNAPSHOT_WRITE_CONTEXT( Z502_CURRENT_CONTEXT, NULL );
+    Z502_SNAPSHOT_WRITE_CONTEXT( z502_machine_next_context_ptr, NULL );
+    Z502_SNAPSHOT_WRITE_CONTEXT( AccountingContext, NULL );
+    for ( index = snapshot_context_count - 1; index >= 0; index-- )
+        if (   Z502_PAGE_TBL_ADDR != NULL
+            && snapshot_page_tables[index] == Z502_PAGE_TBL_ADDR )
+            break;
+    Z502_SNAPSHOT_WRITE( &index, sizeof( index ) );
+    Z502_SNAPSHOT_WRITE( &Z502_PAGE_TBL_LENGTH, sizeof( INT16 ) );
+    Z502_SNAPSHOT_WRITE( &Z502_PROGRAM_COUNTER, sizeof( INT16 ) );
+    Z502_SNAPSHOT_WRITE( &Z502_MODE, sizeof( INT16 ) );
+    Z502_SNAPSHOT_WRITE( &SYS_CALL_CALL_TYPE, sizeof( INT32 ) );
+    Z502_SNAPSHOT_WRITE( &z502_machine_kill_or_save, sizeof( BOOL ) );
+    snapshot_write_value( Z502_ARG1.VAL );
+    snapshot_write_value( Z502_ARG2.VAL );
+    snapshot_write_value( Z502_ARG3.VAL );
+    snapshot_write_value( Z502_ARG4.VAL );
+    snapshot_write_value( Z502_ARG5.VAL );
+    snapshot_write_value( Z502_ARG6.VAL );
+    snapshot_write_value( Z502_REG_1 );
+    snapshot_write_value( Z502_REG_2 );
+    snapshot_write_value( Z502_REG_3 );
+    snapshot_write_value( Z502_REG_4 );
+    snapshot_write_value( Z502_REG_5 );
+    snapshot_write_value( Z502_REG_6 );
+    snapshot_write_value( Z502_REG_7 );
+    snapshot_write_value( Z502_REG_8 );
+    snapshot_write_value( Z502_REG_9 );
+
+#ifdef  LINUX
+    setstate( random_state );           /* Brings its position up to date */
+#endif
+    Z502_SNAPSHOT_WRITE( random_state, sizeof( random_state ) );
+
+    if ( fclose( snapshot_file ) != 0 )
+        {
+        printf( "Unable to write the snapshot %s\n", file_name );
+        GoToExit( 1 );
+    }
+    snapshot_file           = NULL;
+    snapshot_context_count  = 0;
+    printf( "The machine was written to the snapshot %s at time %d\n",
+            file_name, current_simulation_time );
+}                       /* End of take_snapshot                     */
+
+void    restore_snapshot( void )
+    {
+    SNAPSHOT_HEADER     header;
+    EVENT               *ep;
+    char                *sector_ptr;
+    INT32               index, channel, count, length;
+    INT16               disk_id;
+
+    snapshot_file = fopen( RestoreFile, "rb" );
+    if ( snapshot_file == NULL )
+        {
+        printf( "Unable to open the snapshot %s\n", RestoreFile );
+        GoToExit( 1 );
+    }
+    if (   fread( &header, sizeof( header ), 1, snapshot_file ) != 1
+        || strcmp( header.magic, SNAPSHOT_MAGIC ) != 0
+        || header.version != SNAPSHOT_VERSION )
+        {
+        printf( "%s is not a snapshot.\n", RestoreFile );
+        GoToExit( 1 );
+    }
+    if (   header.pgsize != PGSIZE || header.phys_mem_pgs != PHYS_MEM_PGS
+        || header.virtual_mem_pgs != VIRTUAL_MEM_PGS
+        || header.num_logical_sectors != NUM_LOGICAL_SECTORS
+        || header.number_of_disks != MAX_NUMBER_OF_DISKS
+        || header.disk_queue_depth != DiskQueueDepth
+        || header.tlb_sets != TlbSets || header.tlb_ways != TlbWays )
+        {
+        printf( "The snapshot %s was taken on a machine with a\n",
+                RestoreFile );
+        printf( "different geometry, disk queue depth or TLB.\n" );
+        GoToExit( 1 );
+    }
+    if (   header.image_length != IMAGE_END - IMAGE_START
+        || header.os_init_offset != (long)os_init - IMAGE_START )
+        {
+        printf( "The snapshot %s was taken by a different build\n",
+                RestoreFile );
+        printf( "of the simulator and OS.\n" );
+        GoToExit( 1 );
+    }
+    current_simulation_time = header.time;
+
+    Z502_SNAPSHOT_READ( MEMORY, MEMSIZE );
+    if ( tlb != NULL )
+        Z502_SNAPSHOT_READ( tlb, TlbSets * TlbWays * sizeof( TLB_ENTRY ) );
+    Z502_SNAPSHOT_READ( &count, sizeof( count ) );
+    for ( index = 0; index < count; index++ )
+        {
+        ep = alloc_event( );
+        Z502_SNAPSHOT_READ( ep, sizeof( EVENT ) );
+        ep->heap_index                  = index;
+        event_heap[event_heap_count++]  = ep;
+    }
+    publish_next_event_time( );
+    for ( channel = 0; channel < NUMBER_OF_TIMER_CHANNELS; channel++ )
+        {
+        Z502_SNAPSHOT_READ( &timer_state[channel].timer_in_use,
+                            sizeof( timer_state[channel].timer_in_use ) );
+        Z502_SNAPSHOT_READ( &timer_state[channel].period,
+                            sizeof( timer_state[channel].period ) );
+        Z502_SNAPSHOT_READ( &index, sizeof( index ) );
+        timer_state[channel].event_ptr
+                            = ( index >= 0 ) ? event_heap[index] : NULL;
+    }
+
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        {
+        Z502_SNAPSHOT_READ( &disk_state[disk_id], sizeof( DISK_STATE ) );
+        Z502_SNAPSHOT_READ( &index, sizeof( index ) );
+        disk_state[disk_id].event_ptr = ( index >= 0 ) ? event_heap[index]
+                                                       : NULL;
+    }
+    for ( disk_id = 1; disk_id <= MAX_NUMBER_OF_DISKS; disk_id++ )
+        {
+        Z502_SNAPSHOT_READ( &index, sizeof( index ) );
+        while ( index >= 0 )
+            {
+            create_sector_struct( disk_id, (INT16)index, &sector_ptr );
+            Z502_SNAPSHOT_READ( sector_ptr, PGSIZE );
+            Z502_SNAPSHOT_READ( &index, sizeof( index ) );
+        }
+    }
+
+    Z502_SNAPSHOT_READ( &event_sequence, sizeof( event_sequence ) );
+    Z502_SNAPSHOT_READ( &next_asid, sizeof( next_asid ) );
+    Z502_SNAPSHOT_READ( asid_holders, sizeof( asid_holders ) );
+    Z502_SNAPSHOT_READ( &tlb_clock, sizeof( tlb_clock ) );
+    Z502_SNAPSHOT_READ( &hardware_stats, sizeof( hardware_stats ) );
+    Z502_SNAPSHOT_READ( pmu_counts, sizeof( pmu_counts ) );
+    Z502_SNAPSHOT_READ( &NumberOfInterruptsStarted, sizeof( INT32 ) );
+    Z502_SNAPSHOT_READ( &NumberOfInterruptsCompleted, sizeof( INT32 ) );
+    Z502_SNAPSHOT_READ( STAT_VECTOR, sizeof( STAT_VECTOR ) );
+    Z502_SNAPSHOT_READ( interrupt_tag, sizeof( interrupt_tag ) );
+    Z502_SNAPSHOT_READ( interrupt_frame, sizeof( interrupt_frame ) );
+    completion_ring = (COMPLETION_RING *)snapshot_read_value( );
+    Z502_SNAPSHOT_READ( &completion_threshold, sizeof( INT32 ) );
+    Z502_SNAPSHOT_READ( &completion_delay, sizeof( INT32 ) );
+    Z502_SNAPSHOT_READ( &completion_waiting, sizeof( INT32 ) );
+    Z502_SNAPSHOT_READ( &completion_flush_pending, sizeof( BOOL ) );
+    Z502_SNAPSHOT_READ( InterlockRecord, sizeof( InterlockRecord ) );
+    Z502_SNAPSHOT_READ( &InterlocksHeld, sizeof( InterlocksHeld ) );
+    Z502_SNAPSHOT_READ( InterlockWord, sizeof( InterlockWord ) );
+
+    Z502_SNAPSHOT_READ( &count, sizeof( count ) );
+    for ( index = 0; index < count; index++ )
+        {
+        Z502_SNAPSHOT_READ( &length, sizeof( length ) );
+        if ( Z502_ALLOCATE_USER_DATA( length ) == NULL )
+            {
+            printf( "We didn't complete the calloc of user data.\n" );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+        Z502_SNAPSHOT_READ( user_data[index].data, length );
+    }
+    snapshot_context_count = 0;
+    os_snapshot_restore( );
+
+    Z502_SNAPSHOT_READ_CONTEXT( (void **)&Z502_CURRENT_CONTEXT, NULL );
+    Z502_SNAPSHOT_READ_CONTEXT( (void **)&z502_machine_next_context_ptr,
+                                NULL );
+    Z502_SNAPSHOT_READ_CONTEXT( (void **)&AccountingContext, NULL );
+    Z502_SNAPSHOT_READ( &index, sizeof( index ) );
+    Z502_PAGE_TBL_ADDR = ( index >= 0 ) ? snapshot_page_tables[index] : NULL;
+    Z502_SNAPSHOT_READ( &Z502_PAGE_TBL_LENGTH, sizeof( INT16 ) );
+    Z502_SNAPSHOT_READ( &Z502_PROGRAM_COUNTER, sizeof( INT16 ) );
+    Z502_SNAPSHOT_READ( &Z502_MODE, sizeof( INT16 ) );
+    Z502_SNAPSHOT_READ( &SYS_CALL_CALL_TYPE, sizeof( INT32 ) );
+    Z502_SNAPSHOT_READ( &z502_machine_kill_or_save, sizeof( BOOL ) );
+    Z502_ARG1.VAL   = snapshot_read_value( );
+    Z502_ARG2.VAL   = snapshot_read_value( );
+    Z502_ARG3.VAL   = snapshot_read_value( );
+    Z502_ARG4.VAL   = snapshot_read_value( );
+    Z502_ARG5.VAL   = snapshot_read_value( );
+    Z502_ARG6.VAL   = snapshot_read_value( );
+    Z502_REG_1      = snapshot_read_value( );
+    Z502_REG_2      = snapshot_read_value( );
+    Z502_REG_3      = snapshot_read_value( );
+    Z502_REG_4      = snapshot_read_value( );
+    Z502_REG_5      = snapshot_read_value( );
+    Z502_REG_6      = snapshot_read_value( );
+    Z502_REG_7      = snapshot_read_value( );
+    Z502_REG_8      = snapshot_read_value( );
+    Z502_REG_9      = snapshot_read_value( );
+
+    Z502_SNAPSHOT_READ( random_state, sizeof( random_state ) );
+#ifdef  LINUX
+    setstate( random_state );
+#endif
+    fclose( snapshot_file );
+    snapshot_file           = NULL;
+    snapshot_context_count  = 0;
+    printf( "Restored the snapshot %s, taken at time %d\n",
+            RestoreFile, current_simulation_time );
+}                       /* End of restore_snapshot                  */
+
+void    snapshot_write_value( long value )
+    {
+    SNAPSHOT_VALUE      v;
+    INT32               index;
+
+    v.kind      = SNAPSHOT_PLAIN;
+    v.block     = 0;
+    v.value     = value;
+    for ( index = 0; index < user_data_count; index++ )
+        if (   value >= (long)user_data[index].data
+            && value <  (long)user_data[index].data + user_data[index].length )
+            {
+            v.kind      = SNAPSHOT_USER_DATA;
+            v.block     = index;
+            v.value     = value - (long)user_data[index].data;
+        }
+    if (   v.kind == SNAPSHOT_PLAIN
+        && value >= IMAGE_START && value < IMAGE_END )
+        {
+        v.kind      = SNAPSHOT_IMAGE;
+        v.value     = value - IMAGE_START;
+    }
+    Z502_SNAPSHOT_WRITE( &v, sizeof( v ) );
+}                       /* End of snapshot_write_value              */
+
+long    snapshot_read_value( void )
+    {
+    SNAPSHOT_VALUE      v;
+
+    Z502_SNAPSHOT_READ( &v, sizeof( v ) );
+    if ( v.kind == SNAPSHOT_USER_DATA )
+        return( (long)user_data[v.block].data + v.value );
+    if ( v.kind == SNAPSHOT_IMAGE )
+        return( IMAGE_START + v.value );
+    return( v.value );
+}                       /* End of snapshot_read_value               */
+
+
+    /*****************************************************************
+
+        Z502_SNAPSHOT_WRITE()
+        Z502_SNAPSHOT_READ()
 
-    Actions include:
-        o Hunt along the sector data until we find the
-          appropriate sector.
-        o Return the address of the sector data.
+            The OS writes its own state to the snapshot with these,
+            from os_snapshot_save(), and reads it back in the same
+            order from os_snapshot_restore().  Pointers mean nothing
+            in a later run; the OS must write what they point at.
 
-    Error not 0 means the structure wasn't found.  This means that
-    noone has used this particular sector before and thus it hasn't
-    been written to.
     *****************************************************************/
 
-void    get_sector_struct( INT16         disk_id, 
-                           INT16         sector, 
-                           char          **sector_ptr, 
-                           INT32         *error )
+void    Z502_SNAPSHOT_WRITE( void *data, INT32 length )
     {
-    SECTOR              *temp_ptr;
+    if (   snapshot_file == NULL
+        || fwrite( data, 1, length, snapshot_file ) != (size_t)length )
+        {
+        printf( "Unable to write to the snapshot.\n" );
+        GoToExit( 1 );
+    }
+}                       /* End of Z502_SNAPSHOT_WRITE               */
 
-    *error      = 0;
-    temp_ptr    = (SECTOR *)sector_queue[disk_id].queue;
-    while (1)
+void    Z502_SNAPSHOT_READ( void *data, INT32 length )
+    {
+    if (   snapshot_file == NULL
+        || fread( data, 1, length, snapshot_file ) != (size_t)length )
         {
-        if ( temp_ptr == NULL )
-            {
-            *error = 1;
-            break;
-        }
+        printf( "Unable to read from the snapshot; it is cut short.\n" );
+        GoToExit( 1 );
+    }
+}                       /* End of Z502_SNAPSHOT_READ                */
 
-        if ( temp_ptr->structure_id != SECTOR_STRUCTURE_ID )
-            {
-            printf( "Bad structure id read in get_sector_structure.\n" );
-            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
-        }
 
-        if ( temp_ptr->sector   == sector )
-            {
-            *sector_ptr = (temp_ptr->sector_data);
-            break;
-        }
-        temp_ptr = (SECTOR *)temp_ptr->queue;
-    }                                   /* End while                */ 
-}                                       /* End get_sector_struct*/ 
-
     /*****************************************************************
 
-        create_sector_struct()
-
-    This is the routine that will create a sector structure and add it 
-    to the list of valid sectors.
+        Z502_SNAPSHOT_WRITE_CONTEXT()
+        Z502_SNAPSHOT_READ_CONTEXT()
 
-    Actions include:
-                o Allocate a structure for the event.
-                o Fill in the structure.
-                o Enqueue it.
-                o Pass back the pointer to the sector data.
+            Write a context to the snapshot along with the page table
+            it runs on, or read one back.  A context is written once,
+            however often it's named; after that just its number is.
+            Actions include:
+                o Write the entry point as the name the OS gives it
+                  in os_get_entry_name(), and turn it back into an
+                  address with os_get_entry_point().
+                o Write the registers and arguments so that pointers
+                  into user data or our image can be put right.
+                o On the way back in, point the context at the page
+                  table the OS gives - the one it has just restored.
 
-    WARNING: NO CHECK is made to ensure a structure for this sector 
-    doesn't exist.  The assumption is that the caller has previously 
-    failed a call to get_sector_struct.
     *****************************************************************/
 
-void    create_sector_struct( INT16   disk_id, 
-                              INT16   sector, 
-                              char    **returned_sector_ptr )
+void    Z502_SNAPSHOT_WRITE_CONTEXT( void *context, UINT16 *page_table )
     {
-    SECTOR              *ssp;
+    Z502CONTEXT     *cp = (Z502CONTEXT *)context;
+    Z502CONTEXT     copy;
+    char            name[SNAPSHOT_NAME_LENGTH];
+    char            *entry_name;
+    INT32           index;
+
+    for ( index = 0; index < snapshot_context_count; index++ )
+        if ( snapshot_contexts[index] == cp )
+            break;
+    if ( cp == NULL )
+        index = -1;
+    Z502_SNAPSHOT_WRITE( &index, sizeof( index ) );
+    if ( index < snapshot_context_count )
+        return;
 
-    ssp = ( SECTOR *)malloc ( sizeof( SECTOR ) );
-    if ( ssp == NULL )
+    snapshot_contexts    = (Z502CONTEXT **)realloc( snapshot_contexts,
+                    ( snapshot_context_count + 1 ) * sizeof( Z502CONTEXT * ) );
+    snapshot_page_tables = (UINT16 **)realloc( snapshot_page_tables,
+                    ( snapshot_context_count + 1 ) * sizeof( UINT16 * ) );
+    if ( snapshot_contexts == NULL || snapshot_page_tables == NULL )
         {
-        printf( "We didn't complete the malloc in create_sector_struct.\n" );
-        printf( "A malloc returned with a NULL pointer.\n" );
-        z502_internal_panic( ERR_OS502_GENERATED_BUG      );
+        printf( "We didn't complete the malloc of the snapshot contexts.\n" );
+        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+    }
+    snapshot_contexts[snapshot_context_count]       = cp;
+    snapshot_page_tables[snapshot_context_count]    = page_table;
+    snapshot_context_count++;
+
+    entry_name = os_get_entry_name( cp->entry );
+    if ( entry_name == NULL )
+        {
+        printf( "The OS has no name for the entry point of a context,\n" );
+        printf( "so it can't be written to the snapshot.\n" );
+        GoToExit( 1 );
+    }
+    memset( name, 0, sizeof( name ) );
+    strncpy( name, entry_name, sizeof( name ) - 1 );
+    Z502_SNAPSHOT_WRITE( name, sizeof( name ) );
+
+    copy                = *cp;          /* Of page_table_ptr, only      */
+    copy.entry          = NULL;         /*   whether it's NULL counts   */
+    Z502_SNAPSHOT_WRITE( &copy, sizeof( copy ) );
+    snapshot_write_value( cp->arg1.VAL );
+    snapshot_write_value( cp->arg2.VAL );
+    snapshot_write_value( cp->arg3.VAL );
+    snapshot_write_value( cp->arg4.VAL );
+    snapshot_write_value( cp->arg5.VAL );
+    snapshot_write_value( cp->arg6.VAL );
+    snapshot_write_value( cp->reg1 );
+    snapshot_write_value( cp->reg2 );
+    snapshot_write_value( cp->reg3 );
+    snapshot_write_value( cp->reg4 );
+    snapshot_write_value( cp->reg5 );
+    snapshot_write_value( cp->reg6 );
+    snapshot_write_value( cp->reg7 );
+    snapshot_write_value( cp->reg8 );
+    snapshot_write_value( cp->reg9 );
+}                       /* End of Z502_SNAPSHOT_WRITE_CONTEXT       */
+
+void    Z502_SNAPSHOT_READ_CONTEXT( void **context, UINT16 *page_table )
+    {
+    Z502CONTEXT     *cp;
+    char            name[SNAPSHOT_NAME_LENGTH];
+    INT32           index;
+
+    Z502_SNAPSHOT_READ( &index, sizeof( index ) );
+    if ( index < 0 )
+        {
+        *context = NULL;
+        return;
+    }
+    if ( index < snapshot_context_count )
+        {
+        *context = snapshot_contexts[index];
+        return;
+    }
+
+    cp = (Z502CONTEXT *)slab_alloc( &context_slab );
+    snapshot_contexts    = (Z502CONTEXT **)realloc( snapshot_contexts,
+                    ( snapshot_context_count + 1 ) * sizeof( Z502CONTEXT * ) );
+    snapshot_page_tables = (UINT16 **)realloc( snapshot_page_tables,
+                    ( snapshot_context_count + 1 ) * sizeof( UINT16 * ) );
+    if (   index != snapshot_context_count
+        || snapshot_contexts == NULL || snapshot_page_tables == NULL )
+        {
+        printf( "The contexts in the snapshot are out of order.\n" );
+        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+    }
+    snapshot_contexts[snapshot_context_count]       = cp;
+    snapshot_page_tables[snapshot_context_count]    = page_table;
+    snapshot_context_count++;
+
+    Z502_SNAPSHOT_READ( name, sizeof( name ) );
+    Z502_SNAPSHOT_READ( cp, sizeof( Z502CONTEXT ) );
+    cp->entry = os_get_entry_point( name );
+    if ( cp->entry == NULL )
+        {
+        printf( "The OS has no routine called %s to run a context\n", name );
+        printf( "from the snapshot on.\n" );
+        GoToExit( 1 );
     }
-    ssp->structure_id   = SECTOR_STRUCTURE_ID;
-    ssp->disk_id        = disk_id;
-    ssp->sector         = sector;
-    *returned_sector_ptr = (ssp->sector_data); 
+    if ( cp->page_table_ptr != NULL )
+        cp->page_table_ptr = page_table;
+    cp->arg1.VAL    = snapshot_read_value( );
+    cp->arg2.VAL    = snapshot_read_value( );
+    cp->arg3.VAL    = snapshot_read_value( );
+    cp->arg4.VAL    = snapshot_read_value( );
+    cp->arg5.VAL    = snapshot_read_value( );
+    cp->arg6.VAL    = snapshot_read_value( );
+    cp->reg1        = snapshot_read_value( );
+    cp->reg2        = snapshot_read_value( );
+    cp->reg3        = snapshot_read_value( );
+    cp->reg4        = snapshot_read_value( );
+    cp->reg5        = snapshot_read_value( );
+    cp->reg6        = snapshot_read_value( );
+    cp->reg7        = snapshot_read_value( );
+    cp->reg8        = snapshot_read_value( );
+    cp->reg9        = snapshot_read_value( );
+    *context = cp;
+}                       /* End of Z502_SNAPSHOT_READ_CONTEXT        */
 
-    /* Enqueue this new structure on the HEAD of the queue for this disk   */
-    ssp->queue                   = sector_queue[disk_id].queue;   
-    sector_queue[disk_id].queue  = (INT32 *)ssp;
 
-}                       /* End of create_sector_struct              */
+    /*****************************************************************
+
+        Z502_ALLOCATE_USER_DATA()
+
+            A user program that needs more room than its registers
+            gets it here rather than from the host's heap, so that a
+            snapshot can carry it and point the registers back at it.
+            Like calloc(), the memory is set to 0, and NULL comes back
+            if there isn't any.  It's never freed.
+
+    *****************************************************************/
+
+void    *Z502_ALLOCATE_USER_DATA( INT32 length )
+    {
+    USER_DATA   *grown;
+    char        *data;
+
+    GetLock ( HardwareLock, "Z502_ALLOCATE_USER_DATA" );
+    data  = (char *)calloc( 1, length );
+    grown = (USER_DATA *)realloc( user_data,
+                        ( user_data_count + 1 ) * sizeof( USER_DATA ) );
+    if ( grown != NULL )
+        user_data = grown;
+    if ( data == NULL || grown == NULL )
+        {
+        free( data );
+        ReleaseLock ( HardwareLock, "Z502_ALLOCATE_USER_DATA" );
+        return( NULL );
+    }
+    user_data[user_data_count].data     = data;
+    user_data[user_data_count].length   = length;
+    user_data_count++;
+    ReleaseLock ( HardwareLock, "Z502_ALLOCATE_USER_DATA" );
+    return( data );
+}                       /* End of Z502_ALLOCATE_USER_DATA           */
 
 
 
@@ -2300,10 +5803,11 @@ int    GetMyTid( )    {
 /**************************************************************************
            BaseThread
     Returns TRUE if the caller is the base thread, 
-    FALSE if not (for instance if it's the interrupt thread).
+    FALSE if not (for instance if it's the interrupt thread, or the
+    interrupt handler running inline with --single-thread).
 **************************************************************************/
 int  BaseThread()   {
-    if ( GetMyTid() == BaseTid )
+    if ( GetMyTid() == BaseTid && InlineInterrupt == FALSE )
         return( TRUE );
     return( FALSE );
 }                                    // End of BaseThread
@@ -2383,6 +5887,8 @@ int    GetTryLock( UINT32 RequestedMutex )  {
 #endif
 #if defined LINUX || defined MAC
     LockReturn = pthread_mutex_trylock( &(LocalMutex[RequestedMutex])  );
+    if ( LockReturn == 0 && LockStatistics )
+        lock_stats_acquired( RequestedMutex, -1 );
 //    printf( "Code Returned in GetTRyLock is %d\n", LockReturn );
 
     if ( LockReturn == EINVAL )
@@ -2413,6 +5919,7 @@ int    GetTryLock( UINT32 RequestedMutex )  {
 int    GetLock( UINT32 RequestedMutex, char *CallingRoutine )   {
     INT32    LockReturn;
     int      ReturnValue = FALSE;
+    double   WaitStart = 0;
 #ifdef   NT
     HANDLE   MemoryMutex = (HANDLE)RequestedMutex;
 #endif
@@ -2429,7 +5936,11 @@ int    GetLock( UINT32 RequestedMutex, char *CallingRoutine )   {
 #endif
 
 #if defined LINUX || defined MAC
+    if ( LockStatistics )
+        WaitStart = lock_stats_now( );
     LockReturn = pthread_mutex_lock( &(LocalMutex[RequestedMutex])  );
+    if ( LockReturn == 0 && LockStatistics )
+        lock_stats_acquired( RequestedMutex, WaitStart );
     if ( LockReturn == EINVAL )
         printf( "PANIC in GetLock - mutex isn't initialized\n");
     if ( LockReturn == EFAULT )
@@ -2464,6 +5975,8 @@ int    ReleaseLock( UINT32 RequestedMutex, char* CallingRoutine )  {
         ReturnValue = TRUE;
 #endif
 #if defined LINUX || defined MAC
+    if ( LockStatistics )             //  Must be done while still held
+        lock_stats_released( RequestedMutex );
     LockReturn = pthread_mutex_unlock( &(LocalMutex[RequestedMutex]) );
 //    printf( "Return Code in Release Lock = %d\n", LockReturn );
 
@@ -2479,6 +5992,90 @@ int    ReleaseLock( UINT32 RequestedMutex, char* CallingRoutine )  {
     PrintLockDebug( " RelLock", 3, CallingRoutine, RequestedMutex, ReturnValue );
     return( ReturnValue );
 }                               /* End of ReleaseLock     */
+
+/**************************************************************************
+           Lock Statistics
+    With --lock-stats, GetLock, GetTryLock and ReleaseLock keep a
+    LOCK_STATS entry for each mutex.  An entry is only updated by the
+    thread holding that mutex, so the entries need no lock of their own.
+    Only the LINUX and MAC builds keep these.
+
+    lock_stats_now()      - a timestamp in nanoseconds.
+    lock_stats_acquired() - count an acquisition and the time spent
+                            waiting for it (WaitStart < 0 for none).
+    lock_stats_released() - add the time the lock was held.
+    print_lock_stats()    - report them at the end of the run.
+**************************************************************************/
+
+double  lock_stats_now( void )  {
+#ifdef   LINUX
+    struct timespec     Now;
+
+    clock_gettime( CLOCK_MONOTONIC, &Now );
+    return( (double)Now.tv_sec * 1e9 + (double)Now.tv_nsec );
+#endif
+#ifdef   MAC
+    struct timeval      Now;
+
+    gettimeofday( &Now, NULL );
+    return( (double)Now.tv_sec * 1e9 + (double)Now.tv_usec * 1e3 );
+#endif
+#ifdef   NT
+    return( 0 );
+#endif
+}                               /* End of lock_stats_now  */
+
+void    lock_stats_acquired( UINT32 Mutex, double WaitStart )  {
+    LOCK_STATS  *Stats;
+
+    if ( Mutex >= LOCK_STATS_SIZE )
+        return;
+    Stats = &lock_stats[Mutex];
+    Stats->acquired_at = lock_stats_now( );
+    Stats->acquisitions++;
+    if ( WaitStart >= 0 )
+        Stats->wait_ns += Stats->acquired_at - WaitStart;
+}                               /* End of lock_stats_acquired  */
+
+void    lock_stats_released( UINT32 Mutex )  {
+    LOCK_STATS  *Stats;
+    double      Held;
+
+    if ( Mutex >= LOCK_STATS_SIZE || lock_stats[Mutex].acquired_at == 0 )
+        return;
+    Stats = &lock_stats[Mutex];
+    Held  = lock_stats_now( ) - Stats->acquired_at;
+    Stats->acquired_at = 0;
+    Stats->hold_ns += Held;
+    if ( Held > Stats->longest_hold_ns )
+        Stats->longest_hold_ns = Held;
+}                               /* End of lock_stats_released  */
+
+void    print_lock_stats( void )  {
+    INT32       Index;
+    INT32       Mutex[4];
+    char        *Name[4] = { "Event", "Interrupt", "Hardware", "Memory" };
+    LOCK_STATS  *Stats;
+
+    Mutex[0] = EventLock;
+    Mutex[1] = InterruptLock;
+    Mutex[2] = HardwareLock;
+    Mutex[3] = MemoryLock;
+    printf( "Lock Statistics (%s memory path)\n",
+            LockedMemoryPath ? "locked" : "unlocked" );
+    for ( Index = 0; Index < 4; Index++ )
+        {
+        if ( Mutex[Index] < 0 || Mutex[Index] >= LOCK_STATS_SIZE )
+            continue;
+        Stats = &lock_stats[ Mutex[Index] ];
+        printf( "%-9s: Acquired = %9d:  Wait = %10.3f ms:  Held = %10.3f ms:  "
+                "Average Hold = %8.1f ns:  Longest = %10.1f ns\n",
+                Name[Index], Stats->acquisitions, Stats->wait_ns / 1e6,
+                Stats->hold_ns / 1e6,
+                Stats->acquisitions > 0 ? Stats->hold_ns / Stats->acquisitions : 0.0,
+                Stats->longest_hold_ns );
+    }
+}                               /* End of print_lock_stats  */
 /**************************************************************************
            PrintLockDebug
     Print out message indicating what's happening with locks
@@ -2524,6 +6121,7 @@ void    PrintLockDebug( char *Text, int Action, char *LockCaller, int Mutex, int
     if ( Mutex == EventLock )     strcpy( WhichLock, "Event  " );
     if ( Mutex == InterruptLock ) strcpy( WhichLock, "Int    " );
     if ( Mutex == HardwareLock )  strcpy( WhichLock, "Hard   " );
+    if ( Mutex == MemoryLock )    strcpy( WhichLock, "Mem    " );
     LockID = -1;
     for ( i = 0; i < LockDB.NumberOfLocks; i++ ) {
         if ( LockDB.LockID[i] == Mutex )
@@ -2741,6 +6339,457 @@ void    GoToExit( int Value )
 
 
 
+    /*****************************************************************
+
+        Hardware Options
+
+            These are the options understood by the hardware.  They
+            are given on the command line as --name=value, or --name
+            for a flag, and may appear anywhere among the arguments.
+    *****************************************************************/
+
+HARDWARE_OPTION HardwareOptions[] =
+    {
+    { "disk-image", OPTION_STRING, &DiskImageDirectory,
+      "back each disk with DIR/diskNN.img (created if missing)" },
+    { "disk-queue-depth", OPTION_INT, &DiskQueueDepth,
+      "requests each disk will hold at once (1 - 32, default 1)" },
+    { "tlb",        OPTION_STRING, &TlbGeometry,
+      "add a TLB of SETSxWAYS entries, for example 16x4" },
+    { "membench",   OPTION_FLAG,   &MemoryBenchmark,
+      "time MEM_READ and MEM_WRITE, then exit" },
+    { "locked-memory", OPTION_FLAG, &LockedMemoryPath,
+      "take the HardwareLock on every memory access, as before" },
+    { "lock-stats", OPTION_FLAG,   &LockStatistics,
+      "report how long each lock was waited for and held" },
+    { "single-thread", OPTION_FLAG, &SingleThread,
+      "deliver interrupts on the base thread; runs are repeatable" },
+    { "cpus",       OPTION_INT,    &NumberOfCpus,
+      "give the machine N processors (1 - 8, default 1)" },
+    { "phys-mem-pages", OPTION_INT, &Z502Geometry.phys_mem_pgs,
+      "frames of physical memory (1 - 4096, default 64)" },
+    { "page-size",  OPTION_INT,    &Z502Geometry.pgsize,
+      "bytes in a page and a disk sector (16 - 1024, a power of 2)" },
+    { "virtual-mem-pages", OPTION_INT, &Z502Geometry.virtual_mem_pgs,
+      "pages of virtual memory (1 - 16384, default 1024)" },
+    { "disk-sectors", OPTION_INT,  &Z502Geometry.num_logical_sectors,
+      "sectors on each disk (1 - 32767, default 1600)" },
+    { "disks",      OPTION_INT,    &Z502Geometry.number_of_disks,
+      "number of disks (1 - 12, default 12)" },
+    { "record",     OPTION_STRING, &RecordFile,
+      "write where each interrupt was delivered to FILE" },
+    { "replay",     OPTION_STRING, &ReplayFile,
+      "deliver interrupts where the recording in FILE did" },
+    { "snapshot",   OPTION_STRING, &SnapshotFile,
+      "write the machine to FILE at the switch after --snapshot-at" },
+    { "snapshot-at", OPTION_INT,   &SnapshotTime,
+      "simulated time from which to take the --snapshot" },
+    { "restore",    OPTION_STRING, &RestoreFile,
+      "start from the snapshot in FILE instead of booting the OS" },
+    { "stats-file", OPTION_STRING, &StatsFile,
+      "append statistics to FILE, as CSV if it ends in .csv, else JSON" },
+    { "stats-interval", OPTION_INT, &StatsInterval,
+      "simulated ticks between --stats-file lines (default 1000)" },
+    { "cost",       OPTION_COST,   NULL,
+      "set what an operation costs, for example memory-access=1" },
+    { "disk-model", OPTION_DISK_MODEL, NULL,
+      "[DISK:]hdd|ssd|ram|rotational[,NAME=N]... for one disk or all" },
+    { "config",     OPTION_CONFIG, NULL,
+      "read more options, one name=value to a line, from FILE" },
+    { NULL,         OPTION_FLAG,   NULL,                NULL }
+};
+
+/*  The names --cost knows the costs by.                            */
+
+struct
+    {
+    char        *name;
+    INT32       *cost;
+} cost_names[] =
+    {
+    { "memory-access",    &Z502Costs.memory_access },
+    { "atomic",           &Z502Costs.atomic },
+    { "memory-mapped-io", &Z502Costs.memory_mapped_io },
+    { "disk-access",      &Z502Costs.disk_access },
+    { "delay",            &Z502Costs.delay },
+    { "clock",            &Z502Costs.clock },
+    { "timer",            &Z502Costs.timer },
+    { "make-context",     &Z502Costs.make_context },
+    { "destroy-context",  &Z502Costs.destroy_context },
+    { "switch-context",   &Z502Costs.switch_context },
+    { "software-trap",    &Z502Costs.software_trap },
+    { "cpu-instruction",  &Z502Costs.cpu_instruction },
+    { "call",             &Z502Costs.call },
+    { "tlb-miss",         &Z502Costs.tlb_miss },
+    { NULL,               NULL }
+};
+
+/*  The disk models --disk-model knows, each with what it starts
+    from, and the names of the parameters that may follow it.       */
+
+struct
+    {
+    char        *name;
+    DISK_MODEL  model;
+} disk_model_names[] =
+    {
+    { "hdd",        { DISK_MODEL_HDD,        100, 20, 10,  0,   0, 0 } },
+    { "ssd",        { DISK_MODEL_SSD,         25,  1,  2,  0,   0, 0 } },
+    { "ram",        { DISK_MODEL_RAM,          2,  1,  0,  0,   0, 0 } },
+    { "rotational", { DISK_MODEL_ROTATIONAL,  10,  1,  0, 32, 160, 2 } },
+    { NULL,         { DISK_MODEL_DEFAULT,      0,  0,  0,  0,   0, 0 } }
+};
+
+struct
+    {
+    char        *name;
+    size_t      offset;
+} disk_model_parameters[] =
+    {
+    { "latency",            offsetof( DISK_MODEL, latency ) },
+    { "seek-divisor",       offsetof( DISK_MODEL, seek_divisor ) },
+    { "transfer",           offsetof( DISK_MODEL, transfer ) },
+    { "sectors-per-track",  offsetof( DISK_MODEL, sectors_per_track ) },
+    { "rotation",           offsetof( DISK_MODEL, rotation ) },
+    { "track-seek",         offsetof( DISK_MODEL, track_seek ) },
+    { NULL,                 0 }
+};
+
+    /*****************************************************************
+
+        parse_hardware_options()
+
+            Pick the hardware options out of the command line.  The
+            arguments that remain are handed on to the OS in
+            CALLING_ARGV, so the OS sees exactly what it always has.
+            Options are applied in order, so one given after a
+            --config overrides what the file said.
+    *****************************************************************/
+
+void    parse_hardware_options( int *argc, char *argv[] )
+    {
+    int         in, out;
+
+    out = 1;
+    for ( in = 1; in < *argc; in++ )
+        {
+        if ( strncmp( argv[in], "--", 2 ) != 0 )
+            {
+            argv[out++] = argv[in];
+            continue;
+        }
+        set_hardware_option( argv[in] + 2, argv[in] );
+    }
+    argv[out]   = NULL;
+    *argc       = out;
+}                       /* End of parse_hardware_options            */
+
+
+    /*****************************************************************
+
+        set_hardware_option()
+
+            Apply one option, given as name=value or just name for a
+            flag.  The value is kept, not copied, for string options.
+            Where is what to show in the message if it's not one we
+            know.
+    *****************************************************************/
+
+void    set_hardware_option( char *option, char *where )
+    {
+    INT16       i;
+    char        *value;
+    size_t      name_length;
+
+    value       = strchr( option, '=' );
+    name_length = ( value == NULL ) ? strlen( option )
+                                    : (size_t)( value - option );
+    if ( value != NULL )
+        value++;
+
+    for ( i = 0; HardwareOptions[i].name != NULL; i++ )
+        if (   strlen( HardwareOptions[i].name ) == name_length
+            && strncmp( HardwareOptions[i].name, option, name_length ) == 0 )
+            break;
+
+    if (   HardwareOptions[i].name == NULL
+        || ( HardwareOptions[i].type == OPTION_FLAG && value != NULL )
+        || ( HardwareOptions[i].type != OPTION_FLAG && value == NULL ) )
+        {
+        printf( "Unrecognized hardware option %s\n", where );
+        printf( "The hardware understands:\n" );
+        for ( i = 0; HardwareOptions[i].name != NULL; i++ )
+            printf( "    --%s%s\t%s\n", HardwareOptions[i].name,
+                    HardwareOptions[i].type == OPTION_FLAG ? ""
+                    : HardwareOptions[i].type == OPTION_INT ? "=N"
+                    : HardwareOptions[i].type == OPTION_CONFIG ? "=FILE"
+                    : HardwareOptions[i].type == OPTION_COST ? "=NAME=N"
+                    : HardwareOptions[i].type == OPTION_DISK_MODEL ? "=MODEL"
+                    : "=VALUE",
+                    HardwareOptions[i].help );
+        GoToExit( 1 );
+    }
+
+    if ( HardwareOptions[i].type == OPTION_FLAG )
+        *( BOOL *)HardwareOptions[i].value  = TRUE;
+    if ( HardwareOptions[i].type == OPTION_INT )
+        *( INT32 *)HardwareOptions[i].value = atoi( value );
+    if ( HardwareOptions[i].type == OPTION_STRING )
+        *( char **)HardwareOptions[i].value = value;
+    if ( HardwareOptions[i].type == OPTION_CONFIG )
+        read_hardware_config( value );
+    if ( HardwareOptions[i].type == OPTION_COST )
+        set_hardware_cost( value, where );
+    if ( HardwareOptions[i].type == OPTION_DISK_MODEL )
+        set_disk_model( value, where );
+}                       /* End of set_hardware_option               */
+
+
+    /*****************************************************************
+
+        set_hardware_cost()
+
+            Apply a --cost=NAME=N, where NAME is one of cost_names.
+            Where is what to show in the message if it's wrong.
+    *****************************************************************/
+
+void    set_hardware_cost( char *value, char *where )
+    {
+    INT16       i;
+    char        *number;
+    size_t      name_length;
+
+    number = strchr( value, '=' );
+    name_length = ( number == NULL ) ? 0 : (size_t)( number - value );
+    for ( i = 0; cost_names[i].name != NULL; i++ )
+        if (   strlen( cost_names[i].name ) == name_length
+            && strncmp( cost_names[i].name, value, name_length ) == 0 )
+            break;
+    if ( cost_names[i].name == NULL || atoi( number + 1 ) < 0 )
+        {
+        printf( "Unrecognized cost %s\n", where );
+        printf( "Give --cost=NAME=N, with N at least 0 and NAME one of:\n" );
+        for ( i = 0; cost_names[i].name != NULL; i++ )
+            printf( "    %-18s(now %d)\n", cost_names[i].name,
+                    *cost_names[i].cost );
+        GoToExit( 1 );
+    }
+    *cost_names[i].cost = atoi( number + 1 );
+}                       /* End of set_hardware_cost                 */
+
+
+    /*****************************************************************
+
+        set_disk_model()
+
+            Apply a --disk-model=[DISK:]MODEL[,NAME=N]...  Without a
+            disk number it's the model of every disk that hasn't been
+            given its own, whichever order they come in.  The model
+            starts from its entry in disk_model_names and then takes
+            the parameters given.
+    *****************************************************************/
+
+void    set_disk_model( char *value, char *where )
+    {
+    DISK_MODEL  model;
+    INT32       disk_id = 0;
+    INT16       i;
+    char        *text, *name, *number;
+    BOOL        bad;
+
+    text = strdup( value );
+    name = strchr( text, ':' );
+    if ( name != NULL )
+        {
+        *name++ = '\0';
+        disk_id = atoi( text );
+    }
+    else
+        name = text;
+    bad = ( disk_id < 0 || disk_id > MAX_NUMBER_OF_DISKS_LIMIT
+            || ( name != text && disk_id == 0 ) );
+
+    number = strchr( name, ',' );
+    if ( number != NULL )
+        *number++ = '\0';
+    for ( i = 0; disk_model_names[i].name != NULL; i++ )
+        if ( strcmp( disk_model_names[i].name, name ) == 0 )
+            break;
+    bad = bad || disk_model_names[i].name == NULL;
+    model = disk_model_names[i].model;
+
+    /*  Then NAME=N for each parameter given.                   */
+
+    while ( bad == FALSE && number != NULL )
+        {
+        name   = number;
+        number = strchr( name, ',' );
+        if ( number != NULL )
+            *number++ = '\0';
+        for ( i = 0; disk_model_parameters[i].name != NULL; i++ )
+            if (   strncmp( disk_model_parameters[i].name, name,
+                            strlen( disk_model_parameters[i].name ) ) == 0
+                && name[strlen( disk_model_parameters[i].name )] == '=' )
+                break;
+        if ( disk_model_parameters[i].name == NULL )
+            bad = TRUE;
+        else
+            *(INT32 *)( (char *)&model + disk_model_parameters[i].offset )
+                = atoi( strchr( name, '=' ) + 1 );
+    }
+    bad = bad || model.latency < 0 || model.seek_divisor < 1
+              || model.transfer < 0 || model.track_seek < 0
+              || (   model.kind == DISK_MODEL_ROTATIONAL
+                  && ( model.sectors_per_track < 1 || model.rotation < 1 ) );
+    free( text );
+    if ( bad )
+        {
+        printf( "Unrecognized disk model %s\n", where );
+        printf( "Give --disk-model=[DISK:]MODEL[,NAME=N]..., where MODEL is" );
+        for ( i = 0; disk_model_names[i].name != NULL; i++ )
+            printf( " %s", disk_model_names[i].name );
+        printf( "\nand NAME is" );
+        for ( i = 0; disk_model_parameters[i].name != NULL; i++ )
+            printf( " %s", disk_model_parameters[i].name );
+        printf( ".\n" );
+        GoToExit( 1 );
+    }
+    disk_models[disk_id] = model;
+}                       /* End of set_disk_model                    */
+
+
+    /*****************************************************************
+
+        read_hardware_config()
+
+            Apply the options in a configuration file.  Each line
+            holds one option, written as on the command line with or
+            without the leading "--".  Blank lines and lines starting
+            with '#' are skipped.
+    *****************************************************************/
+
+void    read_hardware_config( char *file_name )
+    {
+    FILE        *config;
+    char        line[256];
+    char        where[300];
+    char        *option;
+    size_t      length;
+    INT32       line_number = 0;
+
+    config = fopen( file_name, "r" );
+    if ( config == NULL )
+        {
+        printf( "Unable to open the hardware configuration %s\n", file_name );
+        GoToExit( 1 );
+    }
+    while ( fgets( line, sizeof( line ), config ) != NULL )
+        {
+        line_number++;
+        length = strlen( line );
+        while ( length > 0 && isspace( (unsigned char)line[length - 1] ) )
+            line[--length] = '\0';
+        option = line;
+        while ( isspace( (unsigned char)*option ) )
+            option++;
+        if ( *option == '\0' || *option == '#' )
+            continue;
+        if ( strncmp( option, "--", 2 ) == 0 )
+            option += 2;
+        snprintf( where, sizeof( where ), "%s (%s line %d)",
+                  option, file_name, line_number );
+        /*  String options keep a pointer to their value.       */
+        set_hardware_option( strdup( option ), where );
+    }
+    fclose( config );
+}                       /* End of read_hardware_config              */
+
+
+    /*****************************************************************
+
+        set_machine_geometry()
+
+            Once the options are in, check the machine's geometry and
+            build everything whose size depends on it.  Actions
+            include:
+                o Make sure each value is within its _LIMIT.  A page
+                  is also a disk sector, and must be a power of two.
+                o Work out PGBITS and VMEMPGBITS.
+                o Allocate MEMORY and fill it with a known pattern.
+                o Allocate the disk state and the per disk tables,
+                  and size the slab objects that hold the sectors.
+    *****************************************************************/
+
+void    set_machine_geometry( void )
+    {
+    Z502_GEOMETRY       *g = &Z502Geometry;
+    INT32               i;
+
+    if ( g->phys_mem_pgs < 1 || g->phys_mem_pgs > PHYS_MEM_PGS_LIMIT )
+        {
+        printf( "Physical memory must be between 1 and %d pages.\n",
+                PHYS_MEM_PGS_LIMIT );
+        GoToExit( 1 );
+    }
+    if (   g->pgsize < 16 || g->pgsize > PGSIZE_LIMIT
+        || ( g->pgsize & ( g->pgsize - 1 ) ) != 0 )
+        {
+        printf( "The page size must be a power of 2 between 16 and %d.\n",
+                PGSIZE_LIMIT );
+        GoToExit( 1 );
+    }
+    if ( g->virtual_mem_pgs < 1 || g->virtual_mem_pgs > VIRTUAL_MEM_PGS_LIMIT )
+        {
+        printf( "Virtual memory must be between 1 and %d pages.\n",
+                VIRTUAL_MEM_PGS_LIMIT );
+        GoToExit( 1 );
+    }
+    if (   g->num_logical_sectors < 1
+        || g->num_logical_sectors > NUM_LOGICAL_SECTORS_LIMIT )
+        {
+        printf( "A disk must have between 1 and %d sectors.\n",
+                NUM_LOGICAL_SECTORS_LIMIT );
+        GoToExit( 1 );
+    }
+    if ( g->number_of_disks < 1 || g->number_of_disks > MAX_NUMBER_OF_DISKS_LIMIT )
+        {
+        printf( "The number of disks must be between 1 and %d.\n",
+                MAX_NUMBER_OF_DISKS_LIMIT );
+        GoToExit( 1 );
+    }
+    for ( g->pgbits = 0; ( 1 << g->pgbits ) < g->pgsize; g->pgbits++ )
+        ;
+    for ( g->vmempgbits = 0; ( 1 << g->vmempgbits ) < g->virtual_mem_pgs;
+          g->vmempgbits++ )
+        ;
+
+    MEMORY     = (char *)malloc( MEMSIZE );
+    disk_state = (DISK_STATE *)calloc( MAX_NUMBER_OF_DISKS + 1,
+                                       sizeof( DISK_STATE ) );
+    disk_image = (DISK_IMAGE *)calloc( MAX_NUMBER_OF_DISKS + 1,
+                                       sizeof( DISK_IMAGE ) );
+    if ( MEMORY == NULL || disk_state == NULL || disk_image == NULL )
+        {
+        printf( "We didn't complete the malloc of memory and disks.\n" );
+        z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+    }
+    for ( i = 0; i < MEMSIZE; i++ )
+        MEMORY[i] = i % 256;
+    for ( i = 1; i <= MAX_NUMBER_OF_DISKS; i++ )
+        {
+        sector_table[i] = (SECTOR_CHUNK **)calloc( SECTOR_CHUNKS_PER_DISK,
+                                                   sizeof( SECTOR_CHUNK * ) );
+        if ( sector_table[i] == NULL )
+            {
+            printf( "We didn't complete the calloc of a sector table.\n" );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+    }
+    sector_slab.object_size = sizeof( SECTOR_CHUNK )
+                            + (size_t)SECTORS_PER_CHUNK * PGSIZE;
+}                       /* End of set_machine_geometry              */
+
+
     /*****************************************************************
 
         main()
@@ -2757,29 +6806,28 @@ int    main( int argc, char  *argv[] )
     {
     void        *starting_context_ptr;
     INT16       i;
+    static INT32 cpu_numbers[MAX_NUMBER_OF_CPUS];
 
     printf( "This is Simulation Version %s and Hardware Version %s.\n\n", 
             CURRENT_REL, HARDWARE_VERSION );
-    event_queue.queue   = NULL;
     BaseTid = GetMyTid();
     CreateLock( &EventLock );
     CreateLock( &InterruptLock );
     CreateLock( &HardwareLock );
+    CreateLock( &MemoryLock );
     CreateCondition( &InterruptCondition );
-    for ( i = 1; i < MAX_NUMBER_OF_DISKS; i++ )
-        {
-        sector_queue[i].queue           = NULL;
-        disk_state[i].last_sector       = 0;
-        disk_state[i].disk_in_use       = FALSE;
-        disk_state[i].event_ptr         = NULL;
-        hardware_stats.disk_reads[i]    = 0;
-        hardware_stats.disk_writes[i]   = 0;
-        hardware_stats.time_disk_busy[i]= 0;
-    }
     hardware_stats.context_switches     = 0;
     hardware_stats.number_charge_times  = 0;
     hardware_stats.number_faults        = 0;
     hardware_stats.number_mask_set_seen = 0;
+    hardware_stats.sector_chunks        = 0;
+    hardware_stats.disk_storage_bytes   = 0;
+    hardware_stats.translation_hits     = 0;
+    hardware_stats.translation_misses   = 0;
+    hardware_stats.tlb_hits             = 0;
+    hardware_stats.tlb_misses           = 0;
+    hardware_stats.tlb_page_invalidations = 0;
+    hardware_stats.tlb_flushes          = 0;
 
     for ( i = 0; i <= LARGEST_STAT_VECTOR_INDEX; i++ )
     {
@@ -2789,28 +6837,124 @@ int    main( int argc, char  *argv[] )
     for ( i = 0; i < MEMORY_INTERLOCK_SIZE; i++ )
         InterlockRecord[i] = -1;
 
-    for ( i = 0; i < sizeof(MEMORY); i++ )
-        MEMORY[i] = i % 256;
+    parse_hardware_options( &argc, argv );
+    set_machine_geometry();
+    for ( i = 1; i < MAX_NUMBER_OF_DISKS; i++ )
+        {
+        disk_state[i].last_sector       = 0;
+        disk_state[i].disk_in_use       = FALSE;
+        disk_state[i].event_ptr         = NULL;
+        disk_state[i].requests_queued   = 0;
+        disk_state[i].frame             = -1;
+        hardware_stats.disk_reads[i]    = 0;
+        hardware_stats.disk_writes[i]   = 0;
+        hardware_stats.time_disk_busy[i]= 0;
+    }
+    if ( DiskQueueDepth < 1 || DiskQueueDepth > DISK_QUEUE_MAX_DEPTH )
+        {
+        printf( "The disk queue depth must be between 1 and %d.\n",
+                DISK_QUEUE_MAX_DEPTH );
+        GoToExit( 1 );
+    }
+    if ( NumberOfCpus < 1 || NumberOfCpus > MAX_NUMBER_OF_CPUS )
+        {
+        printf( "The number of processors must be between 1 and %d.\n",
+                MAX_NUMBER_OF_CPUS );
+        GoToExit( 1 );
+    }
+    /*  The processors take turns on their host threads, and each one
+        takes its own interrupts, so there is no interrupt thread.  */
+    if ( NumberOfCpus > 1 )
+        SingleThread = TRUE;
+    if ( DiskImageDirectory != NULL )
+        open_disk_images();
+    if ( RecordFile != NULL || ReplayFile != NULL )
+        open_interrupt_log();
+    if ( SnapshotFile != NULL || RestoreFile != NULL )
+        open_snapshot();
+    if ( StatsFile != NULL )
+        open_stats_export();
+
+    if ( TlbGeometry != NULL )
+        {
+        if (   sscanf( TlbGeometry, "%dx%d", &TlbSets, &TlbWays ) != 2
+            || TlbSets < 1 || TlbSets > TLB_MAX_SETS
+            || TlbWays < 1 || TlbWays > TLB_MAX_WAYS )
+            {
+            printf( "The TLB must be given as SETSxWAYS with at most %d sets\n",
+                    TLB_MAX_SETS );
+            printf( "and %d ways.\n", TLB_MAX_WAYS );
+            GoToExit( 1 );
+        }
+        tlb = (TLB_ENTRY *)calloc( TlbSets * TlbWays, sizeof( TLB_ENTRY ) );
+        if ( tlb == NULL )
+            {
+            printf( "We didn't complete the calloc of the TLB.\n" );
+            z502_internal_panic( ERR_Z502_INTERNAL_BUG );
+        }
+    }
+    if ( MemoryBenchmark == TRUE )
+        memory_benchmark();
 
     CALLING_ARGC                        = ( INT32 )argc;/* make global  */
     CALLING_ARGV                        = argv;
 
-    timer_state.timer_in_use            = 0;
-    timer_state.event_ptr               = NULL;
+    for ( i = 0; i < NUMBER_OF_TIMER_CHANNELS; i++ )
+        {
+        timer_state[i].timer_in_use     = 0;
+        timer_state[i].event_ptr        = NULL;
+        timer_state[i].period           = 0;
+    }
 
     Z502_MODE                       = KERNEL_MODE;
 
-    Z502_MAKE_CONTEXT( &starting_context_ptr,  
+    if ( RestoreFile != NULL )
+        restore_snapshot();
+    else
+        {
+        Z502_MAKE_CONTEXT( &starting_context_ptr,  
                                         ( void *)os_init, KERNEL_MODE );
-    Z502_CURRENT_CONTEXT            = NULL;
-    z502_machine_next_context_ptr       = starting_context_ptr;
+        Z502_CURRENT_CONTEXT            = NULL;
+        z502_machine_next_context_ptr   = starting_context_ptr;
+    }
     POP_THE_STACK                       = TRUE;
 
-    CreateAThread( (int *)hardware_interrupt, &EventLock );
-    DoSleep(100);
-    ChangeThreadPriority( LESS_FAVORABLE_PRIORITY );
+    if ( SingleThread == FALSE )
+        {
+        CreateAThread( (int *)hardware_interrupt, &EventLock );
+        DoSleep(100);
+        ChangeThreadPriority( LESS_FAVORABLE_PRIORITY );
+    }
+
+    cpu_state[0].state                  = CPU_RUNNING;
+    if ( NumberOfCpus > 1 )
+        {
+        CreateLock( &CpuLock );
+        for ( i = 0; i < NumberOfCpus; i++ )
+            CreateCondition( &cpu_state[i].condition );
+        for ( i = 1; i < NumberOfCpus; i++ )
+            {
+            cpu_numbers[i] = i;
+            CreateAThread( (void *)cpu_thread, &cpu_numbers[i] );
+        }
+    }
+    base_level( );
+    return( 0 );
+}                                               /* End of main      */
 
 
+    /*****************************************************************
+
+        base_level()
+
+            Every processor's host thread ends up here and never
+            leaves.  Memory references and system calls made by user
+            code come back here to be carried out.
+
+    *****************************************************************/
+
+void    base_level( void )
+    {
     while( 1 )          /* This is base level - always come here*/
         {
         /*      If popping the stack, we're just trying to get 
@@ -2819,6 +6963,12 @@ int    main( int argc, char  *argv[] )
         while ( POP_THE_STACK == TRUE )
             change_context();
 
+        /*      Between instructions is a good time to let another
+                processor that has fallen behind catch up.          */
+
+        if ( NumberOfCpus > 1 )
+            cpu_yield( );
+
         if ( SYS_CALL_CALL_TYPE == SYSNUM_MEM_READ )
             Z502_MEM_READ( Z502_ARG1.VAL, (INT32 *)Z502_ARG2.PTR );
         if ( SYS_CALL_CALL_TYPE == SYSNUM_MEM_WRITE )
@@ -2826,11 +6976,16 @@ int    main( int argc, char  *argv[] )
         if ( SYS_CALL_CALL_TYPE == SYSNUM_READ_MODIFY )
             Z502_READ_MODIFY( Z502_ARG1.VAL, Z502_ARG2.VAL,
                               Z502_ARG3.VAL, (INT32 *)Z502_ARG4.PTR );
+        if ( SYS_CALL_CALL_TYPE == SYSNUM_ATOMIC )
+            Z502_ATOMIC( Z502_ARG1.VAL, Z502_ARG2.VAL, Z502_ARG3.VAL,
+                         Z502_ARG4.VAL, (INT32 *)Z502_ARG5.PTR,
+                         (INT32 *)Z502_ARG6.PTR );
 
         if (   SYS_CALL_CALL_TYPE != SYSNUM_MEM_WRITE 
             && SYS_CALL_CALL_TYPE != SYSNUM_MEM_READ 
-            && SYS_CALL_CALL_TYPE != SYSNUM_READ_MODIFY )
+            && SYS_CALL_CALL_TYPE != SYSNUM_READ_MODIFY
+            && SYS_CALL_CALL_TYPE != SYSNUM_ATOMIC )
             software_trap();
 
     }                                           /* End of while(1)  */
-}                                               /* End of main      */
+}                                               /* End of base_level */
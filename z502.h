@@ -17,18 +17,58 @@
                         to store addresses.
 *********************************************************************/
 
-#define         COST_OF_MEMORY_ACCESS           1L
-#define         COST_OF_MEMORY_MAPPED_IO        1L
-#define         COST_OF_DISK_ACCESS             8L
-#define         COST_OF_DELAY                   2L
-#define         COST_OF_CLOCK                   3L
-#define         COST_OF_TIMER                   2L
-#define         COST_OF_MAKE_CONTEXT            20L
-#define         COST_OF_DESTROY_CONTEXT         10L
-#define         COST_OF_SWITCH_CONTEXT          15L
-#define         COST_OF_SOFTWARE_TRAP           5L
-#define         COST_OF_CPU_INSTRUCTION         1L
-#define         COST_OF_CALL                    2L
+/*  The costs are in Z502Costs (see global.h); COST_OF_CALL and
+    COST_OF_CPU_INSTRUCTION are in syscalls.h, since the OS and the
+    tests charge them too.                                          */
+
+#define         COST_OF_MEMORY_ACCESS           (long)Z502Costs.memory_access
+#define         COST_OF_ATOMIC                  (long)Z502Costs.atomic
+#define         COST_OF_MEMORY_MAPPED_IO        (long)Z502Costs.memory_mapped_io
+#define         COST_OF_DISK_ACCESS             (long)Z502Costs.disk_access
+#define         COST_OF_DELAY                   (long)Z502Costs.delay
+#define         COST_OF_CLOCK                   (long)Z502Costs.clock
+#define         COST_OF_TIMER                   (long)Z502Costs.timer
+#define         COST_OF_MAKE_CONTEXT            (long)Z502Costs.make_context
+#define         COST_OF_DESTROY_CONTEXT         (long)Z502Costs.destroy_context
+#define         COST_OF_SWITCH_CONTEXT          (long)Z502Costs.switch_context
+#define         COST_OF_SOFTWARE_TRAP           (long)Z502Costs.software_trap
+#define         COST_OF_TLB_MISS                (long)Z502Costs.tlb_miss
+
+/*  How long a disk takes to service a request depends on its model,
+    chosen with --disk-model (see disk_service_time() in z502.c):
+        DISK_MODEL_HDD        - latency, plus a seek of one tick for
+                                every seek_divisor sectors the head
+                                crosses, plus transfer for each sector
+                                after the first.  The original disk.
+        DISK_MODEL_SSD        - latency, plus transfer for each sector
+                                after the first; no seek.
+        DISK_MODEL_RAM        - the same, far faster.
+        DISK_MODEL_ROTATIONAL - sectors_per_track to a track.  Moving
+                                to another track costs latency to
+                                settle plus track_seek for each track
+                                crossed; then the disk waits for the
+                                sector to come round, and each sector
+                                takes rotation / sectors_per_track to
+                                pass under the head.
+    DISK_MODEL_DEFAULT on a disk means it uses the model given for
+    every disk.                                                     */
+
+#define         DISK_MODEL_DEFAULT              0
+#define         DISK_MODEL_HDD                  1
+#define         DISK_MODEL_SSD                  2
+#define         DISK_MODEL_RAM                  3
+#define         DISK_MODEL_ROTATIONAL           4
+
+typedef struct
+    {
+    INT32               kind;
+    INT32               latency;
+    INT32               seek_divisor;
+    INT32               transfer;
+    INT32               sectors_per_track;
+    INT32               rotation;
+    INT32               track_seek;
+} DISK_MODEL;
 
 #ifndef NULL
 #define         NULL                            0
@@ -39,6 +79,32 @@
 #define         CONTEXT_STRUCTURE_ID            (unsigned char)126
 
 #define         EVENT_RING_BUFFER_SIZE          16
+#define         EVENTS_PER_SLAB                 64
+#define         SECTOR_CHUNKS_PER_SLAB          16
+#define         CONTEXTS_PER_SLAB               16
+#define         DISK_QUEUE_MAX_DEPTH            32
+#define         TRANSLATION_CACHE_SIZE          64
+#define         TLB_MAX_SETS                    256
+#define         TLB_MAX_WAYS                    16
+#define         TLB_MAX_ASID                    255
+#define         MEMBENCH_ACCESSES               2000000
+
+/*  The time of the earliest pending event is kept in a single word
+    that is written under EventLock but read without it.  These give
+    the reader and the writer the ordering they need.               */
+
+#if defined LINUX || defined MAC
+#define         ATOMIC_LOAD_INT32( ptr )                                \
+                __atomic_load_n( ( ptr ), __ATOMIC_ACQUIRE )
+#define         ATOMIC_STORE_INT32( ptr, value )                        \
+                __atomic_store_n( ( ptr ), ( value ), __ATOMIC_RELEASE )
+#endif
+#ifdef  NT
+#define         ATOMIC_LOAD_INT32( ptr )                                \
+                InterlockedCompareExchange( (volatile LONG *)( ptr ), 0, 0 )
+#define         ATOMIC_STORE_INT32( ptr, value )                        \
+                InterlockedExchange( (volatile LONG *)( ptr ), ( value ) )
+#endif
 
 /*  STAT_VECTOR is a two dimensional array.  The first 
     dimension can take on values shown here.  The
@@ -50,14 +116,34 @@
 
 typedef struct
     {
-    INT32               *queue;
-    INT32               time_of_event;
+    unsigned char       structure_id;
     INT16               ring_buffer_location;
     INT16               event_error;
     INT16               event_type;
-    unsigned char       structure_id;
+    INT32               event_tag;      /* Request tag seen by the OS  */
+    INT32               time_of_event;
+    UINT32              sequence;       /* Breaks ties on time_of_event */
+    INT32               heap_index;     /* Slot on the event heap or -1 */
 } EVENT;
 
+/*  EVENTs, SECTOR_CHUNKs and Z502CONTEXTs come from slabs: blocks of
+    objects_per_slab objects that are allocated together and never
+    given back.  A freed object goes on the slab's free list, which is
+    kept outside the objects, with its structure_id - always the first
+    member - set to 0 so the usual checks catch any later use of it.  */
+
+typedef struct
+    {
+    char                *name;
+    size_t              object_size;
+    INT32               objects_per_slab;
+    INT32               slabs;
+    INT32               in_use;
+    INT32               high_water;
+    INT32               free_count;
+    void                **free_list;    /* Room for every object        */
+} SLAB;
+
 /* Supports history which is dumped on a hardware panic */
 
 typedef struct
@@ -73,22 +159,211 @@ typedef struct
 typedef struct
 {
     INT32               context_switches;
-    INT32               disk_reads[MAX_NUMBER_OF_DISKS];
-    INT32               disk_writes[MAX_NUMBER_OF_DISKS];
-    INT32               time_disk_busy[MAX_NUMBER_OF_DISKS];
+    INT32               disk_reads[MAX_NUMBER_OF_DISKS_LIMIT + 1];
+    INT32               disk_writes[MAX_NUMBER_OF_DISKS_LIMIT + 1];
+    INT32               time_disk_busy[MAX_NUMBER_OF_DISKS_LIMIT + 1];
     INT32               number_charge_times;
     INT32               number_mask_set_seen;
     INT32               number_faults;
+    INT32               sector_chunks;
+    INT32               disk_storage_bytes;
+    INT32               translation_hits;
+    INT32               translation_misses;
+    INT32               tlb_hits;
+    INT32               tlb_misses;
+    INT32               tlb_page_invalidations;
+    INT32               tlb_flushes;
 } HARDWARE_STATS;
 
+/*  The translation cache remembers where recently used pages live in
+    MEMORY.  It is direct mapped on the virtual page number and keyed
+    on the page table too.  Entries are dropped when the OS says it
+    changed a PTE, and all of them on a context switch.              */
+
 typedef struct
     {
-    INT32               *queue;
-    INT16               structure_id;
+    UINT16              *page_table;
+    INT16               vpn;
+    INT16               pte_index;      /* Holds the referenced bits    */
+    char                *frame;         /* Start of the frame in MEMORY */
+} TRANSLATION_CACHE_ENTRY;
+
+/*  The TLB is only present when the simulator is started with
+    --tlb=SETSxWAYS.  Entries are tagged with the address space ID of
+    the context that filled them, so a context switch needs no flush.
+    Within a set the least recently used way is replaced.            */
+
+typedef struct
+    {
+    BOOL                valid;
+    INT16               asid;
+    INT16               vpn;
+    UINT16              pte;            /* Valid and frame bits only    */
+    UINT32              last_used;
+} TLB_ENTRY;
+
+/*  With --lock-stats, every lock records how often it was taken, how
+    long callers waited for it and how long it was held.  Entries are
+    indexed by mutex number; times are in nanoseconds.              */
+
+#define         LOCK_STATS_SIZE                 16
+
+typedef struct
+    {
+    INT32               acquisitions;
+    double              wait_ns;
+    double              hold_ns;
+    double              longest_hold_ns;
+    double              acquired_at;
+} LOCK_STATS;
+
+/*  Disk contents are kept per disk in a table of SECTOR_CHUNKs.  A
+    chunk covers SECTORS_PER_CHUNK consecutive sectors and is only
+    allocated when one of them is first written.  The sector size is
+    only known at startup, so the sectors follow the chunk in the same
+    slab object and sector_data points at them.                     */
+
+#define         SECTORS_PER_CHUNK               64
+#define         SECTOR_CHUNKS_PER_DISK          \
+        ( ( NUM_LOGICAL_SECTORS + SECTORS_PER_CHUNK - 1 ) / SECTORS_PER_CHUNK )
+
+typedef struct
+    {
+    unsigned char       structure_id;
     INT16               disk_id;
-    INT16               sector;
-    char                sector_data[PGSIZE];
-} SECTOR;
+    INT16               first_sector;
+    INT16               sectors_written;
+    unsigned char       written[SECTORS_PER_CHUNK / 8];
+    char                *sector_data;
+} SECTOR_CHUNK;
+
+/*  A disk may instead be backed by an image file that is mapped into
+    the simulator's address space.  The file starts with a header,
+    then a bit for each sector saying whether it has been written; the
+    sectors follow at DISK_IMAGE_DATA_OFFSET.  Images are created on
+    first use.                                                      */
+
+#define         DISK_IMAGE_MAGIC                "Z502DSK"
+#define         DISK_IMAGE_VERSION              1
+#define         DISK_IMAGE_DATA_OFFSET          \
+        ( ( sizeof( DISK_IMAGE_HEADER ) + ( NUM_LOGICAL_SECTORS + 7 ) / 8 \
+            + 63 ) & ~(size_t)63 )
+
+typedef struct
+    {
+    char                magic[8];
+    INT32               version;
+    INT32               disk_id;
+    INT32               number_of_sectors;
+    INT32               sector_size;
+} DISK_IMAGE_HEADER;
+
+typedef struct
+    {
+    DISK_IMAGE_HEADER   *header;
+    unsigned char       *written;       /* Follows the header          */
+    char                *sector_data;
+    size_t              length;
+} DISK_IMAGE;
+
+/*  --record=FILE writes the point at which each interrupt was
+    delivered to FILE; --replay=FILE delivers them at exactly those
+    points again.  The file is an INTERRUPT_LOG_HEADER followed by an
+    INTERRUPT_LOG_ENTRY for each interrupt.  A point is counted in the
+    charges made by base level code, leaving out those made by the
+    interrupt handler, so it doesn't depend on how the host happened
+    to schedule the interrupt thread.                               */
+
+#define         INTERRUPT_LOG_MAGIC             "Z502IRQ"
+#define         INTERRUPT_LOG_VERSION           1
+
+typedef struct
+    {
+    char                magic[8];
+    INT32               version;
+    INT32               pgsize;         /* Geometry it was made with   */
+    INT32               phys_mem_pgs;
+    INT32               number_of_disks;
+} INTERRUPT_LOG_HEADER;
+
+typedef struct
+    {
+    UINT32              time;           /* Simulated time at delivery  */
+    UINT32              base_charges;   /* Base level charges so far   */
+    INT16               device;
+    INT16               status;
+} INTERRUPT_LOG_ENTRY;
+
+/*  --snapshot=FILE writes the whole machine - the hardware's state and
+    then, through Z502_SNAPSHOT_WRITE, the OS's - to FILE at the first
+    context switch at or after --snapshot-at=TIME.  --restore=FILE
+    starts a run at that switch instead of at os_init.  Contexts are
+    written with the name of the routine they run, and the page table
+    the OS gives with them.  A register or argument that points into
+    user data (see Z502_ALLOCATE_USER_DATA) or into the simulator's
+    own image is written relative to it, so a restore may run with the
+    image loaded somewhere else - though it must be the same binary. */
+
+#define         SNAPSHOT_MAGIC                  "Z502SNP"
+#define         SNAPSHOT_VERSION                6
+#define         SNAPSHOT_NAME_LENGTH            32
+#define         SNAPSHOT_RANDOM_STATE           128
+
+#define         SNAPSHOT_PLAIN                  0
+#define         SNAPSHOT_USER_DATA              1
+#define         SNAPSHOT_IMAGE                  2
+
+typedef struct
+    {
+    char                magic[8];
+    INT32               version;
+    INT32               pgsize;         /* Geometry it was made with   */
+    INT32               phys_mem_pgs;
+    INT32               virtual_mem_pgs;
+    INT32               num_logical_sectors;
+    INT32               number_of_disks;
+    INT32               disk_queue_depth;
+    INT32               tlb_sets;
+    INT32               tlb_ways;
+    long                image_length;   /* Identify the binary         */
+    long                os_init_offset;
+    UINT32              time;
+} SNAPSHOT_HEADER;
+
+typedef struct
+    {
+    INT32               kind;           /* SNAPSHOT_PLAIN ...          */
+    INT32               block;          /* Which user data             */
+    long                value;          /* Or the offset into it       */
+} SNAPSHOT_VALUE;
+
+typedef struct
+    {
+    char                *data;
+    INT32               length;
+} USER_DATA;
+
+/*  Hardware options are given on the command line as --name=value
+    (or just --name for a flag).  The hardware consumes them before
+    the OS ever sees argv.  An OPTION_CONFIG names a file holding
+    more of them, one name=value to a line.  An OPTION_COST sets one
+    of the costs, and an OPTION_DISK_MODEL the model of one disk or
+    of all of them.                                                 */
+
+#define         OPTION_FLAG                     0
+#define         OPTION_INT                      1
+#define         OPTION_STRING                   2
+#define         OPTION_CONFIG                   3
+#define         OPTION_COST                     4
+#define         OPTION_DISK_MODEL               5
+
+typedef struct
+    {
+    char                *name;
+    INT16               type;
+    void                *value;
+    char                *help;
+} HARDWARE_OPTION;
 
 typedef struct
     {
@@ -104,26 +379,94 @@ typedef struct
     INT16               program_mode;
     INT16               mode_at_first_interrupt;        
     BOOL                fault_in_progress;
+    INT16               asid;           /* Tags this context's TLB entries */
+    UINT64              pmu_counts[PMU_NUMBER_OF_EVENTS];
+    INT32               user_ticks;     /* Time charged while it ran in */
+    INT32               kernel_ticks;   /*   user mode / kernel mode    */
+    INT32               faults;
+    INT32               traps;
+    UINT32              last_clock;     /* Its processor's clock when   */
+                                        /*   it was last switched out   */
 } Z502CONTEXT;
 
+/*  With --cpus=N each processor has its own registers and its own
+    clock.  Only one processor's host thread runs at a time: the one
+    running keeps its registers in the usual globals and the others
+    keep theirs here.  The hardware hands over to whichever processor
+    is furthest behind once the running one is CPU_QUANTUM ahead of
+    it, so the clocks never drift far apart.                         */
+
+#define         CPU_PARKED                      0   /* Never started    */
+#define         CPU_RUNNING                     1
+#define         CPU_HALTED                      2   /* In Z502_IDLE     */
+#define         CPU_QUANTUM                     20
+
+typedef struct
+    {
+    INT16               state;
+    INT32               wake_time;      /* When HALTED; -1 waits for IPI */
+    BOOL                ipi_pending;
+    INT32               ipi_sender;
+    BOOL                interrupted;    /* Since it last halted         */
+    UINT32              condition;      /* Its host thread waits here   */
+    UINT32              clock;
+    UINT32              start_time;
+    INT32               idle_ticks;
+    INT32               ipis;
+    INT32               handoffs;
+    INT32               interlocks_held;
+    Z502CONTEXT         *current_context;
+    UINT16              *page_tbl_addr;
+    INT16               page_tbl_length;
+    INT16               program_counter;
+    INT16               mode;
+    INT32               call_type;
+    Z502_ARG            arg1, arg2, arg3, arg4, arg5, arg6;
+    long                reg1, reg2, reg3, reg4, reg5;
+    long                reg6, reg7, reg8, reg9;
+    BOOL                pop_the_stack;
+    BOOL                kill_or_save;
+    Z502CONTEXT         *next_context_ptr;
+} Z502_CPU;
+
+/*  A disk holds up to DiskQueueDepth requests.  One is being serviced
+    (disk_in_use); the rest wait in queue[] until the disk head is
+    free, and are then taken in order of shortest seek.              */
+
+typedef struct
+    {
+    INT16               sector;
+    INT16               count;
+    INT32               tag;
+    INT32               frame;          /* DMA frame, or -1             */
+} DISK_REQUEST;
+
 typedef struct
     {
     EVENT               *event_ptr;
     INT16               last_sector;
     INT16               disk_in_use;
     INT16               action;
+    INT16               requests_queued;
+    INT32               frame;          /* Of the request in service    */
+    DISK_REQUEST        queue[DISK_QUEUE_MAX_DEPTH];
 } DISK_STATE;
 
 typedef struct
     {
     INT16               sector;
     INT16               action;
+    INT16               count;
     char                *buffer;
+    char                **sg_list;
+    INT32               frame;
+    INT32               tag;
 } MEMORY_MAPPED_DISK_STATE;
 
 typedef struct
     {
     EVENT               *event_ptr;
     INT16               timer_in_use;
+    INT32               period;                 /* 0 for one shot */
 } TIMER_STATE;
  